@@ -19,6 +19,7 @@ typedef struct bitmap bitmap_t;
 
 bitmap_t bitmap_wrap(uint8_t* data, size_t len);
 bitmap_t bitmap_allocate(size_t len);
+int bitmap_next_range_of_unset_bits(bitmap_t bitmap, int from, size_t min_len, int* start_of_free_chunks);
 int bitmap_find_space(bitmap_t bitmap, int req);
 int bitmap_find_space_aligned(bitmap_t bitmap, int req, int alignment);
 int bitmap_set(bitmap_t bitmap, int where);
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_ALGO_LZ_H
+#define _KERNEL_ALGO_LZ_H
+
+#include <libkern/types.h>
+
+/**
+ * A fast LZ77 codec in the LZF format. It trades the ratio for speed and
+ * is meant for short-lived in-memory data, like compressed swap.
+ */
+
+#define LZ_HASH_LOG (12)
+#define LZ_HASH_SIZE (1 << LZ_HASH_LOG)
+
+// The hash table is kept by a caller, so the codec doesn't use the stack or the heap.
+typedef uint16_t lz_hash_table_t[LZ_HASH_SIZE];
+
+size_t lz_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len, lz_hash_table_t table);
+int lz_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len);
+
+#endif // _KERNEL_ALGO_LZ_H
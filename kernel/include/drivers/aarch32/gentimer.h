@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_DRIVERS_AARCH32_GENTIMER_H
+#define _KERNEL_DRIVERS_AARCH32_GENTIMER_H
+
+#include <drivers/driver_manager.h>
+#include <libkern/mask.h>
+#include <libkern/types.h>
+
+// https://developer.arm.com/documentation/ddi0406/c/System-Level-Architecture/System-Control-Registers-in-a-VMSA-implementation/VMSA-System-control-registers-descriptions--in-register-order/ID-PFR1--Processor-Feature-Register-1--VMSA
+enum IDPFR1Masks {
+    MASKDEFINE(ID_PFR1_GENERIC_TIMER, 16, 4),
+};
+
+void gentimer_install();
+
+#endif //_KERNEL_DRIVERS_AARCH32_GENTIMER_H
@@ -36,8 +36,8 @@ enum DRIVER_VIDEO_OPERTAION {
 // Api function of DRIVER_STORAGE type
 enum DRIVER_STORAGE_OPERTAION {
     DRIVER_STORAGE_ADD_DEVICE = 0x1, // function called when a device is found
-    DRIVER_STORAGE_READ,
-    DRIVER_STORAGE_WRITE,
+    DRIVER_STORAGE_READ, // int read(device_t* dev, uint32_t sector, uint8_t* buf, uint32_t count)
+    DRIVER_STORAGE_WRITE, // int write(device_t* dev, uint32_t sector, uint8_t* buf, uint32_t count)
     DRIVER_STORAGE_FLUSH,
     DRIVER_STORAGE_CAPACITY,
 };
@@ -88,6 +88,8 @@ enum DRIVER_FILE_SYSTEM_OPERTAION {
     DRIVER_FILE_SYSTEM_FSTAT,
     DRIVER_FILE_SYSTEM_IOCTL,
     DRIVER_FILE_SYSTEM_MMAP,
+    DRIVER_FILE_SYSTEM_SYNC_DEVICE,
+    DRIVER_FILE_SYSTEM_WAIT_QUEUE,
 };
 
 struct driver;
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_DRIVERS_GENERIC_BLKQUEUE_H
+#define _KERNEL_DRIVERS_GENERIC_BLKQUEUE_H
+
+#include <drivers/driver_manager.h>
+#include <libkern/lock.h>
+#include <libkern/types.h>
+#include <tasking/wait_queue.h>
+
+#define BLKQUEUE_SECTOR_SIZE (512)
+
+enum BLK_REQUEST_TYPE {
+    BLK_REQUEST_READ,
+    BLK_REQUEST_WRITE,
+    BLK_REQUEST_FLUSH, // Flushes the drive's write cache, transfers no data.
+};
+
+enum BLK_REQUEST_STATUS {
+    BLK_REQUEST_FREE = 0,
+    BLK_REQUEST_PENDING,
+    BLK_REQUEST_ACTIVE,
+    BLK_REQUEST_DONE,
+};
+
+/**
+ * A request describes a transfer of count sectors to/from buf. Adjacent
+ * requests are merged by the queue: the request which is kept in the queue
+ * becomes a head and the rest are chained in sector order with merged_next.
+ * Drivers serve a head as a single transfer of total_count sectors. A flush
+ * is a barrier: it is served after all requests submitted before it and
+ * before all requests submitted after it.
+ */
+struct blk_request {
+    device_t* dev;
+    int type;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buf;
+
+    volatile int status;
+    int result;
+
+    uint32_t seq; // Submission order, a head gets the one of its oldest request.
+    uint32_t total_count;
+    struct blk_request* next;
+    struct blk_request* merged_next;
+};
+typedef struct blk_request blk_request_t;
+
+struct blkqueue;
+struct blkqueue_ops {
+    // Programs the hardware to serve the request, is called with the queue lock held.
+    int (*start)(struct blkqueue* queue, blk_request_t* req);
+    // Checks the hardware and calls blkqueue_complete() if the active request is done.
+    void (*poll)(struct blkqueue* queue);
+};
+typedef struct blkqueue_ops blkqueue_ops_t;
+
+struct blkqueue {
+    device_t* dev;
+    lock_t lock;
+    const blkqueue_ops_t* ops;
+    uint32_t max_sectors;
+
+    blk_request_t* pending; // Sorted by sector.
+    blk_request_t* active;
+    uint32_t head_sector; // Where the last dispatched request has ended.
+    uint32_t next_seq;
+    wait_queue_t wait_queue; // Threads sleeping on requests of the queue.
+
+    /* Stat */
+    uint32_t stat_submitted;
+    uint32_t stat_merged;
+};
+typedef struct blkqueue blkqueue_t;
+
+blkqueue_t* blkqueue_register(device_t* dev, const blkqueue_ops_t* ops, uint32_t max_sectors);
+blkqueue_t* blkqueue_get(device_t* dev);
+
+void blkqueue_init_request(blk_request_t* req, device_t* dev, int type, uint32_t sector, uint8_t* buf, uint32_t count);
+int blkqueue_submit(blk_request_t* req);
+int blkqueue_wait(blk_request_t* req, bool can_sleep);
+int blkqueue_rw(device_t* dev, int type, uint32_t sector, uint8_t* buf, uint32_t count, bool can_sleep);
+int blkqueue_flush(device_t* dev, bool can_sleep);
+
+void blkqueue_complete(blkqueue_t* queue, int result);
+
+#endif // _KERNEL_DRIVERS_GENERIC_BLKQUEUE_H
@@ -11,10 +11,16 @@
 
 #include <drivers/driver_manager.h>
 #include <drivers/x86/display.h>
+#include <libkern/c_attrs.h>
 #include <libkern/types.h>
 #include <mem/kmalloc.h>
 #include <platform/x86/port.h>
 
+#define ATA_SECTOR_SIZE (512)
+#define ATA_MAX_SECTORS_PER_CMD (256)
+#define ATA_DMA_BUFFER_SIZE (64 * 1024)
+#define ATA_DMA_MAX_SECTORS (ATA_DMA_BUFFER_SIZE / ATA_SECTOR_SIZE)
+
 typedef struct { // LBA28 | LBA48
     uint32_t data; // 16bit | 16 bits
     uint32_t error; // 8 bit | 16 bits
@@ -27,6 +33,19 @@ typedef struct { // LBA28 | LBA48
     uint32_t control;
 } ata_ports_t;
 
+typedef struct {
+    uint32_t command;
+    uint32_t status;
+    uint32_t prdt;
+} ata_bm_ports_t;
+
+struct PACKED ata_prd {
+    uint32_t paddr;
+    uint16_t bytes; // 0 means 64KiB
+    uint16_t flags; // bit 15 marks the last entry
+};
+typedef struct ata_prd ata_prd_t;
+
 typedef struct {
     ata_ports_t port;
     bool is_master;
@@ -36,6 +55,15 @@ typedef struct {
     bool dma;
     bool lba;
     uint32_t capacity; // in sectors
+
+    /* Bus-master DMA, set up only when both drive and controller support it. */
+    bool dma_enabled;
+    ata_bm_ports_t bm_port;
+    ata_prd_t* prdt;
+    uintptr_t prdt_paddr;
+    uint8_t* dma_buf;
+    uintptr_t dma_buf_paddr;
+    struct blkqueue* queue;
 } ata_t;
 
 extern ata_t _ata_drives[MAX_DEVICES_COUNT];
@@ -45,5 +73,6 @@ int ata_init_with_dev(device_t* dev);
 void ata_install();
 void ata_init(ata_t* ata, uint32_t port, bool is_master);
 bool ata_indentify(ata_t* ata);
+int ata_setup_dma(ata_t* ata, device_t* dev);
 
 #endif //_KERNEL_DRIVERS_X86_ATA_H
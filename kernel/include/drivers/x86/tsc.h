@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_DRIVERS_X86_TSC_H
+#define _KERNEL_DRIVERS_X86_TSC_H
+
+#include <libkern/types.h>
+
+#define TSC_CALIBRATE_MS (50)
+
+void tsc_setup();
+
+#endif /* _KERNEL_DRIVERS_X86_TSC_H */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_FS_BCACHE_H
+#define _KERNEL_FS_BCACHE_H
+
+#include <drivers/driver_manager.h>
+#include <libkern/types.h>
+
+#define BCACHE_SECTOR_LEN (512)
+#define BCACHE_BLOCK_LEN (1024)
+#define BCACHE_SECTORS_PER_BLOCK (BCACHE_BLOCK_LEN / BCACHE_SECTOR_LEN)
+#define BCACHE_HASH_SIZE (256)
+#define BCACHE_MAX_BLOCKS (512)
+#define BCACHE_WRITEBACK_BATCH (32)
+#define BCACHE_READ_BATCH (32)
+
+enum BCACHE_BUF_FLAGS {
+    BCACHE_BUF_VALID = 0x1,
+    BCACHE_BUF_DIRTY = 0x2,
+    BCACHE_BUF_WRITEBACK = 0x4, // A copy is being written by the flusher, the buffer stays dirty until it is done.
+    BCACHE_BUF_BUSY = 0x8, // The block is being read without the cache lock, its data is not valid yet.
+};
+
+struct bcache_buf {
+    device_t* dev;
+    uint32_t block;
+    uint32_t flags;
+    uint8_t* data;
+
+    struct bcache_buf* hash_next;
+    struct bcache_buf* lru_prev;
+    struct bcache_buf* lru_next;
+};
+typedef struct bcache_buf bcache_buf_t;
+
+struct bcache_stat {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    uint32_t evictions;
+    uint32_t cached_blocks;
+    uint32_t dirty_blocks;
+};
+typedef struct bcache_stat bcache_stat_t;
+
+void bcache_init();
+
+int bcache_read(device_t* dev, uint8_t* buf, uint32_t start, uint32_t len);
+int bcache_write(device_t* dev, uint8_t* buf, uint32_t start, uint32_t len);
+
+int bcache_flush_device(device_t* dev);
+int bcache_sync_device(device_t* dev);
+int bcache_invalidate_device(device_t* dev);
+int bcache_flush_all();
+int bcache_reclaim(int max_blocks);
+
+void bcache_get_stat(bcache_stat_t* stat);
+
+#endif // _KERNEL_FS_BCACHE_H
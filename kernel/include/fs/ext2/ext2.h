@@ -129,6 +129,53 @@ struct PACKED dir_entry {
 };
 typedef struct dir_entry dir_entry_t;
 
+#define EXT2_PREALLOC_BLOCKS 8
+#define EXT2_PREALLOC_SLOTS 16
+
+enum EXT2_GROUP_DIRTY_FLAGS {
+    EXT2_GROUP_BLOCK_BITMAP_DIRTY = 0x1,
+    EXT2_GROUP_INODE_BITMAP_DIRTY = 0x2,
+};
+
+/**
+ * Blocks which are reserved for the next appends to an inode. They are
+ * marked as used in the cached bitmap and are given back on sync.
+ */
+struct ext2_prealloc {
+    uint32_t ino;
+    uint32_t start;
+    uint32_t count;
+};
+typedef struct ext2_prealloc ext2_prealloc_t;
+
+struct ext2_alloc_info {
+    uint8_t* block_bitmaps; // Block bitmaps of all groups, one block per group.
+    uint8_t* inode_bitmaps;
+    uint8_t* dirty_groups; // EXT2_GROUP_DIRTY_FLAGS of each group.
+    bool dirty_descs; // Group descriptors and the superblock.
+    ext2_prealloc_t prealloc[EXT2_PREALLOC_SLOTS];
+};
+typedef struct ext2_alloc_info ext2_alloc_info_t;
+
+#define EXT2_DIR_INDEX_SLOTS 8
+#define EXT2_DIR_INDEX_MIN_BLOCKS 4
+#define EXT2_DIR_INDEX_MIN_CAPACITY 64
+#define EXT2_DIR_INDEX_EMPTY 0xffffffff
+
+/**
+ * An in-memory hash index of a large directory. It maps hashes of names
+ * to blocks of the directory which hold them, so a lookup scans one block.
+ */
+struct ext2_dir_index {
+    ino_t ino; // 0 marks an unused slot.
+    uint32_t last_used;
+    uint32_t count;
+    uint32_t capacity; // Power of 2, open addressing.
+    uint32_t* hashes;
+    uint32_t* blocks; // Index of a block inside of the directory.
+};
+typedef struct ext2_dir_index ext2_dir_index_t;
+
 void ext2_install();
 
 /* All others apis are avail for VFS throw struct fs_ops_t */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_FS_PCACHE_H
+#define _KERNEL_FS_PCACHE_H
+
+#include <fs/vfs.h>
+#include <libkern/types.h>
+
+#define PCACHE_MAX_PAGES (1024)
+#define PCACHE_HASH_SIZE (256)
+#define PCACHE_READAHEAD_MAX_PAGES (16)
+
+enum PCACHE_PAGE_FLAGS {
+    PCACHE_PAGE_VALID = 0x1,
+    PCACHE_PAGE_DETACHED = 0x2, // Removed from the cache, but still mapped.
+    PCACHE_PAGE_DIRTY = 0x4, // Modified through a shared mapping, not written back yet.
+    PCACHE_PAGE_LOCKED = 0x8, // Being read from the filesystem with the cache lock released.
+};
+
+struct pcache_page {
+    dev_t dev;
+    ino_t ino;
+    uint32_t index;
+    uint32_t flags;
+    uint32_t refs; // User mappings and in-flight kernel copies.
+    uint32_t wmaps; // Writable mappings, a subset of refs.
+    uintptr_t paddr;
+
+    struct pcache_page* hash_next;
+    struct pcache_page* frame_next;
+    struct pcache_page* lru_prev;
+    struct pcache_page* lru_next;
+};
+typedef struct pcache_page pcache_page_t;
+
+struct pcache_stat {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t cached_pages;
+    uint32_t mapped_pages;
+    uint32_t dirty_pages;
+    uint32_t writebacks;
+    uint32_t readahead_pages;
+};
+typedef struct pcache_stat pcache_stat_t;
+
+void pcache_init();
+bool pcache_is_cacheable(dentry_t* dentry);
+
+int pcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+void pcache_readahead(dentry_t* dentry, uint32_t index, uint32_t count);
+void pcache_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+void pcache_truncate(dentry_t* dentry, size_t size);
+void pcache_invalidate_inode(dev_t dev, ino_t ino);
+void pcache_invalidate_device(dev_t dev);
+
+uintptr_t pcache_get_frame(dentry_t* dentry, uint32_t index);
+bool pcache_owns_frame(uintptr_t paddr);
+bool pcache_dup_frame(uintptr_t paddr);
+bool pcache_put_frame(uintptr_t paddr);
+bool pcache_frame_map_writable(uintptr_t paddr);
+bool pcache_frame_unmap_writable(uintptr_t paddr);
+
+int pcache_sync_inode(dentry_t* dentry);
+int pcache_sync_device(dev_t dev);
+int pcache_sync_all();
+
+int pcache_reclaim(int max_pages);
+void pcache_get_stat(pcache_stat_t* stat);
+
+#endif // _KERNEL_FS_PCACHE_H
@@ -14,6 +14,7 @@
 #include <fs/ext2/ext2.h>
 #include <libkern/lock.h>
 #include <libkern/syscall_structs.h>
+#include <tasking/wait_queue.h>
 
 #define DENTRY_WAS_IN_CACHE 0
 #define DENTRY_NEWLY_ALLOCATED 1
@@ -76,17 +77,21 @@ struct dentry {
     struct dentry* mounted_dentry;
 
     struct socket* sock;
-};
-typedef struct dentry dentry_t;
 
-struct dentry_cache_list {
-    struct dentry_cache_list* prev;
-    struct dentry_cache_list* next;
-    dentry_t* data;
-    size_t len;
-    lock_t lock;
+    /* Cache, protected by the dentry cache lock */
+    uint32_t name_hash;
+    dev_t name_dev; // The directory which holds the filename.
+    ino_t name_ino;
+    bool name_hashed;
+    bool in_lru;
+    uint32_t negative_gen; // Is bumped when a name appears in or leaves the directory.
+    struct dentry* hash_next;
+    struct dentry* name_next;
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+    struct dentry* all_next; // Dentries are never freed, the list only grows.
 };
-typedef struct dentry_cache_list dentry_cache_list_t;
+typedef struct dentry dentry_t;
 
 struct file_descriptor;
 struct file_ops {
@@ -105,6 +110,7 @@ struct file_ops {
     int (*ioctl)(dentry_t* dentry, uint32_t cmd, uint32_t arg);
     int (*fstat)(dentry_t* dentry, fstat_t* stat);
     struct memzone* (*mmap)(dentry_t* dentry, mmap_params_t* params);
+    struct wait_queue* (*wait_queue)(dentry_t* dentry);
 };
 typedef struct file_ops file_ops_t;
 
@@ -120,6 +126,7 @@ struct fs_ops {
     int (*recognize)(vfs_device_t* dev);
     int (*prepare_fs)(vfs_device_t* dev);
     int (*eject_device)(vfs_device_t* dev);
+    int (*sync_device)(vfs_device_t* dev);
 
     file_ops_t file;
     dentry_ops_t dentry;
@@ -148,6 +155,11 @@ struct file_descriptor {
     int flags;
     file_ops_t* ops;
     lock_t lock;
+
+    /* Read-ahead */
+    off_t ra_next; // Where the next sequential read starts.
+    uint32_t ra_start; // First page of the current window.
+    uint32_t ra_window; // In pages, 0 while access is not sequential.
 };
 typedef struct file_descriptor file_descriptor_t;
 
@@ -157,6 +169,7 @@ struct socket {
     int type;
     int protocol;
     sync_ringbuffer_t buffer;
+    wait_queue_t wait_queue; // Readers of the socket.
     file_descriptor_t bind_file;
     lock_t lock;
 };
@@ -166,11 +179,18 @@ typedef struct socket socket_t;
  * DENTRIES
  */
 
+void dentry_init();
 void kdentryflusherd();
 
-void dentry_set_parent(dentry_t* to, dentry_t* parent);
-void dentry_set_filename(dentry_t* to, char* filename);
+void dentry_set_name(dentry_t* to, dentry_t* parent, const char* name, size_t len);
+void dentry_unhash_name(dentry_t* dentry);
 dentry_t* dentry_get(dev_t dev_indx, ino_t inode_indx);
+dentry_t* dentry_lookup_child(dentry_t* dir, const char* name, size_t len);
+bool dentry_lookup_negative(dentry_t* dir, const char* name, size_t len);
+uint32_t dentry_negative_gen(dentry_t* dir);
+void dentry_add_negative(dentry_t* dir, const char* name, size_t len, uint32_t gen);
+void dentry_forget_negative(dentry_t* dir, const char* name, size_t len);
+void dentry_forget_negative_dir(dentry_t* dir);
 dentry_t* dentry_get_no_inode(dev_t dev_indx, ino_t inode_indx, int* newly_allocated);
 dentry_t* dentry_get_parent(dentry_t* dentry);
 dentry_t* dentry_duplicate(dentry_t* dentry);
@@ -212,6 +232,8 @@ int vfs_add_dev_with_fs(device_t* dev, int fs_id);
 int vfs_add_fs(driver_t* fs);
 int vfs_get_fs_id(const char* name);
 void vfs_eject_device(device_t* t_new_dev);
+int vfs_sync_device(dev_t dev_indx);
+void vfs_sync_all();
 
 int vfs_resolve_path(const char* path, dentry_t** result);
 int vfs_resolve_path_start_from(dentry_t* dentry, const char* path, dentry_t** result);
@@ -223,6 +245,7 @@ int vfs_open(dentry_t* file, file_descriptor_t* fd, int flags);
 int vfs_close(file_descriptor_t* fd);
 bool vfs_can_read(file_descriptor_t* fd);
 bool vfs_can_write(file_descriptor_t* fd);
+struct wait_queue* vfs_wait_queue(file_descriptor_t* fd);
 int vfs_read(file_descriptor_t* fd, void* buf, size_t len);
 int vfs_write(file_descriptor_t* fd, void* buf, size_t len);
 int vfs_mkdir(dentry_t* dir, const char* name, size_t len, mode_t mode, uid_t uid, gid_t gid);
@@ -237,7 +260,9 @@ int vfs_umount(dentry_t* mountpoint);
 
 struct proc;
 struct memzone* vfs_mmap(file_descriptor_t* fd, mmap_params_t* params);
+void vfs_mmap_private_zone(struct memzone* zone, dentry_t* file, off_t offset);
 int vfs_munmap(struct proc* p, struct memzone*);
+int vfs_msync(struct memzone* zone, uintptr_t addr, size_t length, int flags);
 
 struct thread;
 int vfs_perm_to_read(dentry_t* dentry, struct thread* t);
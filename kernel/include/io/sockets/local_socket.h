@@ -16,6 +16,7 @@ bool local_socket_can_read(dentry_t* dentry, size_t start);
 int local_socket_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 bool local_socket_can_write(dentry_t* dentry, size_t start);
 int local_socket_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+wait_queue_t* local_socket_wait_queue(dentry_t* dentry);
 
 int local_socket_bind(file_descriptor_t* sock, char* name, uint32_t len);
 int local_socket_connect(file_descriptor_t* sock, char* name, uint32_t len);
@@ -11,6 +11,7 @@
 
 #include <algo/sync_ringbuffer.h>
 #include <fs/vfs.h>
+#include <tasking/wait_queue.h>
 
 #ifndef PTYS_COUNT
 #define PTYS_COUNT 16
@@ -21,6 +22,7 @@ struct pty_master_entry {
     sync_ringbuffer_t buffer;
     struct pty_slave_entry* pts;
     dentry_t dentry;
+    wait_queue_t wait_queue; // Readers of the master.
 };
 typedef struct pty_master_entry pty_master_entry_t;
 
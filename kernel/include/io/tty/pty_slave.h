@@ -10,6 +10,7 @@
 #define _KERNEL_IO_TTY_PTY_SLAVE_H
 
 #include <algo/sync_ringbuffer.h>
+#include <tasking/wait_queue.h>
 
 #ifndef PTYS_COUNT
 #define PTYS_COUNT 4
@@ -20,6 +21,7 @@ struct pty_slave_entry {
     int inode_indx;
     struct pty_master_entry* ptm;
     sync_ringbuffer_t buffer;
+    wait_queue_t wait_queue; // Readers of the slave.
 };
 typedef struct pty_slave_entry pty_slave_entry_t;
 
@@ -12,6 +12,7 @@
 #include <algo/sync_ringbuffer.h>
 #include <drivers/x86/keyboard.h>
 #include <libkern/types.h>
+#include <tasking/wait_queue.h>
 
 #define TTY_MAX_COUNT 8
 #define TTY_BUFFER_SIZE 1024
@@ -80,6 +81,7 @@ struct tty_entry {
     int id;
     int inode_indx;
     sync_ringbuffer_t buffer;
+    wait_queue_t wait_queue; // Readers of the tty.
     int lines_avail;
     uint32_t pgid;
     termios_t termios;
@@ -0,0 +1,23 @@
+#ifndef _KERNEL_LIBKERN_BITS_SPAWN_H
+#define _KERNEL_LIBKERN_BITS_SPAWN_H
+
+#include <libkern/types.h>
+
+#define SPAWN_MAX_FILE_ACTIONS 32
+
+#define SPAWN_FILE_ACTION_CLOSE 0x1
+#define SPAWN_FILE_ACTION_DUP2 0x2
+#define SPAWN_FILE_ACTION_OPEN 0x3
+
+/* Actions are applied to the new process in the order they were added. */
+struct spawn_file_action {
+    int type;
+    int fd;
+    int newfd; // SPAWN_FILE_ACTION_DUP2
+    int flags; // SPAWN_FILE_ACTION_OPEN
+    mode_t mode; // SPAWN_FILE_ACTION_OPEN
+    const char* path; // SPAWN_FILE_ACTION_OPEN
+};
+typedef struct spawn_file_action spawn_file_action_t;
+
+#endif // _KERNEL_LIBKERN_BITS_SPAWN_H
@@ -14,6 +14,10 @@
 #define PROT_EXEC 0x4
 #define PROT_NONE 0x0
 
+#define MS_ASYNC 0x1
+#define MS_INVALIDATE 0x2
+#define MS_SYNC 0x4
+
 struct mmap_params {
     void* addr;
     size_t size;
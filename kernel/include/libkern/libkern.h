@@ -26,6 +26,8 @@ bool str_validate_len(const char* c, size_t len);
 size_t ptrarr_len(const char** s);
 bool ptrarr_validate_len(const char** s, size_t len);
 
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem);
+
 #ifndef max
 #define max(a, b) \
     ({ __typeof__ (a) _a = (a); \
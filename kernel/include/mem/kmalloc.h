@@ -15,6 +15,35 @@
 #define KMALLOC_SPACE_SIZE (4 * MB)
 #define KMALLOC_BLOCK_SIZE 32
 
+#define KMEM_MIN_OBJ_SIZE (16)
+#define KMEM_MAX_OBJ_SIZE (2048) /* Larger requests bypass the slabs. */
+#define KMEM_SIZE_CLASSES (8) /* 16, 32, ..., KMEM_MAX_OBJ_SIZE */
+#define KMEM_SLAB_SIZE VMM_PAGE_SIZE
+#define KMEM_MAGAZINE_SIZE (16)
+#define KMEM_CACHE_NAME_LEN (16)
+
+struct kmem_cache;
+typedef struct kmem_cache kmem_cache_t;
+
+struct kmem_cache_stat {
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t obj_size;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    uint32_t slabs;
+    uint32_t allocs;
+    uint32_t frees;
+};
+typedef struct kmem_cache_stat kmem_cache_stat_t;
+
+struct kmalloc_stat {
+    uint32_t slab_pages;
+    uint32_t large_allocs;
+    uint32_t large_blocks;
+    uint32_t free_blocks;
+};
+typedef struct kmalloc_stat kmalloc_stat_t;
+
 void kmalloc_init();
 void* kmalloc(size_t size);
 void* kmalloc_aligned(size_t size, size_t alignment);
@@ -23,4 +52,16 @@ void kfree(void* ptr);
 void kfree_aligned(void* ptr);
 void* krealloc(void* ptr, size_t size);
 
+/**
+ * Object caches keep objects of one size in page-sized slabs. kfree() could
+ * be used to free an object of any cache as well.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* ptr);
+
+kmem_cache_t* kmem_cache_next(kmem_cache_t* cache);
+void kmem_cache_get_stat(kmem_cache_t* cache, kmem_cache_stat_t* stat);
+void kmalloc_get_stat(kmalloc_stat_t* stat);
+
 #endif // _KERNEL_MEM_KMALLOC_H
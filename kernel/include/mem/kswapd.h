@@ -9,6 +9,19 @@
 #ifndef _KERNEL_MEM_KSWAPD_H
 #define _KERNEL_MEM_KSWAPD_H
 
+#include <libkern/types.h>
+
+struct kswapd_stat {
+    uint32_t scanned_pages;
+    uint32_t activated_pages; // Were referenced since the last scan and got a second chance.
+    uint32_t reclaimed_file_pages;
+    uint32_t reclaimed_anon_pages;
+    uint32_t refaulted_pages; // Were swapped out and faulted back.
+};
+typedef struct kswapd_stat kswapd_stat_t;
+
 void kswapd();
+void kswapd_note_refault();
+void kswapd_get_stat(kswapd_stat_t* stat);
 
 #endif // _KERNEL_MEM_KSWAPD_H
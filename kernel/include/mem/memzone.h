@@ -9,7 +9,6 @@
 #ifndef _KERNEL_MEM_MEMZONE_H
 #define _KERNEL_MEM_MEMZONE_H
 
-#include <algo/dynamic_array.h>
 #include <fs/vfs.h>
 #include <libkern/types.h>
 #include <mem/bits/zone.h>
@@ -26,15 +25,41 @@ struct memzone {
 };
 typedef struct memzone memzone_t;
 
+#define MEMZONES_INIT_CAPACITY (8)
+
+/**
+ * Zones of an address space, sorted by their start address. Every zone is
+ * allocated separately, so a pointer to it stays valid until it is freed.
+ */
+struct memzones {
+    memzone_t** list;
+    size_t size;
+    size_t capacity;
+
+    memzone_t* last_hit;
+
+    // Placement of new zones starts at free_area_hint, all holes below it
+    // are not larger than cached_hole_size.
+    uintptr_t free_area_hint;
+    size_t cached_hole_size;
+};
+typedef struct memzones memzones_t;
+
+void memzone_init();
+int memzones_init(memzones_t* zones);
+int memzones_copy(memzones_t* to, memzones_t* from);
+void memzones_free(memzones_t* zones);
+
 // TODO: Make it not depandent on proc.
 struct proc;
 memzone_t* memzone_new(struct proc* p, size_t start, size_t len);
 memzone_t* memzone_extend(struct proc* proc, size_t start, size_t len);
 memzone_t* memzone_new_random(struct proc* p, size_t len);
 memzone_t* memzone_new_random_backward(struct proc* p, size_t len);
+memzone_t* memzone_new_random_aligned(struct proc* p, size_t len, size_t alignment);
 memzone_t* memzone_find(struct proc* p, size_t addr);
-memzone_t* memzone_find_no_proc(dynamic_array_t* zones, size_t addr);
-int memzone_free_no_proc(dynamic_array_t*, memzone_t*);
+memzone_t* memzone_find_no_proc(memzones_t* zones, size_t addr);
+int memzone_free_no_proc(memzones_t*, memzone_t*);
 int memzone_free(struct proc*, memzone_t*);
 
 #endif // _KERNEL_MEM_MEMZONE_H
\ No newline at end of file
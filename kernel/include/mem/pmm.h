@@ -6,11 +6,16 @@
 #include <mem/boot.h>
 #include <platform/generic/pmm/settings.h>
 
+#define PMM_MAX_ORDER (12) /* The largest contiguous allocation is 2^12 blocks. */
+#define PMM_PCP_SIZE (32) /* Free pages kept by every CPU. */
+#define PMM_PCP_BATCH (16)
+
 struct pmm_state {
     size_t kernel_va_base;
     size_t kernel_size;
 
     bitmap_t mat;
+    size_t meta_size; // MAT and buddy maps, which are placed after the kernel.
     boot_desc_t* boot_desc;
 
     size_t ram_size;
@@ -16,8 +16,30 @@
 #include <platform/generic/vmm/pde.h>
 #include <platform/generic/vmm/pte.h>
 
+#define SWAPFILE_MAX_SLOTS (8192)
+#define SWAPFILE_CLUSTER_PAGES (8)
+
+// Ids of pages of the compressed tier have this bit set. Ids are kept in
+// the frame field of a page descriptor, so they are limited to 20 bits.
+#define SWAPFILE_COMPRESSED_ID_FLAG (1 << 19)
+#define SWAPFILE_COMPRESSED_SLOTS (2048)
+#define SWAPFILE_COMPRESSED_MAX_OBJ_SIZE (2048)
+#define SWAPFILE_COMPRESSED_LIMIT (2 * 1024 * 1024) // The size of the zone of the tier.
+#define SWAPFILE_COMPRESSED_CHUNK_SIZE (64)
+
+struct swapfile_stat {
+    uint32_t file_pages;
+    uint32_t compressed_pages;
+    uint32_t compressed_bytes;
+    uint32_t file_writes;
+};
+typedef struct swapfile_stat swapfile_stat_t;
+
 int swapfile_init();
 int swapfile_load(uintptr_t vaddr, int id);
 int swapfile_store(uintptr_t vaddr);
+void swapfile_free(int id);
+int swapfile_flush();
+void swapfile_get_stat(swapfile_stat_t* stat);
 
 #endif // _KERNEL_MEM_SWAPFILE_H
@@ -28,6 +28,8 @@ struct vm_ops {
     int (*load_page_content)(struct memzone* zone, uintptr_t vaddr);
     int (*swap_page_mode)(struct memzone* zone, uintptr_t vaddr);
     int (*restore_swapped_page)(struct memzone* zone, uintptr_t vaddr);
+    // Returns a referenced physical page, which is mapped read-only instead of loading a private copy.
+    uintptr_t (*get_cached_page)(struct memzone* zone, uintptr_t vaddr);
 };
 typedef struct vm_ops vm_ops_t;
 
@@ -35,24 +37,28 @@ typedef struct vm_ops vm_ops_t;
  * PUBLIC FUNCTIONS
  */
 
-struct dynamic_array;
+struct memzones;
 
 int vmm_setup();
 int vmm_setup_secondary_cpu();
 
-int vmm_free_pdir(pdirectory_t* pdir, struct dynamic_array* zones);
+int vmm_free_pdir(pdirectory_t* pdir, struct memzones* zones);
 
 int vmm_alloc_page(uintptr_t vaddr, uint32_t settings);
 int vmm_tune_page(uintptr_t vaddr, uint32_t settings);
 int vmm_tune_pages(uintptr_t vaddr, size_t length, uint32_t settings);
-int vmm_free_page(uintptr_t vaddr, page_desc_t* page, struct dynamic_array* zones);
+int vmm_free_page(uintptr_t vaddr, page_desc_t* page, struct memzones* zones);
+int vmm_free_pages(uintptr_t vaddr, size_t length, struct memzones* zones);
+int vmm_protect_cached_pages(uintptr_t vaddr, size_t length);
 
 int vmm_map_page(uintptr_t vaddr, uintptr_t paddr, uint32_t settings);
 int vmm_map_pages(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uint32_t settings);
 int vmm_unmap_page(uintptr_t vaddr);
 int vmm_unmap_pages(uintptr_t vaddr, size_t n_pages);
 int vmm_copy_page(uintptr_t to_vaddr, uintptr_t src_vaddr, ptable_t* src_ptable);
-int vmm_swap_page(ptable_t* ptable, struct memzone* zone, uintptr_t vaddr);
+int vmm_swap_page(pdirectory_t* pdir, ptable_t* ptable, struct memzone* zone, uintptr_t vaddr);
+bool vmm_test_and_clear_accessed(pdirectory_t* pdir, ptable_t* ptable, uintptr_t vaddr);
+bool vmm_is_zero_frame(uintptr_t paddr);
 
 int vmm_map_page_lockless(uintptr_t vaddr, uintptr_t paddr, uint32_t settings);
 int vmm_map_pages_lockless(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uint32_t settings);
@@ -64,6 +70,7 @@ pdirectory_t* vmm_new_user_pdir();
 pdirectory_t* vmm_new_forked_user_pdir();
 void* vmm_bring_to_kernel(uint8_t* src, size_t length);
 void vmm_prepare_active_pdir_for_writing_at(uintptr_t dest_vaddr, size_t length);
+int vmm_unshare_zero_pages(uintptr_t vaddr, size_t length);
 void vmm_copy_to_user(void* dest, void* src, size_t length);
 void vmm_copy_to_pdir(pdirectory_t* pdir, void* src, uintptr_t dest_vaddr, size_t length);
 
@@ -73,6 +80,7 @@ pdirectory_t* vmm_get_kernel_pdir();
 int vmm_switch_pdir(pdirectory_t* pdir);
 
 int vmm_page_fault_handler(uint32_t info, uintptr_t vaddr);
+bool vmm_holds_lock();
 
 inline static table_desc_t* _vmm_pdirectory_lookup(pdirectory_t* pdir, uintptr_t vaddr)
 {
@@ -138,4 +138,32 @@ static inline uint32_t read_cpu_id_register()
     return res;
 }
 
+static inline uint32_t read_id_pfr1()
+{
+    uint32_t res;
+    asm volatile("mrc p15, 0, %0, c0, c1, 1"
+                 : "=r"(res)
+                 :);
+    return res;
+}
+
+static inline uint32_t read_cntfrq()
+{
+    uint32_t res;
+    asm volatile("mrc p15, 0, %0, c14, c0, 0"
+                 : "=r"(res)
+                 :);
+    return res;
+}
+
+static inline uint64_t read_cntpct()
+{
+    uint32_t lo, hi;
+    system_instruction_barrier();
+    asm volatile("mrrc p15, 0, %0, %1, c14"
+                 : "=r"(lo), "=r"(hi)
+                 :);
+    return ((uint64_t)hi << 32) | lo;
+}
+
 #endif /* _KERNEL_PLATFORM_AARCH32_REGISTERS_H */
\ No newline at end of file
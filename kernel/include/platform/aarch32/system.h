@@ -72,6 +72,17 @@ inline static void system_flush_whole_tlb()
     system_data_synchronise_barrier();
 }
 
+inline static void system_flush_all_cpus_whole_tlb()
+{
+    system_data_synchronise_barrier();
+    asm volatile("mcr p15, 0, %0, c8, c3, 0"
+                 :
+                 : "r"(0)
+                 : "memory");
+    system_data_synchronise_barrier();
+    system_instruction_barrier();
+}
+
 inline static void system_set_pdir(uint32_t pdir)
 {
     system_data_synchronise_barrier();
@@ -90,6 +101,11 @@ inline static void system_disable_write_protect()
 {
 }
 
+// Sections are always supported.
+inline static void system_enable_large_pages()
+{
+}
+
 inline static void system_enable_paging()
 {
     volatile uint32_t val;
@@ -112,6 +128,13 @@ inline static void system_stop_until_interrupt()
     asm volatile("wfi");
 }
 
+// Is called with interrupts disabled. A pending interrupt wakes wfi up
+// even while masked, and is taken once interrupts are enabled.
+inline static void system_idle_until_interrupt()
+{
+    asm volatile("wfi; cpsie i");
+}
+
 NORETURN inline static void system_stop()
 {
     system_disable_interrupts();
@@ -15,6 +15,7 @@
 #include <mem/vmm.h>
 #include <platform/generic/tasking/context.h>
 #include <tasking/bits/sched.h>
+#include <time/timer_wheel.h>
 
 #define CPU_CNT 4
 #define THIS_CPU (&cpus[system_cpu_id()])
@@ -39,6 +40,7 @@ typedef struct {
     struct thread* idle_thread;
 
     sched_data_t sched;
+    timer_wheel_t timer_wheel;
 
     /* Stat */
     time_t stat_ticks_since_boot;
@@ -59,4 +59,19 @@ static inline void write_cr0(uintptr_t val)
                  : "r"(val));
 }
 
+static inline uintptr_t read_cr4()
+{
+    uintptr_t val;
+    asm volatile("movl %%cr4, %0"
+                 : "=r"(val));
+    return val;
+}
+
+static inline void write_cr4(uintptr_t val)
+{
+    asm volatile("movl %0, %%cr4"
+                 :
+                 : "r"(val));
+}
+
 #endif /* _KERNEL_PLATFORM_X86_REGISTERS_H */
\ No newline at end of file
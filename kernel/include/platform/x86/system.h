@@ -51,6 +51,12 @@ inline static void system_flush_whole_tlb()
     system_set_pdir(read_cr3());
 }
 
+inline static void system_flush_all_cpus_whole_tlb()
+{
+    system_flush_whole_tlb();
+    // TODO: Send inter-processor messages.
+}
+
 inline static void system_enable_write_protect()
 {
     asm volatile("mov %cr0, %eax");
@@ -65,6 +71,12 @@ inline static void system_disable_write_protect()
     asm volatile("mov %eax, %cr0");
 }
 
+// Enables PSE, so table descriptors could map 4MB pages.
+inline static void system_enable_large_pages()
+{
+    write_cr4(read_cr4() | (1 << 4));
+}
+
 inline static void system_enable_paging()
 {
     asm volatile("mov %cr0, %eax");
@@ -84,6 +96,13 @@ inline static void system_stop_until_interrupt()
     asm volatile("hlt");
 }
 
+// Is called with interrupts disabled. Interrupts are taken only after the
+// instruction which follows sti, so none is lost before hlt.
+inline static void system_idle_until_interrupt()
+{
+    asm volatile("sti; hlt");
+}
+
 NORETURN inline static void system_stop()
 {
     system_disable_interrupts();
@@ -12,6 +12,7 @@
 #define VMM_PTE_COUNT (1024)
 #define VMM_PDE_COUNT (1024)
 #define VMM_PAGE_SIZE (4096)
+#define VMM_LARGE_PAGE_SIZE (4096 * 1024)
 
 #define VMM_OFFSET_IN_DIRECTORY(a) (((a) >> 22) & 0x3ff)
 #define VMM_OFFSET_IN_TABLE(a) (((a) >> 12) & 0x3ff)
@@ -41,10 +41,12 @@ bool table_desc_has_attrs(table_desc_t pde, uint32_t attrs);
 
 void table_desc_set_frame(table_desc_t* pde, uint32_t frame);
 void table_desc_del_frame(table_desc_t* pde);
+void table_desc_set_large_page(table_desc_t* pde, uint32_t paddr, uint32_t attrs);
 
 bool table_desc_is_present(table_desc_t pde);
 bool table_desc_is_writable(table_desc_t pde);
 bool table_desc_is_4mb(table_desc_t pde);
+bool table_desc_is_large_page(table_desc_t pde);
 bool table_desc_is_copy_on_write(table_desc_t pde);
 uint32_t table_desc_get_frame(table_desc_t pde);
 
@@ -31,6 +31,7 @@ void sys_close(trapframe_t* tf);
 void sys_waitpid(trapframe_t* tf);
 void sys_creat(trapframe_t* tf);
 void sys_exec(trapframe_t* tf);
+void sys_spawn(trapframe_t* tf);
 void sys_chdir(trapframe_t* tf);
 void sys_getcwd(trapframe_t* tf);
 void sys_sigaction(trapframe_t* tf);
@@ -49,6 +50,7 @@ void sys_rmdir(trapframe_t* tf);
 void sys_unlink(trapframe_t* tf);
 void sys_mmap(trapframe_t* tf);
 void sys_munmap(trapframe_t* tf);
+void sys_msync(trapframe_t* tf);
 void sys_dup(trapframe_t* tf);
 void sys_dup2(trapframe_t* tf);
 void sys_socket(trapframe_t* tf);
@@ -59,7 +61,7 @@ void sys_ioctl(trapframe_t* tf);
 void sys_setpgid(trapframe_t* tf);
 void sys_getpgid(trapframe_t* tf);
 void sys_create_thread(trapframe_t* tf);
-void sys_sleep(trapframe_t* tf);
+void sys_nanosleep(trapframe_t* tf);
 void sys_select(trapframe_t* tf);
 void sys_fstat(trapframe_t* tf);
 void sys_fsync(trapframe_t* tf);
@@ -68,6 +70,7 @@ void sys_uname(trapframe_t* tf);
 void sys_clock_settime(trapframe_t* tf);
 void sys_clock_gettime(trapframe_t* tf);
 void sys_clock_getres(trapframe_t* tf);
+void sys_clock_nanosleep(trapframe_t* tf);
 void sys_nice(trapframe_t* tf);
 void sys_shbuf_create(trapframe_t* tf);
 void sys_shbuf_get(trapframe_t* tf);
@@ -9,6 +9,9 @@
 #ifndef _KERNEL_TASKING_BITS_SCHED_H
 #define _KERNEL_TASKING_BITS_SCHED_H
 
+#include <libkern/lock.h>
+#include <libkern/types.h>
+
 #define MAX_PRIO 0
 #define MIN_PRIO 11
 #define IDLE_PRIO (MIN_PRIO + 1)
@@ -26,11 +29,27 @@ struct runqueue {
 };
 typedef struct runqueue runqueue_t;
 
+// Bit N of the bitmap is set if the runqueue of prio N is not empty.
+struct prio_array {
+    uint32_t bitmap;
+    runqueue_t queues[TOTAL_PRIOS_COUNT];
+};
+typedef struct prio_array prio_array_t;
+
 struct sched_data {
-    int next_read_prio;
-    runqueue_t* master_buf;
-    runqueue_t* slave_buf;
-    int enqueued_tasks;
+    lock_t lock;
+    prio_array_t* active;
+    prio_array_t* expired;
+    prio_array_t arrays[2];
+    uint64_t expired_since; // When the expired array got its first thread.
+    int enqueued_tasks; // Threads in runqueues, the running one is not counted.
+
+    int balance_countdown; // Ticks until the next periodic balancing.
+    int balance_failed; // Balancing passes in a row which found only cache hot threads.
+
+    /* Stat */
+    uint32_t stat_migrations_in;
+    uint32_t stat_migrations_out;
 };
 typedef struct sched_data sched_data_t;
 
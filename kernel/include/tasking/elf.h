@@ -74,6 +74,12 @@ enum P_TYPE_FIELDS {
     PT_HIPROC = 0x7FFFFFFF,
 };
 
+enum P_FLAGS_FIELDS {
+    PF_X = 0x1,
+    PF_W = 0x2,
+    PF_R = 0x4,
+};
+
 typedef struct {
     uint32_t p_type;
     uint32_t p_offset;
@@ -13,6 +13,7 @@
 #include <fs/vfs.h>
 #include <io/tty/tty.h>
 #include <libkern/atomic.h>
+#include <libkern/bits/spawn.h>
 #include <libkern/lock.h>
 #include <libkern/types.h>
 #include <mem/kmemzone.h>
@@ -53,7 +54,7 @@ struct proc {
     uid_t suid;
     gid_t sgid;
 
-    dynamic_array_t zones;
+    memzones_t zones;
 
     dentry_t* proc_file;
     dentry_t* cwd;
@@ -100,6 +101,7 @@ int kthread_free(proc_t* p);
 
 int proc_load(proc_t* p, struct thread* main_thread, const char* path);
 int proc_fork_from(proc_t* new_proc, struct thread* from_thread);
+int proc_spawn_from(proc_t* new_proc, struct thread* from_thread, const spawn_file_action_t* actions, int count);
 
 int proc_die(proc_t* p);
 int proc_block_all_threads(proc_t* p, const struct blocker* blocker);
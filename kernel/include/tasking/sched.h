@@ -21,11 +21,13 @@ void resched();
 void sched();
 void sched_enqueue(thread_t* thread);
 void sched_dequeue(thread_t* thread);
+void sched_balance_tick();
 uint32_t active_cpu_count();
 
 static inline void sched_tick()
 {
     if (RUNNING_THREAD) {
+        sched_balance_tick();
         RUNNING_THREAD->ticks_until_preemption--;
         if (!RUNNING_THREAD->ticks_until_preemption) {
             resched();
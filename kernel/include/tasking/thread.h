@@ -16,7 +16,9 @@
 #include <platform/generic/tasking/context.h>
 #include <platform/generic/tasking/trapframe.h>
 #include <tasking/signal.h>
+#include <tasking/wait_queue.h>
 #include <time/time_manager.h>
+#include <time/timer_wheel.h>
 
 enum THREAD_STATUS {
     THREAD_STATUS_INVALID = 0,
@@ -44,6 +46,7 @@ enum BLOCKER_REASON {
     BLOCKER_SELECT,
     BLOCKER_DUMPING,
     BLOCKER_STOP, // Just waiting for signal which will continue the thread.
+    BLOCKER_BLKIO,
 };
 
 struct blocker_join {
@@ -58,11 +61,12 @@ struct blocker_rw {
 typedef struct blocker_rw blocker_rw_t;
 
 struct blocker_sleep {
-    time_t until;
+    uint64_t until; // Nanoseconds since boot.
 };
 typedef struct blocker_sleep blocker_sleep_t;
 
 struct blocker_select {
+    uint64_t until; // Nanoseconds since boot, 0 if there is no timeout.
     int nfds;
     fd_set_t readfds;
     fd_set_t writefds;
@@ -70,6 +74,15 @@ struct blocker_select {
 };
 typedef struct blocker_select blocker_select_t;
 
+struct blk_request;
+struct blocker_blkio {
+    struct blk_request* req;
+};
+typedef struct blocker_blkio blocker_blkio_t;
+
+// Select waits on read and write queues of every fd.
+#define THREAD_WAIT_ENTRIES (2 * FD_SETSIZE)
+
 struct proc;
 struct thread {
     struct proc* process;
@@ -85,6 +98,10 @@ struct thread {
     /* Scheduler data */
     struct thread* sched_prev;
     struct thread* sched_next;
+    struct prio_array* sched_array; // NULL if the thread is not in a runqueue.
+    int sched_prio;
+    uint64_t sched_enqueue_time;
+    uint64_t sched_last_ran; // Time when the thread was switched out, 0 if it has not run.
     int last_cpu;
     time_t ticks_until_preemption;
     time_t start_time_in_ticks; // Time when the task was put to run.
@@ -96,10 +113,19 @@ struct thread {
         blocker_rw_t rw;
         blocker_sleep_t sleep;
         blocker_select_t select;
+        blocker_blkio_t blkio;
     } blocker_data;
+    wait_entry_t wait_entries[THREAD_WAIT_ENTRIES];
+    int wait_entries_count;
+    ktimer_t wait_timer;
+    bool wait_timed_out;
+    wait_queue_t exit_wait_queue; // Joiners of the thread.
 
     /* Stat data */
     time_t stat_total_running_ticks;
+    uint32_t stat_sched_runs;
+    uint64_t stat_sched_latency_total_ns; // Time spent runnable in runqueues.
+    uint64_t stat_sched_latency_max_ns;
 
     uint32_t signals_mask;
     uint32_t pending_signals_mask;
@@ -151,12 +177,15 @@ static ALWAYS_INLINE int thread_is_alive(thread_t* thread) { return !thread_is_f
  */
 
 int thread_init_blocker(thread_t* thread, const struct blocker* blocker);
+bool thread_try_unblock(thread_t* thread);
+void thread_leave_wait_queues(thread_t* thread);
 
 int init_join_blocker(thread_t* thread, int wait_for_pid);
 int init_read_blocker(thread_t* p, file_descriptor_t* bfd);
 int init_write_blocker(thread_t* thread, file_descriptor_t* bfd);
-int init_sleep_blocker(thread_t* thread, time_t time);
+int init_sleep_blocker(thread_t* thread, uint64_t until);
 int init_select_blocker(thread_t* thread, int nfds, fd_set_t* readfds, fd_set_t* writefds, fd_set_t* exceptfds, timeval_t* timeout);
+int init_blkio_blocker(thread_t* thread, struct blk_request* req);
 
 /**
  * DEBUG FUNCTIONS
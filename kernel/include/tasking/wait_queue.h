@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_TASKING_WAIT_QUEUE_H
+#define _KERNEL_TASKING_WAIT_QUEUE_H
+
+#include <libkern/lock.h>
+#include <libkern/types.h>
+
+struct thread;
+struct wait_queue;
+
+struct wait_entry {
+    struct thread* thread;
+    struct wait_queue* queue;
+    struct wait_entry* next;
+};
+typedef struct wait_entry wait_entry_t;
+
+/**
+ * A wait queue is attached to an object threads wait on. A producer calls
+ * wait_queue_wake_all() once the state of the object has changed, and only
+ * the threads which wait on the object are checked.
+ */
+struct wait_queue {
+    lock_t lock;
+    wait_entry_t* head;
+};
+typedef struct wait_queue wait_queue_t;
+
+void wait_queue_init(wait_queue_t* wq);
+void wait_queue_add(wait_queue_t* wq, wait_entry_t* entry);
+void wait_queue_remove(wait_entry_t* entry);
+void wait_queue_wake_all(wait_queue_t* wq);
+
+#endif // _KERNEL_TASKING_WAIT_QUEUE_H
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_TIME_CLOCKEVENT_H
+#define _KERNEL_TIME_CLOCKEVENT_H
+
+#include <libkern/types.h>
+
+/**
+ * A device which raises the timer interrupt. It ticks periodically with
+ * TIMER_TICKS_PER_SECOND, and is switched to one-shot while all cpus idle.
+ * Callbacks are called with interrupts disabled.
+ */
+struct clockevent {
+    const char* name;
+    uint64_t min_delta_ns;
+    uint64_t max_delta_ns;
+    void (*set_periodic)();
+    void (*set_oneshot)(uint64_t delta_ns);
+};
+typedef struct clockevent clockevent_t;
+
+void clockevent_register(clockevent_t* ce);
+void clockevent_tick();
+void clockevent_enter_idle();
+void clockevent_exit_idle();
+
+#endif // _KERNEL_TIME_CLOCKEVENT_H
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_TIME_CLOCKSOURCE_H
+#define _KERNEL_TIME_CLOCKSOURCE_H
+
+#include <libkern/types.h>
+
+// Conversions stay exact for deltas up to this, the clock is updated much more often.
+#define CLOCKSOURCE_MAX_DELTA_SECS (600)
+
+/**
+ * A free running counter, which the time is read from.
+ * ns = (cycles * mult) >> shift, mult and shift are set on registration.
+ */
+struct clocksource {
+    const char* name;
+    int rating; // The best rated clocksource is used.
+    uint64_t (*read)();
+    uint64_t mask; // Counters which are narrower than 64 bits wrap at mask.
+    uint32_t freq; // Hz.
+
+    uint32_t mult;
+    uint32_t shift;
+};
+typedef struct clocksource clocksource_t;
+
+void clocksource_register(clocksource_t* cs);
+void clocksource_calc_mult_shift(clocksource_t* cs);
+
+static inline uint64_t clocksource_cycles_to_ns(clocksource_t* cs, uint64_t cycles)
+{
+    return (cycles * cs->mult) >> cs->shift;
+}
+
+#endif // _KERNEL_TIME_CLOCKSOURCE_H
@@ -14,9 +14,11 @@
 #include <libkern/bits/time.h>
 #include <libkern/types.h>
 #include <platform/generic/cpu.h>
+#include <time/clocksource.h>
+
+#define NS_PER_SEC (1000000000)
 
 extern time_t ticks_since_boot;
-extern time_t ticks_since_second;
 
 bool timeman_is_leap_year(uint32_t year);
 uint32_t timeman_days_in_years_since_epoch(uint32_t year);
@@ -26,10 +28,20 @@ time_t timeman_to_seconds_since_epoch(uint8_t secs, uint8_t mins, uint8_t hrs, u
 int timeman_setup();
 void timeman_timer_tick();
 
+clocksource_t* timeman_clocksource();
+void timeman_set_clocksource(clocksource_t* cs);
+bool timeman_has_highres_clock();
+
 time_t timeman_now();
 time_t timeman_seconds_since_boot();
 time_t timeman_get_ticks_from_last_second();
+uint64_t timeman_ns_since_boot();
+uint64_t timeman_ns_since_epoch();
+uint64_t timeman_timespec_to_ns(const timespec_t* ts);
+void timeman_ns_to_timespec(uint64_t ns, timespec_t* ts);
+uint32_t timeman_ns_to_ticks(uint64_t ns);
 static inline time_t timeman_ticks_per_second() { return TIMER_TICKS_PER_SECOND; };
+static inline uint32_t timeman_ns_per_tick() { return NS_PER_SEC / TIMER_TICKS_PER_SECOND; };
 static inline time_t timeman_ticks_since_boot() { return THIS_CPU->stat_ticks_since_boot; };
 
 #endif /* _KERNEL_TIME_TIME_MANAGER_H */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _KERNEL_TIME_TIMER_WHEEL_H
+#define _KERNEL_TIME_TIMER_WHEEL_H
+
+#include <libkern/lock.h>
+#include <libkern/types.h>
+
+#define TIMER_WHEEL_LEVELS (4)
+#define TIMER_WHEEL_SLOT_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_TICKS (0x3fffffff)
+
+struct timer_wheel;
+struct ktimer {
+    uint64_t expires; // Nanoseconds since boot.
+    uint32_t expires_tick;
+    // Is called from the timer interrupt with the wheel lock held.
+    void (*callback)(struct ktimer* timer);
+    void* data;
+
+    struct timer_wheel* wheel;
+    struct ktimer* next;
+    struct ktimer** pprev; // NULL if the timer is not armed.
+};
+typedef struct ktimer ktimer_t;
+
+struct timer_wheel {
+    lock_t lock;
+    uint32_t tick; // The next tick to be served.
+    ktimer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+typedef struct timer_wheel timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* wheel);
+uint32_t timer_wheel_run(timer_wheel_t* wheel, uint32_t now_tick);
+uint32_t timer_wheel_next_tick(timer_wheel_t* wheel);
+
+void ktimer_init(ktimer_t* timer, void (*callback)(ktimer_t*), void* data);
+void ktimer_arm(ktimer_t* timer, uint64_t expires);
+void ktimer_cancel(ktimer_t* timer);
+static inline bool ktimer_is_armed(ktimer_t* timer) { return timer->pprev != NULL; }
+
+#endif // _KERNEL_TIME_TIMER_WHEEL_H
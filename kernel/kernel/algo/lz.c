@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <algo/lz.h>
+#include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
+
+/**
+ * The stream is a sequence of chunks, a chunk starts with a control byte:
+ *  - 000LLLLL: a run of L + 1 literals follows.
+ *  - LLLOOOOO OOOOOOOO: a match of L + 2 bytes at offset O + 1 back.
+ *    If L is 7, one more byte, which is added to the length, goes before
+ *    the low byte of the offset.
+ */
+
+#define LZ_MAX_LITERALS (32)
+#define LZ_MAX_OFFSET (1 << 13)
+#define LZ_MAX_MATCH (7 + 255 + 2)
+
+static inline uint32_t _lz_hash(const uint8_t* p)
+{
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761u) >> (32 - LZ_HASH_LOG)) & (LZ_HASH_SIZE - 1);
+}
+
+/**
+ * Returns the size of the compressed data, or 0 if it doesn't fit into out.
+ */
+size_t lz_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len, lz_hash_table_t table)
+{
+    if (!in_len || !out_len || in_len > 0xffff) {
+        return 0;
+    }
+    memset(table, 0, sizeof(lz_hash_table_t));
+
+    // A control byte of the current literal run is reserved in advance.
+    size_t ip = 0;
+    size_t op = 1;
+    size_t lit = 0;
+
+    while (ip < in_len) {
+        if (ip + 2 < in_len) {
+            uint32_t h = _lz_hash(&in[ip]);
+            size_t ref = table[h];
+            table[h] = ip;
+
+            size_t off = ip - ref - 1;
+            if (ref < ip && off < LZ_MAX_OFFSET && in[ref] == in[ip] && in[ref + 1] == in[ip + 1] && in[ref + 2] == in[ip + 2]) {
+                size_t max_len = min(in_len - ip, LZ_MAX_MATCH);
+                size_t len = 3;
+                while (len < max_len && in[ref + len] == in[ip + len]) {
+                    len++;
+                }
+
+                // Closing the literal run, or dropping its unused control byte.
+                if (lit) {
+                    out[op - lit - 1] = lit - 1;
+                } else {
+                    op--;
+                }
+
+                if (op + 3 + 1 > out_len) {
+                    return 0;
+                }
+
+                size_t enc_len = len - 2;
+                if (enc_len < 7) {
+                    out[op++] = (enc_len << 5) | (off >> 8);
+                } else {
+                    out[op++] = (7 << 5) | (off >> 8);
+                    out[op++] = enc_len - 7;
+                }
+                out[op++] = off & 0xff;
+
+                lit = 0;
+                op++;
+                ip += len;
+                continue;
+            }
+        }
+
+        if (op >= out_len) {
+            return 0;
+        }
+        out[op++] = in[ip++];
+        lit++;
+
+        if (lit == LZ_MAX_LITERALS) {
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+            if (op >= out_len) {
+                return 0;
+            }
+            op++;
+        }
+    }
+
+    if (lit) {
+        out[op - lit - 1] = lit - 1;
+    } else {
+        op--;
+    }
+    return op;
+}
+
+/**
+ * Returns the size of the decompressed data, or a negative error if the
+ * stream is malformed or doesn't fit into out.
+ */
+int lz_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < in_len) {
+        uint32_t ctrl = in[ip++];
+        if (ctrl < LZ_MAX_LITERALS) {
+            size_t len = ctrl + 1;
+            if (ip + len > in_len || op + len > out_len) {
+                return -EINVAL;
+            }
+            memcpy(&out[op], &in[ip], len);
+            ip += len;
+            op += len;
+            continue;
+        }
+
+        size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= in_len) {
+                return -EINVAL;
+            }
+            len += in[ip++];
+        }
+        if (ip >= in_len) {
+            return -EINVAL;
+        }
+
+        size_t off = ((ctrl & 0x1f) << 8) + in[ip++] + 1;
+        len += 2;
+        if (off > op || op + len > out_len) {
+            return -EINVAL;
+        }
+
+        // Regions could overlap, so the match is copied bytewise.
+        for (size_t i = 0; i < len; i++, op++) {
+            out[op] = out[op - off];
+        }
+    }
+    return op;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <drivers/aarch32/gentimer.h>
+#include <libkern/log.h>
+#include <platform/aarch32/registers.h>
+#include <time/clocksource.h>
+
+// #define DEBUG_GENTIMER
+
+/**
+ * Only the system counter of the generic timer is used. It is shared by
+ * all cpus, 56 bits at least, and usually runs at tens of MHz.
+ */
+
+static uint64_t _gentimer_read()
+{
+    return read_cntpct();
+}
+
+static clocksource_t _gentimer_clocksource = {
+    .name = "cntpct",
+    .rating = 300,
+    .read = _gentimer_read,
+    .mask = ~0ULL,
+};
+
+void gentimer_install()
+{
+    if (!(read_id_pfr1() & ID_PFR1_GENERIC_TIMER_MASK)) {
+        return;
+    }
+
+    uint32_t freq = read_cntfrq();
+    if (!freq) {
+        // Firmware is expected to set the frequency.
+        log_warn("Gentimer: frequency is not set");
+        return;
+    }
+
+#ifdef DEBUG_GENTIMER
+    log("Gentimer: %u Hz", freq);
+#endif
+    _gentimer_clocksource.freq = freq;
+    clocksource_register(&_gentimer_clocksource);
+}
+
+devman_register_driver_installation(gentimer_install);
@@ -19,6 +19,7 @@
 #include <mem/vmm.h>
 #include <platform/aarch32/interrupts.h>
 #include <tasking/tasking.h>
+#include <tasking/wait_queue.h>
 
 // #define MOUSE_DRIVER_DEBUG
 #ifdef MOUSE_DRIVER_DEBUG
@@ -26,6 +27,7 @@
 #endif
 
 static ringbuffer_t mouse_buffer;
+static wait_queue_t mouse_wait_queue;
 static kmemzone_t mapped_zone;
 static volatile pl050_registers_t* registers;
 
@@ -62,6 +64,11 @@ static int _mouse_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
     int res = ringbuffer_read(&mouse_buffer, buf, leno);
     return leno;
 }
+
+static wait_queue_t* _mouse_wait_queue(dentry_t* dentry)
+{
+    return &mouse_wait_queue;
+}
 static void pl050_mouse_recieve_notification(uint32_t msg, uint32_t param)
 {
     if (msg == DEVMAN_NOTIFICATION_DEVFS_READY) {
@@ -73,6 +80,7 @@ static void pl050_mouse_recieve_notification(uint32_t msg, uint32_t param)
         file_ops_t fops = { 0 };
         fops.can_read = _mouse_can_read;
         fops.read = _mouse_read;
+        fops.wait_queue = _mouse_wait_queue;
         devfs_inode_t* res = devfs_register(mp, MKDEV(10, 1), "mouse", 5, 0400, &fops);
 
         dentry_put(mp);
@@ -150,6 +158,7 @@ static void _pl050_mouse_int_handler()
     }
 
     ringbuffer_write(&mouse_buffer, (uint8_t*)&packet, sizeof(mouse_packet_t));
+    wait_queue_wake_all(&mouse_wait_queue);
 
 #ifdef MOUSE_DRIVER_DEBUG
     log("%x ", packet.button_states);
@@ -190,6 +199,7 @@ int pl050_mouse_init(device_t* dev)
     _mouse_send_cmd_and_data(0xF3, 80);
     irq_register_handler(PL050_MOUSE_IRQ_LINE, 0, 0, _pl050_mouse_int_handler, BOOT_CPU_MASK);
     mouse_buffer = ringbuffer_create_std();
+    wait_queue_init(&mouse_wait_queue);
     return 0;
 }
 
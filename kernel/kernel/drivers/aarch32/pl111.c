@@ -44,6 +44,7 @@ static vm_ops_t mmap_file_vm_ops = {
     .load_page_content = NULL,
     .restore_swapped_page = NULL,
     .swap_page_mode = _pl111_swap_page_mode,
+    .get_cached_page = NULL,
 };
 
 static inline int _pl111_map_itself(device_t* dev)
@@ -68,7 +69,8 @@ static int _pl111_init_buffer(uint32_t width, uint32_t height)
 {
     uint32_t one_screen_len = width * 4 * height;
     pl111_screen_buffer_size = one_screen_len * 2;
-    char* paddr_zone = pmm_alloc(pl111_screen_buffer_size);
+    // Aligned buffers are mapped with sections, see _pl111_mmap().
+    char* paddr_zone = pmm_alloc_aligned(pl111_screen_buffer_size, VMM_LARGE_PAGE_SIZE);
     pl111_bufs_paddr[0] = (char*)(paddr_zone);
     pl111_bufs_paddr[1] = (char*)(paddr_zone + one_screen_len);
     registers->lcd_upbase = (uint32_t)pl111_bufs_paddr[0];
@@ -98,7 +100,8 @@ static memzone_t* _pl111_mmap(dentry_t* dentry, mmap_params_t* params)
         return 0;
     }
 
-    memzone_t* zone = memzone_new_random(RUNNING_THREAD->process, pl111_screen_buffer_size);
+    // Aligned placement lets the buffer be mapped with large pages.
+    memzone_t* zone = memzone_new_random_aligned(RUNNING_THREAD->process, pl111_screen_buffer_size, VMM_LARGE_PAGE_SIZE);
     if (!zone) {
         return 0;
     }
@@ -108,9 +111,7 @@ static memzone_t* _pl111_mmap(dentry_t* dentry, mmap_params_t* params)
     zone->file = dentry_duplicate(dentry);
     zone->ops = &mmap_file_vm_ops;
 
-    for (int offset = 0; offset < pl111_screen_buffer_size; offset += VMM_PAGE_SIZE) {
-        vmm_map_page(zone->start + offset, (uint32_t)(pl111_bufs_paddr[0] + offset), zone->flags);
-    }
+    vmm_map_pages(zone->start, (uint32_t)pl111_bufs_paddr[0], zone->len / VMM_PAGE_SIZE, zone->flags);
 
     return zone;
 }
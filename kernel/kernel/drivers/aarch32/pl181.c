@@ -127,6 +127,26 @@ static int _pl181_write_block(device_t* device, uint32_t lba_like, void* write_d
     return bytes_written;
 }
 
+static int _pl181_read(device_t* device, uint32_t sector, uint8_t* read_data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (_pl181_read_block(device, sector + i, read_data + i * PL181_SECTOR_SIZE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int _pl181_write(device_t* device, uint32_t sector, uint8_t* write_data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (_pl181_write_block(device, sector + i, write_data + i * PL181_SECTOR_SIZE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int _pl181_add_new_device(device_t* new_device)
 {
     if (new_device->device_desc.type != DEVICE_DESC_DEVTREE) {
@@ -180,8 +200,8 @@ static driver_desc_t _pl181_driver_info()
     pl181_desc.system_funcs.init_with_dev = _pl181_add_new_device;
 
     pl181_desc.functions[DRIVER_STORAGE_ADD_DEVICE] = _pl181_add_new_device;
-    pl181_desc.functions[DRIVER_STORAGE_READ] = _pl181_read_block;
-    pl181_desc.functions[DRIVER_STORAGE_WRITE] = _pl181_write_block;
+    pl181_desc.functions[DRIVER_STORAGE_READ] = _pl181_read;
+    pl181_desc.functions[DRIVER_STORAGE_WRITE] = _pl181_write;
     pl181_desc.functions[DRIVER_STORAGE_FLUSH] = 0;
     pl181_desc.functions[DRIVER_STORAGE_CAPACITY] = _pl181_get_capacity;
     return pl181_desc;
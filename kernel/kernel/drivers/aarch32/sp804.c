@@ -8,18 +8,27 @@
 
 #include <drivers/aarch32/sp804.h>
 #include <drivers/devtree.h>
+#include <libkern/libkern.h>
 #include <libkern/log.h>
 #include <mem/kmemzone.h>
 #include <mem/vmm.h>
 #include <platform/aarch32/interrupts.h>
 #include <tasking/cpu.h>
 #include <tasking/sched.h>
+#include <time/clockevent.h>
+#include <time/clocksource.h>
 #include <time/time_manager.h>
 
 // #define DEBUG_SP804
 
+/**
+ * Timer1 raises the timer interrupt, timer2 runs freely and is used as
+ * a clocksource when the cpu has no generic timer.
+ */
+
 static kmemzone_t mapped_zone;
 volatile sp804_registers_t* timer1;
+volatile sp804_registers_t* timer2;
 
 static inline uintptr_t _sp804_mmio_paddr()
 {
@@ -38,6 +47,7 @@ static inline int _sp804_map_itself()
     mapped_zone = kmemzone_new(VMM_PAGE_SIZE);
     vmm_map_page(mapped_zone.start, mmio_paddr, MMU_FLAG_DEVICE);
     timer1 = (sp804_registers_t*)mapped_zone.ptr;
+    timer2 = (sp804_registers_t*)(mapped_zone.ptr + (SP804_TIMER2_BASE - SP804_TIMER1_BASE));
     return 0;
 }
 
@@ -54,12 +64,55 @@ static void _sp804_int_handler()
     sched_tick();
 }
 
-void sp804_install()
+static void _sp804_set_periodic()
 {
-    _sp804_map_itself();
+    timer1->control = 0;
     timer1->load = SP804_CLK_HZ / TIMER_TICKS_PER_SECOND;
     timer1->control = SP804_ENABLE_MASK | SP804_PERIODIC_MASK | SP804_32_BIT_MASK | SP804_INTS_ENABLED_MASK;
+}
+
+static void _sp804_set_oneshot(uint64_t delta_ns)
+{
+    // Rounding up, so the interrupt doesn't come before the tick it is set for.
+    uint64_t count = udiv64(delta_ns * SP804_CLK_HZ + NS_PER_SEC - 1, NS_PER_SEC, NULL);
+    timer1->control = 0;
+    timer1->load = max(min(count, (uint64_t)0xffffffff), (uint64_t)1);
+    timer1->control = SP804_ENABLE_MASK | SP804_ONE_SHOT_MASK | SP804_32_BIT_MASK | SP804_INTS_ENABLED_MASK;
+}
+
+static clockevent_t _sp804_clockevent = {
+    .name = "sp804",
+    .min_delta_ns = 100000,
+    .max_delta_ns = 0xffffffffULL * (NS_PER_SEC / SP804_CLK_HZ),
+    .set_periodic = _sp804_set_periodic,
+    .set_oneshot = _sp804_set_oneshot,
+};
+
+static uint64_t _sp804_read_counter()
+{
+    // The counter goes down.
+    return (uint32_t)~timer2->value;
+}
+
+static clocksource_t _sp804_clocksource = {
+    .name = "sp804",
+    .rating = 200,
+    .read = _sp804_read_counter,
+    .mask = 0xffffffff,
+    .freq = SP804_CLK_HZ,
+};
+
+void sp804_install()
+{
+    _sp804_map_itself();
+    _sp804_set_periodic();
     irq_register_handler(SP804_TIMER1_IRQ_LINE, 0, IRQ_TYPE_EDGE_TRIGGERED_MASK, _sp804_int_handler, ALL_CPU_MASK);
+    clockevent_register(&_sp804_clockevent);
+
+    // Free running mode wraps from 0 to the max value.
+    timer2->load = 0xffffffff;
+    timer2->control = SP804_ENABLE_MASK | SP804_32_BIT_MASK;
+    clocksource_register(&_sp804_clocksource);
 }
 
 devman_register_driver_installation(sp804_install);
\ No newline at end of file
@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <drivers/generic/blkqueue.h>
+#include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
+#include <libkern/log.h>
+#include <mem/kmalloc.h>
+#include <platform/generic/system.h>
+#include <tasking/cpu.h>
+#include <tasking/tasking.h>
+
+// #define BLKQUEUE_DEBUG
+
+static blkqueue_t* _blkqueues[MAX_DEVICES_COUNT];
+
+/**
+ * The queue lock is taken by interrupt handlers as well, so interrupts
+ * are disabled while it is held by a thread.
+ */
+static inline void _blkqueue_lock(blkqueue_t* queue)
+{
+    system_disable_interrupts();
+    lock_acquire(&queue->lock);
+}
+
+static inline void _blkqueue_unlock(blkqueue_t* queue)
+{
+    lock_release(&queue->lock);
+    system_enable_interrupts();
+}
+
+blkqueue_t* blkqueue_register(device_t* dev, const blkqueue_ops_t* ops, uint32_t max_sectors)
+{
+    blkqueue_t* queue = (blkqueue_t*)kmalloc(sizeof(blkqueue_t));
+    memset(queue, 0, sizeof(blkqueue_t));
+    lock_init(&queue->lock);
+    wait_queue_init(&queue->wait_queue);
+    queue->dev = dev;
+    queue->ops = ops;
+    queue->max_sectors = max_sectors;
+    _blkqueues[dev->id] = queue;
+    return queue;
+}
+
+blkqueue_t* blkqueue_get(device_t* dev)
+{
+    return _blkqueues[dev->id];
+}
+
+void blkqueue_init_request(blk_request_t* req, device_t* dev, int type, uint32_t sector, uint8_t* buf, uint32_t count)
+{
+    req->dev = dev;
+    req->type = type;
+    req->sector = sector;
+    req->count = count;
+    req->buf = buf;
+    req->status = BLK_REQUEST_FREE;
+    req->result = 0;
+    req->seq = 0;
+    req->total_count = count;
+    req->next = NULL;
+    req->merged_next = NULL;
+}
+
+/**
+ * ELEVATOR
+ */
+
+static inline blk_request_t* _blkqueue_last_merged(blk_request_t* head)
+{
+    while (head->merged_next) {
+        head = head->merged_next;
+    }
+    return head;
+}
+
+static inline bool _blkqueue_is_older(blk_request_t* a, blk_request_t* b)
+{
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+// Requests conflict if their order matters: they overlap and one of them writes, or one of them is a flush.
+static inline bool _blkqueue_conflicts(blk_request_t* a, blk_request_t* b)
+{
+    if (a->type == BLK_REQUEST_FLUSH || b->type == BLK_REQUEST_FLUSH) {
+        return true;
+    }
+    if (a->type == BLK_REQUEST_READ && b->type == BLK_REQUEST_READ) {
+        return false;
+    }
+    return a->sector < b->sector + b->total_count && b->sector < a->sector + a->total_count;
+}
+
+static bool _blkqueue_has_conflicts_lockless(blkqueue_t* queue, blk_request_t* req)
+{
+    for (blk_request_t* it = queue->pending; it; it = it->next) {
+        if (_blkqueue_conflicts(it, req)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * A merged request is served together with its head, so it could overtake
+ * pending requests which are placed before the head. Requests which
+ * conflict with any pending one are never merged.
+ */
+static bool _blkqueue_try_merge_lockless(blkqueue_t* queue, blk_request_t* req)
+{
+    if (_blkqueue_has_conflicts_lockless(queue, req)) {
+        return false;
+    }
+
+    blk_request_t** it = &queue->pending;
+    while (*it) {
+        blk_request_t* head = *it;
+        if (head->type != req->type || head->total_count + req->count > queue->max_sectors) {
+            it = &head->next;
+            continue;
+        }
+
+        // Back merge: the request continues the head.
+        if (head->sector + head->total_count == req->sector) {
+            _blkqueue_last_merged(head)->merged_next = req;
+            head->total_count += req->count;
+            return true;
+        }
+
+        // Front merge: the request becomes a new head.
+        if (req->sector + req->count == head->sector) {
+            req->merged_next = head;
+            req->seq = head->seq;
+            req->total_count = req->count + head->total_count;
+            req->next = head->next;
+            head->next = NULL;
+            *it = req;
+            return true;
+        }
+        it = &head->next;
+    }
+    return false;
+}
+
+/**
+ * Requests to the same sector keep submission order, see also
+ * _blkqueue_pick_next_lockless().
+ */
+static void _blkqueue_insert_sorted_lockless(blkqueue_t* queue, blk_request_t* req)
+{
+    blk_request_t** it = &queue->pending;
+    while (*it && (*it)->sector <= req->sector) {
+        it = &(*it)->next;
+    }
+    req->next = *it;
+    *it = req;
+}
+
+/**
+ * Picks the next request in C-LOOK order: the first one which is placed
+ * after the disk head, or the lowest one if the head has passed all of them.
+ * A request never overtakes an older one which it conflicts with, since
+ * C-LOOK could reach a later request to the same sectors first.
+ */
+static blk_request_t* _blkqueue_pick_next_lockless(blkqueue_t* queue)
+{
+    blk_request_t** it = &queue->pending;
+    while (*it && (*it)->sector < queue->head_sector) {
+        it = &(*it)->next;
+    }
+    if (!*it) {
+        it = &queue->pending;
+    }
+
+    blk_request_t* req = *it;
+    if (!req) {
+        return NULL;
+    }
+
+    for (blk_request_t* older = queue->pending; older;) {
+        if (older != req && _blkqueue_is_older(older, req) && _blkqueue_conflicts(older, req)) {
+            req = older;
+            older = queue->pending;
+            continue;
+        }
+        older = older->next;
+    }
+
+    it = &queue->pending;
+    while (*it != req) {
+        it = &(*it)->next;
+    }
+    *it = req->next;
+    req->next = NULL;
+    return req;
+}
+
+static void _blkqueue_set_status(blk_request_t* head, int status, int result)
+{
+    for (blk_request_t* it = head; it; it = it->merged_next) {
+        it->result = result;
+        it->status = status;
+    }
+}
+
+static void _blkqueue_dispatch_lockless(blkqueue_t* queue)
+{
+    while (!queue->active) {
+        blk_request_t* req = _blkqueue_pick_next_lockless(queue);
+        if (!req) {
+            return;
+        }
+
+        queue->active = req;
+        queue->head_sector = req->sector + req->total_count;
+        _blkqueue_set_status(req, BLK_REQUEST_ACTIVE, 0);
+
+        int err = queue->ops->start(queue, req);
+        if (err < 0) {
+            queue->active = NULL;
+            _blkqueue_set_status(req, BLK_REQUEST_DONE, err);
+        }
+    }
+}
+
+/**
+ * API FUNCTIONS
+ */
+
+int blkqueue_submit(blk_request_t* req)
+{
+    blkqueue_t* queue = blkqueue_get(req->dev);
+    if (!queue) {
+        return -ENODEV;
+    }
+
+    if (req->count > queue->max_sectors) {
+        return -EINVAL;
+    }
+
+    req->status = BLK_REQUEST_PENDING;
+    req->total_count = req->count;
+    req->next = req->merged_next = NULL;
+
+    _blkqueue_lock(queue);
+    req->seq = queue->next_seq++;
+    queue->stat_submitted++;
+    if (_blkqueue_try_merge_lockless(queue, req)) {
+        queue->stat_merged++;
+    } else {
+        _blkqueue_insert_sorted_lockless(queue, req);
+    }
+    _blkqueue_dispatch_lockless(queue);
+    _blkqueue_unlock(queue);
+    return 0;
+}
+
+/**
+ * Is called by a driver (usually from an interrupt handler) with the queue
+ * lock held, when the active request is served.
+ */
+void blkqueue_complete(blkqueue_t* queue, int result)
+{
+    blk_request_t* req = queue->active;
+    if (!req) {
+        return;
+    }
+
+#ifdef BLKQUEUE_DEBUG
+    log("[blkqueue] dev %d: done %d sectors at %d, res %d", queue->dev->id, req->total_count, req->sector, result);
+#endif
+    queue->active = NULL;
+    _blkqueue_set_status(req, BLK_REQUEST_DONE, result);
+    _blkqueue_dispatch_lockless(queue);
+    wait_queue_wake_all(&queue->wait_queue);
+}
+
+/**
+ * Waits for the request to be served. A thread could sleep only if it holds
+ * no spinlocks, it is woken when the interrupt handler completes the
+ * request. Otherwise the queue is polled.
+ */
+int blkqueue_wait(blk_request_t* req, bool can_sleep)
+{
+    blkqueue_t* queue = blkqueue_get(req->dev);
+    if (!queue) {
+        return -ENODEV;
+    }
+
+    if (can_sleep && RUNNING_THREAD) {
+        while (req->status != BLK_REQUEST_DONE) {
+            system_disable_interrupts();
+            init_blkio_blocker(RUNNING_THREAD, req);
+            system_enable_interrupts();
+        }
+    }
+
+    while (req->status != BLK_REQUEST_DONE) {
+        _blkqueue_lock(queue);
+        if (queue->ops->poll) {
+            queue->ops->poll(queue);
+        }
+        _blkqueue_unlock(queue);
+    }
+
+    req->status = BLK_REQUEST_FREE;
+    return req->result;
+}
+
+/**
+ * Serves a transfer of any length through the queue and waits for it. The
+ * block cache reads its misses this way without holding its lock. Storage
+ * callbacks of drivers use it with can_sleep unset, since they are called
+ * with the cache lock held.
+ */
+int blkqueue_rw(device_t* dev, int type, uint32_t sector, uint8_t* buf, uint32_t count, bool can_sleep)
+{
+    blkqueue_t* queue = blkqueue_get(dev);
+    if (!queue) {
+        return -ENODEV;
+    }
+
+    blk_request_t req;
+    while (count) {
+        uint32_t chunk = min(count, queue->max_sectors);
+        blkqueue_init_request(&req, dev, type, sector, buf, chunk);
+        int err = blkqueue_submit(&req);
+        if (!err) {
+            err = blkqueue_wait(&req, can_sleep);
+        }
+        if (err < 0) {
+            return err;
+        }
+
+        sector += chunk;
+        buf += chunk * BLKQUEUE_SECTOR_SIZE;
+        count -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Submits a flush of the drive's write cache as a barrier, so it covers all
+ * writes which were queued before it, and waits for it.
+ */
+int blkqueue_flush(device_t* dev, bool can_sleep)
+{
+    blk_request_t req;
+    blkqueue_init_request(&req, dev, BLK_REQUEST_FLUSH, 0, NULL, 0);
+    int err = blkqueue_submit(&req);
+    if (err < 0) {
+        return err;
+    }
+    return blkqueue_wait(&req, can_sleep);
+}
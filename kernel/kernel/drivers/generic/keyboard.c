@@ -11,8 +11,10 @@
 #include <fs/devfs/devfs.h>
 #include <fs/vfs.h>
 #include <libkern/libkern.h>
+#include <tasking/wait_queue.h>
 
 static ringbuffer_t gkeyboard_buffer;
+static wait_queue_t gkeyboard_wait_queue;
 static bool _gkeyboard_has_prefix_e0 = false;
 static bool _gkeyboard_shift_enabled = false;
 static bool _gkeyboard_ctrl_enabled = false;
@@ -45,6 +47,11 @@ static int _generic_keyboard_read(dentry_t* dentry, uint8_t* buf, size_t start,
     return read_len;
 }
 
+static wait_queue_t* _generic_keyboard_wait_queue(dentry_t* dentry)
+{
+    return &gkeyboard_wait_queue;
+}
+
 int generic_keyboard_create_devfs()
 {
     dentry_t* mp;
@@ -54,6 +61,7 @@ int generic_keyboard_create_devfs()
     file_ops_t fops = { 0 };
     fops.can_read = _generic_keyboard_can_read;
     fops.read = _generic_keyboard_read;
+    fops.wait_queue = _generic_keyboard_wait_queue;
     devfs_inode_t* res = devfs_register(mp, MKDEV(11, 0), "kbd", 3, 0400, &fops);
 
     dentry_put(mp);
@@ -63,6 +71,7 @@ int generic_keyboard_create_devfs()
 void generic_keyboard_init()
 {
     gkeyboard_buffer = ringbuffer_create_std();
+    wait_queue_init(&gkeyboard_wait_queue);
 }
 
 void generic_emit_key_set1(uint32_t scancode)
@@ -136,6 +145,7 @@ void generic_emit_key_set1(uint32_t scancode)
     }
 
     ringbuffer_write(&gkeyboard_buffer, (uint8_t*)&packet, sizeof(kbd_packet_t));
+    wait_queue_wake_all(&gkeyboard_wait_queue);
 }
 
 static key_t _generic_keyboard_apply_modifiers(key_t key)
@@ -6,8 +6,35 @@
  * found in the LICENSE file.
  */
 
+#include <drivers/generic/blkqueue.h>
 #include <drivers/x86/ata.h>
+#include <drivers/x86/pci.h>
+#include <platform/x86/idt.h>
 #include <libkern/bits/errno.h>
+#include <libkern/log.h>
+#include <mem/kmemzone.h>
+#include <mem/pmm.h>
+#include <mem/vmm.h>
+
+// #define ATA_DEBUG
+
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_BSY 0x80
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ 0x08 // Direction: device to memory.
+#define ATA_BM_SR_ACTIVE 0x01
+#define ATA_BM_SR_ERR 0x02
+#define ATA_BM_SR_IRQ 0x04
+#define ATA_PRD_LAST 0x8000
 
 ata_t _ata_drives[MAX_DEVICES_COUNT];
 
@@ -15,9 +42,10 @@ static uint8_t _ata_drives_count = 0;
 static driver_desc_t _ata_driver_info();
 
 static uint8_t _ata_gen_drive_head_register(bool is_lba, bool is_master, uint8_t head);
+static void _ata_setup_queue(ata_t* ata, device_t* dev);
 
-static int ata_write(device_t* device, uint32_t sector, uint8_t* data, uint32_t size);
-static int ata_read(device_t* device, uint32_t sector, uint8_t* read_data);
+static int ata_write(device_t* device, uint32_t sector, uint8_t* data, uint32_t count);
+static int ata_read(device_t* device, uint32_t sector, uint8_t* read_data, uint32_t count);
 static int ata_flush(device_t* device);
 static uint32_t ata_get_capacity(device_t* device);
 
@@ -72,6 +100,12 @@ int ata_init_with_dev(device_t* dev)
     } else {
         return -1;
     }
+
+    if (_ata_drives[dev->id].dma) {
+        if (!ata_setup_dma(&_ata_drives[dev->id], dev)) {
+            _ata_setup_queue(&_ata_drives[dev->id], dev);
+        }
+    }
     return 0;
 }
 
@@ -94,6 +128,9 @@ void ata_init(ata_t* ata, uint32_t port, bool is_master)
     ata->port.device = port + 0x6;
     ata->port.command = port + 0x7;
     ata->port.control = port + 0x206;
+    ata->dma = false;
+    ata->dma_enabled = false;
+    ata->queue = NULL;
 }
 
 bool ata_indentify(ata_t* ata)
@@ -103,7 +140,7 @@ bool ata_indentify(ata_t* ata)
     port_8bit_out(ata->port.lba_lo, 0);
     port_8bit_out(ata->port.lba_mid, 0);
     port_8bit_out(ata->port.lba_hi, 0);
-    port_8bit_out(ata->port.command, 0xEC);
+    port_8bit_out(ata->port.command, ATA_CMD_IDENTIFY);
 
     // check the acceptance of a command
     uint8_t status = port_8bit_in(ata->port.command);
@@ -155,105 +192,376 @@ bool ata_indentify(ata_t* ata)
     return true;
 }
 
-int ata_write(device_t* device, uint32_t sectorNum, uint8_t* data, uint32_t size)
+/**
+ * The bus-master registers of the channel are in the BAR4 of the IDE controller,
+ * the secondary channel's registers follow the primary's ones.
+ */
+int ata_setup_dma(ata_t* ata, device_t* dev)
 {
-    ata_t* dev = &_ata_drives[device->id];
+    uint32_t bar4 = pci_read_bar(dev, 4);
+    if (!(bar4 & 0x1) || !(bar4 & ~0x3)) {
+        return -ENODEV;
+    }
 
-    uint8_t dev_config = _ata_gen_drive_head_register(true, !dev->is_master, 0);
+    uint16_t bm_base = (bar4 & 0xFFFC) + (ata->port.data == 0x170 ? 8 : 0);
+    ata->bm_port.command = bm_base;
+    ata->bm_port.status = bm_base + 0x2;
+    ata->bm_port.prdt = bm_base + 0x4;
 
-    port_8bit_out(dev->port.device, dev_config);
-    port_8bit_out(dev->port.sector_count, 1);
-    port_8bit_out(dev->port.lba_lo, sectorNum & 0x000000FF);
-    port_8bit_out(dev->port.lba_mid, (sectorNum & 0x0000FF00) >> 8);
-    port_8bit_out(dev->port.lba_hi, (sectorNum & 0x00FF0000) >> 16);
-    port_8bit_out(dev->port.error, 0);
-    port_8bit_out(dev->port.command, 0x31);
+    // Enabling bus mastering for the controller.
+    uint32_t pci_cmd = pci_read(dev->device_desc.pci.bus, dev->device_desc.pci.device, dev->device_desc.pci.function, 0x04) & 0xFFFF;
+    pci_write(dev->device_desc.pci.bus, dev->device_desc.pci.device, dev->device_desc.pci.function, 0x04, pci_cmd | (1 << 2));
 
-    // waiting for processing
-    // while BSY is on and no Errors
+    // PRDT and the buffer must not cross a 64KiB boundary, so they are aligned.
+    ata->prdt_paddr = (uintptr_t)pmm_alloc_aligned(VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+    ata->dma_buf_paddr = (uintptr_t)pmm_alloc_aligned(ATA_DMA_BUFFER_SIZE, ATA_DMA_BUFFER_SIZE);
+    if (!ata->prdt_paddr || !ata->dma_buf_paddr) {
+        return -ENOMEM;
+    }
+
+    kmemzone_t prdt_zone = kmemzone_new(VMM_PAGE_SIZE);
+    vmm_map_page(prdt_zone.start, ata->prdt_paddr, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+    kmemzone_t buf_zone = kmemzone_new(ATA_DMA_BUFFER_SIZE);
+    vmm_map_pages(buf_zone.start, ata->dma_buf_paddr, ATA_DMA_BUFFER_SIZE / VMM_PAGE_SIZE, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+
+    ata->prdt = (ata_prd_t*)prdt_zone.ptr;
+    ata->dma_buf = buf_zone.ptr;
+    ata->prdt[0].paddr = ata->dma_buf_paddr;
+    ata->prdt[0].bytes = 0;
+    ata->prdt[0].flags = ATA_PRD_LAST;
+    ata->dma_enabled = true;
+#ifdef ATA_DEBUG
+    log("[ata] DMA is enabled, bus-master port %x", bm_base);
+#endif
+    return 0;
+}
+
+static uint8_t _ata_wait_not_busy(ata_t* dev)
+{
     uint8_t status = port_8bit_in(dev->port.command);
-    while (((status >> 7) & 1) == 1 && ((status >> 0) & 1) != 1) {
+    while ((status & ATA_SR_BSY) && !(status & ATA_SR_ERR)) {
         status = port_8bit_in(dev->port.command);
     }
+    return status;
+}
 
-    // check if drive isn't ready to transer DRQ
-    if (((status >> 0) & 1) == 1) {
-        kprintf("Error");
-        return -EBUSY;
+/**
+ * Programs an LBA28 command. count is in range [1, 256], 256 is sent as 0.
+ */
+static void _ata_send_lba28_cmd(ata_t* dev, uint32_t sector, uint32_t count, uint8_t cmd)
+{
+    uint8_t dev_config = _ata_gen_drive_head_register(true, !dev->is_master, (sector >> 24) & 0xF);
+
+    port_8bit_out(dev->port.device, dev_config);
+    port_8bit_out(dev->port.sector_count, count & 0xFF);
+    port_8bit_out(dev->port.lba_lo, sector & 0x000000FF);
+    port_8bit_out(dev->port.lba_mid, (sector & 0x0000FF00) >> 8);
+    port_8bit_out(dev->port.lba_hi, (sector & 0x00FF0000) >> 16);
+    port_8bit_out(dev->port.error, 0);
+    port_8bit_out(dev->port.command, cmd);
+}
+
+static int _ata_pio_read(ata_t* dev, uint32_t sector, uint8_t* read_data, uint32_t count)
+{
+    _ata_send_lba28_cmd(dev, sector, count, ATA_CMD_READ_PIO);
+
+    for (uint32_t s = 0; s < count; s++) {
+        // waiting for processing
+        // while BSY is on and no Errors
+        uint8_t status = _ata_wait_not_busy(dev);
+
+        // check if drive isn't ready to transer DRQ
+        if (status & ATA_SR_ERR) {
+            kprintf("Error");
+            return -EBUSY;
+        }
+
+        if (!(status & ATA_SR_DRQ)) {
+            kprintf("No DRQ");
+            return -ENODEV;
+        }
+
+        for (int i = 0; i < 256; i++) {
+            uint16_t data = port_16bit_in(dev->port.data);
+            read_data[2 * i + 1] = (data >> 8) & 0xFF;
+            read_data[2 * i + 0] = (data >> 0) & 0xFF;
+        }
+        read_data += ATA_SECTOR_SIZE;
     }
 
-    for (int i = 0; i < size; i += 2) {
-        uint16_t db = (data[i + 1] << 8) + data[i];
-        port_16bit_out(dev->port.data, db);
+    return 0;
+}
+
+static int _ata_pio_write(ata_t* dev, uint32_t sector, uint8_t* data, uint32_t count)
+{
+    _ata_send_lba28_cmd(dev, sector, count, ATA_CMD_WRITE_PIO);
+
+    for (uint32_t s = 0; s < count; s++) {
+        uint8_t status = _ata_wait_not_busy(dev);
+        if (status & ATA_SR_ERR) {
+            kprintf("Error");
+            return -EBUSY;
+        }
+
+        for (int i = 0; i < ATA_SECTOR_SIZE; i += 2) {
+            uint16_t db = (data[i + 1] << 8) + data[i];
+            port_16bit_out(dev->port.data, db);
+        }
+        data += ATA_SECTOR_SIZE;
     }
 
-    for (int i = size / 2; i < 256; i++) {
-        port_16bit_out(dev->port.data, 0);
+    uint8_t status = _ata_wait_not_busy(dev);
+    if (status & ATA_SR_ERR) {
+        return -EBUSY;
     }
+    return 0;
+}
+
+static void _ata_dma_start(ata_t* dev, uint32_t sector, uint32_t count, bool is_read)
+{
+    dev->prdt[0].bytes = (count * ATA_SECTOR_SIZE) & 0xFFFF;
+
+    port_8bit_out(dev->bm_port.command, 0);
+    port_32bit_out(dev->bm_port.prdt, dev->prdt_paddr);
+    port_8bit_out(dev->bm_port.status, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    port_8bit_out(dev->bm_port.command, is_read ? ATA_BM_CMD_READ : 0);
 
-    return ata_flush(device);
+    _ata_send_lba28_cmd(dev, sector, count, is_read ? ATA_CMD_READ_DMA : ATA_CMD_WRITE_DMA);
+    port_8bit_out(dev->bm_port.command, (is_read ? ATA_BM_CMD_READ : 0) | ATA_BM_CMD_START);
 }
 
-int ata_read(device_t* device, uint32_t sectorNum, uint8_t* read_data)
+static inline bool _ata_dma_is_done(ata_t* dev)
 {
-    ata_t* dev = &_ata_drives[device->id];
+    uint8_t bm_status = port_8bit_in(dev->bm_port.status);
+    return !(bm_status & ATA_BM_SR_ACTIVE) || (bm_status & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR));
+}
 
-    uint8_t dev_config = _ata_gen_drive_head_register(true, !dev->is_master, 0);
+static int _ata_dma_finish(ata_t* dev)
+{
+    uint8_t bm_status = port_8bit_in(dev->bm_port.status);
+    port_8bit_out(dev->bm_port.command, 0);
+    // Reading the status register also acknowledges the drive's interrupt.
+    uint8_t status = _ata_wait_not_busy(dev);
+    port_8bit_out(dev->bm_port.status, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+
+    if ((bm_status & ATA_BM_SR_ERR) || (status & ATA_SR_ERR)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int _ata_dma_transfer(ata_t* dev, uint32_t sector, uint32_t count, bool is_read)
+{
+    _ata_dma_start(dev, sector, count, is_read);
+    while (!_ata_dma_is_done(dev)) { }
+    return _ata_dma_finish(dev);
+}
+
+/**
+ * ASYNC REQUESTS
+ */
 
+static void _ata_flush_start(ata_t* dev)
+{
+    uint8_t dev_config = _ata_gen_drive_head_register(true, !dev->is_master, 0);
     port_8bit_out(dev->port.device, dev_config);
-    port_8bit_out(dev->port.sector_count, 1);
-    port_8bit_out(dev->port.lba_lo, sectorNum & 0x000000FF);
-    port_8bit_out(dev->port.lba_mid, (sectorNum & 0x0000FF00) >> 8);
-    port_8bit_out(dev->port.lba_hi, (sectorNum & 0x00FF0000) >> 16);
-    port_8bit_out(dev->port.error, 0);
-    port_8bit_out(dev->port.command, 0x21);
+    port_8bit_out(dev->port.command, ATA_CMD_CACHE_FLUSH);
+}
 
-    // waiting for processing
-    // while BSY is on and no Errors
-    uint8_t status = port_8bit_in(dev->port.command);
-    while (((status >> 7) & 1) == 1 && ((status >> 0) & 1) != 1) {
-        status = port_8bit_in(dev->port.command);
+static int _ata_queue_start(blkqueue_t* queue, blk_request_t* req)
+{
+    ata_t* dev = &_ata_drives[queue->dev->id];
+    if (req->type == BLK_REQUEST_FLUSH) {
+        _ata_flush_start(dev);
+        return 0;
     }
 
-    // check if drive isn't ready to transer DRQ
-    if (((status >> 0) & 1) == 1) {
-        kprintf("Error");
-        return -EBUSY;
+    bool is_read = (req->type == BLK_REQUEST_READ);
+
+    if (!is_read) {
+        uint8_t* dst = dev->dma_buf;
+        for (blk_request_t* it = req; it; it = it->merged_next) {
+            memcpy(dst, it->buf, it->count * ATA_SECTOR_SIZE);
+            dst += it->count * ATA_SECTOR_SIZE;
+        }
     }
 
-    if (((status >> 3) & 1) == 0) {
-        kprintf("No DRQ");
-        return -ENODEV;
+    _ata_dma_start(dev, req->sector, req->total_count, is_read);
+    return 0;
+}
+
+static void _ata_queue_poll(blkqueue_t* queue)
+{
+    ata_t* dev = &_ata_drives[queue->dev->id];
+    blk_request_t* req = queue->active;
+    if (!req) {
+        return;
     }
 
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = port_16bit_in(dev->port.data);
-        read_data[2 * i + 1] = (data >> 8) & 0xFF;
-        read_data[2 * i + 0] = (data >> 0) & 0xFF;
+    // The drive raises an interrupt when the flush is done, reading the status acknowledges it.
+    if (req->type == BLK_REQUEST_FLUSH) {
+        uint8_t status = port_8bit_in(dev->port.command);
+        if (status & ATA_SR_BSY) {
+            return;
+        }
+        blkqueue_complete(queue, (status & ATA_SR_ERR) ? -EIO : 0);
+        return;
+    }
+
+    if (!_ata_dma_is_done(dev)) {
+        return;
+    }
+
+    int err = _ata_dma_finish(dev);
+    if (!err && req->type == BLK_REQUEST_READ) {
+        uint8_t* src = dev->dma_buf;
+        for (blk_request_t* it = req; it; it = it->merged_next) {
+            memcpy(it->buf, src, it->count * ATA_SECTOR_SIZE);
+            src += it->count * ATA_SECTOR_SIZE;
+        }
+    }
+    blkqueue_complete(queue, err);
+}
+
+static const blkqueue_ops_t _ata_queue_ops = {
+    .start = _ata_queue_start,
+    .poll = _ata_queue_poll,
+};
+
+static void _ata_irq_handler_impl(uint32_t port)
+{
+    for (int i = 0; i < MAX_DEVICES_COUNT; i++) {
+        ata_t* dev = &_ata_drives[i];
+        if (!dev->queue || dev->port.data != port) {
+            continue;
+        }
+
+        lock_acquire(&dev->queue->lock);
+        _ata_queue_poll(dev->queue);
+        lock_release(&dev->queue->lock);
+    }
+}
+
+static void _ata_primary_irq_handler()
+{
+    _ata_irq_handler_impl(0x1F0);
+}
+
+static void _ata_secondary_irq_handler()
+{
+    _ata_irq_handler_impl(0x170);
+}
+
+static void _ata_setup_queue(ata_t* ata, device_t* dev)
+{
+    // Drives of one channel share the bus-master engine, only the first one gets the queue.
+    for (int i = 0; i < MAX_DEVICES_COUNT; i++) {
+        if (_ata_drives[i].queue && _ata_drives[i].bm_port.command == ata->bm_port.command) {
+            ata->dma_enabled = false;
+            return;
+        }
+    }
+
+    ata->queue = blkqueue_register(dev, &_ata_queue_ops, ATA_DMA_MAX_SECTORS);
+    port_8bit_out(ata->port.control, 0); // Clearing nIEN to get interrupts.
+    if (ata->port.data == 0x170) {
+        set_irq_handler(IRQ15, _ata_secondary_irq_handler);
+    } else {
+        set_irq_handler(IRQ14, _ata_primary_irq_handler);
+    }
+}
+
+/**
+ * Reads count sectors starting from the sector. Large requests are split into
+ * the biggest chunks a single command could handle.
+ */
+int ata_read(device_t* device, uint32_t sector, uint8_t* read_data, uint32_t count)
+{
+    ata_t* dev = &_ata_drives[device->id];
+    if (dev->queue) {
+        return blkqueue_rw(device, BLK_REQUEST_READ, sector, read_data, count, false);
+    }
+
+    while (count) {
+        int err;
+        uint32_t chunk;
+        if (dev->dma_enabled) {
+            chunk = min(count, ATA_DMA_MAX_SECTORS);
+            err = _ata_dma_transfer(dev, sector, chunk, true);
+            if (!err) {
+                memcpy(read_data, dev->dma_buf, chunk * ATA_SECTOR_SIZE);
+            }
+        } else {
+            chunk = min(count, ATA_MAX_SECTORS_PER_CMD);
+            err = _ata_pio_read(dev, sector, read_data, chunk);
+        }
+
+        if (err) {
+            return err;
+        }
+        sector += chunk;
+        read_data += chunk * ATA_SECTOR_SIZE;
+        count -= chunk;
     }
 
     return 0;
 }
 
-int ata_flush(device_t* device)
+/**
+ * Writes count sectors starting from the sector. No cache flush is issued,
+ * callers use DRIVER_STORAGE_FLUSH when data has to reach the media.
+ */
+int ata_write(device_t* device, uint32_t sector, uint8_t* data, uint32_t count)
 {
     ata_t* dev = &_ata_drives[device->id];
+    if (dev->queue) {
+        return blkqueue_rw(device, BLK_REQUEST_WRITE, sector, data, count, false);
+    }
 
-    uint8_t dev_config = _ata_gen_drive_head_register(true, !dev->is_master, 0);
+    while (count) {
+        int err;
+        uint32_t chunk;
+        if (dev->dma_enabled) {
+            chunk = min(count, ATA_DMA_MAX_SECTORS);
+            memcpy(dev->dma_buf, data, chunk * ATA_SECTOR_SIZE);
+            err = _ata_dma_transfer(dev, sector, chunk, false);
+        } else {
+            chunk = min(count, ATA_MAX_SECTORS_PER_CMD);
+            err = _ata_pio_write(dev, sector, data, chunk);
+        }
 
-    port_8bit_out(dev->port.device, dev_config);
-    port_8bit_out(dev->port.command, 0xE7);
+        if (err) {
+            return err;
+        }
+        sector += chunk;
+        data += chunk * ATA_SECTOR_SIZE;
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Drives with a request queue get the flush as a barrier through the queue,
+ * so it doesn't race with a request which is being served. The flush is
+ * requested by the block cache without its lock held, so the caller sleeps.
+ */
+int ata_flush(device_t* device)
+{
+    ata_t* dev = &_ata_drives[device->id];
+    if (dev->queue) {
+        return blkqueue_flush(device, true);
+    }
+
+    _ata_flush_start(dev);
 
     uint8_t status = port_8bit_in(dev->port.command);
     if (status == 0x00) {
         return -ENODEV;
     }
 
-    while (((status >> 7) & 1) == 1 && ((status >> 0) & 1) != 1) {
-        status = port_8bit_in(dev->port.command);
-    }
-
-    if (status & 0x01) {
+    status = _ata_wait_not_busy(dev);
+    if (status & ATA_SR_ERR) {
         return -EBUSY;
     }
 
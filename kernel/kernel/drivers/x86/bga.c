@@ -48,6 +48,7 @@ static vm_ops_t mmap_file_vm_ops = {
     .load_page_content = NULL,
     .restore_swapped_page = NULL,
     .swap_page_mode = _bga_swap_page_mode,
+    .get_cached_page = NULL,
 };
 
 static inline void _bga_write_reg(uint16_t cmd, uint16_t data)
@@ -103,7 +104,8 @@ static memzone_t* _bga_mmap(dentry_t* dentry, mmap_params_t* params)
         return 0;
     }
 
-    memzone_t* zone = memzone_new_random(RUNNING_THREAD->process, bga_screen_buffer_size);
+    // Aligned placement lets the buffer be mapped with large pages.
+    memzone_t* zone = memzone_new_random_aligned(RUNNING_THREAD->process, bga_screen_buffer_size, VMM_LARGE_PAGE_SIZE);
     if (!zone) {
         return 0;
     }
@@ -113,9 +115,7 @@ static memzone_t* _bga_mmap(dentry_t* dentry, mmap_params_t* params)
     zone->file = dentry_duplicate(dentry);
     zone->ops = &mmap_file_vm_ops;
 
-    for (int offset = 0; offset < bga_screen_buffer_size; offset += VMM_PAGE_SIZE) {
-        vmm_map_page(zone->start + offset, bga_buf_paddr + offset, zone->flags);
-    }
+    vmm_map_pages(zone->start, bga_buf_paddr, zone->len / VMM_PAGE_SIZE, zone->flags);
 
     return zone;
 }
@@ -63,6 +63,10 @@ int ide_init_with_dev(device_t* dev)
             new_device.pci.subclass_id = 0x05; // mark as Ata drive
             new_device.pci.interface_id = 0;
             new_device.pci.revision_id = 0;
+            // Keeping the controller's address, so the drive can reach its bus-master registers.
+            new_device.pci.bus = dev->device_desc.pci.bus;
+            new_device.pci.device = dev->device_desc.pci.device;
+            new_device.pci.function = dev->device_desc.pci.function;
             new_device.pci.port_base = ask_ports[i] | (1 << 31);
             new_device.pci.interrupt = IRQ14;
             devman_register_device(new_device, DEVICE_STORAGE);
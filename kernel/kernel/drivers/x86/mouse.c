@@ -16,10 +16,12 @@
 #include <libkern/types.h>
 #include <platform/x86/idt.h>
 #include <platform/x86/port.h>
+#include <tasking/wait_queue.h>
 
 // #define MOUSE_DRIVER_DEBUG
 
 static ringbuffer_t mouse_buffer;
+static wait_queue_t mouse_wait_queue;
 
 int mouse_run();
 
@@ -38,6 +40,11 @@ static int _mouse_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
     return leno;
 }
 
+static wait_queue_t* _mouse_wait_queue(dentry_t* dentry)
+{
+    return &mouse_wait_queue;
+}
+
 static void _mouse_recieve_notification(uint32_t msg, uint32_t param)
 {
     if (msg == DEVMAN_NOTIFICATION_DEVFS_READY) {
@@ -49,6 +56,7 @@ static void _mouse_recieve_notification(uint32_t msg, uint32_t param)
         file_ops_t fops = { 0 };
         fops.can_read = _mouse_can_read;
         fops.read = _mouse_read;
+        fops.wait_queue = _mouse_wait_queue;
         devfs_inode_t* res = devfs_register(mp, MKDEV(10, 1), "mouse", 5, 0400, &fops);
 
         dentry_put(mp);
@@ -151,6 +159,7 @@ void mouse_handler()
     }
 
     ringbuffer_write(&mouse_buffer, (uint8_t*)&packet, sizeof(mouse_packet_t));
+    wait_queue_wake_all(&mouse_wait_queue);
 
 #ifdef MOUSE_DRIVER_DEBUG
     log("%x", packet.button_states);
@@ -179,6 +188,7 @@ int mouse_run()
     set_irq_handler(IRQ12, mouse_handler);
 
     mouse_buffer = ringbuffer_create_std();
+    wait_queue_init(&mouse_wait_queue);
     return 0;
 }
 
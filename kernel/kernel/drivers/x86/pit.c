@@ -8,10 +8,12 @@
 
 #include <drivers/x86/pit.h>
 #include <libkern/kassert.h>
+#include <libkern/libkern.h>
 #include <libkern/log.h>
 #include <platform/generic/system.h>
 #include <tasking/cpu.h>
 #include <tasking/sched.h>
+#include <time/clockevent.h>
 #include <time/time_manager.h>
 
 static int ticks_to_sched = 0;
@@ -34,6 +36,35 @@ static int _pit_set_frequency(uint16_t freq)
     return 0;
 }
 
+static inline void _pit_load_channel0(uint8_t mode, uint16_t count)
+{
+    port_byte_out(0x43, mode);
+    port_byte_out(0x40, count & 0xFF);
+    port_byte_out(0x40, (count >> 8) & 0xFF);
+}
+
+static void _pit_set_periodic()
+{
+    _pit_load_channel0(0b110110, PIT_BASE_FREQ / TIMER_TICKS_PER_SECOND);
+}
+
+static void _pit_set_oneshot(uint64_t delta_ns)
+{
+    // Rounding up, so the interrupt doesn't come before the tick it is set for.
+    uint64_t count = udiv64(delta_ns * PIT_BASE_FREQ + NS_PER_SEC - 1, NS_PER_SEC, NULL);
+    count = max(min(count, (uint64_t)0xffff), (uint64_t)1);
+    // Mode 0 raises the interrupt once the count reaches zero.
+    _pit_load_channel0(0b110000, count);
+}
+
+static clockevent_t _pit_clockevent = {
+    .name = "pit",
+    .min_delta_ns = 100000,
+    .max_delta_ns = 0xffffULL * NS_PER_SEC / PIT_BASE_FREQ,
+    .set_periodic = _pit_set_periodic,
+    .set_oneshot = _pit_set_oneshot,
+};
+
 void pit_setup()
 {
     int err = _pit_set_frequency(TIMER_TICKS_PER_SECOND);
@@ -41,6 +72,7 @@ void pit_setup()
         kpanic("Pit: failed to set frequency");
     }
     set_irq_handler(IRQ0, pit_handler);
+    clockevent_register(&_pit_clockevent);
 }
 
 void pit_handler()
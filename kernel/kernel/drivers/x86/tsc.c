@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <drivers/x86/pit.h>
+#include <drivers/x86/tsc.h>
+#include <libkern/log.h>
+#include <platform/x86/port.h>
+#include <time/clocksource.h>
+
+// #define TSC_DEBUG
+
+static uint32_t _tsc_shift = 0;
+
+static inline uint64_t _tsc_read_raw()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc"
+                 : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t _tsc_read()
+{
+    return _tsc_read_raw() >> _tsc_shift;
+}
+
+static clocksource_t _tsc_clocksource = {
+    .name = "tsc",
+    .rating = 300,
+    .read = _tsc_read,
+};
+
+static bool _tsc_is_supported()
+{
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid"
+                 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(1));
+    return (edx >> 4) & 1;
+}
+
+/**
+ * Counts TSC cycles while PIT channel 2 counts down TSC_CALIBRATE_MS.
+ * Is called with interrupts disabled.
+ */
+static uint64_t _tsc_calibrate()
+{
+    uint32_t latch = PIT_BASE_FREQ / (1000 / TSC_CALIBRATE_MS);
+
+    // Gating channel 2 with the speaker off.
+    port_byte_out(0x61, (port_byte_in(0x61) & ~0x02) | 0x01);
+    port_byte_out(0x43, 0b10110000);
+    port_byte_out(0x42, latch & 0xff);
+    port_byte_out(0x42, (latch >> 8) & 0xff);
+
+    uint64_t start = _tsc_read_raw();
+    while (!(port_byte_in(0x61) & 0x20)) { }
+    uint64_t end = _tsc_read_raw();
+    return (end - start) * (1000 / TSC_CALIBRATE_MS);
+}
+
+void tsc_setup()
+{
+    if (!_tsc_is_supported()) {
+        return;
+    }
+
+    uint64_t freq = _tsc_calibrate();
+    if (!freq) {
+        log_warn("TSC: calibration failed");
+        return;
+    }
+
+    // Conversions take 32-bit frequencies, so faster counters lose low bits.
+    while (freq >> 32) {
+        freq >>= 1;
+        _tsc_shift++;
+    }
+
+#ifdef TSC_DEBUG
+    log("TSC: %u Hz, shift %u", (uint32_t)freq, _tsc_shift);
+#endif
+    _tsc_clocksource.freq = freq;
+    _tsc_clocksource.mask = ~0ULL >> _tsc_shift;
+    clocksource_register(&_tsc_clocksource);
+}
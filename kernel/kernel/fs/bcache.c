@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <drivers/generic/blkqueue.h>
+#include <fs/bcache.h>
+#include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
+#include <libkern/lock.h>
+#include <libkern/log.h>
+#include <mem/kmalloc.h>
+#include <mem/kmemzone.h>
+#include <mem/pmm.h>
+#include <mem/vm_pspace.h>
+#include <mem/vmm.h>
+#include <tasking/cpu.h>
+#include <tasking/sched.h>
+
+// #define BCACHE_DEBUG
+
+/**
+ * The block cache sits between filesystems and storage drivers. Data is kept
+ * in BCACHE_BLOCK_LEN chunks which are hashed by (device, block). All valid
+ * buffers are also linked into the LRU list, the head is the most recently
+ * used one. Writes are delayed: buffers are marked dirty and written back
+ * on eviction, on flush requests (see kdentryflusherd) or on device eject.
+ *
+ * Data of buffers lives in a kernel zone reserved at init. Its pages are
+ * backed with frames when the first buffer of a page is taken and freed by
+ * bcache_reclaim() once all buffers of a page are released. The cache is
+ * reached from the page fault handler with a vmm lock held, so frames are
+ * mapped with the lockless vmm helpers instead of kmalloc().
+ *
+ * Misses on devices with a request queue are read without the cache lock:
+ * the buffer is hashed as busy, so other threads wait for it instead of
+ * reading the block again, and the reader sleeps until the transfer is done
+ * unless it comes from the page fault handler.
+ */
+
+#define BCACHE_BUFS_PER_PAGE (VMM_PAGE_SIZE / BCACHE_BLOCK_LEN)
+#define BCACHE_PAGES (BCACHE_MAX_BLOCKS / BCACHE_BUFS_PER_PAGE)
+
+struct bcache_wb {
+    blk_request_t req;
+    bcache_buf_t* buf;
+    bool in_use;
+    uint8_t data[BCACHE_BLOCK_LEN];
+};
+typedef struct bcache_wb bcache_wb_t;
+
+static lock_t _bcache_lock;
+static bcache_buf_t _bcache_bufs[BCACHE_MAX_BLOCKS];
+static kmemzone_t _bcache_zone;
+static uint8_t _bcache_page_used[BCACHE_PAGES];
+static bool _bcache_page_mapped[BCACHE_PAGES];
+static uint8_t* _bcache_read_buf;
+static bool _bcache_read_buf_busy;
+static bcache_wb_t* _bcache_wb_slots;
+static bcache_buf_t* _bcache_hash[BCACHE_HASH_SIZE];
+static bcache_buf_t* _bcache_free_list = NULL;
+static bcache_buf_t* _bcache_lru_head = NULL;
+static bcache_buf_t* _bcache_lru_tail = NULL;
+static bcache_stat_t _bcache_stat;
+
+/**
+ * HELPERS
+ */
+
+static inline uint32_t _bcache_hash_index(device_t* dev, uint32_t block)
+{
+    return (dev->id * 31 + block) & (BCACHE_HASH_SIZE - 1);
+}
+
+static void _bcache_hash_add(bcache_buf_t* buf)
+{
+    uint32_t idx = _bcache_hash_index(buf->dev, buf->block);
+    buf->hash_next = _bcache_hash[idx];
+    _bcache_hash[idx] = buf;
+}
+
+static void _bcache_hash_remove(bcache_buf_t* buf)
+{
+    bcache_buf_t** it = &_bcache_hash[_bcache_hash_index(buf->dev, buf->block)];
+    while (*it) {
+        if (*it == buf) {
+            *it = buf->hash_next;
+            buf->hash_next = NULL;
+            return;
+        }
+        it = &(*it)->hash_next;
+    }
+}
+
+static bcache_buf_t* _bcache_hash_find(device_t* dev, uint32_t block)
+{
+    bcache_buf_t* it = _bcache_hash[_bcache_hash_index(dev, block)];
+    while (it) {
+        if (it->dev == dev && it->block == block) {
+            return it;
+        }
+        it = it->hash_next;
+    }
+    return NULL;
+}
+
+static void _bcache_lru_remove(bcache_buf_t* buf)
+{
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        _bcache_lru_head = buf->lru_next;
+    }
+
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        _bcache_lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void _bcache_lru_push_front(bcache_buf_t* buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = _bcache_lru_head;
+    if (_bcache_lru_head) {
+        _bcache_lru_head->lru_prev = buf;
+    } else {
+        _bcache_lru_tail = buf;
+    }
+    _bcache_lru_head = buf;
+}
+
+static inline void _bcache_lru_touch(bcache_buf_t* buf)
+{
+    if (_bcache_lru_head == buf) {
+        return;
+    }
+    _bcache_lru_remove(buf);
+    _bcache_lru_push_front(buf);
+}
+
+/**
+ * DEVICE IO
+ */
+
+static inline bool _bcache_can_sleep()
+{
+    return RUNNING_THREAD && !vmm_holds_lock();
+}
+
+/**
+ * Is called with the cache lock held. Drivers without a request queue are
+ * not reentrant, so they are called under the lock. Otherwise the lock is
+ * dropped while the transfer is in flight.
+ */
+static int _bcache_read_blocks_lockless(device_t* dev, uint32_t block, uint8_t* data, uint32_t count)
+{
+    uint32_t sector = block * BCACHE_SECTORS_PER_BLOCK;
+    count *= BCACHE_SECTORS_PER_BLOCK;
+
+    if (!blkqueue_get(dev)) {
+        int (*read)(device_t * d, uint32_t s, uint8_t * r, uint32_t c) = devman_function_handler(dev, DRIVER_STORAGE_READ);
+        if (!read) {
+            return -ENODEV;
+        }
+
+        int err = read(dev, sector, data, count);
+        if (err < 0) {
+            return err;
+        }
+        return 0;
+    }
+
+    lock_release(&_bcache_lock);
+    int err = blkqueue_rw(dev, BLK_REQUEST_READ, sector, data, count, _bcache_can_sleep());
+    lock_acquire(&_bcache_lock);
+    return err;
+}
+
+/**
+ * Another thread is reading the block, the lock is dropped until it is done.
+ */
+static void _bcache_wait_busy_lockless()
+{
+    lock_release(&_bcache_lock);
+    if (_bcache_can_sleep()) {
+        resched();
+    }
+    lock_acquire(&_bcache_lock);
+}
+
+static int _bcache_writeback_buf(bcache_buf_t* buf)
+{
+    if (!TEST_FLAG(buf->flags, BCACHE_BUF_DIRTY)) {
+        return 0;
+    }
+
+    int (*write)(device_t * d, uint32_t s, uint8_t * r, uint32_t c) = devman_function_handler(buf->dev, DRIVER_STORAGE_WRITE);
+    if (!write) {
+        return -ENODEV;
+    }
+
+    int err = write(buf->dev, buf->block * BCACHE_SECTORS_PER_BLOCK, buf->data, BCACHE_SECTORS_PER_BLOCK);
+    if (err < 0) {
+        return err;
+    }
+
+    // A copy which is in flight holds the same data, so it is not waited for.
+    buf->flags &= ~(BCACHE_BUF_DIRTY | BCACHE_BUF_WRITEBACK);
+    _bcache_stat.dirty_blocks--;
+    _bcache_stat.writebacks++;
+    return 0;
+}
+
+/**
+ * BUFFER MANAGMENT
+ */
+
+static inline int _bcache_page_of(bcache_buf_t* buf)
+{
+    return (buf - _bcache_bufs) / BCACHE_BUFS_PER_PAGE;
+}
+
+static inline uintptr_t _bcache_page_vaddr(int page)
+{
+    return _bcache_zone.start + page * VMM_PAGE_SIZE;
+}
+
+static int _bcache_map_page_lockless(int page)
+{
+    void* frame = pmm_alloc(VMM_PAGE_SIZE);
+    if (!frame) {
+        return -ENOMEM;
+    }
+
+    vmm_map_pages_lockless(_bcache_page_vaddr(page), (uintptr_t)frame, 1, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+    _bcache_page_mapped[page] = true;
+    return 0;
+}
+
+static void _bcache_unmap_page_lockless(int page)
+{
+    uintptr_t vaddr = _bcache_page_vaddr(page);
+    page_desc_t* desc = vm_pspace_get_page_desc(vaddr);
+    pmm_free((void*)page_desc_get_frame(*desc), VMM_PAGE_SIZE);
+    vmm_unmap_pages_lockless(vaddr, 1);
+    _bcache_page_mapped[page] = false;
+}
+
+static void _bcache_free_buf_lockless(bcache_buf_t* buf)
+{
+    buf->dev = NULL;
+    buf->flags = 0;
+    buf->hash_next = _bcache_free_list;
+    _bcache_free_list = buf;
+    _bcache_page_used[_bcache_page_of(buf)]--;
+}
+
+static void _bcache_release_buf(bcache_buf_t* buf)
+{
+    _bcache_hash_remove(buf);
+    _bcache_lru_remove(buf);
+    _bcache_free_buf_lockless(buf);
+    _bcache_stat.cached_blocks--;
+}
+
+/**
+ * Evicts the least recently used buffer which could be written back. A
+ * buffer which failed to be written stays dirty in the cache.
+ */
+static bcache_buf_t* _bcache_evict_lockless()
+{
+    for (bcache_buf_t* victim = _bcache_lru_tail; victim; victim = victim->lru_prev) {
+        if (TEST_FLAG(victim->flags, BCACHE_BUF_BUSY)) {
+            continue;
+        }
+        if (_bcache_writeback_buf(victim) < 0) {
+            log_warn("[bcache] Writeback of block %d failed, keeping it dirty", victim->block);
+            continue;
+        }
+
+        _bcache_release_buf(victim);
+        _bcache_stat.evictions++;
+        return victim;
+    }
+    return NULL;
+}
+
+/**
+ * Free buffers which sit in already backed pages are taken first, so a new
+ * frame is allocated only when all of them are in use.
+ */
+static bcache_buf_t* _bcache_alloc_buf_lockless()
+{
+    if (!_bcache_free_list) {
+        _bcache_evict_lockless();
+    }
+
+    bcache_buf_t** it = &_bcache_free_list;
+    while (*it && !_bcache_page_mapped[_bcache_page_of(*it)]) {
+        it = &(*it)->hash_next;
+    }
+    if (!*it) {
+        it = &_bcache_free_list;
+    }
+
+    bcache_buf_t* buf = *it;
+    if (!buf) {
+        return NULL;
+    }
+
+    int page = _bcache_page_of(buf);
+    if (!_bcache_page_mapped[page] && _bcache_map_page_lockless(page) < 0) {
+        return NULL;
+    }
+
+    *it = buf->hash_next;
+    buf->hash_next = NULL;
+    _bcache_page_used[page]++;
+    return buf;
+}
+
+/**
+ * Returns a buffer of the block. If need_data is not set, the caller is going
+ * to overwrite the whole block, so no reading from the device is done. The
+ * cache lock could be dropped while the block is read.
+ */
+static bcache_buf_t* _bcache_get_buf_lockless(device_t* dev, uint32_t block, bool need_data)
+{
+    bcache_buf_t* buf = _bcache_hash_find(dev, block);
+    while (buf && TEST_FLAG(buf->flags, BCACHE_BUF_BUSY)) {
+        _bcache_wait_busy_lockless();
+        buf = _bcache_hash_find(dev, block);
+    }
+
+    if (buf) {
+        _bcache_stat.hits++;
+        _bcache_lru_touch(buf);
+        return buf;
+    }
+
+    _bcache_stat.misses++;
+    buf = _bcache_alloc_buf_lockless();
+    if (!buf) {
+        return NULL;
+    }
+
+    buf->dev = dev;
+    buf->block = block;
+    buf->flags = need_data ? BCACHE_BUF_BUSY : BCACHE_BUF_VALID;
+    _bcache_hash_add(buf);
+    _bcache_lru_push_front(buf);
+    _bcache_stat.cached_blocks++;
+    if (!need_data) {
+        return buf;
+    }
+
+    int err = _bcache_read_blocks_lockless(dev, block, buf->data, 1);
+    if (err < 0) {
+        _bcache_release_buf(buf);
+        return NULL;
+    }
+    buf->flags = BCACHE_BUF_VALID;
+    return buf;
+}
+
+/**
+ * Loads a run of up to count consecutive blocks which are not cached with
+ * a single device transfer. Returns the number of loaded blocks. A run is
+ * counted as a single miss, the rest of its blocks are hits when accessed.
+ * Buffers of the run are busy while the transfer is in flight. The bounce
+ * buffer is shared, so only one run is read at a time.
+ */
+static int _bcache_fill_run_lockless(device_t* dev, uint32_t block, uint32_t count)
+{
+    if (_bcache_read_buf_busy) {
+        return 0;
+    }
+
+    bcache_buf_t* bufs[BCACHE_READ_BATCH];
+    uint32_t run = 0;
+    count = min(count, BCACHE_READ_BATCH);
+    while (run < count && !_bcache_hash_find(dev, block + run)) {
+        bcache_buf_t* buf = _bcache_alloc_buf_lockless();
+        if (!buf) {
+            break;
+        }
+
+        buf->dev = dev;
+        buf->block = block + run;
+        buf->flags = BCACHE_BUF_BUSY;
+        _bcache_hash_add(buf);
+        _bcache_lru_push_front(buf);
+        _bcache_stat.cached_blocks++;
+        bufs[run++] = buf;
+    }
+    if (!run) {
+        return 0;
+    }
+
+    _bcache_read_buf_busy = true;
+    int err = _bcache_read_blocks_lockless(dev, block, _bcache_read_buf, run);
+    for (uint32_t i = 0; i < run; i++) {
+        if (err < 0) {
+            _bcache_release_buf(bufs[i]);
+            continue;
+        }
+        memcpy(bufs[i]->data, _bcache_read_buf + i * BCACHE_BLOCK_LEN, BCACHE_BLOCK_LEN);
+        bufs[i]->flags = BCACHE_BUF_VALID;
+    }
+    _bcache_read_buf_busy = false;
+    if (err < 0) {
+        return err;
+    }
+
+#ifdef BCACHE_DEBUG
+    log("[bcache] dev %d: read %d blocks at %d", dev->id, run, block);
+#endif
+    _bcache_stat.misses++;
+    return run;
+}
+
+/**
+ * API FUNCTIONS
+ */
+
+void bcache_init()
+{
+    lock_init(&_bcache_lock);
+    memset(_bcache_bufs, 0, sizeof(_bcache_bufs));
+    memset(_bcache_hash, 0, sizeof(_bcache_hash));
+    memset(&_bcache_stat, 0, sizeof(_bcache_stat));
+    memset(_bcache_page_used, 0, sizeof(_bcache_page_used));
+    memset(_bcache_page_mapped, 0, sizeof(_bcache_page_mapped));
+
+    _bcache_zone = kmemzone_new(BCACHE_MAX_BLOCKS * BCACHE_BLOCK_LEN);
+    _bcache_read_buf = (uint8_t*)kmalloc(BCACHE_READ_BATCH * BCACHE_BLOCK_LEN);
+    _bcache_read_buf_busy = false;
+    _bcache_wb_slots = (bcache_wb_t*)kmalloc(BCACHE_WRITEBACK_BATCH * sizeof(bcache_wb_t));
+    memset(_bcache_wb_slots, 0, BCACHE_WRITEBACK_BATCH * sizeof(bcache_wb_t));
+    _bcache_free_list = NULL;
+    for (int i = BCACHE_MAX_BLOCKS - 1; i >= 0; i--) {
+        _bcache_bufs[i].data = _bcache_zone.ptr + i * BCACHE_BLOCK_LEN;
+        _bcache_bufs[i].hash_next = _bcache_free_list;
+        _bcache_free_list = &_bcache_bufs[i];
+    }
+    _bcache_lru_head = _bcache_lru_tail = NULL;
+}
+
+/**
+ * Blocks of the range which are not cached are loaded in runs, so a large
+ * read turns into a few large device transfers.
+ */
+int bcache_read(device_t* dev, uint8_t* buf, uint32_t start, uint32_t len)
+{
+    lock_acquire(&_bcache_lock);
+    uint32_t block = start / BCACHE_BLOCK_LEN;
+    uint32_t offset = start % BCACHE_BLOCK_LEN;
+    uint32_t end_block = (start + len + BCACHE_BLOCK_LEN - 1) / BCACHE_BLOCK_LEN;
+
+    while (len) {
+        bcache_buf_t* cbuf = NULL;
+        if (end_block - block > 1 && _bcache_fill_run_lockless(dev, block, end_block - block) > 0) {
+            cbuf = _bcache_hash_find(dev, block);
+        }
+        if (!cbuf) {
+            cbuf = _bcache_get_buf_lockless(dev, block, true);
+        }
+        if (!cbuf) {
+            lock_release(&_bcache_lock);
+            return -EIO;
+        }
+
+        uint32_t chunk = min(BCACHE_BLOCK_LEN - offset, len);
+        memcpy(buf, cbuf->data + offset, chunk);
+        buf += chunk;
+        len -= chunk;
+        block++;
+        offset = 0;
+    }
+
+    lock_release(&_bcache_lock);
+    return 0;
+}
+
+int bcache_write(device_t* dev, uint8_t* buf, uint32_t start, uint32_t len)
+{
+    lock_acquire(&_bcache_lock);
+    uint32_t block = start / BCACHE_BLOCK_LEN;
+    uint32_t offset = start % BCACHE_BLOCK_LEN;
+
+    while (len) {
+        uint32_t chunk = min(BCACHE_BLOCK_LEN - offset, len);
+        bool whole_block = (chunk == BCACHE_BLOCK_LEN);
+        bcache_buf_t* cbuf = _bcache_get_buf_lockless(dev, block, !whole_block);
+        if (!cbuf) {
+            lock_release(&_bcache_lock);
+            return -EIO;
+        }
+
+        memcpy(cbuf->data + offset, buf, chunk);
+        // A copy which is in flight is stale now, so its completion doesn't make the buffer clean.
+        cbuf->flags &= ~BCACHE_BUF_WRITEBACK;
+        if (!TEST_FLAG(cbuf->flags, BCACHE_BUF_DIRTY)) {
+            cbuf->flags |= BCACHE_BUF_DIRTY;
+            _bcache_stat.dirty_blocks++;
+        }
+        buf += chunk;
+        len -= chunk;
+        block++;
+        offset = 0;
+    }
+
+    lock_release(&_bcache_lock);
+    return 0;
+}
+
+int bcache_flush_device(device_t* dev)
+{
+    int res = 0;
+    lock_acquire(&_bcache_lock);
+    for (bcache_buf_t* it = _bcache_lru_head; it; it = it->lru_next) {
+        if (dev && it->dev != dev) {
+            continue;
+        }
+        int err = _bcache_writeback_buf(it);
+        if (err < 0) {
+            res = err;
+        }
+    }
+    lock_release(&_bcache_lock);
+    return res;
+}
+
+/**
+ * Background writeback. Dirty blocks of devices with a request queue are
+ * copied to writeback slots and submitted as a batch, so the queue could
+ * merge and sort them, while the caller sleeps. Copies keep buffers free to
+ * be used while the writes are in flight. A buffer stays dirty until its
+ * copy is written, so a failed write is retried by the next flush.
+ */
+static bcache_wb_t* _bcache_wb_get_lockless()
+{
+    for (int i = 0; i < BCACHE_WRITEBACK_BATCH; i++) {
+        if (!_bcache_wb_slots[i].in_use) {
+            _bcache_wb_slots[i].in_use = true;
+            return &_bcache_wb_slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void _bcache_wb_done_lockless(bcache_wb_t* wb, int err)
+{
+    bcache_buf_t* buf = wb->buf;
+    wb->in_use = false;
+
+    // The buffer could be evicted and reused, or written again while the copy was in flight.
+    bool same_block = buf->dev == wb->req.dev && buf->block * BCACHE_SECTORS_PER_BLOCK == wb->req.sector;
+    if (!same_block || !TEST_FLAG(buf->flags, BCACHE_BUF_WRITEBACK)) {
+        return;
+    }
+
+    buf->flags &= ~BCACHE_BUF_WRITEBACK;
+    if (err < 0) {
+        log_warn("[bcache] Writeback of block %d failed, keeping it dirty", buf->block);
+        return;
+    }
+
+    buf->flags &= ~BCACHE_BUF_DIRTY;
+    _bcache_stat.dirty_blocks--;
+    _bcache_stat.writebacks++;
+}
+
+static int _bcache_flush_async(device_t* dev)
+{
+    int res = 0;
+    bcache_wb_t* batch[BCACHE_WRITEBACK_BATCH];
+    int errs[BCACHE_WRITEBACK_BATCH];
+
+    for (;;) {
+        int n = 0;
+        lock_acquire(&_bcache_lock);
+        for (bcache_buf_t* it = _bcache_lru_head; it && n < BCACHE_WRITEBACK_BATCH; it = it->lru_next) {
+            if ((dev && it->dev != dev) || !TEST_FLAG(it->flags, BCACHE_BUF_DIRTY) || TEST_FLAG(it->flags, BCACHE_BUF_WRITEBACK)) {
+                continue;
+            }
+
+            if (!blkqueue_get(it->dev)) {
+                int err = _bcache_writeback_buf(it);
+                if (err < 0) {
+                    res = err;
+                }
+                continue;
+            }
+
+            bcache_wb_t* wb = _bcache_wb_get_lockless();
+            if (!wb) {
+                break;
+            }
+            memcpy(wb->data, it->data, BCACHE_BLOCK_LEN);
+            blkqueue_init_request(&wb->req, it->dev, BLK_REQUEST_WRITE, it->block * BCACHE_SECTORS_PER_BLOCK, wb->data, BCACHE_SECTORS_PER_BLOCK);
+            wb->buf = it;
+            it->flags |= BCACHE_BUF_WRITEBACK;
+            batch[n++] = wb;
+        }
+        lock_release(&_bcache_lock);
+
+        if (!n) {
+            return res;
+        }
+
+        for (int i = 0; i < n; i++) {
+            errs[i] = blkqueue_submit(&batch[i]->req);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!errs[i]) {
+                errs[i] = blkqueue_wait(&batch[i]->req, true);
+            }
+        }
+
+        lock_acquire(&_bcache_lock);
+        for (int i = 0; i < n; i++) {
+            _bcache_wb_done_lockless(batch[i], errs[i]);
+            if (errs[i] < 0) {
+                res = errs[i];
+            }
+        }
+        lock_release(&_bcache_lock);
+
+        // Failed blocks are still dirty, they are left for the next flush.
+        if (res < 0 || n < BCACHE_WRITEBACK_BATCH) {
+            return res;
+        }
+    }
+}
+
+/**
+ * Is called from kernel threads which hold no locks, since it might sleep.
+ */
+int bcache_flush_all()
+{
+    return _bcache_flush_async(NULL);
+}
+
+static int _bcache_flush_drive_cache(device_t* dev)
+{
+    if (dev->is_virtual) {
+        return 0;
+    }
+
+    int (*flush)(device_t * d) = devman_function_handler(dev, DRIVER_STORAGE_FLUSH);
+    if (!flush) {
+        return 0;
+    }
+    return flush(dev);
+}
+
+/**
+ * Writes back dirty buffers of the device and asks the drive to flush its
+ * own write cache. Is called on fsync and umount.
+ */
+int bcache_sync_device(device_t* dev)
+{
+    int err = bcache_flush_device(dev);
+    if (err < 0) {
+        return err;
+    }
+    return _bcache_flush_drive_cache(dev);
+}
+
+/**
+ * Writes back and drops all buffers of the device. Used when the device is
+ * ejected, so no stale data is served if another device gets the same id.
+ * Buffers which failed to be written stay dirty in the cache and the error
+ * is returned.
+ */
+int bcache_invalidate_device(device_t* dev)
+{
+    int res = 0;
+    lock_acquire(&_bcache_lock);
+    bcache_buf_t* it = _bcache_lru_head;
+    while (it) {
+        bcache_buf_t* next = it->lru_next;
+        if (it->dev == dev && !TEST_FLAG(it->flags, BCACHE_BUF_BUSY)) {
+            int err = _bcache_writeback_buf(it);
+            if (err < 0) {
+                log_warn("[bcache] Writeback of block %d failed, keeping it dirty", it->block);
+                res = err;
+            } else {
+                _bcache_release_buf(it);
+            }
+        }
+        it = next;
+    }
+    lock_release(&_bcache_lock);
+
+    int err = _bcache_flush_drive_cache(dev);
+    if (err < 0) {
+        return err;
+    }
+    return res;
+}
+
+/**
+ * Is called by kswapd under memory pressure. Up to max_blocks least recently
+ * used clean buffers are dropped, then frames of pages which have no buffers
+ * in use are freed. Returns the number of freed pages.
+ */
+int bcache_reclaim(int max_blocks)
+{
+    int dropped = 0;
+    int freed = 0;
+    lock_acquire(&_bcache_lock);
+    bcache_buf_t* it = _bcache_lru_tail;
+    while (it && dropped < max_blocks) {
+        bcache_buf_t* prev = it->lru_prev;
+        if (!TEST_FLAG(it->flags, BCACHE_BUF_DIRTY) && !TEST_FLAG(it->flags, BCACHE_BUF_BUSY)) {
+            _bcache_release_buf(it);
+            _bcache_stat.evictions++;
+            dropped++;
+        }
+        it = prev;
+    }
+
+    for (int page = 0; page < BCACHE_PAGES; page++) {
+        if (_bcache_page_mapped[page] && !_bcache_page_used[page]) {
+            _bcache_unmap_page_lockless(page);
+            freed++;
+        }
+    }
+    lock_release(&_bcache_lock);
+
+#ifdef BCACHE_DEBUG
+    log("[bcache] Dropped %d blocks, freed %d pages", dropped, freed);
+#endif
+    return freed;
+}
+
+void bcache_get_stat(bcache_stat_t* stat)
+{
+    lock_acquire(&_bcache_lock);
+    memcpy(stat, &_bcache_stat, sizeof(bcache_stat_t));
+    lock_release(&_bcache_lock);
+}
@@ -7,8 +7,11 @@
  */
 
 #include <algo/dynamic_array.h>
+#include <fs/bcache.h>
+#include <fs/pcache.h>
 #include <fs/vfs.h>
 #include <libkern/atomic.h>
+#include <libkern/bits/time.h>
 #include <libkern/kassert.h>
 #include <libkern/lock.h>
 #include <libkern/log.h>
@@ -21,113 +24,289 @@
 
 #define NOT_READ_INODE 0
 #define READ_INODE 1
-#define DENTRY_ALLOC_SIZE (4 * KB) /* Shows the size of list's parts. */
+#define DENTRY_ALLOC_BATCH (32) /* Dentries which are taken from the cache at once. */
 #define DENTRY_SWAP_THRESHOLD_FOR_INODE_CACHE (16 * KB)
+#define DENTRY_HASH_SIZE (256)
+#define DENTRY_NEGATIVE_CACHE_SIZE (128)
+#define DENTRY_NEGATIVE_NAME_LEN (32)
+
+/**
+ * Dentries are allocated from _dentry_kmem_cache, are never freed and are all
+ * chained in _dentry_all, so they could be walked without locks. Every valid
+ * dentry is indexed by (dev, ino) in _dentry_hash and, once it has been
+ * reached with a path, by (dev and ino of its directory, filename) in
+ * _dentry_name_hash. Dentries which aren't held by someone are kept in the LRU
+ * list (the most recently released at the head) and are reused from its tail.
+ *
+ * Names which are known to be missing are kept in _dentry_negative, a small
+ * direct-mapped table, so repeated misses don't reach the file system.
+ *
+ * Lock order is dentry->lock -> _dentry_cache_lock. The cache lock is never
+ * held while calling fs code, so d_count is changed atomically: dentry_get()
+ * bumps it without taking the dentry lock.
+ */
 
 extern vfs_device_t _vfs_devices[MAX_DEVICES_COUNT];
 extern dynamic_array_t _vfs_fses;
 extern uint32_t root_fs_dev_id;
 
-static bool can_cache_inodes = 1;
+static lock_t _dentry_cache_lock;
 static uint32_t stat_cached_dentries = 0; /* Count of dentries which are held. */
 static uint32_t stat_cached_inodes_area_size = 0; /* Sum of all areas which is used for holding inodes. */
-static dentry_cache_list_t* dentry_cache;
-static uint16_t* dentry_cahced;
+static dentry_t* _dentry_all;
+static kmem_cache_t* _dentry_kmem_cache;
+static kmem_cache_t* _dentry_inode_cache;
+static dentry_t* _dentry_hash[DENTRY_HASH_SIZE];
+static dentry_t* _dentry_name_hash[DENTRY_HASH_SIZE];
+static dentry_t* _dentry_free_list;
+static dentry_t* _dentry_lru_head;
+static dentry_t* _dentry_lru_tail;
+
+struct dentry_negative {
+    dev_t dev;
+    ino_t ino; // The directory, 0 marks an unused entry.
+    uint32_t hash;
+    uint32_t len;
+    char name[DENTRY_NEGATIVE_NAME_LEN];
+};
+static struct dentry_negative _dentry_negative[DENTRY_NEGATIVE_CACHE_SIZE];
+
+/**
+ * HELPERS
+ */
 
 static inline bool need_to_free_inode_cache()
 {
     return (stat_cached_inodes_area_size > DENTRY_SWAP_THRESHOLD_FOR_INODE_CACHE);
 }
 
-static inline bool free_inode_cache()
+static inline uint32_t _dentry_hash_index(dev_t dev, ino_t ino)
 {
-    dentry_cache_list_t* dentry_cache_block = dentry_cache;
-    dentry_t* valid_dentry_candidate = NULL;
-    while (dentry_cache_block) {
-        lock_acquire(&dentry_cache_block->lock);
-        int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-        for (int i = 0; i < dentries_in_block; i++) {
-            if (dentry_cache_block->data[i].d_count == 0) {
-                dentry_cache_block->data[i].inode_indx = 0;
-                stat_cached_inodes_area_size -= INODE_LEN;
-                kfree(dentry_cache_block->data[i].inode);
-            }
+    return (dev * 31 + ino) & (DENTRY_HASH_SIZE - 1);
+}
+
+static uint32_t _dentry_name_hash_of(dev_t dev, ino_t ino, const char* name, size_t len)
+{
+    uint32_t hash = dev * 31 + ino;
+    for (size_t i = 0; i < len; i++) {
+        hash = hash * 33 + (uint8_t)name[i];
+    }
+    return hash;
+}
+
+/**
+ * Names are cached only for directories of real devices, since virtual file
+ * systems (like procfs) could change their entries without going through vfs.
+ */
+static inline bool _dentry_can_hash_name(dentry_t* dir)
+{
+    return dir->dev && dir->dev->dev && !dir->dev->dev->is_virtual;
+}
+
+static inline bool _dentry_name_equals(dentry_t* dentry, const char* name, size_t len)
+{
+    return strlen(dentry->filename) == len && memcmp(dentry->filename, name, len) == 0;
+}
+
+/**
+ * INDEXES
+ */
+
+static void _dentry_hash_add(dentry_t* dentry)
+{
+    uint32_t index = _dentry_hash_index(dentry->dev_indx, dentry->inode_indx);
+    dentry->hash_next = _dentry_hash[index];
+    _dentry_hash[index] = dentry;
+}
+
+static void _dentry_hash_remove(dentry_t* dentry)
+{
+    dentry_t** it = &_dentry_hash[_dentry_hash_index(dentry->dev_indx, dentry->inode_indx)];
+    while (*it) {
+        if (*it == dentry) {
+            *it = dentry->hash_next;
+            break;
         }
-        lock_release(&dentry_cache_block->lock);
-        dentry_cache_block = dentry_cache_block->next;
+        it = &(*it)->hash_next;
     }
+    dentry->hash_next = NULL;
+}
 
-    if (need_to_free_inode_cache()) {
-        can_cache_inodes = 0;
+static dentry_t* _dentry_hash_find(dev_t dev, ino_t ino)
+{
+    for (dentry_t* it = _dentry_hash[_dentry_hash_index(dev, ino)]; it; it = it->hash_next) {
+        if (it->dev_indx == dev && it->inode_indx == ino) {
+            return it;
+        }
     }
-    return true;
+    return NULL;
 }
 
-static void dentry_cache_alloc()
+static void _dentry_name_hash_add(dentry_t* dentry)
 {
-    dentry_cache_list_t* list_block = (dentry_cache_list_t*)kmalloc(DENTRY_ALLOC_SIZE);
-    memset((uint8_t*)list_block, 0, DENTRY_ALLOC_SIZE);
-    lock_init(&list_block->lock);
-    list_block->data = (dentry_t*)&list_block[1];
-    list_block->len = DENTRY_ALLOC_SIZE - ((uint32_t)&list_block[1] - (uint32_t)&list_block[0]);
+    uint32_t index = dentry->name_hash & (DENTRY_HASH_SIZE - 1);
+    dentry->name_next = _dentry_name_hash[index];
+    _dentry_name_hash[index] = dentry;
+    dentry->name_hashed = true;
+}
 
-    if (dentry_cache == 0) {
-        dentry_cache = list_block;
-    } else {
-        dentry_cache_list_t* last = dentry_cache;
-        while (last->next != 0) {
-            last = last->next;
+static void _dentry_name_hash_remove(dentry_t* dentry)
+{
+    if (!dentry->name_hashed) {
+        return;
+    }
+
+    dentry_t** it = &_dentry_name_hash[dentry->name_hash & (DENTRY_HASH_SIZE - 1)];
+    while (*it) {
+        if (*it == dentry) {
+            *it = dentry->name_next;
+            break;
         }
-        last->next = list_block;
-        list_block->prev = last;
+        it = &(*it)->name_next;
+    }
+    dentry->name_next = NULL;
+    dentry->name_hashed = false;
+}
+
+static void _dentry_lru_remove(dentry_t* dentry)
+{
+    if (!dentry->in_lru) {
+        return;
+    }
+
+    if (dentry->lru_prev) {
+        dentry->lru_prev->lru_next = dentry->lru_next;
+    } else {
+        _dentry_lru_head = dentry->lru_next;
+    }
+
+    if (dentry->lru_next) {
+        dentry->lru_next->lru_prev = dentry->lru_prev;
+    } else {
+        _dentry_lru_tail = dentry->lru_prev;
+    }
+    dentry->lru_prev = dentry->lru_next = NULL;
+    dentry->in_lru = false;
+}
+
+static void _dentry_lru_push_front(dentry_t* dentry)
+{
+    dentry->lru_prev = NULL;
+    dentry->lru_next = _dentry_lru_head;
+    if (_dentry_lru_head) {
+        _dentry_lru_head->lru_prev = dentry;
+    }
+    _dentry_lru_head = dentry;
+    if (!_dentry_lru_tail) {
+        _dentry_lru_tail = dentry;
+    }
+    dentry->in_lru = true;
+}
+
+/**
+ * CACHE MANAGMENT
+ */
+
+void dentry_init()
+{
+    _dentry_kmem_cache = kmem_cache_create("dentry", sizeof(dentry_t));
+    _dentry_inode_cache = kmem_cache_create("inode", INODE_LEN);
+}
+
+static void dentry_cache_alloc()
+{
+    dentry_t* batch[DENTRY_ALLOC_BATCH];
+    for (int i = 0; i < DENTRY_ALLOC_BATCH; i++) {
+        batch[i] = (dentry_t*)kmem_cache_alloc(_dentry_kmem_cache);
+        memset((uint8_t*)batch[i], 0, sizeof(dentry_t));
+    }
+
+    lock_acquire(&_dentry_cache_lock);
+    for (int i = DENTRY_ALLOC_BATCH - 1; i >= 0; i--) {
+        batch[i]->hash_next = _dentry_free_list;
+        _dentry_free_list = batch[i];
+        batch[i]->all_next = _dentry_all;
+        _dentry_all = batch[i];
+    }
+    lock_release(&_dentry_cache_lock);
+}
+
+/**
+ * Removes an unused dentry from all indexes. The inode area is kept, so the
+ * entry could be refilled without allocating it again.
+ */
+static void _dentry_cache_evict_lockless(dentry_t* dentry)
+{
+    _dentry_hash_remove(dentry);
+    _dentry_name_hash_remove(dentry);
+    _dentry_lru_remove(dentry);
+    if (dentry->filename) {
+        kfree(dentry->filename);
+        dentry->filename = NULL;
+    }
+    /* This marks the dentry as deleted. */
+    dentry->inode_indx = 0;
+}
+
+static void _dentry_cache_free_lockless(dentry_t* dentry)
+{
+    _dentry_cache_evict_lockless(dentry);
+    if (dentry->inode) {
+        kfree(dentry->inode);
+        dentry->inode = NULL;
+        stat_cached_inodes_area_size -= INODE_LEN;
+    }
+    dentry->hash_next = _dentry_free_list;
+    _dentry_free_list = dentry;
+}
+
+/**
+ * Keeps the memory used by inodes of unused dentries under the threshold,
+ * dropping the least recently used ones.
+ */
+static void _dentry_cache_shrink_lockless()
+{
+    while (need_to_free_inode_cache() && _dentry_lru_tail) {
+        _dentry_cache_free_lockless(_dentry_lru_tail);
     }
 }
 
 /**
  * In this function, we try to find an entry to fill it with a new dentry.
- * Since we have a valid dentries in the cache, which isn't held by someone, they are
- * also condidates to be replaced. But because we want to have more valid entries in the
- * cache, we will start to look for a complitely free entry.
+ * Completely free entries are used first, so more valid dentries stay in
+ * the cache. Otherwise the least recently used dentry is replaced, and only
+ * if every dentry is held, a new batch is allocated.
  */
 static dentry_t* dentry_cache_find_empty_entry()
 {
-    dentry_cache_list_t* dentry_cache_block = dentry_cache;
-    dentry_t* valid_dentry_candidate = NULL;
-    while (dentry_cache_block) {
-        lock_acquire(&dentry_cache_block->lock);
-        int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-        for (int i = 0; i < dentries_in_block; i++) {
-            if (dentry_cache_block->data[i].inode_indx == 0) {
-                lock_release(&dentry_cache_block->lock);
-                return &dentry_cache_block->data[i];
-            }
-            if (dentry_cache_block->data[i].d_count == 0) {
-                valid_dentry_candidate = &dentry_cache_block->data[i];
-            }
+    for (;;) {
+        lock_acquire(&_dentry_cache_lock);
+        dentry_t* dentry = _dentry_free_list;
+        if (dentry) {
+            _dentry_free_list = dentry->hash_next;
+            dentry->hash_next = NULL;
+            lock_release(&_dentry_cache_lock);
+            return dentry;
         }
-        lock_release(&dentry_cache_block->lock);
-        dentry_cache_block = dentry_cache_block->next;
-    }
 
-    /* If we hasn't found a complitely free entry, let's erase a
-       valid dentries in the cache, which isn't held by someone. */
-    if (valid_dentry_candidate) {
-        return valid_dentry_candidate;
-    }
+        dentry = _dentry_lru_tail;
+        if (dentry) {
+            _dentry_cache_evict_lockless(dentry);
+            lock_release(&_dentry_cache_lock);
+            return dentry;
+        }
+        lock_release(&_dentry_cache_lock);
 
-    /* If there is no space, let's allocate a bigger area. */
-    dentry_cache_alloc();
-    dentry_cache_list_t* last = dentry_cache;
-    while (last->next != NULL) {
-        last = last->next;
+        /* If there is no space, let's allocate more dentries. */
+        dentry_cache_alloc();
     }
-    return &last->data[0];
 }
 
 static inline void dentry_delete_inode(dentry_t* dentry)
 {
     ASSERT(dentry->d_count == 0 && dentry_test_flag_lockless(dentry, DENTRY_INODE_TO_BE_DELETED));
     dentry->ops->dentry.free_inode(dentry);
+    pcache_invalidate_inode(dentry->dev_indx, dentry->inode_indx);
 }
 
 static inline void dentry_flush_inode(dentry_t* dentry)
@@ -146,18 +325,9 @@ static inline void dentry_flush_inode(dentry_t* dentry)
  */
 static void dentry_delete_from_cache(dentry_t* dentry)
 {
-    /* This marks the dentry as deleted. */
-    dentry->inode_indx = 0;
-    if (dentry->inode) {
-        kfree(dentry->inode);
-    }
-    if (dentry->filename) {
-        kfree(dentry->filename);
-    }
-    stat_cached_inodes_area_size -= INODE_LEN;
-    if (!need_to_free_inode_cache()) {
-        can_cache_inodes = 1;
-    }
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_cache_free_lockless(dentry);
+    lock_release(&_dentry_cache_lock);
 }
 
 /**
@@ -168,14 +338,13 @@ static void dentry_delete_from_cache(dentry_t* dentry)
  */
 static void dentry_prefree(dentry_t* dentry)
 {
-    if (!can_cache_inodes) {
-        dentry_delete_from_cache(dentry);
-    } else {
-        if (need_to_free_inode_cache()) {
-            free_inode_cache();
-        }
+    lock_acquire(&_dentry_cache_lock);
+    // dentry_get() could have taken the dentry while it was being flushed.
+    if (dentry->d_count == 0 && !dentry->in_lru) {
+        _dentry_lru_push_front(dentry);
+        _dentry_cache_shrink_lockless();
     }
-    stat_cached_dentries--;
+    lock_release(&_dentry_cache_lock);
 }
 
 static dentry_t* dentry_alloc_new(uint32_t dev_indx, uint32_t inode_indx, int need_to_read_inode)
@@ -187,9 +356,6 @@ static dentry_t* dentry_alloc_new(uint32_t dev_indx, uint32_t inode_indx, int ne
     dentry_t* dentry = dentry_cache_find_empty_entry();
     fs_desc_t* fs_desc;
 
-    /* If inode_indx isn't 0, so we can say that we replace a valid dentry, which
-       has area for storing inode allocated. */
-    bool already_allocated_inode = (dentry->inode_indx != 0);
     lock_init(&dentry->lock);
     dentry->d_count = 1;
     dentry->flags = 0;
@@ -201,18 +367,38 @@ static dentry_t* dentry_alloc_new(uint32_t dev_indx, uint32_t inode_indx, int ne
     dentry->fsdata = dentry->ops->dentry.get_fsdata(dentry);
     dentry->parent = NULL;
     dentry->filename = NULL;
+    dentry->negative_gen = 0;
 
-    if (!already_allocated_inode) {
-        dentry->inode = (inode_t*)kmalloc(INODE_LEN);
+    /* A replaced dentry has area for storing inode allocated. */
+    if (!dentry->inode) {
+        dentry->inode = (inode_t*)kmem_cache_alloc(_dentry_inode_cache);
+        lock_acquire(&_dentry_cache_lock);
         stat_cached_inodes_area_size += INODE_LEN;
+        lock_release(&_dentry_cache_lock);
     }
 
     if (need_to_read_inode && dentry->ops->dentry.read_inode(dentry) < 0) {
         log_error("[Dentry] Can't read inode %d %d (dev, ino)", dev_indx, inode_indx);
+        dentry_delete_from_cache(dentry);
         return NULL;
     }
 
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_hash_add(dentry);
     stat_cached_dentries++;
+    lock_release(&_dentry_cache_lock);
+    return dentry;
+}
+
+/**
+ * Takes a reference to a cached dentry. Is called with the cache lock held.
+ */
+static dentry_t* _dentry_grab_lockless(dentry_t* dentry)
+{
+    if (atomic_add(&dentry->d_count, 1) == 1) {
+        _dentry_lru_remove(dentry);
+        stat_cached_dentries++;
+    }
     return dentry;
 }
 
@@ -226,18 +412,65 @@ void dentry_set_inode(dentry_t* dentry, inode_t* inode)
     lock_release(&dentry->lock);
 }
 
-void dentry_set_parent(dentry_t* to, dentry_t* parent)
+/**
+ * Binds the dentry to the directory it has been found in. The dentry holds
+ * a reference to the parent while it is held by someone, and could be found
+ * later with dentry_lookup_child() while it stays in the cache.
+ */
+void dentry_set_name(dentry_t* to, dentry_t* parent, const char* name, size_t len)
 {
     lock_acquire(&to->lock);
+    dentry_t* old_parent = to->parent;
+    bool same_name = to->filename && to->name_dev == parent->dev_indx && to->name_ino == parent->inode_indx
+        && to->name_hashed == _dentry_can_hash_name(parent) && _dentry_name_equals(to, name, len);
+    if (same_name) {
+        // The dentry has been revived from the LRU, so only the parent has to be restored.
+        if (old_parent != parent) {
+            to->parent = dentry_duplicate(parent);
+            if (old_parent) {
+                dentry_put(old_parent);
+            }
+        }
+        lock_release(&to->lock);
+        return;
+    }
+
+    char* filename = kmalloc(len + 1);
+    memcpy(filename, name, len);
+    filename[len] = '\0';
+
     to->parent = dentry_duplicate(parent);
+
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_name_hash_remove(to);
+    char* old_filename = to->filename;
+    to->filename = filename;
+    to->name_dev = parent->dev_indx;
+    to->name_ino = parent->inode_indx;
+    to->name_hash = _dentry_name_hash_of(parent->dev_indx, parent->inode_indx, name, len);
+    if (_dentry_can_hash_name(parent)) {
+        _dentry_name_hash_add(to);
+    }
+    lock_release(&_dentry_cache_lock);
+
+    if (old_filename) {
+        kfree(old_filename);
+    }
+    if (old_parent) {
+        dentry_put(old_parent);
+    }
     lock_release(&to->lock);
 }
 
-void dentry_set_filename(dentry_t* to, char* filename)
+/**
+ * Forgets the name of the dentry, is called when the name is removed from
+ * its directory.
+ */
+void dentry_unhash_name(dentry_t* dentry)
 {
-    lock_acquire(&to->lock);
-    to->filename = filename;
-    lock_release(&to->lock);
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_name_hash_remove(dentry);
+    lock_release(&_dentry_cache_lock);
 }
 
 dentry_t* dentry_get_parent(dentry_t* dentry)
@@ -263,51 +496,42 @@ void kdentryflusherd()
 #ifdef DENTRY_DEBUG
         log("WORK dentry_flusher");
 #endif
-        dentry_cache_list_t* dentry_cache_block = dentry_cache;
-        while (dentry_cache_block) {
-            lock_acquire(&dentry_cache_block->lock);
-            int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-            for (int i = 0; i < dentries_in_block; i++) {
-                if (dentry_cache_block->data[i].inode_indx != 0) {
-                    // Keep only locks here might not be as effective as with disabled interrupts.
-                    lock_acquire(&dentry_cache_block->data[i].lock);
-                    system_disable_interrupts();
-                    dentry_flush(&dentry_cache_block->data[i]);
-                    system_enable_interrupts();
-                    lock_release(&dentry_cache_block->data[i].lock);
-                }
+        // Dentries are never freed, so the list could be walked without the cache lock.
+        for (dentry_t* dentry = _dentry_all; dentry; dentry = dentry->all_next) {
+            if (dentry->inode_indx != 0) {
+                // Keep only locks here might not be as effective as with disabled interrupts.
+                lock_acquire(&dentry->lock);
+                system_disable_interrupts();
+                dentry_flush(dentry);
+                system_enable_interrupts();
+                lock_release(&dentry->lock);
             }
-            lock_release(&dentry_cache_block->lock);
-            dentry_cache_block = dentry_cache_block->next;
         }
-        ksys1(SYS_NANOSLEEP, 2);
+        pcache_sync_all();
+        vfs_sync_all();
+        bcache_flush_all();
+        timespec_t sleep_time = { 2, 0 };
+        ksys1(SYS_NANOSLEEP, (int)&sleep_time);
     }
 }
 
 /**
  * There are 3 cases for each entry in a cache array:
  * 1) We have a valid dentry which is held by someone.
- * 2) We have a valid dentry which isn'y held by someone and ready to swapped out.
- * 3) We have an unsed entry in the cache array.
+ * 2) We have a valid dentry which isn'y held by someone and sits in the LRU.
+ * 3) We have an unsed entry in the free list.
  */
 dentry_t* dentry_get(uint32_t dev_indx, uint32_t inode_indx)
 {
     /* We try to find the dentry in the cache */
-    dentry_cache_list_t* dentry_cache_block = dentry_cache;
-    while (dentry_cache_block) {
-        lock_acquire(&dentry_cache_block->lock);
-        int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-        for (int i = 0; i < dentries_in_block; i++) {
-            if (dentry_cache_block->data[i].dev_indx == dev_indx && dentry_cache_block->data[i].inode_indx == inode_indx) {
-                if (!dentry_cache_block->data[i].d_count)
-                    stat_cached_dentries++;
-                lock_release(&dentry_cache_block->lock);
-                return dentry_duplicate(&dentry_cache_block->data[i]);
-            }
-        }
-        lock_release(&dentry_cache_block->lock);
-        dentry_cache_block = dentry_cache_block->next;
+    lock_acquire(&_dentry_cache_lock);
+    dentry_t* dentry = _dentry_hash_find(dev_indx, inode_indx);
+    if (dentry) {
+        _dentry_grab_lockless(dentry);
+        lock_release(&_dentry_cache_lock);
+        return dentry;
     }
+    lock_release(&_dentry_cache_lock);
 
     /* It means no dentry in the cache. Let's add it. */
     return dentry_alloc_new(dev_indx, inode_indx, READ_INODE);
@@ -316,33 +540,156 @@ dentry_t* dentry_get(uint32_t dev_indx, uint32_t inode_indx)
 dentry_t* dentry_get_no_inode(uint32_t dev_indx, uint32_t inode_indx, int* newly_allocated)
 {
     /* We try to find the dentry in the cache */
-    dentry_cache_list_t* dentry_cache_block = dentry_cache;
-    while (dentry_cache_block) {
-        lock_acquire(&dentry_cache_block->lock);
-        int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-        for (int i = 0; i < dentries_in_block; i++) {
-            if (dentry_cache_block->data[i].dev_indx == dev_indx && dentry_cache_block->data[i].inode_indx == inode_indx) {
-                if (!dentry_cache_block->data[i].d_count)
-                    stat_cached_dentries++;
-                *newly_allocated = DENTRY_WAS_IN_CACHE;
-                lock_release(&dentry_cache_block->lock);
-                return dentry_duplicate(&dentry_cache_block->data[i]);
-            }
-        }
-        lock_release(&dentry_cache_block->lock);
-        dentry_cache_block = dentry_cache_block->next;
+    lock_acquire(&_dentry_cache_lock);
+    dentry_t* dentry = _dentry_hash_find(dev_indx, inode_indx);
+    if (dentry) {
+        _dentry_grab_lockless(dentry);
+        lock_release(&_dentry_cache_lock);
+        *newly_allocated = DENTRY_WAS_IN_CACHE;
+        return dentry;
     }
+    lock_release(&_dentry_cache_lock);
 
     /* It means no dentry in the cache. Let's add it. */
     *newly_allocated = DENTRY_NEWLY_ALLOCATED;
     return dentry_alloc_new(dev_indx, inode_indx, NOT_READ_INODE);
 }
 
+/**
+ * Finds a child of dir by the name it was resolved with, without asking
+ * the file system. Returns NULL if the name isn't cached.
+ */
+dentry_t* dentry_lookup_child(dentry_t* dir, const char* name, size_t len)
+{
+    if (!_dentry_can_hash_name(dir)) {
+        return NULL;
+    }
+
+    uint32_t hash = _dentry_name_hash_of(dir->dev_indx, dir->inode_indx, name, len);
+    lock_acquire(&_dentry_cache_lock);
+    for (dentry_t* it = _dentry_name_hash[hash & (DENTRY_HASH_SIZE - 1)]; it; it = it->name_next) {
+        if (it->name_hash == hash && it->name_dev == dir->dev_indx && it->name_ino == dir->inode_indx
+            && !dentry_test_flag_lockless(it, DENTRY_INODE_TO_BE_DELETED) && _dentry_name_equals(it, name, len)) {
+            _dentry_grab_lockless(it);
+            lock_release(&_dentry_cache_lock);
+            return it;
+        }
+    }
+    lock_release(&_dentry_cache_lock);
+    return NULL;
+}
+
+/**
+ * NEGATIVE ENTRIES
+ */
+
+static inline struct dentry_negative* _dentry_negative_slot(uint32_t hash)
+{
+    return &_dentry_negative[hash & (DENTRY_NEGATIVE_CACHE_SIZE - 1)];
+}
+
+static inline bool _dentry_negative_matches(struct dentry_negative* entry, dentry_t* dir, uint32_t hash, const char* name, size_t len)
+{
+    return entry->ino == dir->inode_indx && entry->dev == dir->dev_indx && entry->hash == hash
+        && entry->len == len && memcmp(entry->name, name, len) == 0;
+}
+
+/**
+ * Drops negative entries of the directory, or of the whole device if ino is 0.
+ */
+static void _dentry_negative_drop_lockless(dev_t dev, ino_t ino)
+{
+    for (int i = 0; i < DENTRY_NEGATIVE_CACHE_SIZE; i++) {
+        if (_dentry_negative[i].dev == dev && (!ino || _dentry_negative[i].ino == ino)) {
+            _dentry_negative[i].ino = 0;
+        }
+    }
+}
+
+/**
+ * Returns true if the name is known to be missing in dir.
+ */
+bool dentry_lookup_negative(dentry_t* dir, const char* name, size_t len)
+{
+    if (!_dentry_can_hash_name(dir) || len > DENTRY_NEGATIVE_NAME_LEN) {
+        return false;
+    }
+
+    uint32_t hash = _dentry_name_hash_of(dir->dev_indx, dir->inode_indx, name, len);
+    lock_acquire(&_dentry_cache_lock);
+    bool res = _dentry_negative_matches(_dentry_negative_slot(hash), dir, hash, name, len);
+    lock_release(&_dentry_cache_lock);
+    return res;
+}
+
+/**
+ * A lookup takes the generation of dir before asking the file system, and
+ * passes it to dentry_add_negative(). If the name was created meanwhile, the
+ * generation has changed and the stale result is not cached.
+ */
+uint32_t dentry_negative_gen(dentry_t* dir)
+{
+    lock_acquire(&_dentry_cache_lock);
+    uint32_t gen = dir->negative_gen;
+    lock_release(&_dentry_cache_lock);
+    return gen;
+}
+
+void dentry_add_negative(dentry_t* dir, const char* name, size_t len, uint32_t gen)
+{
+    if (!_dentry_can_hash_name(dir) || len > DENTRY_NEGATIVE_NAME_LEN) {
+        return;
+    }
+
+    uint32_t hash = _dentry_name_hash_of(dir->dev_indx, dir->inode_indx, name, len);
+    lock_acquire(&_dentry_cache_lock);
+    if (dir->negative_gen != gen) {
+        lock_release(&_dentry_cache_lock);
+        return;
+    }
+
+    struct dentry_negative* entry = _dentry_negative_slot(hash);
+    entry->dev = dir->dev_indx;
+    entry->ino = dir->inode_indx;
+    entry->hash = hash;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    lock_release(&_dentry_cache_lock);
+}
+
+/**
+ * Is called when the name appears in or leaves dir.
+ */
+void dentry_forget_negative(dentry_t* dir, const char* name, size_t len)
+{
+    lock_acquire(&_dentry_cache_lock);
+    dir->negative_gen++;
+    if (len > DENTRY_NEGATIVE_NAME_LEN) {
+        lock_release(&_dentry_cache_lock);
+        return;
+    }
+
+    uint32_t hash = _dentry_name_hash_of(dir->dev_indx, dir->inode_indx, name, len);
+    struct dentry_negative* entry = _dentry_negative_slot(hash);
+    if (_dentry_negative_matches(entry, dir, hash, name, len)) {
+        entry->ino = 0;
+    }
+    lock_release(&_dentry_cache_lock);
+}
+
+/**
+ * Is called when dir is removed, since its inode could be reused by a new one.
+ */
+void dentry_forget_negative_dir(dentry_t* dir)
+{
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_negative_drop_lockless(dir->dev_indx, dir->inode_indx);
+    lock_release(&_dentry_cache_lock);
+}
+
 dentry_t* dentry_duplicate(dentry_t* dentry)
 {
-    lock_acquire(&dentry->lock);
-    dentry->d_count++;
-    lock_release(&dentry->lock);
+    atomic_add(&dentry->d_count, 1);
     return dentry;
 }
 
@@ -350,6 +697,7 @@ static inline void dentry_put_impl(dentry_t* dentry)
 {
     if (dentry->parent) {
         dentry_put(dentry->parent);
+        dentry->parent = NULL;
     }
 
     if (dentry_test_flag_lockless(dentry, DENTRY_CUSTOM)) {
@@ -360,6 +708,7 @@ static inline void dentry_put_impl(dentry_t* dentry)
         return;
     }
 
+    atomic_add(&stat_cached_dentries, -1);
     if (dentry_test_flag_lockless(dentry, DENTRY_INODE_TO_BE_DELETED)) {
 #ifdef DENTRY_DEBUG
         log("Inode delete %d", dentry->inode_indx);
@@ -383,17 +732,17 @@ void dentry_force_put(dentry_t* dentry)
         return;
     }
 
-    dentry->d_count = 0;
-    dentry_put_impl(dentry);
+    if (dentry->d_count) {
+        dentry->d_count = 0;
+        dentry_put_impl(dentry);
+    }
     lock_release(&dentry->lock);
 }
 
 inline void dentry_put_lockless(dentry_t* dentry)
 {
     ASSERT(dentry->d_count > 0);
-    dentry->d_count--;
-
-    if (dentry->d_count == 0) {
+    if (atomic_add(&dentry->d_count, -1) == 0) {
         dentry_put_impl(dentry);
     }
 }
@@ -405,19 +754,33 @@ void dentry_put(dentry_t* dentry)
     lock_release(&dentry->lock);
 }
 
+/**
+ * Drops all dentries of the ejected device from the cache. Links between
+ * them are cut first, so forcing a parent out doesn't break its children.
+ */
 void dentry_put_all_dentries_of_dev(uint32_t dev_indx)
 {
-    dentry_cache_list_t* dentry_cache_block = dentry_cache;
-    while (dentry_cache_block) {
-        lock_acquire(&dentry_cache_block->lock);
-        int dentries_in_block = dentry_cache_block->len / sizeof(dentry_t);
-        for (int i = 0; i < dentries_in_block; i++) {
-            if (dentry_cache_block->data[i].dev_indx == dev_indx && dentry_cache_block->data[i].inode != 0) {
-                dentry_force_put(&dentry_cache_block->data[i]);
+    lock_acquire(&_dentry_cache_lock);
+    _dentry_negative_drop_lockless(dev_indx, 0);
+    lock_release(&_dentry_cache_lock);
+
+    for (dentry_t* dentry = _dentry_all; dentry; dentry = dentry->all_next) {
+        if (dentry->dev_indx == dev_indx && dentry->inode_indx != 0 && dentry->parent && dentry->parent->dev_indx == dev_indx) {
+            lock_acquire(&dentry->lock);
+            dentry->parent = NULL;
+            lock_release(&dentry->lock);
+        }
+    }
+
+    for (dentry_t* dentry = _dentry_all; dentry; dentry = dentry->all_next) {
+        if (dentry->dev_indx == dev_indx && dentry->inode_indx != 0) {
+            dentry_force_put(dentry);
+            lock_acquire(&_dentry_cache_lock);
+            if (dentry->in_lru) {
+                _dentry_cache_free_lockless(dentry);
             }
+            lock_release(&_dentry_cache_lock);
         }
-        lock_release(&dentry_cache_block->lock);
-        dentry_cache_block = dentry_cache_block->next;
     }
 }
 
@@ -447,6 +447,15 @@ int devfs_can_write(dentry_t* dentry, size_t start)
     return true;
 }
 
+struct wait_queue* devfs_wait_queue(dentry_t* dentry)
+{
+    devfs_inode_t* devfs_inode = (devfs_inode_t*)dentry->inode;
+    if (devfs_inode->handlers->wait_queue) {
+        return devfs_inode->handlers->wait_queue(dentry);
+    }
+    return NULL;
+}
+
 int devfs_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
 {
     devfs_inode_t* devfs_inode = (devfs_inode_t*)dentry->inode;
@@ -509,6 +518,7 @@ driver_desc_t _devfs_driver_info()
     fs_desc.functions[DRIVER_FILE_SYSTEM_PREPARE_FS] = devfs_prepare_fs;
     fs_desc.functions[DRIVER_FILE_SYSTEM_CAN_READ] = devfs_can_read;
     fs_desc.functions[DRIVER_FILE_SYSTEM_CAN_WRITE] = devfs_can_write;
+    fs_desc.functions[DRIVER_FILE_SYSTEM_WAIT_QUEUE] = devfs_wait_queue;
     fs_desc.functions[DRIVER_FILE_SYSTEM_OPEN] = devfs_open;
     fs_desc.functions[DRIVER_FILE_SYSTEM_READ] = devfs_read;
     fs_desc.functions[DRIVER_FILE_SYSTEM_WRITE] = devfs_write;
@@ -6,6 +6,8 @@
  * found in the LICENSE file.
  */
 
+#include <algo/bitmap.h>
+#include <fs/bcache.h>
 #include <fs/vfs.h>
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
@@ -19,6 +21,7 @@
 #define SUPERBLOCK _ext2_superblocks[dev->dev->id]
 #define GROUPS_COUNT _ext2_group_table_info[dev->dev->id].count
 #define GROUP_TABLES _ext2_group_table_info[dev->dev->id].table
+#define ALLOC_INFO _ext2_alloc_info[dev->dev->id]
 #define VFS_DEVICE_LOCK dev->lock
 #define VFS_DEVICE_LOCK_OWNED_BY(x) x->dev->lock
 #define BLOCK_LEN(sb) (1024 << (sb->log_block_size))
@@ -27,6 +30,9 @@
 
 static superblock_t* _ext2_superblocks[MAX_DEVICES_COUNT];
 static groups_info_t _ext2_group_table_info[MAX_DEVICES_COUNT];
+static ext2_alloc_info_t _ext2_alloc_info[MAX_DEVICES_COUNT];
+static ext2_dir_index_t _ext2_dir_indexes[MAX_DEVICES_COUNT][EXT2_DIR_INDEX_SLOTS];
+static uint32_t _ext2_dir_index_clock;
 static lock_t _ext2_lock;
 
 driver_desc_t _ext2_driver_info();
@@ -58,11 +64,12 @@ static int _ext2_set_block_of_inode_lev1(dentry_t* dentry, uint32_t cur_block, u
 static int _ext2_set_block_of_inode_lev2(dentry_t* dentry, uint32_t cur_block, uint32_t inode_block_index, uint32_t val);
 static int _ext2_set_block_of_inode(dentry_t* dentry, uint32_t inode_block_index, uint32_t val);
 
-static int _ext2_find_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t group_index);
-static int _ext2_allocate_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t pref_group);
+static int _ext2_find_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t group_index, uint32_t from);
+static int _ext2_allocate_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t goal);
 static int _ext2_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t block_index);
+static void _ext2_discard_prealloc(vfs_device_t* dev, fsdata_t fsdata, ext2_prealloc_t* prealloc);
 
-static int _ext2_allocate_block_for_inode(dentry_t* dentry, uint32_t pref_group, uint32_t* block_index);
+static int _ext2_allocate_block_for_inode(dentry_t* dentry, uint32_t* block_index);
 
 /* INODE FUNCTIONS */
 int ext2_read_inode(dentry_t* dentry);
@@ -83,6 +90,11 @@ static int _ext2_add_first_entry_to_dir_block(vfs_device_t* dev, fsdata_t fsdata
 static int _ext2_add_to_dir_block(vfs_device_t* dev, fsdata_t fsdata, uint32_t block_index, dentry_t* child_dentry, const char* filename, uint32_t len);
 static int _ext2_rm_from_dir_block(vfs_device_t* dev, fsdata_t fsdata, uint32_t block_index, dentry_t* child_dentry);
 
+static ext2_dir_index_t* _ext2_dir_index_get(dentry_t* dir);
+static void _ext2_dir_index_drop(vfs_device_t* dev, ino_t ino);
+static int _ext2_dir_index_lookup(dentry_t* dir, ext2_dir_index_t* index, const char* name, uint32_t len, uint32_t* found_inode_index);
+static void _ext2_dir_index_add(dentry_t* dir, const char* name, uint32_t len, uint32_t block_index);
+
 static int _ext2_add_child(dentry_t* dir, dentry_t* child_dentry, const char* name, int len);
 static int _ext2_rm_child(dentry_t* dir, dentry_t* child_dentry);
 static int _ext2_setup_dir(dentry_t* dir, dentry_t* parent_dir, mode_t mode, uid_t uid, gid_t gid);
@@ -94,6 +106,7 @@ static int _ext2_setup_file(dentry_t* file, mode_t mode, uid_t uid, gid_t gid);
 int ext2_recognize_drive(vfs_device_t* dev);
 int ext2_prepare_fs(vfs_device_t* dev);
 int ext2_save_state(vfs_device_t* dev);
+int ext2_sync_device(vfs_device_t* dev);
 fsdata_t get_fsdata(dentry_t* dentry);
 
 int ext2_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
@@ -111,42 +124,15 @@ int ext2_rm(dentry_t* dentry);
 
 static void _ext2_read_from_dev(vfs_device_t* dev, uint8_t* buf, uint32_t start, uint32_t len)
 {
-    void (*read)(device_t * d, uint32_t s, uint8_t * r) = devman_function_handler(dev->dev, DRIVER_STORAGE_READ);
-    int already_read = 0;
-    uint32_t sector = start / 512;
-    uint32_t start_offset = start % 512;
-    uint8_t tmp_buf[512];
-
-    while (len) {
-        read(dev->dev, sector, tmp_buf);
-        for (int i = 0; i < min(512 - start_offset, len); i++) {
-            buf[already_read++] = tmp_buf[start_offset + i];
-        }
-        len -= min(512 - start_offset, len);
-        sector++;
-        start_offset = 0;
+    if (bcache_read(dev->dev, buf, start, len) < 0) {
+        log_error("[ext2] Read from dev %d failed at %x", dev->dev->id, start);
     }
 }
 
 static void _ext2_write_to_dev(vfs_device_t* dev, uint8_t* buf, uint32_t start, uint32_t len)
 {
-    void (*read)(device_t * d, uint32_t s, uint8_t * r) = devman_function_handler(dev->dev, DRIVER_STORAGE_READ);
-    void (*write)(device_t * d, uint32_t s, uint8_t * r, uint32_t siz) = devman_function_handler(dev->dev, DRIVER_STORAGE_WRITE);
-    int already_written = 0;
-    uint32_t sector = start / 512;
-    uint32_t start_offset = start % 512;
-    uint8_t tmp_buf[512];
-    while (len != 0) {
-        if (start_offset != 0 || len < 512) {
-            read(dev->dev, sector, tmp_buf);
-        }
-        for (int i = 0; i < min(512 - start_offset, len); i++) {
-            tmp_buf[start_offset + i] = buf[already_written++];
-        }
-        write(dev->dev, sector, tmp_buf, 512);
-        len -= min(512 - start_offset, len);
-        sector++;
-        start_offset = 0;
+    if (bcache_write(dev->dev, buf, start, len) < 0) {
+        log_error("[ext2] Write to dev %d failed at %x", dev->dev->id, start);
     }
 }
 
@@ -195,6 +181,82 @@ static inline int _ext2_get_groups_cnt(vfs_device_t* dev, superblock_t* sb)
     return ans;
 }
 
+static inline uint8_t* _ext2_group_block_bitmap(vfs_device_t* dev, uint32_t group_index)
+{
+    return ALLOC_INFO.block_bitmaps + group_index * BLOCK_LEN(SUPERBLOCK);
+}
+
+static inline uint8_t* _ext2_group_inode_bitmap(vfs_device_t* dev, uint32_t group_index)
+{
+    return ALLOC_INFO.inode_bitmaps + group_index * BLOCK_LEN(SUPERBLOCK);
+}
+
+/**
+ * Bitmaps of all groups are read once, when the fs is prepared, and are
+ * written back to the block cache only on sync.
+ */
+static void _ext2_load_bitmaps(vfs_device_t* dev)
+{
+    uint32_t block_len = BLOCK_LEN(SUPERBLOCK);
+    uint32_t groups_cnt = GROUPS_COUNT;
+    memset((uint8_t*)&ALLOC_INFO, 0, sizeof(ext2_alloc_info_t));
+    ALLOC_INFO.block_bitmaps = (uint8_t*)kmalloc(groups_cnt * block_len);
+    ALLOC_INFO.inode_bitmaps = (uint8_t*)kmalloc(groups_cnt * block_len);
+    ALLOC_INFO.dirty_groups = (uint8_t*)kmalloc(groups_cnt);
+    memset(ALLOC_INFO.dirty_groups, 0, groups_cnt);
+
+    for (uint32_t group_index = 0; group_index < groups_cnt; group_index++) {
+        _ext2_read_from_dev(dev, _ext2_group_block_bitmap(dev, group_index), _ext2_get_block_offset(SUPERBLOCK, GROUP_TABLES[group_index].block_bitmap), block_len);
+        _ext2_read_from_dev(dev, _ext2_group_inode_bitmap(dev, group_index), _ext2_get_block_offset(SUPERBLOCK, GROUP_TABLES[group_index].inode_bitmap), block_len);
+    }
+}
+
+static void _ext2_sync_lockless(vfs_device_t* dev)
+{
+    uint32_t block_len = BLOCK_LEN(SUPERBLOCK);
+    fsdata_t fsdata;
+    fsdata.sb = SUPERBLOCK;
+    fsdata.gt = &_ext2_group_table_info[dev->dev->id];
+
+    for (int i = 0; i < EXT2_PREALLOC_SLOTS; i++) {
+        _ext2_discard_prealloc(dev, fsdata, &ALLOC_INFO.prealloc[i]);
+    }
+
+    for (uint32_t group_index = 0; group_index < GROUPS_COUNT; group_index++) {
+        uint8_t dirty = ALLOC_INFO.dirty_groups[group_index];
+        if (TEST_FLAG(dirty, EXT2_GROUP_BLOCK_BITMAP_DIRTY)) {
+            _ext2_write_to_dev(dev, _ext2_group_block_bitmap(dev, group_index), _ext2_get_block_offset(SUPERBLOCK, GROUP_TABLES[group_index].block_bitmap), block_len);
+        }
+        if (TEST_FLAG(dirty, EXT2_GROUP_INODE_BITMAP_DIRTY)) {
+            _ext2_write_to_dev(dev, _ext2_group_inode_bitmap(dev, group_index), _ext2_get_block_offset(SUPERBLOCK, GROUP_TABLES[group_index].inode_bitmap), block_len);
+        }
+        ALLOC_INFO.dirty_groups[group_index] = 0;
+    }
+
+    if (ALLOC_INFO.dirty_descs) {
+        _ext2_write_to_dev(dev, (uint8_t*)GROUP_TABLES, _ext2_get_block_offset(SUPERBLOCK, 2), GROUPS_COUNT * GROUP_LEN);
+        _ext2_write_to_dev(dev, (uint8_t*)SUPERBLOCK, SUPERBLOCK_START, SUPERBLOCK_LEN);
+        ALLOC_INFO.dirty_descs = false;
+    }
+}
+
+/**
+ * Looks for a free bit starting from @from, wrapping to the start of
+ * the bitmap. The search goes a word at a time.
+ */
+static int _ext2_bitmap_find_free(uint8_t* bitmap, uint32_t len, uint32_t from)
+{
+    int start = 0;
+    bitmap_t wrapped = bitmap_wrap(bitmap, len);
+    if (from < len && bitmap_next_range_of_unset_bits(wrapped, from, 1, &start) > 0) {
+        return start;
+    }
+    if (from && bitmap_next_range_of_unset_bits(wrapped, 0, 1, &start) > 0) {
+        return start;
+    }
+    return -ENOSPC;
+}
+
 /**
  * BLOCK FUNCTIONS
  */
@@ -295,29 +357,48 @@ int _ext2_set_block_of_inode(dentry_t* dentry, uint32_t inode_block_index, uint3
     return _ext2_set_block_of_inode_lev2(dentry, dentry->inode->block[14], inode_block_index - (12 + block_len + block_len * block_len), val);
 }
 
-static int _ext2_find_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t group_index)
+static inline void _ext2_take_block(vfs_device_t* dev, fsdata_t fsdata, uint32_t group_index, uint32_t off)
 {
-    uint8_t block_bitmap[MAX_BLOCK_LEN];
-    _ext2_read_from_dev(dev, block_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].block_bitmap), BLOCK_LEN(fsdata.sb));
+    _ext2_bitmap_set_bit(_ext2_group_block_bitmap(dev, group_index), off);
+    fsdata.gt->table[group_index].free_blocks_count--;
+    fsdata.sb->free_blocks_count--;
+    ALLOC_INFO.dirty_groups[group_index] |= EXT2_GROUP_BLOCK_BITMAP_DIRTY;
+    ALLOC_INFO.dirty_descs = true;
+}
 
-    for (uint32_t off = 0; off < 8 * BLOCK_LEN(fsdata.sb); off++) {
-        if (!_ext2_bitmap_get(block_bitmap, off)) {
-            *block_index = fsdata.sb->blocks_per_group * group_index + off + 1;
-            _ext2_bitmap_set_bit(block_bitmap, off);
-            _ext2_write_to_dev(dev, block_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].block_bitmap), BLOCK_LEN(fsdata.sb));
-            return 0;
-        }
+static int _ext2_find_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t group_index, uint32_t from)
+{
+    int off = _ext2_bitmap_find_free(_ext2_group_block_bitmap(dev, group_index), fsdata.sb->blocks_per_group, from);
+    if (off < 0) {
+        return -ENOSPC;
     }
-    return -ENOSPC;
+
+    _ext2_take_block(dev, fsdata, group_index, off);
+    *block_index = fsdata.sb->blocks_per_group * group_index + off + fsdata.sb->first_data_block;
+    return 0;
 }
 
-static int _ext2_allocate_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t pref_group)
+/**
+ * Allocates a block as close as possible after @goal, so blocks of a file
+ * which is being appended stay contiguous.
+ */
+static int _ext2_allocate_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* block_index, uint32_t goal)
 {
     uint32_t groups_cnt = GROUPS_COUNT;
+    uint32_t goal_group = 0;
+    uint32_t goal_off = 0;
+    if (goal >= fsdata.sb->first_data_block) {
+        goal_group = (goal - fsdata.sb->first_data_block) / fsdata.sb->blocks_per_group;
+        goal_off = (goal - fsdata.sb->first_data_block) % fsdata.sb->blocks_per_group;
+    }
+    if (goal_group >= groups_cnt) {
+        goal_group = goal_off = 0;
+    }
+
     for (int i = 0; i < groups_cnt; i++) {
-        uint32_t group_id = (pref_group + i) % groups_cnt;
+        uint32_t group_id = (goal_group + i) % groups_cnt;
         if (GROUP_TABLES[group_id].free_blocks_count) {
-            if (_ext2_find_free_block_index(dev, fsdata, block_index, group_id) == 0) {
+            if (_ext2_find_free_block_index(dev, fsdata, block_index, group_id, i ? 0 : goal_off) == 0) {
                 return 0;
             }
         }
@@ -327,33 +408,121 @@ static int _ext2_allocate_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32
 
 static int _ext2_free_block_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t block_index)
 {
-    block_index--;
-    uint32_t block_len = BLOCK_LEN(fsdata.sb);
-    uint32_t group_index = block_index / block_len;
-    uint32_t off = block_index % block_len;
+    if (block_index < fsdata.sb->first_data_block) {
+        return -EINVAL;
+    }
 
-    uint8_t block_bitmap[MAX_BLOCK_LEN];
-    _ext2_read_from_dev(dev, block_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].block_bitmap), block_len);
+    block_index -= fsdata.sb->first_data_block;
+    uint32_t group_index = block_index / fsdata.sb->blocks_per_group;
+    uint32_t off = block_index % fsdata.sb->blocks_per_group;
+    if (group_index >= GROUPS_COUNT) {
+        return -EINVAL;
+    }
+
+    uint8_t* block_bitmap = _ext2_group_block_bitmap(dev, group_index);
+    if (!_ext2_bitmap_get(block_bitmap, off)) {
+        return 0;
+    }
 
     _ext2_bitmap_unset_bit(block_bitmap, off);
-    _ext2_write_to_dev(dev, block_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].block_bitmap), block_len);
+    fsdata.gt->table[group_index].free_blocks_count++;
+    fsdata.sb->free_blocks_count++;
+    ALLOC_INFO.dirty_groups[group_index] |= EXT2_GROUP_BLOCK_BITMAP_DIRTY;
+    ALLOC_INFO.dirty_descs = true;
     return 0;
 }
 
+/**
+ * PREALLOCATION
+ */
+
+static void _ext2_discard_prealloc(vfs_device_t* dev, fsdata_t fsdata, ext2_prealloc_t* prealloc)
+{
+    for (uint32_t i = 0; i < prealloc->count; i++) {
+        _ext2_free_block_index(dev, fsdata, prealloc->start + i);
+    }
+    prealloc->ino = 0;
+    prealloc->count = 0;
+}
+
+static inline ext2_prealloc_t* _ext2_prealloc_of(dentry_t* dentry)
+{
+    return &_ext2_alloc_info[dentry->dev_indx].prealloc[dentry->inode_indx % EXT2_PREALLOC_SLOTS];
+}
+
+static void _ext2_discard_prealloc_of_inode(dentry_t* dentry)
+{
+    ext2_prealloc_t* prealloc = _ext2_prealloc_of(dentry);
+    if (prealloc->ino == dentry->inode_indx) {
+        _ext2_discard_prealloc(dentry->dev, dentry->fsdata, prealloc);
+    }
+}
+
+/**
+ * Reserves free blocks which directly follow @block_index for the next
+ * appends to the inode.
+ */
+static void _ext2_reserve_prealloc(dentry_t* dentry, ext2_prealloc_t* prealloc, uint32_t block_index)
+{
+    vfs_device_t* dev = dentry->dev;
+    fsdata_t fsdata = dentry->fsdata;
+    uint32_t group_index = (block_index - fsdata.sb->first_data_block) / fsdata.sb->blocks_per_group;
+    uint32_t off = (block_index - fsdata.sb->first_data_block) % fsdata.sb->blocks_per_group;
+    uint8_t* block_bitmap = _ext2_group_block_bitmap(dev, group_index);
+
+    prealloc->ino = dentry->inode_indx;
+    prealloc->start = block_index + 1;
+    prealloc->count = 0;
+    while (prealloc->count < EXT2_PREALLOC_BLOCKS && off + 1 + prealloc->count < fsdata.sb->blocks_per_group) {
+        if (_ext2_bitmap_get(block_bitmap, off + 1 + prealloc->count)) {
+            break;
+        }
+        _ext2_take_block(dev, fsdata, group_index, off + 1 + prealloc->count);
+        prealloc->count++;
+    }
+}
+
 /**
  * Returns allocated block in @block_index
  */
-static int _ext2_allocate_block_for_inode(dentry_t* dentry, uint32_t pref_group, uint32_t* block_index)
+static int _ext2_allocate_block_for_inode(dentry_t* dentry, uint32_t* block_index)
 {
-    if (_ext2_allocate_block_index(dentry->dev, dentry->fsdata, block_index, pref_group) == 0) {
-        uint32_t blocks_per_inode = TO_EXT_BLOCKS_CNT(dentry->fsdata.sb, dentry->inode->blocks);
-        if (_ext2_set_block_of_inode(dentry, blocks_per_inode, *block_index) == 0) {
-            dentry->inode->blocks += BLOCK_LEN(dentry->fsdata.sb) / 512;
-            dentry_set_flag(dentry, DENTRY_DIRTY);
-            return 0;
+    uint32_t blocks_per_inode = TO_EXT_BLOCKS_CNT(dentry->fsdata.sb, dentry->inode->blocks);
+    ext2_prealloc_t* prealloc = _ext2_prealloc_of(dentry);
+
+    // The goal is the block after the last one of the file, or the start of the inode's group.
+    uint32_t goal;
+    if (blocks_per_inode) {
+        goal = _ext2_get_block_of_inode(dentry, blocks_per_inode - 1) + 1;
+    } else {
+        uint32_t inode_group = (dentry->inode_indx - 1) / dentry->fsdata.sb->inodes_per_group;
+        goal = inode_group * dentry->fsdata.sb->blocks_per_group + dentry->fsdata.sb->first_data_block;
+    }
+
+    if (prealloc->ino == dentry->inode_indx && prealloc->count && prealloc->start == goal) {
+        *block_index = prealloc->start;
+        prealloc->start++;
+        prealloc->count--;
+    } else {
+        if (prealloc->count) {
+            _ext2_discard_prealloc(dentry->dev, dentry->fsdata, prealloc);
+        }
+        if (_ext2_allocate_block_index(dentry->dev, dentry->fsdata, block_index, goal) < 0) {
+            return -ENOSPC;
+        }
+        // Only growing files get a window, so small files don't hold extra blocks.
+        if (blocks_per_inode) {
+            _ext2_reserve_prealloc(dentry, prealloc, *block_index);
         }
     }
-    return -ENOSPC;
+
+    if (_ext2_set_block_of_inode(dentry, blocks_per_inode, *block_index) < 0) {
+        _ext2_free_block_index(dentry->dev, dentry->fsdata, *block_index);
+        return -ENOSPC;
+    }
+    dentry->inode->blocks += BLOCK_LEN(dentry->fsdata.sb) / 512;
+    dentry_set_flag(dentry, DENTRY_DIRTY);
+    return 0;
 }
 
 /**
@@ -382,18 +551,19 @@ int ext2_write_inode(dentry_t* dentry)
 
 static int _ext2_find_free_inode_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* inode_index, uint32_t group_index)
 {
-    uint8_t inode_bitmap[MAX_BLOCK_LEN];
-    _ext2_read_from_dev(dev, inode_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].inode_bitmap), BLOCK_LEN(fsdata.sb));
-
-    for (uint32_t off = 0; off < 8 * BLOCK_LEN(fsdata.sb); off++) {
-        if (!_ext2_bitmap_get(inode_bitmap, off)) {
-            *inode_index = SUPERBLOCK->inodes_per_group * group_index + off + 1;
-            _ext2_bitmap_set_bit(inode_bitmap, off);
-            _ext2_write_to_dev(dev, inode_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].inode_bitmap), BLOCK_LEN(fsdata.sb));
-            return 0;
-        }
+    uint8_t* inode_bitmap = _ext2_group_inode_bitmap(dev, group_index);
+    int off = _ext2_bitmap_find_free(inode_bitmap, fsdata.sb->inodes_per_group, 0);
+    if (off < 0) {
+        return -ENOSPC;
     }
-    return -ENOSPC;
+
+    _ext2_bitmap_set_bit(inode_bitmap, off);
+    fsdata.gt->table[group_index].free_inodes_count--;
+    fsdata.sb->free_inodes_count--;
+    ALLOC_INFO.dirty_groups[group_index] |= EXT2_GROUP_INODE_BITMAP_DIRTY;
+    ALLOC_INFO.dirty_descs = true;
+    *inode_index = fsdata.sb->inodes_per_group * group_index + off + 1;
+    return 0;
 }
 
 static int _ext2_allocate_inode_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t* inode_index, uint32_t pref_group)
@@ -413,22 +583,29 @@ static int _ext2_allocate_inode_index(vfs_device_t* dev, fsdata_t fsdata, uint32
 static int _ext2_free_inode_index(vfs_device_t* dev, fsdata_t fsdata, uint32_t inode_index)
 {
     inode_index--;
-    uint32_t block_len = BLOCK_LEN(fsdata.sb);
     uint32_t inodes_per_group = fsdata.sb->inodes_per_group;
     uint32_t group_index = inode_index / inodes_per_group;
     uint32_t off = inode_index % inodes_per_group;
 
-    uint8_t inode_bitmap[MAX_BLOCK_LEN];
-    _ext2_read_from_dev(dev, inode_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].inode_bitmap), block_len);
+    uint8_t* inode_bitmap = _ext2_group_inode_bitmap(dev, group_index);
+    if (!_ext2_bitmap_get(inode_bitmap, off)) {
+        return 0;
+    }
 
     _ext2_bitmap_unset_bit(inode_bitmap, off);
-    _ext2_write_to_dev(dev, inode_bitmap, _ext2_get_block_offset(fsdata.sb, fsdata.gt->table[group_index].inode_bitmap), block_len);
+    fsdata.gt->table[group_index].free_inodes_count++;
+    fsdata.sb->free_inodes_count++;
+    ALLOC_INFO.dirty_groups[group_index] |= EXT2_GROUP_INODE_BITMAP_DIRTY;
+    ALLOC_INFO.dirty_descs = true;
     return 0;
 }
 
 int ext2_free_inode(dentry_t* dentry)
 {
     ASSERT(dentry->d_count == 0 && dentry->inode->links_count == 0);
+    lock_acquire(&VFS_DEVICE_LOCK_OWNED_BY(dentry));
+    _ext2_discard_prealloc_of_inode(dentry);
+    _ext2_dir_index_drop(dentry->dev, dentry->inode_indx);
     uint32_t block_per_dir = TO_EXT_BLOCKS_CNT(dentry->fsdata.sb, dentry->inode->blocks);
 
     /* freeing all data blocks */
@@ -438,6 +615,7 @@ int ext2_free_inode(dentry_t* dentry)
     }
 
     _ext2_free_inode_index(dentry->dev, dentry->fsdata, dentry->inode_indx);
+    lock_release(&VFS_DEVICE_LOCK_OWNED_BY(dentry));
     return 0;
 }
 
@@ -722,6 +900,176 @@ static int _ext2_rm_from_dir_block(vfs_device_t* dev, fsdata_t fsdata, uint32_t
     }
 }
 
+/**
+ * DIR INDEX
+ */
+
+static uint32_t _ext2_name_hash(const char* name, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void _ext2_dir_index_free(ext2_dir_index_t* index)
+{
+    if (index->hashes) {
+        kfree(index->hashes);
+        kfree(index->blocks);
+    }
+    memset((uint8_t*)index, 0, sizeof(ext2_dir_index_t));
+}
+
+static ext2_dir_index_t* _ext2_dir_index_find(dentry_t* dir)
+{
+    ext2_dir_index_t* indexes = _ext2_dir_indexes[dir->dev_indx];
+    for (int i = 0; i < EXT2_DIR_INDEX_SLOTS; i++) {
+        if (indexes[i].ino == dir->inode_indx) {
+            indexes[i].last_used = ++_ext2_dir_index_clock;
+            return &indexes[i];
+        }
+    }
+    return NULL;
+}
+
+static void _ext2_dir_index_drop(vfs_device_t* dev, ino_t ino)
+{
+    ext2_dir_index_t* indexes = _ext2_dir_indexes[dev->dev->id];
+    for (int i = 0; i < EXT2_DIR_INDEX_SLOTS; i++) {
+        if (indexes[i].ino && (!ino || indexes[i].ino == ino)) {
+            _ext2_dir_index_free(&indexes[i]);
+        }
+    }
+}
+
+static void _ext2_dir_index_insert(ext2_dir_index_t* index, uint32_t hash, uint32_t block)
+{
+    if ((index->count + 1) * 2 > index->capacity) {
+        uint32_t old_capacity = index->capacity;
+        uint32_t* old_hashes = index->hashes;
+        uint32_t* old_blocks = index->blocks;
+
+        index->capacity = old_capacity ? old_capacity * 2 : EXT2_DIR_INDEX_MIN_CAPACITY;
+        index->hashes = (uint32_t*)kmalloc(index->capacity * sizeof(uint32_t));
+        index->blocks = (uint32_t*)kmalloc(index->capacity * sizeof(uint32_t));
+        memset((uint8_t*)index->blocks, 0xff, index->capacity * sizeof(uint32_t));
+        index->count = 0;
+
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old_blocks[i] != EXT2_DIR_INDEX_EMPTY) {
+                _ext2_dir_index_insert(index, old_hashes[i], old_blocks[i]);
+            }
+        }
+        if (old_hashes) {
+            kfree(old_hashes);
+            kfree(old_blocks);
+        }
+    }
+
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash & mask;
+    while (index->blocks[i] != EXT2_DIR_INDEX_EMPTY) {
+        if (index->hashes[i] == hash && index->blocks[i] == block) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    index->hashes[i] = hash;
+    index->blocks[i] = block;
+    index->count++;
+}
+
+static void _ext2_dir_index_build(dentry_t* dir, ext2_dir_index_t* index)
+{
+    const uint32_t block_len = BLOCK_LEN(dir->fsdata.sb);
+    uint32_t blocks_per_dir = TO_EXT_BLOCKS_CNT(dir->fsdata.sb, dir->inode->blocks);
+    uint8_t tmp_buf[MAX_BLOCK_LEN];
+
+    for (uint32_t block_index = 0; block_index < blocks_per_dir; block_index++) {
+        uint32_t data_block_index = _ext2_get_block_of_inode(dir, block_index);
+        if (!data_block_index) {
+            continue;
+        }
+
+        _ext2_read_from_dev(dir->dev, tmp_buf, _ext2_get_block_offset(dir->fsdata.sb, data_block_index), block_len);
+        for (uint32_t offset = 0; offset < block_len;) {
+            dir_entry_t* entry = (dir_entry_t*)(tmp_buf + offset);
+            if (!entry->rec_len) {
+                break;
+            }
+            if (entry->inode) {
+                _ext2_dir_index_insert(index, _ext2_name_hash((char*)entry + 8, entry->name_len), block_index);
+            }
+            offset += entry->rec_len;
+        }
+    }
+}
+
+/**
+ * Returns the index of the directory, building it on the first lookup.
+ * Small directories aren't indexed, since scanning them is cheap.
+ */
+static ext2_dir_index_t* _ext2_dir_index_get(dentry_t* dir)
+{
+    ext2_dir_index_t* index = _ext2_dir_index_find(dir);
+    if (index) {
+        return index;
+    }
+
+    if (TO_EXT_BLOCKS_CNT(dir->fsdata.sb, dir->inode->blocks) < EXT2_DIR_INDEX_MIN_BLOCKS) {
+        return NULL;
+    }
+
+    ext2_dir_index_t* indexes = _ext2_dir_indexes[dir->dev_indx];
+    index = &indexes[0];
+    for (int i = 1; i < EXT2_DIR_INDEX_SLOTS && index->ino; i++) {
+        if (!indexes[i].ino || indexes[i].last_used < index->last_used) {
+            index = &indexes[i];
+        }
+    }
+
+    _ext2_dir_index_free(index);
+    index->ino = dir->inode_indx;
+    index->last_used = ++_ext2_dir_index_clock;
+    _ext2_dir_index_build(dir, index);
+    return index;
+}
+
+/**
+ * Entries are never removed from the index: a stale one only costs a scan
+ * of a block, while every added name is inserted, so a miss is reliable.
+ */
+static int _ext2_dir_index_lookup(dentry_t* dir, ext2_dir_index_t* index, const char* name, uint32_t len, uint32_t* found_inode_index)
+{
+    if (!index->capacity) {
+        return -ENOENT;
+    }
+
+    uint32_t hash = _ext2_name_hash(name, len);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask; index->blocks[i] != EXT2_DIR_INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->hashes[i] != hash) {
+            continue;
+        }
+
+        uint32_t data_block_index = _ext2_get_block_of_inode(dir, index->blocks[i]);
+        if (_ext2_lookup_block(dir->dev, dir->fsdata, data_block_index, name, len, found_inode_index) == 0) {
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+static void _ext2_dir_index_add(dentry_t* dir, const char* name, uint32_t len, uint32_t block_index)
+{
+    ext2_dir_index_t* index = _ext2_dir_index_find(dir);
+    if (index) {
+        _ext2_dir_index_insert(index, _ext2_name_hash(name, len), block_index);
+    }
+}
+
 static int _ext2_add_child(dentry_t* dir, dentry_t* child_dentry, const char* name, int len)
 {
     uint32_t block_index;
@@ -730,6 +1078,7 @@ static int _ext2_add_child(dentry_t* dir, dentry_t* child_dentry, const char* na
     for (int i = 0; i < blocks_per_dir; i++) {
         if ((block_index = _ext2_get_block_of_inode(dir, i))) {
             if (_ext2_add_to_dir_block(dir->dev, dir->fsdata, block_index, child_dentry, name, len) == 0) {
+                _ext2_dir_index_add(dir, name, len, i);
                 goto updated_inode;
             }
         }
@@ -737,8 +1086,9 @@ static int _ext2_add_child(dentry_t* dir, dentry_t* child_dentry, const char* na
 
     // FIXME: group
     uint32_t new_block_index;
-    if (_ext2_allocate_block_for_inode(dir, 0, &new_block_index) == 0) {
+    if (_ext2_allocate_block_for_inode(dir, &new_block_index) == 0) {
         if (_ext2_add_first_entry_to_dir_block(dir->dev, dir->fsdata, new_block_index, child_dentry, name, len) == 0) {
+            _ext2_dir_index_add(dir, name, len, blocks_per_dir);
             goto updated_inode;
         }
     }
@@ -833,13 +1183,21 @@ int ext2_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
     uint32_t read_offset = start % block_len;
     uint32_t already_read = 0;
 
-    for (uint32_t virt_block_index = start_block_index; virt_block_index <= end_block_index; virt_block_index++) {
+    for (uint32_t virt_block_index = start_block_index; virt_block_index <= end_block_index;) {
         uint32_t data_block_index = _ext2_get_block_of_inode(dentry, virt_block_index);
-        uint32_t read_from_block = min(have_to_read, block_len - read_offset);
-        _ext2_read_from_dev(dentry->dev, buf + already_read, _ext2_get_block_offset(dentry->fsdata.sb, data_block_index) + read_offset, read_from_block);
-        have_to_read -= read_from_block;
-        already_read += read_from_block;
+
+        // Blocks which are contiguous on disk are read at once.
+        uint32_t run = 1;
+        while (virt_block_index + run <= end_block_index && _ext2_get_block_of_inode(dentry, virt_block_index + run) == data_block_index + run) {
+            run++;
+        }
+
+        uint32_t read_from_run = min(have_to_read, run * block_len - read_offset);
+        _ext2_read_from_dev(dentry->dev, buf + already_read, _ext2_get_block_offset(dentry->fsdata.sb, data_block_index) + read_offset, read_from_run);
+        have_to_read -= read_from_run;
+        already_read += read_from_run;
         read_offset = 0;
+        virt_block_index += run;
     }
 
     lock_release(&VFS_DEVICE_LOCK_OWNED_BY(dentry));
@@ -861,7 +1219,9 @@ int ext2_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
         uint32_t write_to_block = min(to_write, block_len - write_offset);
 
         if (blocks_allocated <= virt_block_index) {
-            _ext2_allocate_block_for_inode(dentry, 0, &data_block_index);
+            if (_ext2_allocate_block_for_inode(dentry, &data_block_index) < 0) {
+                break;
+            }
         } else {
             data_block_index = _ext2_get_block_of_inode(dentry, virt_block_index);
         }
@@ -872,8 +1232,8 @@ int ext2_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
         write_offset = 0;
     }
 
-    if (dentry->inode->size < start + len) {
-        dentry->inode->size = start + len;
+    if (dentry->inode->size < start + already_written) {
+        dentry->inode->size = start + already_written;
     }
     dentry->inode->mtime = (uint32_t)timeman_now();
     dentry_set_flag(dentry, DENTRY_DIRTY);
@@ -891,15 +1251,17 @@ int ext2_truncate(dentry_t* dentry, uint32_t len)
     }
 
     const uint32_t block_len = BLOCK_LEN(dentry->fsdata.sb);
-    const uint32_t last_written_byte = len - 1;
-    uint32_t last_written_block_index = last_written_byte / block_len;
-    uint32_t start_block_index = last_written_block_index + 1;
+    uint32_t start_block_index = (len + block_len - 1) / block_len;
     uint32_t blocks_allocated = TO_EXT_BLOCKS_CNT(dentry->fsdata.sb, dentry->inode->blocks);
 
+    _ext2_discard_prealloc_of_inode(dentry);
     for (uint32_t block_index, virt_block_index = start_block_index; virt_block_index < blocks_allocated; virt_block_index++) {
         block_index = _ext2_get_block_of_inode(dentry, virt_block_index);
         _ext2_free_block_index(dentry->dev, dentry->fsdata, block_index);
     }
+    if (start_block_index < blocks_allocated) {
+        dentry->inode->blocks = start_block_index * (block_len / 512);
+    }
 
     dentry->inode->size = len;
     dentry->inode->mtime = (uint32_t)timeman_now();
@@ -911,6 +1273,18 @@ int ext2_truncate(dentry_t* dentry, uint32_t len)
 int ext2_lookup(dentry_t* dir, const char* name, uint32_t len, dentry_t** result)
 {
     lock_acquire(&VFS_DEVICE_LOCK_OWNED_BY(dir));
+    ext2_dir_index_t* index = _ext2_dir_index_get(dir);
+    if (index) {
+        uint32_t res_inode_indx = 0;
+        if (_ext2_dir_index_lookup(dir, index, name, len, &res_inode_indx) == 0) {
+            *result = dentry_get(dir->dev_indx, res_inode_indx);
+            lock_release(&VFS_DEVICE_LOCK_OWNED_BY(dir));
+            return 0;
+        }
+        lock_release(&VFS_DEVICE_LOCK_OWNED_BY(dir));
+        return -ENOENT;
+    }
+
     uint32_t block_per_dir = TO_EXT_BLOCKS_CNT(dir->fsdata.sb, dir->inode->blocks);
     for (int block_index = 0; block_index < block_per_dir; block_index++) {
         uint32_t data_block_index = _ext2_get_block_of_inode(dir, block_index);
@@ -1110,6 +1484,7 @@ int ext2_prepare_fs(vfs_device_t* dev)
 
     _ext2_group_table_info[dev->dev->id].count = groups_cnt;
     _ext2_group_table_info[dev->dev->id].table = group_table;
+    _ext2_load_bitmaps(dev);
     lock_release(&VFS_DEVICE_LOCK);
     return 0;
 }
@@ -1122,6 +1497,12 @@ int ext2_save_state(vfs_device_t* dev)
         return -1;
     }
 
+    _ext2_sync_lockless(dev);
+    _ext2_dir_index_drop(dev, 0);
+    kfree(ALLOC_INFO.block_bitmaps);
+    kfree(ALLOC_INFO.inode_bitmaps);
+    kfree(ALLOC_INFO.dirty_groups);
+
     superblock_t* superblock = _ext2_superblocks[dev->dev->id];
 
     uint32_t group_table_len = _ext2_group_table_info[dev->dev->id].count * GROUP_LEN;
@@ -1131,6 +1512,22 @@ int ext2_save_state(vfs_device_t* dev)
 
     _ext2_write_to_dev(dev, (uint8_t*)superblock, SUPERBLOCK_START, SUPERBLOCK_LEN);
     kfree(superblock);
+    _ext2_superblocks[dev->dev->id] = NULL;
+
+    bcache_invalidate_device(dev->dev);
+    lock_release(&VFS_DEVICE_LOCK);
+    return 0;
+}
+
+int ext2_sync_device(vfs_device_t* dev)
+{
+    lock_acquire(&VFS_DEVICE_LOCK);
+    if (!_ext2_superblocks[dev->dev->id]) {
+        lock_release(&VFS_DEVICE_LOCK);
+        return -ENODEV;
+    }
+
+    _ext2_sync_lockless(dev);
     lock_release(&VFS_DEVICE_LOCK);
     return 0;
 }
@@ -1163,6 +1560,7 @@ driver_desc_t _ext2_driver_info()
     fs_desc.functions[DRIVER_FILE_SYSTEM_MKDIR] = ext2_mkdir;
     fs_desc.functions[DRIVER_FILE_SYSTEM_RMDIR] = ext2_rmdir;
     fs_desc.functions[DRIVER_FILE_SYSTEM_EJECT_DEVICE] = ext2_save_state;
+    fs_desc.functions[DRIVER_FILE_SYSTEM_SYNC_DEVICE] = ext2_sync_device;
 
     fs_desc.functions[DRIVER_FILE_SYSTEM_READ_INODE] = ext2_read_inode;
     fs_desc.functions[DRIVER_FILE_SYSTEM_WRITE_INODE] = ext2_write_inode;
@@ -0,0 +1,812 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <fs/pcache.h>
+#include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
+#include <libkern/lock.h>
+#include <libkern/log.h>
+#include <mem/kmalloc.h>
+#include <mem/kmemzone.h>
+#include <mem/vm_alloc.h>
+#include <mem/vmm.h>
+
+// #define PCACHE_DEBUG
+
+#define PCACHE_FILE_TYPE_MASK (0xF000)
+#define PCACHE_SYNC_BATCH (16)
+
+/**
+ * The page cache keeps file data in pages which are indexed by
+ * (device, inode, page index). It is shared by vfs_read(), faults of file
+ * mappings and the ELF loader, so pages of a file which is used by several
+ * processes are read once and could be mapped read-only into all of them.
+ *
+ * Every cache slot has a fixed kernel address inside of _pcache_zone, so the
+ * cache never needs vmm locks to access its pages and could be used from the
+ * page fault handler. A page which is referenced (mapped into a process, or
+ * being copied by the kernel) is never evicted. If such a page is
+ * invalidated, it is detached from the cache and freed with the last
+ * reference.
+ *
+ * Pages are read from the filesystem with the cache lock released, since a
+ * read could be a long disk transfer. Such a page is in the cache, but
+ * locked and pinned by the reader. Other lookups wait for it to be unlocked.
+ *
+ * Shared file mappings write straight into cache pages. A page becomes dirty
+ * when a shared mapping gets write access to it and stays dirty while it is
+ * mapped writable. Dirty pages are never evicted, they are written back to
+ * the filesystem by msync(), munmap(), fsync() and kdentryflusherd.
+ */
+
+static lock_t _pcache_lock;
+static kmemzone_t _pcache_zone;
+static pcache_page_t _pcache_pages[PCACHE_MAX_PAGES];
+static pcache_page_t* _pcache_hash[PCACHE_HASH_SIZE];
+static pcache_page_t* _pcache_frame_hash[PCACHE_HASH_SIZE];
+static pcache_page_t* _pcache_free_list = NULL;
+static pcache_page_t* _pcache_lru_head = NULL;
+static pcache_page_t* _pcache_lru_tail = NULL;
+static pcache_stat_t _pcache_stat;
+static uint8_t* _pcache_readahead_buf;
+static bool _pcache_readahead_busy = false;
+
+/**
+ * HELPERS
+ */
+
+static inline uint8_t* _pcache_page_data(pcache_page_t* page)
+{
+    return (uint8_t*)(_pcache_zone.start + (page - _pcache_pages) * VMM_PAGE_SIZE);
+}
+
+static inline uint32_t _pcache_hash_index(dev_t dev, ino_t ino, uint32_t index)
+{
+    return (dev * 31 + ino * 17 + index) & (PCACHE_HASH_SIZE - 1);
+}
+
+static inline uint32_t _pcache_frame_hash_index(uintptr_t paddr)
+{
+    return (paddr / VMM_PAGE_SIZE) & (PCACHE_HASH_SIZE - 1);
+}
+
+static void _pcache_hash_add(pcache_page_t* page)
+{
+    uint32_t idx = _pcache_hash_index(page->dev, page->ino, page->index);
+    page->hash_next = _pcache_hash[idx];
+    _pcache_hash[idx] = page;
+}
+
+static void _pcache_hash_remove(pcache_page_t* page)
+{
+    pcache_page_t** it = &_pcache_hash[_pcache_hash_index(page->dev, page->ino, page->index)];
+    while (*it) {
+        if (*it == page) {
+            *it = page->hash_next;
+            page->hash_next = NULL;
+            return;
+        }
+        it = &(*it)->hash_next;
+    }
+}
+
+static pcache_page_t* _pcache_hash_find(dev_t dev, ino_t ino, uint32_t index)
+{
+    pcache_page_t* it = _pcache_hash[_pcache_hash_index(dev, ino, index)];
+    while (it) {
+        if (it->dev == dev && it->ino == ino && it->index == index) {
+            return it;
+        }
+        it = it->hash_next;
+    }
+    return NULL;
+}
+
+static void _pcache_frame_hash_add(pcache_page_t* page)
+{
+    uint32_t idx = _pcache_frame_hash_index(page->paddr);
+    page->frame_next = _pcache_frame_hash[idx];
+    _pcache_frame_hash[idx] = page;
+}
+
+static void _pcache_frame_hash_remove(pcache_page_t* page)
+{
+    pcache_page_t** it = &_pcache_frame_hash[_pcache_frame_hash_index(page->paddr)];
+    while (*it) {
+        if (*it == page) {
+            *it = page->frame_next;
+            page->frame_next = NULL;
+            return;
+        }
+        it = &(*it)->frame_next;
+    }
+}
+
+static pcache_page_t* _pcache_frame_hash_find(uintptr_t paddr)
+{
+    pcache_page_t* it = _pcache_frame_hash[_pcache_frame_hash_index(paddr)];
+    while (it) {
+        if (it->paddr == paddr) {
+            return it;
+        }
+        it = it->frame_next;
+    }
+    return NULL;
+}
+
+static void _pcache_lru_remove(pcache_page_t* page)
+{
+    if (page->lru_prev) {
+        page->lru_prev->lru_next = page->lru_next;
+    } else {
+        _pcache_lru_head = page->lru_next;
+    }
+
+    if (page->lru_next) {
+        page->lru_next->lru_prev = page->lru_prev;
+    } else {
+        _pcache_lru_tail = page->lru_prev;
+    }
+    page->lru_prev = page->lru_next = NULL;
+}
+
+static void _pcache_lru_push_front(pcache_page_t* page)
+{
+    page->lru_prev = NULL;
+    page->lru_next = _pcache_lru_head;
+    if (_pcache_lru_head) {
+        _pcache_lru_head->lru_prev = page;
+    }
+    _pcache_lru_head = page;
+    if (!_pcache_lru_tail) {
+        _pcache_lru_tail = page;
+    }
+}
+
+/**
+ * PAGE MANAGMENT
+ */
+
+static void _pcache_release_page_lockless(pcache_page_t* page)
+{
+    _pcache_frame_hash_remove(page);
+    vmm_unmap_page_lockless((uintptr_t)_pcache_page_data(page));
+    vm_free_page_paddr(page->paddr);
+
+    page->paddr = 0;
+    page->flags = 0;
+    page->refs = 0;
+    page->wmaps = 0;
+    page->hash_next = _pcache_free_list;
+    _pcache_free_list = page;
+}
+
+// Removes the page from the cache. Referenced pages live until the last put.
+static void _pcache_drop_page_lockless(pcache_page_t* page)
+{
+    _pcache_hash_remove(page);
+    _pcache_lru_remove(page);
+    _pcache_stat.cached_pages--;
+    page->flags &= ~PCACHE_PAGE_DIRTY;
+
+    if (page->refs) {
+        page->flags |= PCACHE_PAGE_DETACHED;
+        return;
+    }
+    _pcache_release_page_lockless(page);
+}
+
+static pcache_page_t* _pcache_alloc_page_lockless()
+{
+    if (_pcache_free_list) {
+        pcache_page_t* page = _pcache_free_list;
+        _pcache_free_list = page->hash_next;
+        page->hash_next = NULL;
+
+        page->paddr = vm_alloc_page_paddr();
+        if (!page->paddr) {
+            page->hash_next = _pcache_free_list;
+            _pcache_free_list = page;
+            return NULL;
+        }
+
+        // The slot is owned by the cache, so no need to take the vmm kernel lock.
+        vmm_map_page_lockless((uintptr_t)_pcache_page_data(page), page->paddr, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+        _pcache_frame_hash_add(page);
+        return page;
+    }
+
+    // Reusing the least recently used clean page with no references.
+    for (pcache_page_t* victim = _pcache_lru_tail; victim; victim = victim->lru_prev) {
+        if (!victim->refs && !TEST_FLAG(victim->flags, PCACHE_PAGE_DIRTY)) {
+            _pcache_hash_remove(victim);
+            _pcache_lru_remove(victim);
+            _pcache_stat.cached_pages--;
+            _pcache_stat.evictions++;
+            victim->flags = 0;
+            return victim;
+        }
+    }
+    return NULL;
+}
+
+static void _pcache_unref_page_lockless(pcache_page_t* page)
+{
+    ASSERT(page->refs);
+    page->refs--;
+    if (!page->refs && TEST_FLAG(page->flags, PCACHE_PAGE_DETACHED)) {
+        _pcache_release_page_lockless(page);
+    }
+}
+
+/**
+ * Looks up the page, waits while it is being read by another thread.
+ */
+static pcache_page_t* _pcache_find_lockless(dev_t dev, ino_t ino, uint32_t index)
+{
+    for (;;) {
+        pcache_page_t* page = _pcache_hash_find(dev, ino, index);
+        if (!page || !TEST_FLAG(page->flags, PCACHE_PAGE_LOCKED)) {
+            return page;
+        }
+
+        // Letting the reader take the lock to finish the page.
+        lock_release(&_pcache_lock);
+        lock_acquire(&_pcache_lock);
+    }
+}
+
+/**
+ * Adds a page to the cache before its data is read. The page is locked and
+ * pinned until _pcache_unlock_page_lockless() is called.
+ */
+static void _pcache_add_locked_page_lockless(pcache_page_t* page, dentry_t* dentry, uint32_t index)
+{
+    page->dev = dentry->dev_indx;
+    page->ino = dentry->inode_indx;
+    page->index = index;
+    page->flags = PCACHE_PAGE_VALID | PCACHE_PAGE_LOCKED;
+    page->refs = 1;
+    page->wmaps = 0;
+    _pcache_hash_add(page);
+    _pcache_lru_push_front(page);
+    _pcache_stat.cached_pages++;
+}
+
+/**
+ * Unlocks a page once its data is read. Returns false if the read failed
+ * or the page was invalidated meanwhile, the page is dropped then.
+ */
+static bool _pcache_unlock_page_lockless(pcache_page_t* page, int err)
+{
+    page->flags &= ~PCACHE_PAGE_LOCKED;
+    if (err < 0 && !TEST_FLAG(page->flags, PCACHE_PAGE_DETACHED)) {
+        _pcache_drop_page_lockless(page);
+    }
+
+    bool cached = !TEST_FLAG(page->flags, PCACHE_PAGE_DETACHED);
+    _pcache_unref_page_lockless(page);
+    return cached;
+}
+
+/**
+ * Returns the page with the lock held. A page which is not cached is read
+ * with the lock released.
+ */
+static pcache_page_t* _pcache_get_page_lockless(dentry_t* dentry, uint32_t index)
+{
+    for (;;) {
+        pcache_page_t* page = _pcache_find_lockless(dentry->dev_indx, dentry->inode_indx, index);
+        if (page) {
+            _pcache_stat.hits++;
+            _pcache_lru_remove(page);
+            _pcache_lru_push_front(page);
+            return page;
+        }
+
+        _pcache_stat.misses++;
+        page = _pcache_alloc_page_lockless();
+        if (!page) {
+            return NULL;
+        }
+        _pcache_add_locked_page_lockless(page, dentry, index);
+        lock_release(&_pcache_lock);
+
+        uint8_t* data = _pcache_page_data(page);
+        memset(data, 0, VMM_PAGE_SIZE);
+        int err = dentry->ops->file.read(dentry, data, index * VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+
+        lock_acquire(&_pcache_lock);
+        if (_pcache_unlock_page_lockless(page, err)) {
+#ifdef PCACHE_DEBUG
+            log("[pcache] Load page %d of inode %d (dev %d)", index, dentry->inode_indx, dentry->dev_indx);
+#endif
+            return page;
+        }
+        if (err < 0) {
+            return NULL;
+        }
+        // The page was invalidated while being read, so its data could be stale.
+    }
+}
+
+/**
+ * Invalidates pages of the inode which starts at or after the given page
+ * index. Pass dev only to drop all pages of a device.
+ */
+static void _pcache_invalidate_lockless(dev_t dev, ino_t ino, bool any_inode, uint32_t from_index)
+{
+    for (pcache_page_t* it = _pcache_lru_head; it;) {
+        pcache_page_t* next = it->lru_next;
+        if (it->dev == dev && (any_inode || (it->ino == ino && it->index >= from_index))) {
+            _pcache_drop_page_lockless(it);
+        }
+        it = next;
+    }
+}
+
+/**
+ * WRITEBACK
+ */
+
+static inline bool _pcache_page_needs_sync(pcache_page_t* page, dentry_t* dentry, dev_t dev, bool any_device)
+{
+    if (!TEST_FLAG(page->flags, PCACHE_PAGE_DIRTY) || TEST_FLAG(page->flags, PCACHE_PAGE_DETACHED)) {
+        return false;
+    }
+    if (dentry) {
+        return page->dev == dentry->dev_indx && page->ino == dentry->inode_indx;
+    }
+    return any_device || page->dev == dev;
+}
+
+/**
+ * Writes a pinned page to the filesystem. Data beyond the end of the file
+ * is not written, so writeback never changes the size of a file.
+ */
+static int _pcache_write_page(pcache_page_t* page, dentry_t* file)
+{
+    dentry_t* dentry = file ? file : dentry_get(page->dev, page->ino);
+    if (!dentry) {
+        return -ENOENT;
+    }
+
+    int res = 0;
+    size_t start = page->index * VMM_PAGE_SIZE;
+    if (dentry->ops->file.write && start < dentry->inode->size) {
+        size_t len = min(VMM_PAGE_SIZE, dentry->inode->size - start);
+        res = dentry->ops->file.write(dentry, _pcache_page_data(page), start, len);
+    }
+
+#ifdef PCACHE_DEBUG
+    log("[pcache] Write back page %d of inode %d (dev %d), res %d", page->index, page->ino, page->dev, res);
+#endif
+    if (!file) {
+        dentry_put(dentry);
+    }
+    return res < 0 ? res : 0;
+}
+
+/**
+ * Writes back dirty pages of the inode of the dentry, or of the device
+ * (all devices if any_device is set). Pages are collected in batches and
+ * written with the cache lock released, since the filesystem might sleep.
+ * The cache is walked by slots, which keep their place while pinned.
+ */
+static int _pcache_sync(dentry_t* dentry, dev_t dev, bool any_device)
+{
+    pcache_page_t* batch[PCACHE_SYNC_BATCH];
+    int errs[PCACHE_SYNC_BATCH];
+    int res = 0;
+
+    for (int slot = 0; slot < PCACHE_MAX_PAGES;) {
+        int count = 0;
+        lock_acquire(&_pcache_lock);
+        for (; slot < PCACHE_MAX_PAGES && count < PCACHE_SYNC_BATCH; slot++) {
+            pcache_page_t* page = &_pcache_pages[slot];
+            if (!_pcache_page_needs_sync(page, dentry, dev, any_device)) {
+                continue;
+            }
+
+            // A page which is still mapped writable could be modified at any
+            // moment, so it stays dirty.
+            if (!page->wmaps) {
+                page->flags &= ~PCACHE_PAGE_DIRTY;
+            }
+            page->refs++;
+            batch[count++] = page;
+        }
+        lock_release(&_pcache_lock);
+
+        for (int i = 0; i < count; i++) {
+            errs[i] = _pcache_write_page(batch[i], dentry);
+        }
+
+        lock_acquire(&_pcache_lock);
+        for (int i = 0; i < count; i++) {
+            if (errs[i] < 0) {
+                if (!TEST_FLAG(batch[i]->flags, PCACHE_PAGE_DETACHED)) {
+                    batch[i]->flags |= PCACHE_PAGE_DIRTY;
+                }
+                res = errs[i];
+            } else {
+                _pcache_stat.writebacks++;
+            }
+            _pcache_unref_page_lockless(batch[i]);
+        }
+        lock_release(&_pcache_lock);
+    }
+    return res;
+}
+
+/**
+ * API FUNCTIONS
+ */
+
+void pcache_init()
+{
+    lock_init(&_pcache_lock);
+    _pcache_zone = kmemzone_new(PCACHE_MAX_PAGES * VMM_PAGE_SIZE);
+    _pcache_readahead_buf = (uint8_t*)kmalloc(PCACHE_READAHEAD_MAX_PAGES * VMM_PAGE_SIZE);
+    memset(_pcache_pages, 0, sizeof(_pcache_pages));
+    memset(_pcache_hash, 0, sizeof(_pcache_hash));
+    memset(_pcache_frame_hash, 0, sizeof(_pcache_frame_hash));
+    memset(&_pcache_stat, 0, sizeof(_pcache_stat));
+
+    _pcache_free_list = NULL;
+    for (int i = PCACHE_MAX_PAGES - 1; i >= 0; i--) {
+        _pcache_pages[i].hash_next = _pcache_free_list;
+        _pcache_free_list = &_pcache_pages[i];
+    }
+}
+
+/**
+ * Only regular files of real filesystems are cached, data of virtual
+ * filesystems (procfs, devfs) is generated on each read.
+ */
+bool pcache_is_cacheable(dentry_t* dentry)
+{
+    if (!dentry->dev || !dentry->dev->dev || dentry->dev->dev->is_virtual) {
+        return false;
+    }
+    if (!dentry->inode || (dentry->inode->mode & PCACHE_FILE_TYPE_MASK) != S_IFREG) {
+        return false;
+    }
+    return dentry->ops->file.read;
+}
+
+int pcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return dentry->ops->file.read(dentry, buf, start, len);
+    }
+
+    if (start >= dentry->inode->size) {
+        return 0;
+    }
+    len = min(len, dentry->inode->size - start);
+
+    size_t done = 0;
+    lock_acquire(&_pcache_lock);
+    while (done < len) {
+        size_t offset = (start + done) % VMM_PAGE_SIZE;
+        size_t chunk = min(VMM_PAGE_SIZE - offset, len - done);
+        pcache_page_t* page = _pcache_get_page_lockless(dentry, (start + done) / VMM_PAGE_SIZE);
+        if (!page) {
+            // The cache is full of mapped pages, reading directly.
+            lock_release(&_pcache_lock);
+            int res = dentry->ops->file.read(dentry, buf + done, start + done, len - done);
+            if (res < 0) {
+                return done ? done : res;
+            }
+            return done + res;
+        }
+
+        // buf could be a user page which is not loaded yet, so the page
+        // is pinned and the lock is released while copying.
+        page->refs++;
+        lock_release(&_pcache_lock);
+        memcpy(buf + done, _pcache_page_data(page) + offset, chunk);
+        lock_acquire(&_pcache_lock);
+        _pcache_unref_page_lockless(page);
+        done += chunk;
+    }
+    lock_release(&_pcache_lock);
+    return done;
+}
+
+/**
+ * Loads pages [index, index + count) of the file which are not cached yet.
+ * Every run of missing pages is read with a single filesystem call, so the
+ * filesystem and the block cache could issue large device transfers.
+ */
+void pcache_readahead(dentry_t* dentry, uint32_t index, uint32_t count)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return;
+    }
+
+    pcache_page_t* run[PCACHE_READAHEAD_MAX_PAGES];
+    uint32_t file_pages = (dentry->inode->size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    uint32_t end = min(index + min(count, PCACHE_READAHEAD_MAX_PAGES), file_pages);
+
+    lock_acquire(&_pcache_lock);
+    // The buffer is shared, and read-ahead is only a hint, so it is skipped while another one runs.
+    if (_pcache_readahead_busy) {
+        lock_release(&_pcache_lock);
+        return;
+    }
+    _pcache_readahead_busy = true;
+
+    while (index < end) {
+        uint32_t n = 0;
+        while (index + n < end && !_pcache_hash_find(dentry->dev_indx, dentry->inode_indx, index + n)) {
+            pcache_page_t* page = _pcache_alloc_page_lockless();
+            if (!page) {
+                break;
+            }
+            _pcache_add_locked_page_lockless(page, dentry, index + n);
+            run[n++] = page;
+        }
+
+        if (!n) {
+            // The page is cached already or the cache is full of mapped pages.
+            if (!_pcache_hash_find(dentry->dev_indx, dentry->inode_indx, index)) {
+                break;
+            }
+            index++;
+            continue;
+        }
+
+        lock_release(&_pcache_lock);
+        memset(_pcache_readahead_buf, 0, n * VMM_PAGE_SIZE);
+        int err = dentry->ops->file.read(dentry, _pcache_readahead_buf, index * VMM_PAGE_SIZE, n * VMM_PAGE_SIZE);
+        if (err >= 0) {
+            for (uint32_t i = 0; i < n; i++) {
+                memcpy(_pcache_page_data(run[i]), _pcache_readahead_buf + i * VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+            }
+        }
+
+        lock_acquire(&_pcache_lock);
+        for (uint32_t i = 0; i < n; i++) {
+            if (_pcache_unlock_page_lockless(run[i], err)) {
+                _pcache_stat.readahead_pages++;
+            }
+        }
+
+        if (err < 0) {
+            break;
+        }
+#ifdef PCACHE_DEBUG
+        log("[pcache] Read ahead %d pages from %d of inode %d (dev %d)", n, index, dentry->inode_indx, dentry->dev_indx);
+#endif
+        index += n;
+    }
+
+    _pcache_readahead_busy = false;
+    lock_release(&_pcache_lock);
+}
+
+/**
+ * Is called after data is written to the filesystem to keep cached pages
+ * up to date. Pages which are not cached are not loaded.
+ */
+void pcache_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return;
+    }
+
+    size_t done = 0;
+    lock_acquire(&_pcache_lock);
+    while (done < len) {
+        size_t offset = (start + done) % VMM_PAGE_SIZE;
+        size_t chunk = min(VMM_PAGE_SIZE - offset, len - done);
+        pcache_page_t* page = _pcache_find_lockless(dentry->dev_indx, dentry->inode_indx, (start + done) / VMM_PAGE_SIZE);
+        if (page) {
+            page->refs++;
+            lock_release(&_pcache_lock);
+            memcpy(_pcache_page_data(page) + offset, buf + done, chunk);
+            lock_acquire(&_pcache_lock);
+            _pcache_unref_page_lockless(page);
+        }
+        done += chunk;
+    }
+    lock_release(&_pcache_lock);
+}
+
+void pcache_truncate(dentry_t* dentry, size_t size)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return;
+    }
+
+    lock_acquire(&_pcache_lock);
+    uint32_t index = size / VMM_PAGE_SIZE;
+    size_t offset = size % VMM_PAGE_SIZE;
+    if (offset) {
+        pcache_page_t* page = _pcache_find_lockless(dentry->dev_indx, dentry->inode_indx, index);
+        if (page) {
+            memset(_pcache_page_data(page) + offset, 0, VMM_PAGE_SIZE - offset);
+        }
+        index++;
+    }
+    _pcache_invalidate_lockless(dentry->dev_indx, dentry->inode_indx, false, index);
+    lock_release(&_pcache_lock);
+}
+
+void pcache_invalidate_inode(dev_t dev, ino_t ino)
+{
+    lock_acquire(&_pcache_lock);
+    _pcache_invalidate_lockless(dev, ino, false, 0);
+    lock_release(&_pcache_lock);
+}
+
+void pcache_invalidate_device(dev_t dev)
+{
+    lock_acquire(&_pcache_lock);
+    _pcache_invalidate_lockless(dev, 0, true, 0);
+    lock_release(&_pcache_lock);
+}
+
+/**
+ * Returns a physical page with file data to be mapped into a process. The
+ * page is referenced until pcache_put_frame() is called. Returns 0 if the
+ * file is not cacheable or the cache is full.
+ */
+uintptr_t pcache_get_frame(dentry_t* dentry, uint32_t index)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return 0;
+    }
+
+    lock_acquire(&_pcache_lock);
+    pcache_page_t* page = _pcache_get_page_lockless(dentry, index);
+    if (!page) {
+        lock_release(&_pcache_lock);
+        return 0;
+    }
+
+    page->refs++;
+    uintptr_t paddr = page->paddr;
+    lock_release(&_pcache_lock);
+    return paddr;
+}
+
+bool pcache_owns_frame(uintptr_t paddr)
+{
+    lock_acquire(&_pcache_lock);
+    bool res = _pcache_frame_hash_find(paddr);
+    lock_release(&_pcache_lock);
+    return res;
+}
+
+/**
+ * Adds a reference to a mapped frame, when a mapping is copied.
+ * Returns false if the frame is not owned by the cache.
+ */
+bool pcache_dup_frame(uintptr_t paddr)
+{
+    lock_acquire(&_pcache_lock);
+    pcache_page_t* page = _pcache_frame_hash_find(paddr);
+    if (page) {
+        page->refs++;
+    }
+    lock_release(&_pcache_lock);
+    return page;
+}
+
+/**
+ * Drops a reference to a mapped frame. Returns false if the frame is not
+ * owned by the cache, so the caller should free it itself.
+ */
+bool pcache_put_frame(uintptr_t paddr)
+{
+    lock_acquire(&_pcache_lock);
+    pcache_page_t* page = _pcache_frame_hash_find(paddr);
+    if (page) {
+        _pcache_unref_page_lockless(page);
+    }
+    lock_release(&_pcache_lock);
+    return page;
+}
+
+/**
+ * Is called when a shared mapping gets write access to the frame. The page
+ * is dirty until all writable mappings are gone and it is written back.
+ */
+bool pcache_frame_map_writable(uintptr_t paddr)
+{
+    lock_acquire(&_pcache_lock);
+    pcache_page_t* page = _pcache_frame_hash_find(paddr);
+    if (page) {
+        page->wmaps++;
+        page->flags |= PCACHE_PAGE_DIRTY;
+    }
+    lock_release(&_pcache_lock);
+    return page;
+}
+
+/**
+ * Is called when write access to the frame is revoked. The page could be
+ * modified through the mapping since the last writeback, so it is marked
+ * dirty again.
+ */
+bool pcache_frame_unmap_writable(uintptr_t paddr)
+{
+    lock_acquire(&_pcache_lock);
+    pcache_page_t* page = _pcache_frame_hash_find(paddr);
+    if (page) {
+        if (page->wmaps) {
+            page->wmaps--;
+        }
+        if (!TEST_FLAG(page->flags, PCACHE_PAGE_DETACHED)) {
+            page->flags |= PCACHE_PAGE_DIRTY;
+        }
+    }
+    lock_release(&_pcache_lock);
+    return page;
+}
+
+int pcache_sync_inode(dentry_t* dentry)
+{
+    if (!pcache_is_cacheable(dentry)) {
+        return 0;
+    }
+    return _pcache_sync(dentry, 0, false);
+}
+
+int pcache_sync_device(dev_t dev)
+{
+    return _pcache_sync(NULL, dev, false);
+}
+
+/**
+ * Is called from kernel threads which hold no locks, since it might sleep.
+ */
+int pcache_sync_all()
+{
+    return _pcache_sync(NULL, 0, true);
+}
+
+/**
+ * Frees up to max_pages least recently used pages which are not mapped.
+ */
+int pcache_reclaim(int max_pages)
+{
+    int freed = 0;
+    lock_acquire(&_pcache_lock);
+    for (pcache_page_t* it = _pcache_lru_tail; it && freed < max_pages;) {
+        pcache_page_t* prev = it->lru_prev;
+        if (!it->refs && !TEST_FLAG(it->flags, PCACHE_PAGE_DIRTY)) {
+            _pcache_drop_page_lockless(it);
+            _pcache_stat.evictions++;
+            freed++;
+        }
+        it = prev;
+    }
+    lock_release(&_pcache_lock);
+    return freed;
+}
+
+void pcache_get_stat(pcache_stat_t* stat)
+{
+    lock_acquire(&_pcache_lock);
+    *stat = _pcache_stat;
+    stat->mapped_pages = 0;
+    stat->dirty_pages = 0;
+    for (pcache_page_t* it = _pcache_lru_head; it; it = it->lru_next) {
+        if (it->refs) {
+            stat->mapped_pages++;
+        }
+        if (TEST_FLAG(it->flags, PCACHE_PAGE_DIRTY)) {
+            stat->dirty_pages++;
+        }
+    }
+    lock_release(&_pcache_lock);
+}
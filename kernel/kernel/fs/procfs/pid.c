@@ -28,6 +28,9 @@ int procfs_pid_lookup(dentry_t* dir, const char* name, size_t len, dentry_t** re
 static bool procfs_pid_memstat_can_read(dentry_t* dentry, size_t start);
 static int procfs_pid_memstat_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 
+static bool procfs_pid_stat_can_read(dentry_t* dentry, size_t start);
+static int procfs_pid_stat_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+
 static bool procfs_pid_exe_can_read(dentry_t* dentry, size_t start);
 static int procfs_pid_exe_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 
@@ -46,8 +49,8 @@ const file_ops_t procfs_pid_memstat_ops = {
 };
 
 const file_ops_t procfs_pid_stat_ops = {
-    .can_read = procfs_pid_memstat_can_read,
-    .read = procfs_pid_memstat_read,
+    .can_read = procfs_pid_stat_can_read,
+    .read = procfs_pid_stat_read,
 };
 
 const file_ops_t procfs_pid_exe_ops = {
@@ -165,6 +168,46 @@ static int procfs_pid_memstat_read(dentry_t* dentry, uint8_t* buf, size_t start,
     return 12;
 }
 
+static bool procfs_pid_stat_can_read(dentry_t* dentry, size_t start)
+{
+    return true;
+}
+
+/**
+ * Format: running_ticks sched_runs avg_latency_us max_latency_us
+ * Latency is the time a thread waited in a runqueue before it was picked.
+ */
+static int procfs_pid_stat_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    int pid = procfs_pid_get_pid_from_inode_index(dentry->inode_indx);
+    thread_t* th = thread_by_pid(pid);
+    if (!th) {
+        return -EFAULT;
+    }
+
+    uint32_t runs = th->stat_sched_runs;
+    uint32_t avg_latency_us = 0;
+    if (runs) {
+        avg_latency_us = udiv64(udiv64(th->stat_sched_latency_total_ns, runs, NULL), 1000, NULL);
+    }
+    uint32_t max_latency_us = udiv64(th->stat_sched_latency_max_ns, 1000, NULL);
+
+    char res[64];
+    snprintf(res, 64, "%u %u %u %u\n", (uint32_t)th->stat_total_running_ticks, runs, avg_latency_us, max_latency_us);
+    size_t size = strlen(res);
+
+    if (start == size) {
+        return 0;
+    }
+
+    if (len < size) {
+        return -EFAULT;
+    }
+
+    memcpy(buf, res, size);
+    return size;
+}
+
 static bool procfs_pid_exe_can_read(dentry_t* dentry, size_t start)
 {
     return true;
@@ -6,10 +6,15 @@
  * found in the LICENSE file.
  */
 
+#include <fs/bcache.h>
+#include <fs/pcache.h>
 #include <fs/procfs/procfs.h>
 #include <fs/vfs.h>
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
+#include <mem/kmalloc.h>
+#include <mem/kswapd.h>
+#include <mem/swapfile.h>
 #include <tasking/sched.h>
 #include <tasking/tasking.h>
 #include <time/time_manager.h>
@@ -41,6 +46,15 @@ static int procfs_root_stat_read(dentry_t* dentry, uint8_t* buf, size_t start, s
 static bool procfs_root_meminfo_can_read(dentry_t* dentry, size_t start);
 static int procfs_root_meminfo_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 
+static bool procfs_root_bcache_can_read(dentry_t* dentry, size_t start);
+static int procfs_root_bcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+
+static bool procfs_root_pcache_can_read(dentry_t* dentry, size_t start);
+static int procfs_root_pcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+
+static bool procfs_root_slabinfo_can_read(dentry_t* dentry, size_t start);
+static int procfs_root_slabinfo_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
+
 /**
  * DATA
  */
@@ -65,10 +79,28 @@ const file_ops_t procfs_root_stat_ops = {
     .read = procfs_root_stat_read,
 };
 
+const file_ops_t procfs_root_bcache_ops = {
+    .can_read = procfs_root_bcache_can_read,
+    .read = procfs_root_bcache_read,
+};
+
+const file_ops_t procfs_root_pcache_ops = {
+    .can_read = procfs_root_pcache_can_read,
+    .read = procfs_root_pcache_read,
+};
+
+const file_ops_t procfs_root_slabinfo_ops = {
+    .can_read = procfs_root_slabinfo_can_read,
+    .read = procfs_root_slabinfo_read,
+};
+
 static const procfs_files_t static_procfs_files[] = {
     { .name = "stat", .mode = 0444, .ops = &procfs_root_stat_ops, .inode_index = procfs_root_sfiles_get_inode_index },
     { .name = "uptime", .mode = 0444, .ops = &procfs_root_uptime_ops, .inode_index = procfs_root_sfiles_get_inode_index },
     { .name = "meminfo", .mode = 0444, .ops = &procfs_root_meminfo_ops, .inode_index = procfs_root_sfiles_get_inode_index },
+    { .name = "bcache", .mode = 0444, .ops = &procfs_root_bcache_ops, .inode_index = procfs_root_sfiles_get_inode_index },
+    { .name = "pcache", .mode = 0444, .ops = &procfs_root_pcache_ops, .inode_index = procfs_root_sfiles_get_inode_index },
+    { .name = "slabinfo", .mode = 0444, .ops = &procfs_root_slabinfo_ops, .inode_index = procfs_root_sfiles_get_inode_index },
     { .name = "self", .mode = S_IFDIR | 0444, .ops = &procfs_pid_ops, .inode_index = procfs_root_self_get_inode_index },
     { .name = "sys", .mode = S_IFDIR | 0444, .ops = &procfs_sys_ops, .inode_index = procfs_root_self_get_inode_index },
 };
@@ -237,13 +269,20 @@ static bool procfs_root_stat_can_read(dentry_t* dentry, size_t start)
 
 static int procfs_root_stat_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
 {
-    char res[128];
+    char res[256];
     int offset = 0;
     for (int i = 0; i < active_cpu_count(); i++) {
         time_t user = cpus[i].stat_user_ticks;
         time_t idle = cpus[i].idle_thread->stat_total_running_ticks;
         time_t system = cpus[i].stat_system_and_idle_ticks - idle;
-        snprintf(res + offset, 128 - offset, "cpu%d %u %u %u %u\n", i, user, 0, system, idle);
+        snprintf(res + offset, 256 - offset, "cpu%d %u %u %u %u\n", i, user, 0, system, idle);
+        offset = strlen(res);
+    }
+    // Parsers walk cpu lines until the first mismatch, so balancing stats go after all of them.
+    for (int i = 0; i < active_cpu_count(); i++) {
+        uint32_t migrations_in = cpus[i].sched.stat_migrations_in;
+        uint32_t migrations_out = cpus[i].sched.stat_migrations_out;
+        snprintf(res + offset, 256 - offset, "migrations%d %u %u\n", i, migrations_in, migrations_out);
         offset = strlen(res);
     }
     size_t size = strlen(res);
@@ -267,8 +306,105 @@ static bool procfs_root_meminfo_can_read(dentry_t* dentry, size_t start)
 
 static int procfs_root_meminfo_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
 {
-    char res[128];
-    snprintf(res, 128, "MemTotal: %u kB\nMemFree: %u kB\n", pmm_get_ram_in_kb(), pmm_get_free_space_in_kb());
+    char res[384];
+    kswapd_stat_t stat;
+    kswapd_get_stat(&stat);
+    swapfile_stat_t swap_stat;
+    swapfile_get_stat(&swap_stat);
+    snprintf(res, 384, "MemTotal: %u kB\nMemFree: %u kB\nSwapFile: %u kB\nSwapCompressed: %u kB\nSwapCompressedBytes: %u\nSwapWrites: %u\nPgScanned: %u\nPgActivated: %u\nPgReclaimedFile: %u\nPgReclaimedAnon: %u\nPgRefaulted: %u\n",
+        pmm_get_ram_in_kb(), pmm_get_free_space_in_kb(), swap_stat.file_pages * (VMM_PAGE_SIZE / 1024), swap_stat.compressed_pages * (VMM_PAGE_SIZE / 1024),
+        swap_stat.compressed_bytes, swap_stat.file_writes, stat.scanned_pages, stat.activated_pages,
+        stat.reclaimed_file_pages, stat.reclaimed_anon_pages, stat.refaulted_pages);
+    size_t size = strlen(res);
+
+    if (start == size) {
+        return 0;
+    }
+
+    if (len < size) {
+        return -EFAULT;
+    }
+
+    memcpy(buf, res, size);
+    return size;
+}
+
+static bool procfs_root_bcache_can_read(dentry_t* dentry, size_t start)
+{
+    return true;
+}
+
+static int procfs_root_bcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    char res[192];
+    bcache_stat_t stat;
+    bcache_get_stat(&stat);
+    snprintf(res, 192, "Hits: %u\nMisses: %u\nCached: %u kB\nDirty: %u kB\nWritebacks: %u\nEvictions: %u\n",
+        stat.hits, stat.misses, stat.cached_blocks * BCACHE_BLOCK_LEN / 1024, stat.dirty_blocks * BCACHE_BLOCK_LEN / 1024,
+        stat.writebacks, stat.evictions);
+    size_t size = strlen(res);
+
+    if (start == size) {
+        return 0;
+    }
+
+    if (len < size) {
+        return -EFAULT;
+    }
+
+    memcpy(buf, res, size);
+    return size;
+}
+
+static bool procfs_root_pcache_can_read(dentry_t* dentry, size_t start)
+{
+    return true;
+}
+
+static int procfs_root_pcache_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    char res[220];
+    pcache_stat_t stat;
+    pcache_get_stat(&stat);
+    snprintf(res, 220, "Hits: %u\nMisses: %u\nReadahead: %u\nCached: %u kB\nMapped: %u kB\nDirty: %u kB\nEvictions: %u\nWritebacks: %u\n",
+        stat.hits, stat.misses, stat.readahead_pages, stat.cached_pages * VMM_PAGE_SIZE / 1024, stat.mapped_pages * VMM_PAGE_SIZE / 1024,
+        stat.dirty_pages * VMM_PAGE_SIZE / 1024, stat.evictions, stat.writebacks);
+    size_t size = strlen(res);
+
+    if (start == size) {
+        return 0;
+    }
+
+    if (len < size) {
+        return -EFAULT;
+    }
+
+    memcpy(buf, res, size);
+    return size;
+}
+
+static bool procfs_root_slabinfo_can_read(dentry_t* dentry, size_t start)
+{
+    return true;
+}
+
+static int procfs_root_slabinfo_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
+{
+    char res[768];
+    kmalloc_stat_t kstat;
+    kmalloc_get_stat(&kstat);
+    snprintf(res, 768, "SlabPages: %u\nLarge: %u (%u kB)\nFree: %u kB\n",
+        kstat.slab_pages, kstat.large_allocs, kstat.large_blocks * KMALLOC_BLOCK_SIZE / 1024, kstat.free_blocks * KMALLOC_BLOCK_SIZE / 1024);
+    size_t offset = strlen(res);
+
+    // name objsize active total slabs allocs frees
+    kmem_cache_stat_t stat;
+    for (kmem_cache_t* cache = kmem_cache_next(NULL); cache && offset < 768; cache = kmem_cache_next(cache)) {
+        kmem_cache_get_stat(cache, &stat);
+        snprintf(res + offset, 768 - offset, "%s %u %u %u %u %u %u\n",
+            stat.name, stat.obj_size, stat.active_objs, stat.total_objs, stat.slabs, stat.allocs, stat.frees);
+        offset = strlen(res);
+    }
     size_t size = strlen(res);
 
     if (start == size) {
@@ -281,4 +417,4 @@ static int procfs_root_meminfo_read(dentry_t* dentry, uint8_t* buf, size_t start
 
     memcpy(buf, res, size);
     return size;
-}
\ No newline at end of file
+}
@@ -7,6 +7,8 @@
  */
 
 #include <algo/dynamic_array.h>
+#include <fs/bcache.h>
+#include <fs/pcache.h>
 #include <fs/vfs.h>
 #include <io/sockets/socket.h>
 #include <libkern/bits/errno.h>
@@ -20,6 +22,7 @@
 
 // #define VFS_DEBUG
 #define MAX_FS 8
+#define VFS_READAHEAD_MIN_PAGES (4)
 
 vfs_device_t _vfs_devices[MAX_DEVICES_COUNT];
 dynamic_array_t _vfs_fses;
@@ -27,11 +30,13 @@ int32_t root_fs_dev_id = -1;
 
 static void vfs_recieve_notification(uint32_t msg, uint32_t param);
 static int _vfs_loadpage_from_mmap_file(struct memzone* zone, uintptr_t vaddr);
+static uintptr_t _vfs_get_cached_page_of_mmap_file(struct memzone* zone, uintptr_t vaddr);
 
 static vm_ops_t mmap_file_vm_ops = {
     .load_page_content = _vfs_loadpage_from_mmap_file,
     .restore_swapped_page = NULL,
     .swap_page_mode = NULL,
+    .get_cached_page = _vfs_get_cached_page_of_mmap_file,
 };
 
 driver_desc_t _vfs_driver_info()
@@ -56,6 +61,9 @@ void vfs_install()
 {
     devman_register_driver(_vfs_driver_info(), "vfs");
     dynarr_init_of_size(fs_desc_t, &_vfs_fses, MAX_FS);
+    dentry_init();
+    bcache_init();
+    pcache_init();
 }
 devman_register_driver_installation(vfs_install);
 
@@ -159,6 +167,33 @@ void vfs_eject_device(device_t* dev)
         eject(&_vfs_devices[dev->id]);
     }
     dentry_put_all_dentries_of_dev(dev->id);
+    pcache_invalidate_device(dev->id);
+}
+
+/**
+ * Writes back metadata which the file system keeps in memory (like
+ * allocation bitmaps) to the block cache.
+ */
+int vfs_sync_device(dev_t dev_indx)
+{
+    if (!_vfs_devices[dev_indx].dev) {
+        return -ENODEV;
+    }
+
+    fs_desc_t* fs = dynarr_get(&_vfs_fses, _vfs_devices[dev_indx].fs);
+    if (!fs || !fs->ops->sync_device) {
+        return 0;
+    }
+    return fs->ops->sync_device(&_vfs_devices[dev_indx]);
+}
+
+void vfs_sync_all()
+{
+    for (int i = 0; i < MAX_DEVICES_COUNT; i++) {
+        if (_vfs_devices[i].dev) {
+            vfs_sync_device(i);
+        }
+    }
 }
 
 int vfs_add_fs(driver_t* new_driver)
@@ -172,6 +207,7 @@ int vfs_add_fs(driver_t* new_driver)
     new_ops->recognize = new_driver->desc.functions[DRIVER_FILE_SYSTEM_RECOGNIZE];
     new_ops->prepare_fs = new_driver->desc.functions[DRIVER_FILE_SYSTEM_PREPARE_FS];
     new_ops->eject_device = new_driver->desc.functions[DRIVER_FILE_SYSTEM_EJECT_DEVICE];
+    new_ops->sync_device = new_driver->desc.functions[DRIVER_FILE_SYSTEM_SYNC_DEVICE];
 
     new_ops->file.mkdir = new_driver->desc.functions[DRIVER_FILE_SYSTEM_MKDIR];
     new_ops->file.rmdir = new_driver->desc.functions[DRIVER_FILE_SYSTEM_RMDIR];
@@ -188,6 +224,7 @@ int vfs_add_fs(driver_t* new_driver)
     new_ops->file.fstat = new_driver->desc.functions[DRIVER_FILE_SYSTEM_FSTAT];
     new_ops->file.ioctl = new_driver->desc.functions[DRIVER_FILE_SYSTEM_IOCTL];
     new_ops->file.mmap = new_driver->desc.functions[DRIVER_FILE_SYSTEM_MMAP];
+    new_ops->file.wait_queue = new_driver->desc.functions[DRIVER_FILE_SYSTEM_WAIT_QUEUE];
 
     new_ops->dentry.write_inode = new_driver->desc.functions[DRIVER_FILE_SYSTEM_WRITE_INODE];
     new_ops->dentry.read_inode = new_driver->desc.functions[DRIVER_FILE_SYSTEM_READ_INODE];
@@ -265,6 +302,9 @@ int vfs_open(dentry_t* file, file_descriptor_t* fd, int flags)
     fd->dentry = dentry_duplicate(file);
     fd->offset = 0;
     fd->ops = &file->ops->file;
+    fd->ra_next = 0;
+    fd->ra_start = 0;
+    fd->ra_window = 0;
     lock_init(&fd->lock);
     return 0;
 }
@@ -302,7 +342,11 @@ int vfs_create(dentry_t* dir, const char* name, size_t len, mode_t mode, uid_t u
         return -EEXIST;
     }
 
-    return dir->ops->file.create(dir, name, len, mode, uid, gid);
+    int err = dir->ops->file.create(dir, name, len, mode, uid, gid);
+    if (!err) {
+        dentry_forget_negative(dir, name, len);
+    }
+    return err;
 }
 
 int vfs_unlink(dentry_t* file)
@@ -319,7 +363,15 @@ int vfs_unlink(dentry_t* file)
 #endif
     }
 
-    return file->ops->file.unlink(file);
+    int err = file->ops->file.unlink(file);
+    if (!err) {
+        dentry_unhash_name(file);
+        dentry_t* parent = dentry_get_parent(file);
+        if (parent && file->filename) {
+            dentry_forget_negative(parent, file->filename, strlen(file->filename));
+        }
+    }
+    return err;
 }
 
 int vfs_lookup(dentry_t* dir, const char* name, size_t len, dentry_t** result)
@@ -352,8 +404,21 @@ int vfs_lookup(dentry_t* dir, const char* name, size_t len, dentry_t** result)
         return -ENOEXEC;
     }
 
+    dentry_t* cached = dentry_lookup_child(dir, name, len);
+    if (cached) {
+        *result = cached;
+        return 0;
+    }
+    if (dentry_lookup_negative(dir, name, len)) {
+        return -ENOENT;
+    }
+
+    uint32_t negative_gen = dentry_negative_gen(dir);
     int err = dir->ops->file.lookup(dir, name, len, result);
     if (err) {
+        if (err == -ENOENT) {
+            dentry_add_negative(dir, name, len, negative_gen);
+        }
         return err;
     }
 
@@ -382,6 +447,50 @@ bool vfs_can_write(file_descriptor_t* fd)
     return res;
 }
 
+/**
+ * Returns the queue which is woken once the file could become readable or
+ * writable, or NULL if the file never blocks.
+ */
+struct wait_queue* vfs_wait_queue(file_descriptor_t* fd)
+{
+    if (!fd->ops->wait_queue) {
+        return NULL;
+    }
+    return fd->ops->wait_queue(fd->dentry);
+}
+
+/**
+ * Detects sequential reads of the file. Once a reader is inside the second
+ * half of the current window, the next window is loaded into the page cache
+ * and the window grows up to PCACHE_READAHEAD_MAX_PAGES. Any seek resets it.
+ */
+static void _vfs_readahead_lockless(file_descriptor_t* fd, size_t len)
+{
+    if (fd->offset != fd->ra_next || !len) {
+        fd->ra_window = 0;
+        return;
+    }
+
+    uint32_t first = fd->offset / VMM_PAGE_SIZE;
+    uint32_t last = (fd->offset + len - 1) / VMM_PAGE_SIZE;
+    if (!fd->ra_window) {
+        fd->ra_start = first;
+        fd->ra_window = VFS_READAHEAD_MIN_PAGES;
+    } else if (last >= fd->ra_start + fd->ra_window / 2) {
+        fd->ra_start = max(fd->ra_start + fd->ra_window, first);
+        fd->ra_window = min(fd->ra_window * 2, PCACHE_READAHEAD_MAX_PAGES);
+    } else {
+        return;
+    }
+
+    // The window is stretched to cover the rest of this read.
+    uint32_t count = fd->ra_window;
+    if (last >= fd->ra_start + count) {
+        count = last - fd->ra_start + 1;
+    }
+    pcache_readahead(fd->dentry, fd->ra_start, count);
+}
+
 int vfs_read(file_descriptor_t* fd, void* buf, size_t len)
 {
     lock_acquire(&fd->lock);
@@ -390,7 +499,14 @@ int vfs_read(file_descriptor_t* fd, void* buf, size_t len)
         return 0;
     }
 
-    int read = fd->ops->read(fd->dentry, (uint8_t*)buf, fd->offset, len);
+    int read;
+    if (fd->type == FD_TYPE_FILE && fd->ops->read == fd->dentry->ops->file.read) {
+        _vfs_readahead_lockless(fd, len);
+        read = pcache_read(fd->dentry, (uint8_t*)buf, fd->offset, len);
+        fd->ra_next = fd->offset + max(read, 0);
+    } else {
+        read = fd->ops->read(fd->dentry, (uint8_t*)buf, fd->offset, len);
+    }
     if (read > 0) {
         fd->offset += read;
     }
@@ -408,12 +524,16 @@ int vfs_write(file_descriptor_t* fd, void* buf, size_t len)
 
     int written = fd->ops->write(fd->dentry, (uint8_t*)buf, fd->offset, len);
     if (written > 0) {
+        if (fd->type == FD_TYPE_FILE) {
+            pcache_write(fd->dentry, (uint8_t*)buf, fd->offset, written);
+        }
         fd->offset += written;
     }
 
     if (TEST_FLAG(fd->flags, O_TRUNC)) {
         if (fd->ops->truncate) {
             fd->ops->truncate(fd->dentry, fd->offset);
+            pcache_truncate(fd->dentry, fd->offset);
         }
     }
 
@@ -429,7 +549,11 @@ int vfs_mkdir(dentry_t* dir, const char* name, size_t len, mode_t mode, uid_t ui
     if (!dentry_inode_test_flag(dir, S_IFDIR)) {
         return -ENOTDIR;
     }
-    return dir->ops->file.mkdir(dir, name, len, mode | S_IFDIR, uid, gid);
+    int err = dir->ops->file.mkdir(dir, name, len, mode | S_IFDIR, uid, gid);
+    if (!err) {
+        dentry_forget_negative(dir, name, len);
+    }
+    return err;
 }
 
 /**
@@ -450,6 +574,8 @@ int vfs_rmdir(dentry_t* dir)
         log("Rmdir: will be deleted %d", dir->inode_indx);
 #endif
         dentry_set_flag(dir, DENTRY_INODE_TO_BE_DELETED);
+        dentry_unhash_name(dir);
+        dentry_forget_negative_dir(dir);
     }
     return err;
 }
@@ -534,12 +660,9 @@ int vfs_resolve_path_start_from(dentry_t* dentry, const char* path, dentry_t** r
         }
 
         // Check for . & .. to not to mess up dentry's parent.
-        if (cur_dent != parent_dent && parent_dent->parent != cur_dent) {
-            char* newname = kmalloc(len + 1);
-            memcpy(newname, name, len);
-            newname[len] = '\0';
-            dentry_set_filename(cur_dent, newname);
-            dentry_set_parent(cur_dent, parent_dent);
+        bool is_dots = (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')));
+        if (cur_dent != parent_dent && parent_dent->parent != cur_dent && !is_dots) {
+            dentry_set_name(cur_dent, parent_dent, name, len);
         }
         dentry_put(parent_dent);
     }
@@ -664,9 +787,17 @@ int vfs_umount(dentry_t* mounted_dentry)
 
     mounted_dentry->mountpoint = NULL;
     mountpoint->mounted_dentry = NULL;
+    dentry_unhash_name(mounted_dentry);
 
+    // The put lets the dentry be reused, so the device is saved before it.
+    dev_t dev_indx = mounted_dentry->dev_indx;
+    device_t* dev = mounted_dentry->dev->dev;
     dentry_put_lockless(mounted_dentry);
     dentry_put(mountpoint);
+    pcache_sync_device(dev_indx);
+    vfs_sync_device(dev_indx);
+    bcache_sync_device(dev);
+    pcache_invalidate_device(dev_indx);
 
     if (dentry_test_flag(mountpoint, DENTRY_MOUNTED)) {
         vfs_umount(mountpoint);
@@ -682,11 +813,33 @@ static int _vfs_loadpage_from_mmap_file(struct memzone* zone, uintptr_t vaddr)
 
     size_t offset = zone->offset + (PAGE_START(vaddr) - zone->start);
     lock_acquire(&zone->file->lock);
-    zone->file->ops->file.read(zone->file, (void*)PAGE_START(vaddr), offset, VMM_PAGE_SIZE);
+    pcache_read(zone->file, (void*)PAGE_START(vaddr), offset, VMM_PAGE_SIZE);
     lock_release(&zone->file->lock);
     return 0;
 }
 
+/**
+ * Pages of private mappings are shared with the page cache until the first
+ * write, see vmm. Pages of shared mappings are always the pages of the cache.
+ * Only page-aligned file offsets could be served by the cache.
+ */
+static uintptr_t _vfs_get_cached_page_of_mmap_file(struct memzone* zone, uintptr_t vaddr)
+{
+    size_t offset = zone->offset + (PAGE_START(vaddr) - zone->start);
+    if (offset % VMM_PAGE_SIZE) {
+        return 0;
+    }
+    return pcache_get_frame(zone->file, offset / VMM_PAGE_SIZE);
+}
+
+void vfs_mmap_private_zone(memzone_t* zone, dentry_t* file, off_t offset)
+{
+    zone->type |= ZONE_TYPE_MAPPED_FILE_PRIVATLY;
+    zone->file = dentry_duplicate(file);
+    zone->offset = offset;
+    zone->ops = &mmap_file_vm_ops;
+}
+
 static memzone_t* _vfs_do_mmap(file_descriptor_t* fd, mmap_params_t* params)
 {
     bool map_shared = TEST_FLAG(params->flags, MAP_SHARED);
@@ -696,13 +849,22 @@ static memzone_t* _vfs_do_mmap(file_descriptor_t* fd, mmap_params_t* params)
 
     if (map_private) {
         zone = memzone_new_random(RUNNING_THREAD->process, params->size);
-        zone->type = ZONE_TYPE_MAPPED_FILE_PRIVATLY;
+        zone->type = ZONE_TYPE_NULL;
+        vfs_mmap_private_zone(zone, fd->dentry, params->offset);
+    } else {
+        // Shared mappings are served only by the page cache.
+        if (params->offset % VMM_PAGE_SIZE || !pcache_is_cacheable(fd->dentry)) {
+            return NULL;
+        }
+
+        zone = memzone_new_random(RUNNING_THREAD->process, params->size);
+        if (!zone) {
+            return NULL;
+        }
+        zone->type = ZONE_TYPE_MAPPED_FILE_SHAREDLY;
         zone->file = dentry_duplicate(fd->dentry);
         zone->offset = params->offset;
         zone->ops = &mmap_file_vm_ops;
-    } else {
-        /* TODO */
-        return NULL;
     }
 
     return zone;
@@ -726,18 +888,38 @@ memzone_t* vfs_mmap(file_descriptor_t* fd, mmap_params_t* params)
 
 int vfs_munmap(proc_t* p, memzone_t* zone)
 {
-    if (!TEST_FLAG(zone->flags, ZONE_TYPE_MAPPED_FILE_PRIVATLY) && !TEST_FLAG(zone->flags, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+    if (!TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_PRIVATLY) && !TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
         return -EFAULT;
     }
 
+    // Pages are unmapped first, so the cache sees all writes to them.
+    vmm_free_pages(zone->start, zone->len, &p->zones);
+    if (TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+        pcache_sync_inode(zone->file);
+    }
+
     dentry_put(zone->file);
+    memzone_free(p, zone);
+    return 0;
+}
 
-    for (uintptr_t vaddr = zone->start; vaddr < zone->start + zone->len + 1; vaddr += VMM_PAGE_SIZE) {
-        system_flush_local_tlb_entry(vaddr);
+/**
+ * Write-protects pages of the shared mapping in the range and writes dirty
+ * pages of the file back. With MS_ASYNC the writeback is left to
+ * kdentryflusherd. Caller must be the owner of the zone.
+ */
+int vfs_msync(memzone_t* zone, uintptr_t addr, size_t length, int flags)
+{
+    if (!TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+        return 0;
     }
-    memzone_free(p, zone);
 
-    return 0;
+    uintptr_t end = min(addr + length, zone->start + zone->len);
+    vmm_protect_cached_pages(addr, end - addr);
+    if (TEST_FLAG(flags, MS_ASYNC)) {
+        return 0;
+    }
+    return pcache_sync_inode(zone->file);
 }
 
 int vfs_perm_to_read(dentry_t* dentry, thread_t* thread)
@@ -32,6 +32,7 @@ static file_ops_t local_socket_ops = {
     .fstat = 0,
     .ioctl = 0,
     .mmap = 0,
+    .wait_queue = local_socket_wait_queue,
 };
 
 int local_socket_create(int type, int protocol, file_descriptor_t* fd)
@@ -64,9 +65,16 @@ int local_socket_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
 {
     socket_t* sock_entry = (socket_t*)dentry;
     uint32_t written = sync_ringbuffer_write_ignore_bounds(&sock_entry->buffer, buf, len);
+    wait_queue_wake_all(&sock_entry->wait_queue);
     return 0;
 }
 
+wait_queue_t* local_socket_wait_queue(dentry_t* dentry)
+{
+    socket_t* sock_entry = (socket_t*)dentry;
+    return &sock_entry->wait_queue;
+}
+
 int local_socket_bind(file_descriptor_t* sock, char* path, uint32_t len)
 {
     lock_acquire(&sock->lock);
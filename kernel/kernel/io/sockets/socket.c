@@ -21,6 +21,7 @@ static socket_t* _socket_create(int domain, int type, int protocol)
     socket_list[next_socket].buffer = sync_ringbuffer_create_std();
     socket_list[next_socket].d_count = 1;
     lock_init(&socket_list[next_socket].lock);
+    wait_queue_init(&socket_list[next_socket].wait_queue);
     return &socket_list[next_socket++];
 }
 
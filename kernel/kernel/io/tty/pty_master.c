@@ -29,6 +29,7 @@ bool pty_master_can_write(dentry_t* dentry, size_t start);
 int pty_master_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 int pty_master_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len);
 int pty_master_fstat(dentry_t* dentry, fstat_t* stat);
+wait_queue_t* pty_master_wait_queue(dentry_t* dentry);
 
 static fs_ops_t pty_master_ops = {
     .recognize = 0,
@@ -56,6 +57,7 @@ static fs_ops_t pty_master_ops = {
         .fstat = pty_master_fstat,
         .ioctl = 0,
         .mmap = 0,
+        .wait_queue = pty_master_wait_queue,
     }
 };
 
@@ -108,6 +110,7 @@ int pty_master_write(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
     pty_master_entry_t* ptm = _ptm_get(dentry);
     ASSERT(ptm);
     sync_ringbuffer_write(&ptm->pts->buffer, buf, len);
+    wait_queue_wake_all(&ptm->pts->wait_queue);
     return len;
 }
 
@@ -119,6 +122,13 @@ int pty_master_fstat(dentry_t* dentry, fstat_t* stat)
     return 0;
 }
 
+wait_queue_t* pty_master_wait_queue(dentry_t* dentry)
+{
+    pty_master_entry_t* ptm = _ptm_get(dentry);
+    ASSERT(ptm);
+    return &ptm->wait_queue;
+}
+
 int pty_master_alloc(file_descriptor_t* fd)
 {
     pty_master_entry_t* ptm = 0;
@@ -152,6 +162,7 @@ int pty_master_alloc(file_descriptor_t* fd)
     fd->offset = 0;
     fd->type = FD_TYPE_FILE;
 
+    wait_queue_init(&ptm->wait_queue);
     pty_slave_create(INODE2PTSNO(ptm->dentry.inode_indx), ptm);
     ptm->buffer = sync_ringbuffer_create_std();
 
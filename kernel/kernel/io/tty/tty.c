@@ -59,6 +59,12 @@ bool tty_can_write(dentry_t* dentry, size_t start)
     return true;
 }
 
+wait_queue_t* tty_wait_queue(dentry_t* dentry)
+{
+    tty_entry_t* tty = _tty_get(dentry);
+    return &tty->wait_queue;
+}
+
 int tty_read(dentry_t* dentry, uint8_t* buf, size_t start, size_t len)
 {
     tty_entry_t* tty = _tty_get(dentry);
@@ -188,11 +194,13 @@ tty_entry_t* tty_new()
     fops.read = tty_read;
     fops.write = tty_write;
     fops.ioctl = tty_ioctl;
+    fops.wait_queue = tty_wait_queue;
     devfs_inode_t* res = devfs_register(mp, MKDEV(4, next_tty), name, 4, 0777, &fops);
     ttys[next_tty].id = next_tty;
     ttys[next_tty].inode_indx = res->index;
     ttys[next_tty].buffer = sync_ringbuffer_create_std();
     ttys[next_tty].lines_avail = 0;
+    wait_queue_init(&ttys[next_tty].wait_queue);
     _tty_setup_termios(&ttys[next_tty]);
     if (!ttys[next_tty].buffer.ringbuffer.zone.start) {
         log_error("Error: tty buffer allocation");
@@ -236,4 +244,5 @@ void tty_eat_key(key_t key)
         sync_ringbuffer_write_one(&tty->buffer, (char)key);
         _tty_echo_key(tty, key);
     }
+    wait_queue_wake_all(&tty->wait_queue);
 }
\ No newline at end of file
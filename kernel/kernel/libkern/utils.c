@@ -167,4 +167,33 @@ bool ptrarr_validate_len(const char** s, size_t len)
         }
     }
     return false;
-}
\ No newline at end of file
+}
+
+/**
+ * Divides without libgcc helpers, which are not linked into the kernel
+ * on every target.
+ */
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem)
+{
+    if (!(n >> 32)) {
+        if (rem) {
+            *rem = (uint32_t)n % d;
+        }
+        return (uint32_t)n / d;
+    }
+
+    uint64_t q = 0;
+    uint64_t r = 0;
+    for (int i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= (1ULL << i);
+        }
+    }
+
+    if (rem) {
+        *rem = (uint32_t)r;
+    }
+    return q;
+}
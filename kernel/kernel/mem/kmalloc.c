@@ -7,26 +7,98 @@
  */
 
 #include <algo/bitmap.h>
+#include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/lock.h>
 #include <libkern/log.h>
 #include <mem/kmalloc.h>
 #include <mem/kmemzone.h>
+#include <platform/generic/cpu.h>
+#include <platform/generic/system.h>
+
+// #define KMALLOC_DEBUG
+
+#define KMALLOC_PAGES (KMALLOC_SPACE_SIZE / KMEM_SLAB_SIZE)
+#define KMALLOC_BLOCKS (KMALLOC_SPACE_SIZE / KMALLOC_BLOCK_SIZE)
+#define KMALLOC_BLOCKS_PER_SLAB (KMEM_SLAB_SIZE / KMALLOC_BLOCK_SIZE)
+
+/**
+ * The kmalloc zone is split into blocks of KMALLOC_BLOCK_SIZE, which are
+ * tracked with a bitmap. Requests up to KMEM_MAX_OBJ_SIZE are served from
+ * slabs: page-aligned runs of blocks cut into objects of a single size. Every
+ * page of the zone has a descriptor in _kmalloc_slabs, so kfree() tells a slab
+ * object from a large allocation by its page, and only large allocations carry
+ * a header with their length.
+ *
+ * Every cache keeps a magazine of free objects per CPU, which is used with
+ * interrupts disabled and without taking a lock. The cache lock is taken only
+ * to refill an empty magazine or to drain a full one by half of its size, and
+ * this is done with interrupts enabled: objects are moved through a buffer on
+ * the stack, so only pushing and popping the magazine happens with interrupts
+ * disabled. New slabs are prepared without holding the cache lock.
+ *
+ * Lock order is cache->lock -> _kmalloc_lock -> vmm.
+ */
 
 struct kmalloc_header {
     uint32_t len;
 };
 typedef struct kmalloc_header kmalloc_header_t;
 
+struct kmem_slab {
+    kmem_cache_t* cache; // NULL if the page is not a slab.
+    struct kmem_slab** list;
+    struct kmem_slab* prev;
+    struct kmem_slab* next;
+    void* free;
+    uint32_t inuse;
+};
+typedef struct kmem_slab kmem_slab_t;
+
+struct kmem_magazine {
+    uint32_t count;
+    void* objs[KMEM_MAGAZINE_SIZE];
+
+    /* Stat */
+    uint32_t stat_allocs;
+    uint32_t stat_frees;
+};
+typedef struct kmem_magazine kmem_magazine_t;
+
+struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t obj_size;
+    uint32_t objs_per_slab;
+    lock_t lock;
+
+    kmem_slab_t* partial;
+    kmem_slab_t* full;
+    kmem_slab_t* empty; // Keeps at most one slab.
+    uint32_t slabs;
+    uint32_t inuse; // Objects taken from slabs, including ones in magazines.
+
+    struct kmem_cache* next;
+    kmem_magazine_t magazines[CPU_CNT];
+};
+
 static lock_t _kmalloc_lock;
 static kmemzone_t _kmalloc_zone;
 static uint32_t _kmalloc_bitmap_len = 0;
 static uint8_t* _kmalloc_bitmap;
 static bitmap_t bitmap;
 
+static kmem_slab_t _kmalloc_slabs[KMALLOC_PAGES];
+static kmem_cache_t _kmalloc_size_caches[KMEM_SIZE_CLASSES];
+static kmem_cache_t* _kmem_caches;
+
+/* Stat */
+static uint32_t stat_slab_pages = 0;
+static uint32_t stat_large_allocs = 0;
+static uint32_t stat_large_blocks = 0;
+static uint32_t stat_used_blocks = 0;
+
 static inline uint32_t kmalloc_to_vaddr(int start)
 {
-    uint32_t vaddr = (uint32_t)_kmalloc_zone.start + start * KMALLOC_BLOCK_SIZE;
     return (uint32_t)_kmalloc_zone.start + start * KMALLOC_BLOCK_SIZE;
 }
 
@@ -35,27 +107,356 @@ static inline int kmalloc_to_index(uint32_t vaddr)
     return (vaddr - (uint32_t)_kmalloc_zone.start) / KMALLOC_BLOCK_SIZE;
 }
 
+static inline kmem_slab_t* _kmalloc_slab_of(void* ptr)
+{
+    return &_kmalloc_slabs[((uintptr_t)ptr - _kmalloc_zone.start) / KMEM_SLAB_SIZE];
+}
+
+static NORETURN void _kmalloc_no_space()
+{
+    log_error("[Err] NO SPACE AT KMALLOC");
+    system_stop();
+}
+
 static void _kmalloc_init_bitmap()
 {
     _kmalloc_bitmap = (uint8_t*)_kmalloc_zone.start;
-    _kmalloc_bitmap_len = (KMALLOC_SPACE_SIZE / KMALLOC_BLOCK_SIZE / 8);
+    _kmalloc_bitmap_len = KMALLOC_BLOCKS / 8;
 
-    bitmap = bitmap_wrap(_kmalloc_bitmap, _kmalloc_bitmap_len);
+    bitmap = bitmap_wrap(_kmalloc_bitmap, KMALLOC_BLOCKS);
     memset(_kmalloc_bitmap, 0, _kmalloc_bitmap_len);
 
     /* Setting bitmap as a busy region. */
     int blocks_needed = (_kmalloc_bitmap_len + KMALLOC_BLOCK_SIZE - 1) / KMALLOC_BLOCK_SIZE;
     bitmap_set_range(bitmap, kmalloc_to_index((uint32_t)_kmalloc_bitmap), blocks_needed);
+    stat_used_blocks = blocks_needed;
+}
+
+/**
+ * SLABS
+ */
+
+static void _kmem_slab_link(kmem_slab_t** list, kmem_slab_t* slab)
+{
+    slab->list = list;
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void _kmem_slab_unlink(kmem_slab_t* slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *slab->list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->list = NULL;
+    slab->prev = slab->next = NULL;
+}
+
+static void _kmem_slab_relink_lockless(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    kmem_slab_t** list = &cache->partial;
+    if (slab->inuse == cache->objs_per_slab) {
+        list = &cache->full;
+    } else if (slab->inuse == 0) {
+        list = &cache->empty;
+    }
+
+    if (slab->list == list) {
+        return;
+    }
+    if (slab->list) {
+        _kmem_slab_unlink(slab);
+    }
+    _kmem_slab_link(list, slab);
+}
+
+/**
+ * Looks for a page which has no blocks taken, checking the bitmap a word at
+ * a time.
+ */
+static int _kmalloc_find_free_page_lockless()
+{
+    const int words_per_page = KMALLOC_BLOCKS_PER_SLAB / 32;
+    uint32_t* words = (uint32_t*)_kmalloc_bitmap;
+    for (int page = 0; page < KMALLOC_PAGES; page++) {
+        uint32_t used = 0;
+        for (int i = 0; i < words_per_page; i++) {
+            used |= words[page * words_per_page + i];
+        }
+        if (!used) {
+            return page;
+        }
+    }
+    return -ENOMEM;
+}
+
+/**
+ * Takes a free page of the zone and cuts it into objects of the cache. It is
+ * called without the cache lock, the slab is added to the cache with
+ * _kmem_cache_add_slab_lockless().
+ */
+static kmem_slab_t* _kmem_slab_new(kmem_cache_t* cache)
+{
+    lock_acquire(&_kmalloc_lock);
+    int page = _kmalloc_find_free_page_lockless();
+    if (page < 0) {
+        lock_release(&_kmalloc_lock);
+        return NULL;
+    }
+    bitmap_set_range(bitmap, page * KMALLOC_BLOCKS_PER_SLAB, KMALLOC_BLOCKS_PER_SLAB);
+    stat_used_blocks += KMALLOC_BLOCKS_PER_SLAB;
+    stat_slab_pages++;
+    lock_release(&_kmalloc_lock);
+
+    uintptr_t base = _kmalloc_zone.start + page * KMEM_SLAB_SIZE;
+    vmm_prepare_active_pdir_for_writing_at(base, KMEM_SLAB_SIZE);
+
+    kmem_slab_t* slab = &_kmalloc_slabs[page];
+    slab->cache = cache;
+    slab->list = NULL;
+    slab->prev = slab->next = NULL;
+    slab->inuse = 0;
+    slab->free = NULL;
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+        void** obj = (void**)(base + i * cache->obj_size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+
+#ifdef KMALLOC_DEBUG
+    log("[kmalloc] %s: new slab at %x", cache->name, base);
+#endif
+    return slab;
+}
+
+static void _kmem_slab_release_lockless(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    if (slab->list) {
+        _kmem_slab_unlink(slab);
+    }
+    slab->cache = NULL;
+    cache->slabs--;
+
+    int page = slab - _kmalloc_slabs;
+    lock_acquire(&_kmalloc_lock);
+    bitmap_unset_range(bitmap, page * KMALLOC_BLOCKS_PER_SLAB, KMALLOC_BLOCKS_PER_SLAB);
+    stat_used_blocks -= KMALLOC_BLOCKS_PER_SLAB;
+    stat_slab_pages--;
+    lock_release(&_kmalloc_lock);
+}
+
+/**
+ * Adds a slab made by _kmem_slab_new(). If another one was added while it was
+ * being prepared, the new one is given back, so at most one empty slab is kept.
+ */
+static void _kmem_cache_add_slab_lockless(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    cache->slabs++;
+    if (cache->empty) {
+        _kmem_slab_release_lockless(cache, slab);
+        return;
+    }
+    _kmem_slab_relink_lockless(cache, slab);
+}
+
+/**
+ * Takes up to max objects from the slabs the cache already has. Returns the
+ * number of objects taken, 0 means that a new slab is needed.
+ */
+static uint32_t _kmem_cache_take_lockless(kmem_cache_t* cache, void** objs, uint32_t max)
+{
+    uint32_t count = 0;
+    while (count < max) {
+        kmem_slab_t* slab = cache->partial ? cache->partial : cache->empty;
+        if (!slab) {
+            break;
+        }
+
+        while (slab->free && count < max) {
+            void** obj = (void**)slab->free;
+            slab->free = *obj;
+            slab->inuse++;
+            cache->inuse++;
+            objs[count++] = obj;
+        }
+        _kmem_slab_relink_lockless(cache, slab);
+    }
+    return count;
 }
 
+/**
+ * Returns an object to its slab. Only one empty slab is kept per cache, the
+ * rest are given back to the zone.
+ */
+static void _kmem_cache_put_lockless(kmem_cache_t* cache, void* ptr)
+{
+    kmem_slab_t* slab = _kmalloc_slab_of(ptr);
+    *(void**)ptr = slab->free;
+    slab->free = ptr;
+    slab->inuse--;
+    cache->inuse--;
+
+    if (slab->inuse == 0 && cache->empty) {
+        _kmem_slab_release_lockless(cache, slab);
+        return;
+    }
+    _kmem_slab_relink_lockless(cache, slab);
+}
+
+static void _kmem_cache_put_many(kmem_cache_t* cache, void** objs, uint32_t count)
+{
+    lock_acquire(&cache->lock);
+    for (uint32_t i = 0; i < count; i++) {
+        _kmem_cache_put_lockless(cache, objs[i]);
+    }
+    lock_release(&cache->lock);
+}
+
+static void _kmem_cache_init(kmem_cache_t* cache, const char* name, size_t size)
+{
+    memset(cache, 0, sizeof(kmem_cache_t));
+    memcpy(cache->name, name, min(strlen(name), KMEM_CACHE_NAME_LEN - 1));
+    lock_init(&cache->lock);
+
+    // Every object should be able to hold a pointer of the free list.
+    cache->obj_size = ROUND_CEIL(max(size, sizeof(void*)), sizeof(void*));
+    cache->objs_per_slab = KMEM_SLAB_SIZE / cache->obj_size;
+
+    lock_acquire(&_kmalloc_lock);
+    cache->next = _kmem_caches;
+    _kmem_caches = cache;
+    lock_release(&_kmalloc_lock);
+}
+
+static inline int _kmalloc_size_class(size_t size)
+{
+    int class = 0;
+    for (size_t class_size = KMEM_MIN_OBJ_SIZE; class_size < size; class_size <<= 1) {
+        class++;
+    }
+    return class;
+}
+
+/**
+ * API FUNCTIONS
+ */
+
 void kmalloc_init()
 {
     lock_init(&_kmalloc_lock);
     _kmalloc_zone = kmemzone_new(KMALLOC_SPACE_SIZE);
     _kmalloc_init_bitmap();
+
+    char name[KMEM_CACHE_NAME_LEN];
+    for (int i = 0; i < KMEM_SIZE_CLASSES; i++) {
+        snprintf(name, KMEM_CACHE_NAME_LEN, "kmalloc-%d", KMEM_MIN_OBJ_SIZE << i);
+        _kmem_cache_init(&_kmalloc_size_caches[i], name, KMEM_MIN_OBJ_SIZE << i);
+    }
 }
 
-void* kmalloc(size_t size)
+kmem_cache_t* kmem_cache_create(const char* name, size_t size)
+{
+    if (!size || size > KMEM_SLAB_SIZE) {
+        return NULL;
+    }
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    _kmem_cache_init(cache, name, size);
+    return cache;
+}
+
+/**
+ * The magazine is checked with interrupts disabled. If it is empty, objects
+ * are taken from slabs with interrupts enabled and then pushed to the magazine
+ * of the CPU we run on at that moment, since the thread could be moved while
+ * refilling. Objects which don't fit, because the magazine was filled in the
+ * meantime, are given back to slabs.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    void* objs[KMEM_MAGAZINE_SIZE / 2];
+    for (;;) {
+        system_disable_interrupts();
+        kmem_magazine_t* mag = &cache->magazines[system_cpu_id()];
+        if (mag->count) {
+            void* obj = mag->objs[--mag->count];
+            mag->stat_allocs++;
+            system_enable_interrupts();
+            return obj;
+        }
+        system_enable_interrupts();
+
+        lock_acquire(&cache->lock);
+        uint32_t count = _kmem_cache_take_lockless(cache, objs, KMEM_MAGAZINE_SIZE / 2);
+        lock_release(&cache->lock);
+
+        if (!count) {
+            kmem_slab_t* slab = _kmem_slab_new(cache);
+            if (!slab) {
+                _kmalloc_no_space();
+            }
+            lock_acquire(&cache->lock);
+            _kmem_cache_add_slab_lockless(cache, slab);
+            lock_release(&cache->lock);
+            continue;
+        }
+
+        system_disable_interrupts();
+        mag = &cache->magazines[system_cpu_id()];
+        while (count > 1 && mag->count < KMEM_MAGAZINE_SIZE) {
+            mag->objs[mag->count++] = objs[--count];
+        }
+        mag->stat_allocs++;
+        system_enable_interrupts();
+
+        if (count > 1) {
+            _kmem_cache_put_many(cache, &objs[1], count - 1);
+        }
+        return objs[0];
+    }
+}
+
+/**
+ * When the magazine is full, the older half of it is moved to a buffer with
+ * interrupts disabled and given back to slabs after they are enabled.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* ptr)
+{
+    void* objs[KMEM_MAGAZINE_SIZE / 2];
+    uint32_t drain = 0;
+
+    system_disable_interrupts();
+    kmem_magazine_t* mag = &cache->magazines[system_cpu_id()];
+    if (mag->count == KMEM_MAGAZINE_SIZE) {
+        drain = KMEM_MAGAZINE_SIZE / 2;
+        for (uint32_t i = 0; i < drain; i++) {
+            objs[i] = mag->objs[i];
+        }
+        for (uint32_t i = drain; i < mag->count; i++) {
+            mag->objs[i - drain] = mag->objs[i];
+        }
+        mag->count -= drain;
+    }
+
+    mag->objs[mag->count++] = ptr;
+    mag->stat_frees++;
+    system_enable_interrupts();
+
+    if (drain) {
+        _kmem_cache_put_many(cache, objs, drain);
+    }
+}
+
+static void* _kmalloc_large(size_t size)
 {
     lock_acquire(&_kmalloc_lock);
     int act_size = size + sizeof(kmalloc_header_t);
@@ -64,12 +465,14 @@ void* kmalloc(size_t size)
 
     int start = bitmap_find_space(bitmap, blocks_needed);
     if (start < 0) {
-        log_error("[Err] NO SPACE AT KMALLOC");
-        system_stop();
+        _kmalloc_no_space();
     }
 
     kmalloc_header_t* space = (kmalloc_header_t*)kmalloc_to_vaddr(start);
     bitmap_set_range(bitmap, start, blocks_needed);
+    stat_used_blocks += blocks_needed;
+    stat_large_blocks += blocks_needed;
+    stat_large_allocs++;
     lock_release(&_kmalloc_lock);
 
     vmm_prepare_active_pdir_for_writing_at((uintptr_t)space, act_size);
@@ -77,6 +480,14 @@ void* kmalloc(size_t size)
     return (void*)&space[1];
 }
 
+void* kmalloc(size_t size)
+{
+    if (size <= KMEM_MAX_OBJ_SIZE) {
+        return kmem_cache_alloc(&_kmalloc_size_caches[_kmalloc_size_class(size)]);
+    }
+    return _kmalloc_large(size);
+}
+
 void* kmalloc_aligned(size_t size, size_t alignment)
 {
     void* ptr = kmalloc(size + alignment + sizeof(void*));
@@ -97,10 +508,19 @@ void kfree(void* ptr)
         return;
     }
 
+    kmem_slab_t* slab = _kmalloc_slab_of(ptr);
+    if (slab->cache) {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
     kmalloc_header_t* sptr = (kmalloc_header_t*)ptr;
     int blocks_to_delete = (sptr[-1].len + KMALLOC_BLOCK_SIZE - 1) / KMALLOC_BLOCK_SIZE;
     lock_acquire(&_kmalloc_lock);
     bitmap_unset_range(bitmap, kmalloc_to_index((size_t)&sptr[-1]), blocks_to_delete);
+    stat_used_blocks -= blocks_to_delete;
+    stat_large_blocks -= blocks_to_delete;
+    stat_large_allocs--;
     lock_release(&_kmalloc_lock);
 }
 
@@ -115,7 +535,14 @@ void kfree_aligned(void* ptr)
 
 void* krealloc(void* ptr, size_t new_size)
 {
-    size_t old_size = ((kmalloc_header_t*)ptr)[-1].len;
+    kmem_slab_t* slab = _kmalloc_slab_of(ptr);
+    size_t old_size;
+    if (slab->cache) {
+        old_size = slab->cache->obj_size;
+    } else {
+        old_size = ((kmalloc_header_t*)ptr)[-1].len - sizeof(kmalloc_header_t);
+    }
+
     if (old_size == new_size) {
         return ptr;
     }
@@ -125,8 +552,51 @@ void* krealloc(void* ptr, size_t new_size)
         return 0;
     }
 
-    memcpy(new_area, ptr, new_size > old_size ? new_size : old_size);
+    memcpy(new_area, ptr, new_size < old_size ? new_size : old_size);
     kfree(ptr);
 
     return new_area;
-}
\ No newline at end of file
+}
+
+/**
+ * STAT
+ */
+
+kmem_cache_t* kmem_cache_next(kmem_cache_t* cache)
+{
+    if (!cache) {
+        return _kmem_caches;
+    }
+    return cache->next;
+}
+
+void kmem_cache_get_stat(kmem_cache_t* cache, kmem_cache_stat_t* stat)
+{
+    memset(stat, 0, sizeof(kmem_cache_stat_t));
+    memcpy(stat->name, cache->name, KMEM_CACHE_NAME_LEN);
+    stat->obj_size = cache->obj_size;
+
+    system_disable_interrupts();
+    lock_acquire(&cache->lock);
+    uint32_t in_magazines = 0;
+    for (int i = 0; i < CPU_CNT; i++) {
+        in_magazines += cache->magazines[i].count;
+        stat->allocs += cache->magazines[i].stat_allocs;
+        stat->frees += cache->magazines[i].stat_frees;
+    }
+    stat->active_objs = cache->inuse - in_magazines;
+    stat->total_objs = cache->slabs * cache->objs_per_slab;
+    stat->slabs = cache->slabs;
+    lock_release(&cache->lock);
+    system_enable_interrupts();
+}
+
+void kmalloc_get_stat(kmalloc_stat_t* stat)
+{
+    lock_acquire(&_kmalloc_lock);
+    stat->slab_pages = stat_slab_pages;
+    stat->large_allocs = stat_large_allocs;
+    stat->large_blocks = stat_large_blocks;
+    stat->free_blocks = KMALLOC_BLOCKS - stat_used_blocks;
+    lock_release(&_kmalloc_lock);
+}
@@ -75,7 +75,7 @@ void kmemzone_init()
     lock_init(&_zoner_lock);
 
     const pmm_state_t* pmm_state = pmm_get_state();
-    uintptr_t start_vaddr = (uintptr_t)pmm_state->mat.data + pmm_state->mat.len / 8;
+    uintptr_t start_vaddr = (uintptr_t)pmm_state->mat.data + pmm_state->meta_size;
 
     // The initial start address is aligned by 1st level ptable, since
     // pspace32 expects to start at the beggining of the 1st level ptable.
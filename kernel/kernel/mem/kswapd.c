@@ -6,7 +6,10 @@
  * found in the LICENSE file.
  */
 
+#include <fs/bcache.h>
+#include <fs/pcache.h>
 #include <fs/vfs.h>
+#include <libkern/atomic.h>
 #include <libkern/bits/errno.h>
 #include <libkern/log.h>
 #include <mem/kswapd.h>
@@ -17,74 +20,179 @@
 
 // #define KSWAPD_DEBUG
 #define KSWAPD_SLEEPTIME (3) // seconds.
+#define KSWAPD_SCAN_PER_PID (256)
+#define KSWAPD_FILE_PER_PID_THRESHOLD (16)
 #define KSWAPD_SWAP_PER_PID_THRESHOLD (2)
 #define KSWAPD_SWAP_PER_RUN_THRESHOLD (4)
+#define KSWAPD_BCACHE_RECLAIM_PER_RUN (64)
+#define KSWAPD_PCACHE_RECLAIM_PER_RUN (64)
+
+/**
+ * Pages are aged with a CLOCK over the address space of every process.
+ * A page which was accessed since the previous pass of the hand gets its
+ * accessed bit cleared and stays (the active set), others are reclaim
+ * candidates (the inactive set). Clean pages of the page cache are dropped
+ * first, since they are loaded back without any writes. Anonymous pages are
+ * swapped out only if a process has not given enough clean pages.
+ * Every process has its own hand and the same scan and reclaim budget per
+ * pass, so one large process doesn't shield the others.
+ */
+
+struct kswapd_hand {
+    pid_t pid;
+    uintptr_t vaddr;
+};
+typedef struct kswapd_hand kswapd_hand_t;
 
 static kmemzone_t _mapzone;
 static uintptr_t _mmaped_ptable;
 static int moved_out_pages_per_run = 0;
-static int moved_out_pages_per_pid = 0;
-static int last_pid = 0, last_pti = 0;
+static int last_pid = 0;
+static kswapd_hand_t _hands[MAX_PROCESS_COUNT];
+static kswapd_stat_t _kswapd_stat;
 extern proc_t proc[MAX_PROCESS_COUNT];
 
-static int map_ptable(table_desc_t* ptable_desc)
+static ptable_t* map_ptable(table_desc_t* ptable_desc)
 {
-    uintptr_t ptable_paddr = PAGE_START((uintptr_t)table_desc_get_frame(*ptable_desc));
-    if (_mmaped_ptable == ptable_paddr) {
-        return 0;
+    uintptr_t ptable_paddr = (uintptr_t)table_desc_get_frame(*ptable_desc);
+    uintptr_t ptable_page_paddr = PAGE_START(ptable_paddr);
+    if (_mmaped_ptable != ptable_page_paddr) {
+        int err = vmm_map_page(_mapzone.start, ptable_page_paddr, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+        if (err) {
+            _mmaped_ptable = 0;
+            return NULL;
+        }
+        _mmaped_ptable = ptable_page_paddr;
     }
 
-    int err = vmm_map_page(_mapzone.start, ptable_paddr, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
-    if (err) {
-        return err;
-    }
+    // Several ptables could share a page.
+    return (ptable_t*)(_mapzone.start + (ptable_paddr - ptable_page_paddr));
+}
 
-    _mmaped_ptable = ptable_paddr;
-    return 0;
+static void do_sleep()
+{
+    moved_out_pages_per_run = 0;
+    timespec_t sleep_time = { KSWAPD_SLEEPTIME, 0 };
+    ksys1(SYS_NANOSLEEP, (int)&sleep_time);
 }
 
-inline static void after_page_swap()
+static inline bool _kswapd_is_clean_file_page(page_desc_t page)
 {
-    moved_out_pages_per_run++;
-    moved_out_pages_per_pid++;
+    return !page_desc_is_writable(page) && pcache_owns_frame(page_desc_get_frame(page));
 }
 
-static void do_sleep()
+static int _kswapd_reclaim(proc_t* p, pdirectory_t* pdir, uintptr_t vaddr)
 {
-    moved_out_pages_per_run = 0;
-    ksys1(SYS_NANOSLEEP, KSWAPD_SLEEPTIME);
+    table_desc_t* ptable_desc = &pdir->entities[VMM_OFFSET_IN_DIRECTORY(vaddr)];
+    if (!table_desc_has_attrs(*ptable_desc, TABLE_DESC_PRESENT) || table_desc_is_large_page(*ptable_desc)) {
+        return -ENOENT;
+    }
+
+    ptable_t* ptable = map_ptable(ptable_desc);
+    if (!ptable) {
+        return -ENOMEM;
+    }
+
+#ifdef KSWAPD_DEBUG
+    log("[kswapd] (pid %d) Reclaim page at %x", p->pid, vaddr);
+#endif
+    return vmm_swap_page(pdir, ptable, memzone_find(p, vaddr), vaddr);
 }
 
-static int find_victim(proc_t* p, pdirectory_t* pdir)
+/**
+ * Moves the hand of the process over KSWAPD_SCAN_PER_PID present pages and
+ * reclaims inactive pages found on the way.
+ */
+static int _kswapd_scan_proc(proc_t* p, kswapd_hand_t* hand)
 {
-    lock_acquire(&p->vm_lock);
-    ptable_t* ptable_map_zone = (ptable_t*)_mapzone.ptr;
-    const size_t ptables_per_page = VMM_PAGE_SIZE / PTABLE_SIZE;
+    uintptr_t file_victims[KSWAPD_FILE_PER_PID_THRESHOLD];
+    uintptr_t anon_victims[KSWAPD_SWAP_PER_PID_THRESHOLD];
+    size_t file_victims_cnt = 0;
+    size_t anon_victims_cnt = 0;
+
     const size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    const size_t user_space_size = table_coverage * VMM_KERNEL_TABLES_START;
+    pdirectory_t* pdir = p->pdir;
+
+    lock_acquire(&p->vm_lock);
+    if (hand->pid != p->pid) {
+        hand->pid = p->pid;
+        hand->vaddr = 0;
+    }
+
+    int scanned = 0;
+    uintptr_t vaddr = hand->vaddr;
+    for (size_t passed = 0; passed < user_space_size && scanned < KSWAPD_SCAN_PER_PID; passed += VMM_PAGE_SIZE, vaddr += VMM_PAGE_SIZE) {
+        if (vaddr >= user_space_size) {
+            vaddr = 0;
+        }
 
-    for (int pti = last_pti; pti < VMM_KERNEL_TABLES_START; pti++, last_pti++) {
-        table_desc_t* ptable_desc = &pdir->entities[pti];
+        table_desc_t* ptable_desc = &pdir->entities[VMM_OFFSET_IN_DIRECTORY(vaddr)];
         if (!table_desc_has_attrs(*ptable_desc, TABLE_DESC_PRESENT)) {
+            // Skipping the rest of the table.
+            size_t skip = table_coverage - (vaddr % table_coverage) - VMM_PAGE_SIZE;
+            passed += skip;
+            vaddr += skip;
+            continue;
+        }
+
+        // Pages of COW tables are shared with other processes.
+        if (table_desc_is_copy_on_write(*ptable_desc)) {
             continue;
         }
 
-        map_ptable(ptable_desc);
-        for (int pgi = 0; pgi < VMM_TOTAL_PAGES_PER_TABLE; pgi++) {
-            page_desc_t* ppage_desc = &ptable_map_zone[pti].entities[pgi];
-            if (!page_desc_has_attrs(*ppage_desc, PAGE_DESC_PRESENT)) {
-                continue;
+        // Large pages map fixed physical ranges, like framebuffers.
+        if (table_desc_is_large_page(*ptable_desc)) {
+            size_t skip = table_coverage - (vaddr % table_coverage) - VMM_PAGE_SIZE;
+            passed += skip;
+            vaddr += skip;
+            continue;
+        }
+
+        ptable_t* ptable = map_ptable(ptable_desc);
+        if (!ptable) {
+            break;
+        }
+
+        page_desc_t page = *_vmm_ptable_lookup(ptable, vaddr);
+        if (!page_desc_is_present(page) || vmm_is_zero_frame(page_desc_get_frame(page))) {
+            continue;
+        }
+
+        scanned++;
+        if (vmm_test_and_clear_accessed(pdir, ptable, vaddr)) {
+            _kswapd_stat.activated_pages++;
+            continue;
+        }
+
+        if (_kswapd_is_clean_file_page(page)) {
+            if (file_victims_cnt < KSWAPD_FILE_PER_PID_THRESHOLD) {
+                file_victims[file_victims_cnt++] = vaddr;
             }
+        } else if (anon_victims_cnt < KSWAPD_SWAP_PER_PID_THRESHOLD) {
+            anon_victims[anon_victims_cnt++] = vaddr;
+        }
 
-            uintptr_t victim_vaddr = table_coverage * pti + VMM_PAGE_SIZE * pgi;
-            memzone_t* zone = memzone_find(p, victim_vaddr);
-#ifdef KSWAPD_DEBUG
-            log("[kswapd] (pid %d) Find victim at %x", p->pid, victim_vaddr);
-#endif
-            vmm_swap_page(&ptable_map_zone[pti], zone, victim_vaddr);
-            after_page_swap();
-            if (moved_out_pages_per_pid >= KSWAPD_SWAP_PER_PID_THRESHOLD) {
-                lock_release(&p->vm_lock);
-                return 0;
+        if (file_victims_cnt == KSWAPD_FILE_PER_PID_THRESHOLD) {
+            vaddr += VMM_PAGE_SIZE;
+            break;
+        }
+    }
+    hand->vaddr = vaddr;
+    _kswapd_stat.scanned_pages += scanned;
+
+    for (size_t i = 0; i < file_victims_cnt; i++) {
+        if (!_kswapd_reclaim(p, pdir, file_victims[i])) {
+            _kswapd_stat.reclaimed_file_pages++;
+        }
+    }
+
+    // Anonymous pages are swapped out only if there are not enough clean ones.
+    if (file_victims_cnt < KSWAPD_FILE_PER_PID_THRESHOLD) {
+        for (size_t i = 0; i < anon_victims_cnt; i++) {
+            if (!_kswapd_reclaim(p, pdir, anon_victims[i])) {
+                _kswapd_stat.reclaimed_anon_pages++;
+                moved_out_pages_per_run++;
             }
         }
     }
@@ -93,6 +201,20 @@ static int find_victim(proc_t* p, pdirectory_t* pdir)
     return 0;
 }
 
+void kswapd_note_refault()
+{
+    atomic_add(&_kswapd_stat.refaulted_pages, 1);
+}
+
+void kswapd_get_stat(kswapd_stat_t* stat)
+{
+    stat->scanned_pages = _kswapd_stat.scanned_pages;
+    stat->activated_pages = _kswapd_stat.activated_pages;
+    stat->reclaimed_file_pages = _kswapd_stat.reclaimed_file_pages;
+    stat->reclaimed_anon_pages = _kswapd_stat.reclaimed_anon_pages;
+    stat->refaulted_pages = atomic_load(&_kswapd_stat.refaulted_pages);
+}
+
 void kswapd()
 {
     _mapzone = kmemzone_new(VMM_PAGE_SIZE);
@@ -105,21 +227,26 @@ void kswapd()
             goto sleep;
         }
 
+        // Cached blocks and pages are cheaper to drop than swapping pages out.
+        bcache_reclaim(KSWAPD_BCACHE_RECLAIM_PER_RUN);
+        pcache_reclaim(KSWAPD_PCACHE_RECLAIM_PER_RUN);
+
         proc_t* p;
         for (int i = last_pid; i < tasking_get_proc_count(); i++, last_pid++) {
             p = &proc[i];
-            if (p->status == PROC_ALIVE) {
-                find_victim(p, p->pdir);
+            if (p->status == PROC_ALIVE && !p->is_kthread && p->pdir) {
+                _kswapd_scan_proc(p, &_hands[i]);
             }
-            last_pti = 0;
-            moved_out_pages_per_pid = 0;
             if (moved_out_pages_per_run >= KSWAPD_SWAP_PER_RUN_THRESHOLD) {
+                last_pid++;
                 goto sleep;
             }
         }
         last_pid = 0;
 
     sleep:
+        // Writing out the partial cluster, so pages don't wait for the next pass in RAM.
+        swapfile_flush();
         do_sleep();
     }
-}
\ No newline at end of file
+}
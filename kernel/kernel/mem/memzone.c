@@ -8,65 +8,147 @@
 
 #include <fs/vfs.h>
 #include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
 #include <libkern/log.h>
 #include <mem/kmalloc.h>
 #include <tasking/proc.h>
 
+static kmem_cache_t* _memzone_cache;
+
 /**
- * PROC ZONING
+ * ZONE LIST
  */
 
-static inline bool _pzones_intersect(size_t start1, size_t size1, size_t start2, size_t size2)
+void memzone_init()
 {
-    size_t end1 = start1 + size1 - 1;
-    size_t end2 = start2 + size2 - 1;
-    return (start1 <= start2 && start2 <= end1) || (start1 <= end2 && end2 <= end1) || (start2 <= start1 && start1 <= end2) || (start2 <= end1 && end1 <= end2);
+    _memzone_cache = kmem_cache_create("memzone", sizeof(memzone_t));
 }
 
-static inline bool _proc_can_fixup_zone(proc_t* proc, size_t* start_ptr, int* len_ptr)
+static inline uintptr_t _memzone_end(memzone_t* zone)
 {
-    size_t zones_count = proc->zones.size;
+    return zone->start + zone->len;
+}
+
+int memzones_init(memzones_t* zones)
+{
+    zones->list = (memzone_t**)kmalloc(MEMZONES_INIT_CAPACITY * sizeof(memzone_t*));
+    if (!zones->list) {
+        return -ENOMEM;
+    }
+    zones->size = 0;
+    zones->capacity = MEMZONES_INIT_CAPACITY;
+    zones->last_hit = NULL;
+    zones->free_area_hint = 0;
+    zones->cached_hole_size = 0;
+    return 0;
+}
 
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(&proc->zones, i);
-        if (_pzones_intersect(*start_ptr, *len_ptr, zone->start, zone->len)) {
-            if (*start_ptr >= zone->start) {
-                int move = (zone->start + zone->len) - (*start_ptr);
-                *start_ptr += move;
-                *len_ptr -= move;
-            } else {
-                int move = (*start_ptr + *len_ptr) - zone->start;
-                *len_ptr -= move;
-            }
+void memzones_free(memzones_t* zones)
+{
+    for (size_t i = 0; i < zones->size; i++) {
+        kmem_cache_free(_memzone_cache, zones->list[i]);
+    }
+    kfree(zones->list);
+    zones->list = NULL;
+    zones->size = zones->capacity = 0;
+    zones->last_hit = NULL;
+}
+
+static int _memzones_reserve(memzones_t* zones, size_t capacity)
+{
+    if (capacity <= zones->capacity) {
+        return 0;
+    }
 
-            if (*len_ptr <= 0) {
-                return false;
-            }
+    size_t new_capacity = max(capacity, zones->capacity * 2);
+    memzone_t** list = (memzone_t**)krealloc(zones->list, new_capacity * sizeof(memzone_t*));
+    if (!list) {
+        return -ENOMEM;
+    }
+    zones->list = list;
+    zones->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Returns the index of the first zone which ends after the addr.
+ */
+static size_t _memzones_lower_bound(memzones_t* zones, uintptr_t addr)
+{
+    size_t lo = 0;
+    size_t hi = zones->size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (_memzone_end(zones->list[mid]) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    return true;
+static bool _memzones_can_add(memzones_t* zones, uintptr_t start, size_t len)
+{
+    if (start + len < start) {
+        return false;
+    }
+
+    size_t idx = _memzones_lower_bound(zones, start);
+    return idx == zones->size || zones->list[idx]->start >= start + len;
+}
+
+static memzone_t* _memzones_insert(memzones_t* zones, memzone_t* new_zone)
+{
+    if (_memzones_reserve(zones, zones->size + 1)) {
+        return NULL;
+    }
+
+    memzone_t* zone = (memzone_t*)kmem_cache_alloc(_memzone_cache);
+    if (!zone) {
+        return NULL;
+    }
+    *zone = *new_zone;
+
+    size_t idx = _memzones_lower_bound(zones, zone->start);
+    memmove(&zones->list[idx + 1], &zones->list[idx], (zones->size - idx) * sizeof(memzone_t*));
+    zones->list[idx] = zone;
+    zones->size++;
+    return zone;
 }
 
-static inline bool _proc_can_add_zone(proc_t* proc, size_t start, size_t len)
+int memzones_copy(memzones_t* to, memzones_t* from)
 {
-    size_t zones_count = proc->zones.size;
+    int err = _memzones_reserve(to, from->size);
+    if (err) {
+        return err;
+    }
 
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(&proc->zones, i);
-        if (_pzones_intersect(start, len, zone->start, zone->len)) {
-            return false;
+    // The source is sorted already, so zones are just appended.
+    for (size_t i = 0; i < from->size; i++) {
+        memzone_t* zone = (memzone_t*)kmem_cache_alloc(_memzone_cache);
+        if (!zone) {
+            return -ENOMEM;
         }
+        *zone = *from->list[i];
+        to->list[to->size++] = zone;
     }
-
-    return true;
+    to->free_area_hint = from->free_area_hint;
+    to->cached_hole_size = from->cached_hole_size;
+    return 0;
 }
 
-static inline void _proc_swap_zones(memzone_t* one, memzone_t* two)
+/**
+ * PROC ZONING
+ */
+
+static inline void _memzone_align(size_t* start, size_t* len)
 {
-    memzone_t tmp = *one;
-    *one = *two;
-    *two = tmp;
+    *len += (*start & (VMM_PAGE_SIZE - 1));
+    *start &= ~(VMM_PAGE_SIZE - 1);
+    if (*len % VMM_PAGE_SIZE) {
+        *len += VMM_PAGE_SIZE - (*len % VMM_PAGE_SIZE);
+    }
 }
 
 /**
@@ -74,35 +156,37 @@ static inline void _proc_swap_zones(memzone_t* one, memzone_t* two)
  */
 memzone_t* memzone_extend(proc_t* proc, size_t start, size_t len)
 {
-    len += (start & (VMM_PAGE_SIZE - 1));
-    start &= ~(VMM_PAGE_SIZE - 1);
-    if (len % VMM_PAGE_SIZE) {
-        len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
+    _memzone_align(&start, &len);
+
+    // Cutting the range by zones which it overlaps.
+    memzones_t* zones = &proc->zones;
+    size_t idx = _memzones_lower_bound(zones, start);
+    uintptr_t end = start + len;
+    for (; idx < zones->size && zones->list[idx]->start < end; idx++) {
+        memzone_t* zone = zones->list[idx];
+        if (zone->start <= start) {
+            start = _memzone_end(zone);
+        } else {
+            end = zone->start;
+            break;
+        }
+    }
+
+    if (end <= start) {
+        return NULL;
     }
 
     memzone_t new_zone = { 0 };
+    new_zone.start = start;
+    new_zone.len = end - start;
     new_zone.type = 0;
     new_zone.flags = ZONE_USER;
-
-    if (_proc_can_fixup_zone(proc, &start, (int*)&len)) {
-        new_zone.start = start;
-        new_zone.len = len;
-        if (!dynarr_push(&proc->zones, &new_zone)) {
-            return NULL;
-        }
-        return (memzone_t*)dynarr_get(&proc->zones, proc->zones.size - 1);
-    }
-
-    return NULL;
+    return _memzones_insert(zones, &new_zone);
 }
 
 memzone_t* memzone_new(proc_t* proc, size_t start, size_t len)
 {
-    len += (start & (VMM_PAGE_SIZE - 1));
-    start &= ~(VMM_PAGE_SIZE - 1);
-    if (len % VMM_PAGE_SIZE) {
-        len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
-    }
+    _memzone_align(&start, &len);
 
     memzone_t new_zone = { 0 };
     new_zone.start = start;
@@ -111,90 +195,119 @@ memzone_t* memzone_new(proc_t* proc, size_t start, size_t len)
     new_zone.flags = ZONE_USER;
     new_zone.ops = NULL;
 
-    if (_proc_can_add_zone(proc, start, len)) {
-        if (!dynarr_push(&proc->zones, &new_zone)) {
-            return NULL;
-        }
-        return (memzone_t*)dynarr_get(&proc->zones, proc->zones.size - 1);
+    if (_memzones_can_add(&proc->zones, start, len)) {
+        return _memzones_insert(&proc->zones, &new_zone);
     }
     return NULL;
 }
 
-/* FIXME: Think of more efficient way */
-memzone_t* memzone_new_random(proc_t* proc, size_t len)
+/**
+ * Looks for the lowest hole of the len starting from the addr. Sizes of the
+ * holes which are passed are accumulated into cached_hole_size.
+ */
+static bool _memzone_first_fit(memzones_t* zones, uintptr_t addr, size_t len, uintptr_t* res)
 {
-    if (len % VMM_PAGE_SIZE) {
-        len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
+    for (size_t idx = _memzones_lower_bound(zones, addr); idx < zones->size; idx++) {
+        memzone_t* zone = zones->list[idx];
+        if (zone->start >= addr + len) {
+            *res = addr;
+            return true;
+        }
+        if (zone->start > addr) {
+            zones->cached_hole_size = max(zones->cached_hole_size, zone->start - addr);
+        }
+        addr = max(addr, _memzone_end(zone));
     }
 
-    size_t zones_count = proc->zones.size;
-
-    /* Check if we can put it at the beginning */
-    memzone_t* ret = memzone_new(proc, 0, len);
-    if (ret) {
-        return ret;
+    if (addr + len < addr || addr + len > KERNEL_BASE) {
+        return false;
     }
+    *res = addr;
+    return true;
+}
 
-    size_t min_start = 0xffffffff;
+memzone_t* memzone_new_random(proc_t* proc, size_t len)
+{
+    if (len % VMM_PAGE_SIZE) {
+        len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
+    }
 
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(&proc->zones, i);
-        if (_proc_can_add_zone(proc, zone->start + zone->len, len)) {
-            if (min_start > zone->start + zone->len) {
-                min_start = zone->start + zone->len;
-            }
+    // The search is started from the hint, unless a hole below it could fit.
+    memzones_t* zones = &proc->zones;
+    uintptr_t start;
+    if (len <= zones->cached_hole_size || !_memzone_first_fit(zones, zones->free_area_hint, len, &start)) {
+        zones->cached_hole_size = 0;
+        if (!_memzone_first_fit(zones, 0, len, &start)) {
+            return NULL;
         }
     }
 
-    if (min_start == 0xffffffff) {
-        return NULL;
+    memzone_t* zone = memzone_new(proc, start, len);
+    if (zone) {
+        zones->free_area_hint = _memzone_end(zone);
     }
-
-    return memzone_new(proc, min_start, len);
+    return zone;
 }
 
-/* FIXME: Think of more efficient way */
-memzone_t* memzone_new_random_backward(proc_t* proc, size_t len)
+/**
+ * Places the zone at the lowest hole which fits it with the alignment. Is
+ * used to let large mappings use large pages, so the hint is not involved.
+ */
+memzone_t* memzone_new_random_aligned(proc_t* proc, size_t len, size_t alignment)
 {
     if (len % VMM_PAGE_SIZE) {
         len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
     }
 
-    size_t zones_count = proc->zones.size;
-
-    /* Check if we can put it at the end */
-    memzone_t* ret = memzone_new(proc, KERNEL_BASE - len, len);
-    if (ret) {
-        return ret;
+    memzones_t* zones = &proc->zones;
+    uintptr_t addr = 0;
+    for (size_t idx = 0; idx <= zones->size; idx++) {
+        uintptr_t hole_end = idx < zones->size ? zones->list[idx]->start : KERNEL_BASE;
+        uintptr_t start = ROUND_CEIL(addr, alignment);
+        if (start >= addr && start + len > start && start + len <= hole_end) {
+            return memzone_new(proc, start, len);
+        }
+        if (idx < zones->size) {
+            addr = max(addr, _memzone_end(zones->list[idx]));
+        }
     }
+    return NULL;
+}
 
-    size_t max_end = 0;
+memzone_t* memzone_new_random_backward(proc_t* proc, size_t len)
+{
+    if (len % VMM_PAGE_SIZE) {
+        len += VMM_PAGE_SIZE - (len % VMM_PAGE_SIZE);
+    }
 
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(&proc->zones, i);
-        if (_proc_can_add_zone(proc, zone->start - len, len)) {
-            if (max_end < zone->start) {
-                max_end = zone->start;
-            }
+    // Looking for the highest hole.
+    memzones_t* zones = &proc->zones;
+    uintptr_t end = KERNEL_BASE;
+    for (size_t i = zones->size; i > 0; i--) {
+        memzone_t* zone = zones->list[i - 1];
+        if (_memzone_end(zone) + len <= end) {
+            break;
         }
+        end = min(end, zone->start);
     }
 
-    if (max_end == 0) {
+    if (end < len) {
         return NULL;
     }
-
-    return memzone_new(proc, max_end - len, len);
+    return memzone_new(proc, end - len, len);
 }
 
-memzone_t* memzone_find_no_proc(dynamic_array_t* zones, size_t addr)
+memzone_t* memzone_find_no_proc(memzones_t* zones, size_t addr)
 {
-    size_t zones_count = zones->size;
+    memzone_t* last_hit = zones->last_hit;
+    if (last_hit && last_hit->start <= addr && addr < _memzone_end(last_hit)) {
+        return last_hit;
+    }
 
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(zones, i);
-        if (zone->start <= addr && addr < zone->start + zone->len) {
-            return zone;
-        }
+    size_t idx = _memzones_lower_bound(zones, addr);
+    if (idx < zones->size && zones->list[idx]->start <= addr) {
+        zones->last_hit = zones->list[idx];
+        return zones->list[idx];
     }
 
     return NULL;
@@ -205,23 +318,27 @@ memzone_t* memzone_find(proc_t* proc, size_t addr)
     return memzone_find_no_proc(&proc->zones, addr);
 }
 
-int memzone_free_no_proc(dynamic_array_t* zones, memzone_t* givzone)
+int memzone_free_no_proc(memzones_t* zones, memzone_t* givzone)
 {
-    size_t zones_count = zones->size;
-
-    for (size_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(zones, i);
-        if (givzone == zone) {
-            _proc_swap_zones(zone, dynarr_get(zones, zones_count - 1));
-            dynarr_pop(zones);
-            return 0;
-        }
+    size_t idx = _memzones_lower_bound(zones, givzone->start);
+    if (idx == zones->size || zones->list[idx] != givzone) {
+        return -EALREADY;
     }
 
-    return -EALREADY;
+    memmove(&zones->list[idx], &zones->list[idx + 1], (zones->size - idx - 1) * sizeof(memzone_t*));
+    zones->size--;
+
+    if (zones->last_hit == givzone) {
+        zones->last_hit = NULL;
+    }
+    if (givzone->start < zones->free_area_hint) {
+        zones->free_area_hint = givzone->start;
+    }
+    kmem_cache_free(_memzone_cache, givzone);
+    return 0;
 }
 
 int memzone_free(proc_t* proc, memzone_t* givzone)
 {
     return memzone_free_no_proc(&proc->zones, givzone);
-}
\ No newline at end of file
+}
@@ -7,16 +7,62 @@
  */
 
 #include <algo/bitmap.h>
+#include <libkern/atomic.h>
+#include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
+#include <libkern/lock.h>
 #include <libkern/log.h>
+#include <libkern/platform.h>
 #include <mem/pmm.h>
+#include <platform/generic/cpu.h>
+#include <platform/generic/system.h>
+#include <platform/generic/vmm/consts.h>
 
 // define DEBUG_PMM
 
+#define PMM_PAGE_BLOCKS (VMM_PAGE_SIZE / PMM_BLOCK_SIZE)
+
+/**
+ * Free memory is kept by a buddy allocator. A free block of order k covers
+ * 2^k blocks and is aligned to its size. Every order has a bitmap with a bit
+ * per block of the order, which is set when the block is free and its buddy
+ * is not, and a summary bitmap with a bit per non-empty word of the first
+ * one. So the lowest free block of an order is found by scanning the summary,
+ * and an allocation or a free touches a couple of words per order.
+ *
+ * The MAT is kept in sync with the buddy: a bit is set for every block which
+ * is not free in the buddy, including pages held by per-CPU lists.
+ *
+ * Every CPU keeps a short list of free pages, which is used with interrupts
+ * disabled and without taking _pmm_lock. It is refilled and drained in
+ * batches.
+ */
+
+struct pmm_order {
+    uint32_t* words;
+    uint32_t* summary;
+    size_t nbits;
+    size_t nwords;
+    size_t nsummary;
+    size_t hint; // No summary words below the hint are set.
+    size_t free;
+};
+typedef struct pmm_order pmm_order_t;
+
+struct pmm_pcp {
+    uint32_t count;
+    uint32_t blocks[PMM_PCP_SIZE];
+};
+typedef struct pmm_pcp pmm_pcp_t;
+
 static void _pmm_init_ram();
 static void _pmm_allocate_mat();
 
 static pmm_state_t pmm_state;
+static lock_t _pmm_lock;
+static pmm_order_t _pmm_orders[PMM_MAX_ORDER + 1];
+static pmm_pcp_t _pmm_pcp[CPU_CNT];
+static int _pmm_page_order;
 
 static inline void* _pmm_block_id_to_ptr(size_t value)
 {
@@ -28,6 +74,15 @@ static inline size_t _pmm_ptr_to_block_id(void* value)
     return ((uintptr_t)value - pmm_state.ram_offset) / PMM_BLOCK_SIZE;
 }
 
+static inline int _pmm_order_of(size_t count)
+{
+    int order = 0;
+    while ((1u << order) < count) {
+        order++;
+    }
+    return order;
+}
+
 void _pmm_mark_avail_region(size_t region_start, size_t region_len)
 {
     region_start = ROUND_CEIL(region_start, PMM_BLOCK_SIZE) - pmm_state.ram_offset;
@@ -39,7 +94,6 @@ void _pmm_mark_avail_region(size_t region_start, size_t region_len)
     size_t block_id = region_start / PMM_BLOCK_SIZE;
     size_t blocks_len = region_len / PMM_BLOCK_SIZE;
 
-    pmm_state.used_blocks -= blocks_len;
     bitmap_unset_range(pmm_state.mat, block_id, blocks_len);
 }
 
@@ -54,11 +108,235 @@ void _pmm_mark_used_region(size_t region_start, size_t region_len)
     size_t block_id = region_start / PMM_BLOCK_SIZE;
     size_t blocks_len = region_len / PMM_BLOCK_SIZE;
 
-    pmm_state.used_blocks -= blocks_len;
-
     bitmap_set_range(pmm_state.mat, block_id, blocks_len);
 }
 
+/**
+ * BUDDY
+ */
+
+static inline bool _pmm_order_test(int order, size_t index)
+{
+    pmm_order_t* ord = &_pmm_orders[order];
+    return (ord->words[index / 32] >> (index % 32)) & 1;
+}
+
+static inline void _pmm_order_set(int order, size_t index)
+{
+    pmm_order_t* ord = &_pmm_orders[order];
+    size_t word = index / 32;
+    ord->words[word] |= (1u << (index % 32));
+    ord->summary[word / 32] |= (1u << (word % 32));
+    ord->hint = min(ord->hint, word / 32);
+    ord->free++;
+}
+
+static inline void _pmm_order_clear(int order, size_t index)
+{
+    pmm_order_t* ord = &_pmm_orders[order];
+    size_t word = index / 32;
+    ord->words[word] &= ~(1u << (index % 32));
+    if (!ord->words[word]) {
+        ord->summary[word / 32] &= ~(1u << (word % 32));
+    }
+    ord->free--;
+}
+
+static int _pmm_order_find_first(int order)
+{
+    pmm_order_t* ord = &_pmm_orders[order];
+    if (!ord->free) {
+        return -ENOMEM;
+    }
+
+    for (size_t s = ord->hint; s < ord->nsummary; s++) {
+        if (ord->summary[s]) {
+            ord->hint = s;
+            size_t word = s * 32 + ctz32(ord->summary[s]);
+            return word * 32 + ctz32(ord->words[word]);
+        }
+    }
+    ord->hint = ord->nsummary;
+    return -ENOMEM;
+}
+
+/**
+ * Places the maps of all orders at area and returns their size in bytes.
+ */
+static size_t _pmm_init_orders(uint8_t* area)
+{
+    uint32_t* ptr = (uint32_t*)area;
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        pmm_order_t* ord = &_pmm_orders[order];
+        ord->nbits = pmm_state.max_blocks >> order;
+        ord->nwords = (ord->nbits + 31) / 32;
+        ord->nsummary = (ord->nwords + 31) / 32;
+        ord->words = ptr;
+        ptr += ord->nwords;
+        ord->summary = ptr;
+        ptr += ord->nsummary;
+        ord->hint = 0;
+        ord->free = 0;
+    }
+
+    size_t size = (uintptr_t)ptr - (uintptr_t)area;
+    memset(area, 0, size);
+    return size;
+}
+
+static void _pmm_buddy_free_lockless(size_t block, int order)
+{
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = block ^ (1u << order);
+        if ((buddy >> order) >= _pmm_orders[order].nbits || !_pmm_order_test(order, buddy >> order)) {
+            break;
+        }
+        _pmm_order_clear(order, buddy >> order);
+        block &= ~(1u << order);
+        order++;
+    }
+    _pmm_order_set(order, block >> order);
+}
+
+static int _pmm_buddy_alloc_lockless(int order)
+{
+    for (int cur = order; cur <= PMM_MAX_ORDER; cur++) {
+        int index = _pmm_order_find_first(cur);
+        if (index < 0) {
+            continue;
+        }
+
+        _pmm_order_clear(cur, index);
+        size_t block = (size_t)index << cur;
+
+        // Splitting the block, upper halves stay free.
+        while (cur > order) {
+            cur--;
+            _pmm_order_set(cur, (block >> cur) + 1);
+        }
+        return block;
+    }
+    return -ENOMEM;
+}
+
+/**
+ * Gives a range of blocks back to the buddy as the largest aligned blocks
+ * which fit into it.
+ */
+static void _pmm_free_range_lockless(size_t block, size_t count)
+{
+    bitmap_unset_range(pmm_state.mat, block, count);
+    while (count) {
+        int order = block ? min(ctz32(block), PMM_MAX_ORDER) : PMM_MAX_ORDER;
+        while ((1u << order) > count) {
+            order--;
+        }
+        _pmm_buddy_free_lockless(block, order);
+        block += (1u << order);
+        count -= (1u << order);
+    }
+}
+
+static int _pmm_alloc_range_lockless(size_t count, int align_order)
+{
+    int order = max(_pmm_order_of(count), align_order);
+    if (order > PMM_MAX_ORDER) {
+        return -ENOMEM;
+    }
+
+    int block = _pmm_buddy_alloc_lockless(order);
+    if (block < 0) {
+        return block;
+    }
+
+    bitmap_set_range(pmm_state.mat, block, (1u << order));
+    if (count < (1u << order)) {
+        _pmm_free_range_lockless(block + count, (1u << order) - count);
+    }
+    return block;
+}
+
+static void _pmm_init_buddy()
+{
+    uint32_t* mat = (uint32_t*)pmm_state.mat.data;
+    size_t free_blocks = 0;
+    size_t run_start = 0;
+    size_t run_len = 0;
+
+    for (size_t block = 0; block < pmm_state.max_blocks; block++) {
+        if (!((mat[block / 32] >> (block % 32)) & 1)) {
+            if (!run_len) {
+                run_start = block;
+            }
+            run_len++;
+            continue;
+        }
+
+        if (run_len) {
+            _pmm_free_range_lockless(run_start, run_len);
+            free_blocks += run_len;
+            run_len = 0;
+        }
+    }
+
+    if (run_len) {
+        _pmm_free_range_lockless(run_start, run_len);
+        free_blocks += run_len;
+    }
+    pmm_state.used_blocks = pmm_state.max_blocks - free_blocks;
+}
+
+/**
+ * PER-CPU PAGES
+ */
+
+static int _pmm_pcp_alloc()
+{
+    system_disable_interrupts();
+    pmm_pcp_t* pcp = &_pmm_pcp[system_cpu_id()];
+    if (!pcp->count) {
+        lock_acquire(&_pmm_lock);
+        while (pcp->count < PMM_PCP_BATCH) {
+            int block = _pmm_alloc_range_lockless(PMM_PAGE_BLOCKS, _pmm_page_order);
+            if (block < 0) {
+                break;
+            }
+            pcp->blocks[pcp->count++] = block;
+        }
+        lock_release(&_pmm_lock);
+    }
+
+    int block = -ENOMEM;
+    if (pcp->count) {
+        block = pcp->blocks[--pcp->count];
+    }
+    system_enable_interrupts();
+    return block;
+}
+
+static void _pmm_pcp_free(uint32_t block)
+{
+    system_disable_interrupts();
+    pmm_pcp_t* pcp = &_pmm_pcp[system_cpu_id()];
+    if (pcp->count == PMM_PCP_SIZE) {
+        lock_acquire(&_pmm_lock);
+        for (int i = 0; i < PMM_PCP_BATCH; i++) {
+            _pmm_free_range_lockless(pcp->blocks[i], PMM_PAGE_BLOCKS);
+        }
+        for (int i = PMM_PCP_BATCH; i < pcp->count; i++) {
+            pcp->blocks[i - PMM_PCP_BATCH] = pcp->blocks[i];
+        }
+        pcp->count -= PMM_PCP_BATCH;
+        lock_release(&_pmm_lock);
+    }
+    pcp->blocks[pcp->count++] = block;
+    system_enable_interrupts();
+}
+
+/**
+ * INITIALIZATION
+ */
+
 static void _pmm_init_ram()
 {
     pmm_state.ram_offset = (size_t)-1;
@@ -79,7 +357,11 @@ static void _pmm_allocate_mat()
     pmm_state.mat = bitmap_wrap((void*)(pmm_state.kernel_va_base + pmm_state.kernel_size), mat_cover_len / PMM_BLOCK_SIZE);
     pmm_state.max_blocks = mat_cover_len / PMM_BLOCK_SIZE;
     pmm_state.used_blocks = pmm_state.max_blocks;
-    memset(pmm_state.mat.data, 0xff, pmm_state.mat.len / 8);
+    memset(pmm_state.mat.data, 0xff, ROUND_CEIL(pmm_state.mat.len, 32) / 8);
+
+    // Maps of the buddy follow the MAT.
+    size_t mat_size = ROUND_CEIL(pmm_state.mat.len, 32) / 8;
+    pmm_state.meta_size = mat_size + _pmm_init_orders(pmm_state.mat.data + mat_size);
 }
 
 static void _pmm_init_mat()
@@ -113,59 +395,67 @@ static void _pmm_init_from_desc(boot_desc_t* boot_desc)
     // Marking kernel as used.
     _pmm_mark_used_region(boot_desc->paddr, boot_desc->kernel_size * 1024);
 
-    // Marking MAT as used.
+    // Marking MAT and buddy maps as used.
     size_t mat_pa_base = (size_t)pmm_state.mat.data - boot_desc->vaddr + boot_desc->paddr;
-    _pmm_mark_used_region(mat_pa_base, pmm_state.mat.len / 8);
+    _pmm_mark_used_region(mat_pa_base, pmm_state.meta_size);
+
+    _pmm_init_buddy();
 }
 
 void pmm_setup(boot_desc_t* boot_desc)
 {
+    lock_init(&_pmm_lock);
+    _pmm_page_order = _pmm_order_of(PMM_PAGE_BLOCKS);
     _pmm_init_from_desc(boot_desc);
 }
 
-static void* pmm_alloc_blocks(size_t count)
+/**
+ * API FUNCTIONS
+ */
+
+static void* pmm_alloc_blocks(size_t count, int align_order)
 {
-    int block_id = bitmap_find_space(pmm_state.mat, count);
-    if (block_id < 0) {
-        return NULL;
+    int block_id;
+    if (count == PMM_PAGE_BLOCKS && align_order <= _pmm_page_order) {
+        block_id = _pmm_pcp_alloc();
+    } else {
+        lock_acquire(&_pmm_lock);
+        block_id = _pmm_alloc_range_lockless(count, align_order);
+        lock_release(&_pmm_lock);
     }
-    bitmap_set_range(pmm_state.mat, block_id, count);
-    pmm_state.used_blocks += count;
-    return _pmm_block_id_to_ptr(block_id);
-}
 
-static void* pmm_alloc_blocks_aligned(size_t count, size_t align)
-{
-    int block_id = bitmap_find_space_aligned(pmm_state.mat, count, align);
     if (block_id < 0) {
         return NULL;
     }
-
-    bitmap_set_range(pmm_state.mat, block_id, count);
-    pmm_state.used_blocks += count;
+    atomic_add(&pmm_state.used_blocks, count);
     return _pmm_block_id_to_ptr(block_id);
 }
 
 static int pmm_free_blocks(size_t block_id, size_t count)
 {
-    pmm_state.used_blocks -= count;
-    return bitmap_unset_range(pmm_state.mat, block_id, count);
+    atomic_add(&pmm_state.used_blocks, -count);
+    if (count == PMM_PAGE_BLOCKS && (block_id % PMM_PAGE_BLOCKS) == 0) {
+        _pmm_pcp_free(block_id);
+        return 0;
+    }
+
+    lock_acquire(&_pmm_lock);
+    _pmm_free_range_lockless(block_id, count);
+    lock_release(&_pmm_lock);
+    return 0;
 }
 
 void* pmm_alloc(size_t size)
 {
     size_t block_count = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
-    return pmm_alloc_blocks(block_count);
+    return pmm_alloc_blocks(block_count, 0);
 }
 
 void* pmm_alloc_aligned(size_t size, size_t align)
 {
     size_t block_count = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
     size_t block_align = (align + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
-    if (block_align == 1) {
-        return pmm_alloc_blocks(block_count);
-    }
-    return pmm_alloc_blocks_aligned(block_count, block_align);
+    return pmm_alloc_blocks(block_count, _pmm_order_of(block_align));
 }
 
 int pmm_free(void* block, size_t size)
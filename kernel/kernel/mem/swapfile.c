@@ -6,16 +6,86 @@
  * found in the LICENSE file.
  */
 
+#include <algo/bitmap.h>
+#include <algo/lz.h>
 #include <fs/vfs.h>
 #include <libkern/bits/errno.h>
+#include <libkern/libkern.h>
+#include <libkern/lock.h>
 #include <libkern/log.h>
+#include <mem/kmalloc.h>
+#include <mem/kmemzone.h>
 #include <mem/swapfile.h>
+#include <mem/vmm.h>
 
+// #define SWAPFILE_DEBUG
+#define SWAPFILE_COMPRESSION
+
+/**
+ * Swapped out pages are kept in two tiers. Pages which compress well stay
+ * in memory in the compressed tier, the rest goes to slots of the swapfile.
+ * The compressed tier has its own zone, cut into chunks which are tracked
+ * with a bitmap, so it never takes space of kmalloc. Frames of the zone are
+ * allocated on the first write to them.
+ * Slots are tracked with a bitmap and are reused once freed. A stored page
+ * is staged in the cluster buffer first. The cluster is written with one
+ * write per run of neighbouring slots, when it is full or on swapfile_flush().
+ * Ids are 1-based, since 0 in a page descriptor means that a page is not
+ * swapped.
+ */
+
+struct swapfile_staged {
+    int slot;
+    bool live;
+};
+typedef struct swapfile_staged swapfile_staged_t;
+
+static lock_t _swapfile_lock;
 static dentry_t* _swapfile = NULL;
-static int _nextid = 0;
+// The bitmap is scanned by words, so the storage is word aligned.
+static uint32_t _slots_bitmap_data[SWAPFILE_MAX_SLOTS / 32];
+static bitmap_t _slots_bitmap;
+static int _slots_in_file = 0;
+
+static swapfile_staged_t _staged[SWAPFILE_CLUSTER_PAGES];
+static int _staged_count = 0;
+static uint8_t* _staging_buf = NULL;
+
+static swapfile_stat_t _swapfile_stat;
+
+#ifdef SWAPFILE_COMPRESSION
+#define SWAPFILE_COMPRESSED_CHUNKS (SWAPFILE_COMPRESSED_LIMIT / SWAPFILE_COMPRESSED_CHUNK_SIZE)
+
+struct swapfile_zpage {
+    int chunk;
+    size_t len; // 0 if the entry is free.
+};
+typedef struct swapfile_zpage swapfile_zpage_t;
+
+static kmemzone_t _zzone;
+static uint32_t _zchunks_bitmap_data[SWAPFILE_COMPRESSED_CHUNKS / 32];
+static bitmap_t _zchunks_bitmap;
+static swapfile_zpage_t _zpages[SWAPFILE_COMPRESSED_SLOTS];
+static int _zpages_hint = 0;
+static uint8_t _zbuf[SWAPFILE_COMPRESSED_MAX_OBJ_SIZE];
+static lz_hash_table_t _ztable;
+#endif // SWAPFILE_COMPRESSION
+
+static inline bool _swapfile_slot_is_used(int slot)
+{
+    return (_slots_bitmap.data[slot / 8] >> (slot % 8)) & 1;
+}
 
 int swapfile_init()
 {
+    lock_init(&_swapfile_lock);
+    _slots_bitmap = bitmap_wrap((uint8_t*)_slots_bitmap_data, SWAPFILE_MAX_SLOTS);
+    _staging_buf = kmalloc(SWAPFILE_CLUSTER_PAGES * VMM_PAGE_SIZE);
+#ifdef SWAPFILE_COMPRESSION
+    _zzone = kmemzone_new(SWAPFILE_COMPRESSED_LIMIT);
+    _zchunks_bitmap = bitmap_wrap((uint8_t*)_zchunks_bitmap_data, SWAPFILE_COMPRESSED_CHUNKS);
+#endif
+
     dentry_t* var_dir = NULL;
     if (vfs_resolve_path("/var", &var_dir) < 0) {
         // Instead of panicing we can create the dir here.
@@ -30,28 +100,281 @@ int swapfile_init()
     return 0;
 }
 
-int swapfile_load(uintptr_t vaddr, int id)
+/**
+ * COMPRESSED TIER
+ */
+
+#ifdef SWAPFILE_COMPRESSION
+static inline int _swapfile_zchunks(size_t len)
 {
-    if (!_swapfile) {
-        return -ENODEV;
+    return (len + SWAPFILE_COMPRESSED_CHUNK_SIZE - 1) / SWAPFILE_COMPRESSED_CHUNK_SIZE;
+}
+
+static inline uint8_t* _swapfile_zdata(int idx)
+{
+    return (uint8_t*)(_zzone.start + _zpages[idx].chunk * SWAPFILE_COMPRESSED_CHUNK_SIZE);
+}
+
+static int _swapfile_store_compressed_lockless(uintptr_t vaddr)
+{
+    size_t len = lz_compress((uint8_t*)PAGE_START(vaddr), VMM_PAGE_SIZE, _zbuf, SWAPFILE_COMPRESSED_MAX_OBJ_SIZE, _ztable);
+    if (!len) {
+        return -EFBIG;
+    }
+
+    for (int i = 0; i < SWAPFILE_COMPRESSED_SLOTS; i++) {
+        int idx = (_zpages_hint + i) % SWAPFILE_COMPRESSED_SLOTS;
+        if (_zpages[idx].len) {
+            continue;
+        }
+
+        // When the zone is full, the page goes to the file tier.
+        int chunk = bitmap_find_space(_zchunks_bitmap, _swapfile_zchunks(len));
+        if (chunk < 0) {
+            return -ENOSPC;
+        }
+        bitmap_set_range(_zchunks_bitmap, chunk, _swapfile_zchunks(len));
+
+        _zpages[idx].chunk = chunk;
+        _zpages[idx].len = len;
+        uint8_t* data = _swapfile_zdata(idx);
+        vmm_prepare_active_pdir_for_writing_at((uintptr_t)data, len);
+        memcpy(data, _zbuf, len);
+        _zpages_hint = idx + 1;
+        _swapfile_stat.compressed_pages++;
+        _swapfile_stat.compressed_bytes += len;
+        return (idx + 1) | SWAPFILE_COMPRESSED_ID_FLAG;
     }
+    return -ENOSPC;
+}
 
-    if (id > _nextid) {
+static int _swapfile_load_compressed_lockless(uintptr_t vaddr, int idx)
+{
+    if (idx < 0 || idx >= SWAPFILE_COMPRESSED_SLOTS || !_zpages[idx].len) {
         return -ENOENT;
     }
 
-    size_t offset = (id - 1) * VMM_PAGE_SIZE;
-    _swapfile->ops->file.read(_swapfile, (void*)PAGE_START(vaddr), offset, VMM_PAGE_SIZE);
+    int res = lz_decompress(_swapfile_zdata(idx), _zpages[idx].len, (uint8_t*)PAGE_START(vaddr), VMM_PAGE_SIZE);
+    if (res != VMM_PAGE_SIZE) {
+        return -EIO;
+    }
     return 0;
 }
 
-int swapfile_store(uintptr_t vaddr)
+static void _swapfile_free_compressed_lockless(int idx)
+{
+    if (idx < 0 || idx >= SWAPFILE_COMPRESSED_SLOTS || !_zpages[idx].len) {
+        return;
+    }
+
+    bitmap_unset_range(_zchunks_bitmap, _zpages[idx].chunk, _swapfile_zchunks(_zpages[idx].len));
+    _swapfile_stat.compressed_pages--;
+    _swapfile_stat.compressed_bytes -= _zpages[idx].len;
+    _zpages[idx].chunk = 0;
+    _zpages[idx].len = 0;
+    _zpages_hint = min(_zpages_hint, idx);
+}
+#endif // SWAPFILE_COMPRESSION
+
+/**
+ * FILE TIER
+ */
+
+static int _swapfile_staged_index(int slot)
+{
+    for (int i = 0; i < _staged_count; i++) {
+        if (_staged[i].slot == slot) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Slots of the cluster are taken one after another when possible, so the
+ * cluster is written with a single write.
+ */
+static int _swapfile_alloc_slot_lockless()
+{
+    int slot = -1;
+    if (_staged_count) {
+        int next = _staged[_staged_count - 1].slot + 1;
+        if (next < SWAPFILE_MAX_SLOTS && !_swapfile_slot_is_used(next)) {
+            slot = next;
+        }
+    }
+
+    if (slot < 0) {
+        slot = bitmap_find_space(_slots_bitmap, 1);
+        if (slot < 0) {
+            return -ENOSPC;
+        }
+    }
+
+    bitmap_set(_slots_bitmap, slot);
+    return slot;
+}
+
+/**
+ * Slots are written in the order of the cluster. A slot which was freed
+ * while being staged is still written, so the file has no holes.
+ */
+static int _swapfile_flush_lockless()
 {
+    int run_start = 0;
+    for (int i = 1; i <= _staged_count; i++) {
+        if (i < _staged_count && _staged[i].slot == _staged[i - 1].slot + 1) {
+            continue;
+        }
+
+        int slot = _staged[run_start].slot;
+        size_t len = (i - run_start) * VMM_PAGE_SIZE;
+        int err = _swapfile->ops->file.write(_swapfile, _staging_buf + run_start * VMM_PAGE_SIZE, slot * VMM_PAGE_SIZE, len);
+        if (err < 0) {
+            log_error("[swap] Cluster write failed: %d", err);
+            return err;
+        }
+#ifdef SWAPFILE_DEBUG
+        log("[swap] Wrote slots %d-%d", slot, slot + (i - run_start) - 1);
+#endif
+        _swapfile_stat.file_writes++;
+        _slots_in_file = max(_slots_in_file, slot + (i - run_start));
+        run_start = i;
+    }
+
+    _staged_count = 0;
+    return 0;
+}
+
+static int _swapfile_store_to_file_lockless(uintptr_t vaddr)
+{
+    if (!_swapfile || !_staging_buf) {
+        return -ENODEV;
+    }
+
+    int slot = _swapfile_alloc_slot_lockless();
+    if (slot < 0) {
+        return slot;
+    }
+
+    // The slot could be freed and taken again while it is still staged.
+    int idx = _swapfile_staged_index(slot);
+    if (idx < 0) {
+        if (_staged_count == SWAPFILE_CLUSTER_PAGES) {
+            int err = _swapfile_flush_lockless();
+            if (err) {
+                bitmap_unset(_slots_bitmap, slot);
+                return err;
+            }
+        }
+        idx = _staged_count++;
+        _staged[idx].slot = slot;
+    }
+
+    _staged[idx].live = true;
+    memcpy(_staging_buf + idx * VMM_PAGE_SIZE, (void*)PAGE_START(vaddr), VMM_PAGE_SIZE);
+    _swapfile_stat.file_pages++;
+    return slot + 1;
+}
+
+static int _swapfile_load_from_file_lockless(uintptr_t vaddr, int slot)
+{
+    if (slot < 0 || slot >= SWAPFILE_MAX_SLOTS || !_swapfile_slot_is_used(slot)) {
+        return -ENOENT;
+    }
+
+    int idx = _swapfile_staged_index(slot);
+    if (idx >= 0) {
+        memcpy((void*)PAGE_START(vaddr), _staging_buf + idx * VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+        return 0;
+    }
+
     if (!_swapfile) {
         return -ENODEV;
     }
 
-    _swapfile->ops->file.write(_swapfile, (void*)PAGE_START(vaddr), _nextid * VMM_PAGE_SIZE, VMM_PAGE_SIZE);
-    _nextid++;
-    return _nextid;
-}
\ No newline at end of file
+    int res = _swapfile->ops->file.read(_swapfile, (void*)PAGE_START(vaddr), slot * VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+    return res < 0 ? res : 0;
+}
+
+static void _swapfile_free_slot_lockless(int slot)
+{
+    if (slot < 0 || slot >= SWAPFILE_MAX_SLOTS || !_swapfile_slot_is_used(slot)) {
+        return;
+    }
+
+    int idx = _swapfile_staged_index(slot);
+    if (idx >= 0) {
+        _staged[idx].live = false;
+    }
+    bitmap_unset(_slots_bitmap, slot);
+    _swapfile_stat.file_pages--;
+}
+
+/**
+ * API FUNCTIONS
+ */
+
+int swapfile_load(uintptr_t vaddr, int id)
+{
+    int res;
+    lock_acquire(&_swapfile_lock);
+#ifdef SWAPFILE_COMPRESSION
+    if (id & SWAPFILE_COMPRESSED_ID_FLAG) {
+        res = _swapfile_load_compressed_lockless(vaddr, (id & ~SWAPFILE_COMPRESSED_ID_FLAG) - 1);
+        lock_release(&_swapfile_lock);
+        return res;
+    }
+#endif
+    res = _swapfile_load_from_file_lockless(vaddr, id - 1);
+    lock_release(&_swapfile_lock);
+    return res;
+}
+
+int swapfile_store(uintptr_t vaddr)
+{
+    int res;
+    lock_acquire(&_swapfile_lock);
+#ifdef SWAPFILE_COMPRESSION
+    res = _swapfile_store_compressed_lockless(vaddr);
+    if (res > 0) {
+        lock_release(&_swapfile_lock);
+        return res;
+    }
+#endif
+    res = _swapfile_store_to_file_lockless(vaddr);
+    lock_release(&_swapfile_lock);
+    return res;
+}
+
+void swapfile_free(int id)
+{
+    lock_acquire(&_swapfile_lock);
+#ifdef SWAPFILE_COMPRESSION
+    if (id & SWAPFILE_COMPRESSED_ID_FLAG) {
+        _swapfile_free_compressed_lockless((id & ~SWAPFILE_COMPRESSED_ID_FLAG) - 1);
+        lock_release(&_swapfile_lock);
+        return;
+    }
+#endif
+    _swapfile_free_slot_lockless(id - 1);
+    lock_release(&_swapfile_lock);
+}
+
+int swapfile_flush()
+{
+    lock_acquire(&_swapfile_lock);
+    int res = 0;
+    if (_swapfile && _staged_count) {
+        res = _swapfile_flush_lockless();
+    }
+    lock_release(&_swapfile_lock);
+    return res;
+}
+
+void swapfile_get_stat(swapfile_stat_t* stat)
+{
+    lock_acquire(&_swapfile_lock);
+    memcpy(stat, &_swapfile_stat, sizeof(swapfile_stat_t));
+    lock_release(&_swapfile_lock);
+}
@@ -6,12 +6,15 @@
  * found in the LICENSE file.
  */
 
+#include <fs/pcache.h>
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/lock.h>
 #include <libkern/log.h>
 #include <mem/kmalloc.h>
 #include <mem/kmemzone.h>
+#include <mem/kswapd.h>
+#include <mem/memzone.h>
 #include <mem/swapfile.h>
 #include <mem/vm_alloc.h>
 #include <mem/vm_pspace.h>
@@ -20,23 +23,104 @@
 #include <platform/generic/system.h>
 #include <platform/generic/vmm/mapping_table.h>
 #include <platform/generic/vmm/pf_types.h>
+#include <tasking/sched.h>
 #include <tasking/tasking.h>
 
 // #define VMM_DEBUG
+#define VMM_ZERO_PAGE
+#define VMM_LARGE_PAGES
 
 static pdir_t* _vmm_kernel_pdir;
-static lock_t _vmm_lock;
+
+/**
+ * Page tables are protected by two kinds of locks. Tables of kernel space
+ * are shared by every pdir and are guarded by _vmm_kernel_lock. User tables
+ * are guarded by a lock of their pdir, picked from a striped set, so page
+ * faults of different processes do not contend with each other.
+ * The locking order is: pdir lock -> kernel lock. Two pdir locks are never
+ * held at once, since two pdirs could share a stripe. _vmm_lock_acquire()
+ * asserts this by recording the owner of every taken stripe.
+ * Temporary kernel mappings (kmemzone-owned vaddrs) are done without the
+ * kernel lock: the vaddr belongs to its caller only and the kernel ptables
+ * covering it are preallocated.
+ */
+#define VMM_PDIR_LOCKS (32)
+static lock_t _vmm_kernel_lock;
+static lock_t _vmm_pdir_locks[VMM_PDIR_LOCKS];
+static void* _vmm_pdir_lock_owners[VMM_PDIR_LOCKS];
 static kmemzone_t pspace_zone;
 uintptr_t kernel_ptables_start_paddr = 0x0;
 
+/**
+ * A page of user tables is shared between pdirs after fork until one of
+ * them writes to it. Shared pages are counted by their holders, a page
+ * which is not in the hash has the only holder. The hash has its own lock,
+ * which is taken after pdir locks.
+ */
+#define VMM_SHARED_PTABLES_HASH_SIZE (256)
+struct vmm_shared_ptables {
+    uintptr_t paddr;
+    int refs;
+    struct vmm_shared_ptables* next;
+};
+typedef struct vmm_shared_ptables vmm_shared_ptables_t;
+
+static lock_t _vmm_shared_ptables_lock;
+static vmm_shared_ptables_t* _vmm_shared_ptables_hash[VMM_SHARED_PTABLES_HASH_SIZE];
+
 #define vmm_kernel_pdir_phys2virt(paddr) ((void*)((uintptr_t)paddr + KERNEL_BASE - KERNEL_PM_BASE))
 
 /**
  * PRIVATE FUNCTIONS
  */
 
+static inline lock_t* _vmm_lock_of_pdir(pdirectory_t* pdir)
+{
+    if (pdir == _vmm_kernel_pdir) {
+        return &_vmm_kernel_lock;
+    }
+    return &_vmm_pdir_locks[((uintptr_t)pdir / PDIR_SIZE) % VMM_PDIR_LOCKS];
+}
+
+static inline lock_t* _vmm_lock_for(uintptr_t vaddr)
+{
+    if (IS_KERNEL_VADDR(vaddr)) {
+        return &_vmm_kernel_lock;
+    }
+    return _vmm_lock_of_pdir(THIS_CPU->pdir);
+}
+
+static inline void* _vmm_lock_owner()
+{
+    // Threads could be moved to another cpu while holding a lock, so they are tracked themselves.
+    return RUNNING_THREAD ? (void*)RUNNING_THREAD : (void*)THIS_CPU;
+}
+
+static inline void _vmm_lock_acquire(lock_t* lock)
+{
+    if (lock == &_vmm_kernel_lock) {
+        lock_acquire(lock);
+        return;
+    }
+
+    void* owner = _vmm_lock_owner();
+    for (int i = 0; i < VMM_PDIR_LOCKS; i++) {
+        ASSERT(_vmm_pdir_lock_owners[i] != owner);
+    }
+    lock_acquire(lock);
+    _vmm_pdir_lock_owners[lock - _vmm_pdir_locks] = owner;
+}
+
+static inline void _vmm_lock_release(lock_t* lock)
+{
+    if (lock != &_vmm_kernel_lock) {
+        _vmm_pdir_lock_owners[lock - _vmm_pdir_locks] = NULL;
+    }
+    lock_release(lock);
+}
+
 static int _vmm_allocate_ptable(uintptr_t vaddr, ptable_lv_t lv);
-static int _vmm_free_ptable(uintptr_t vaddr, struct dynamic_array* zones);
+static int _vmm_free_ptable(uintptr_t vaddr, memzones_t* zones);
 
 inline static pdirectory_t* _vmm_ensure_active_pdir();
 inline static ptable_t* _vmm_ensure_active_ptable(size_t vaddr);
@@ -58,15 +142,37 @@ static int _vmm_resolve_copy_on_write(proc_t* p, uintptr_t vaddr);
 static int _vmm_ensure_cow_for_page(uintptr_t vaddr);
 static int _vmm_ensure_cow_for_range(uintptr_t vaddr, size_t length);
 static int _vmm_copy_page_to_resolve_cow(proc_t* p, uintptr_t vaddr, ptable_t* src_ptable, int page_index);
+static int _vmm_copy_swapped_page_to_resolve_cow(proc_t* p, uintptr_t vaddr, ptable_t* src_ptable, int page_index);
+
+static void _vmm_shared_ptables_dup(uintptr_t ptables_paddr);
+static int _vmm_shared_ptables_put(uintptr_t ptables_paddr);
+static bool _vmm_shared_ptables_is_shared(uintptr_t ptables_paddr);
+static void _vmm_take_shared_ptables_lockless(proc_t* p, uintptr_t vaddr);
+static bool _vmm_release_shared_ptables_lockless(uintptr_t vaddr);
 
 #ifdef ZEROING_ON_DEMAND
 static bool _vmm_is_zeroing_on_demand(uintptr_t vaddr);
 static void _vmm_resolve_zeroing_on_demand(uintptr_t vaddr);
 #endif
 
+#ifdef VMM_ZERO_PAGE
+static void _vmm_zero_page_init();
+static bool _vmm_is_zero_page_mapped(uintptr_t vaddr);
+static int _vmm_map_zero_page_lockless(memzone_t* zone, uintptr_t vaddr);
+#endif
+
+static void _vmm_split_large_page_lockless(uintptr_t vaddr);
+#ifdef VMM_LARGE_PAGES
+static void _vmm_merge_large_pages_lockless(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uint32_t settings);
+#endif
+
 static bool _vmm_is_page_swapped(uintptr_t vaddr);
 static int _vmm_restore_swapped_page_lockless(uintptr_t vaddr);
 
+static bool _vmm_is_cached_page_shared(uintptr_t vaddr);
+static int _vmm_unshare_cached_page_lockless(uintptr_t vaddr);
+static int _vmm_resolve_write_to_cached_page_lockless(memzone_t* zone, uintptr_t vaddr);
+
 static int _vmm_self_test();
 static void _vmm_dump_page(uintptr_t vaddr);
 
@@ -76,8 +182,8 @@ static void _vmm_dump_page(uintptr_t vaddr);
 
 static int vmm_allocate_ptable_lockless(uintptr_t vaddr, ptable_lv_t lv);
 static ALWAYS_INLINE int vmm_force_allocate_ptable_lockless(uintptr_t vaddr, ptable_lv_t lv);
-static ALWAYS_INLINE int vmm_free_ptable_lockless(uintptr_t vaddr, dynamic_array_t* zones);
-static ALWAYS_INLINE int vmm_free_pdir_lockless(pdirectory_t* pdir, dynamic_array_t* zones);
+static ALWAYS_INLINE int vmm_free_ptable_lockless(uintptr_t vaddr, memzones_t* zones);
+static ALWAYS_INLINE int vmm_free_pdir_lockless(pdirectory_t* pdir, memzones_t* zones);
 
 static ALWAYS_INLINE pdirectory_t* vmm_new_user_pdir_lockless();
 static ALWAYS_INLINE pdirectory_t* vmm_new_forked_user_pdir_lockless();
@@ -89,10 +195,116 @@ static ALWAYS_INLINE int vmm_alloc_page_lockless(uintptr_t vaddr, uint32_t setti
 static ALWAYS_INLINE int vmm_alloc_page_no_fill_lockless(uintptr_t vaddr, uint32_t settings);
 static ALWAYS_INLINE int vmm_tune_page_lockless(uintptr_t vaddr, uint32_t settings);
 static ALWAYS_INLINE int vmm_tune_pages_lockless(uintptr_t vaddr, size_t length, uint32_t settings);
-static ALWAYS_INLINE int vmm_free_page_lockless(uintptr_t vaddr, page_desc_t* page, dynamic_array_t* zones);
+static ALWAYS_INLINE int vmm_free_page_lockless(uintptr_t vaddr, page_desc_t* page, memzones_t* zones);
 
 static ALWAYS_INLINE int vmm_switch_pdir_lockless(pdirectory_t* pdir);
 
+/**
+ * TLB FUNCTIONS
+ *
+ * Switching a pdir drops all non-global TLB entries of the CPU, so only CPUs
+ * which have the pdir active could hold stale entries of user pages. Kernel
+ * pages are shared by all pdirs and are invalidated on every CPU.
+ * Invalidations of a range are gathered into a batch, which is flushed page
+ * by page, or with a single full flush if it overflows.
+ */
+
+#define VMM_TLB_BATCH_MAX_PAGES (32)
+
+typedef struct {
+    pdirectory_t* pdir;
+    size_t count;
+    bool overflowed;
+    bool has_kernel_pages;
+    uintptr_t pages[VMM_TLB_BATCH_MAX_PAGES];
+} vmm_tlb_batch_t;
+
+static bool _vmm_tlb_is_shared(pdirectory_t* pdir, bool has_kernel_pages)
+{
+    int cpu_cnt = active_cpu_count();
+    if (cpu_cnt <= 1) {
+        return false;
+    }
+
+    if (has_kernel_pages) {
+        return true;
+    }
+
+    int this_cpu = system_cpu_id();
+    for (int i = 0; i < cpu_cnt; i++) {
+        if (i != this_cpu && cpus[i].pdir == pdir) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _vmm_tlb_flush_page(pdirectory_t* pdir, uintptr_t vaddr)
+{
+    if (_vmm_tlb_is_shared(pdir, IS_KERNEL_VADDR(vaddr))) {
+        system_flush_all_cpus_tlb_entry(vaddr);
+    } else if (pdir == THIS_CPU->pdir || IS_KERNEL_VADDR(vaddr)) {
+        system_flush_local_tlb_entry(vaddr);
+    }
+}
+
+// Entries of a large page and of pages inside it could be cached at once, so
+// replacing one with the other drops the whole TLB.
+static void _vmm_tlb_flush_table(pdirectory_t* pdir, uintptr_t vaddr)
+{
+    if (_vmm_tlb_is_shared(pdir, IS_KERNEL_VADDR(vaddr))) {
+        system_flush_all_cpus_whole_tlb();
+    } else if (pdir == THIS_CPU->pdir || IS_KERNEL_VADDR(vaddr)) {
+        system_flush_whole_tlb();
+    }
+}
+
+static inline void _vmm_tlb_batch_init(vmm_tlb_batch_t* batch, pdirectory_t* pdir)
+{
+    batch->pdir = pdir;
+    batch->count = 0;
+    batch->overflowed = false;
+    batch->has_kernel_pages = false;
+}
+
+static inline void _vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uintptr_t vaddr)
+{
+    batch->has_kernel_pages |= IS_KERNEL_VADDR(vaddr);
+    if (batch->count == VMM_TLB_BATCH_MAX_PAGES) {
+        batch->overflowed = true;
+        return;
+    }
+    batch->pages[batch->count++] = vaddr;
+}
+
+static void _vmm_tlb_batch_flush(vmm_tlb_batch_t* batch)
+{
+    if (!batch->count) {
+        return;
+    }
+
+    bool shared = _vmm_tlb_is_shared(batch->pdir, batch->has_kernel_pages);
+    bool local = batch->pdir == THIS_CPU->pdir || batch->has_kernel_pages;
+    if (batch->overflowed) {
+        if (shared) {
+            system_flush_all_cpus_whole_tlb();
+        } else if (local) {
+            system_flush_whole_tlb();
+        }
+    } else {
+        for (size_t i = 0; i < batch->count; i++) {
+            if (shared) {
+                system_flush_all_cpus_tlb_entry(batch->pages[i]);
+            } else if (local) {
+                system_flush_local_tlb_entry(batch->pages[i]);
+            }
+        }
+    }
+    batch->count = 0;
+    batch->overflowed = false;
+    batch->has_kernel_pages = false;
+}
+
 /**
  * VM INITIALIZATION FUNCTIONS
  */
@@ -160,6 +372,9 @@ static bool _vmm_init_switch_to_kernel_pdir()
 {
     THIS_CPU->pdir = _vmm_kernel_pdir;
     system_disable_interrupts();
+#ifdef VMM_LARGE_PAGES
+    system_enable_large_pages();
+#endif
     system_set_pdir((uintptr_t)_vmm_kernel_convert_vaddr2paddr((uintptr_t)THIS_CPU->pdir));
     system_enable_interrupts();
     return true;
@@ -179,6 +394,16 @@ static void _vmm_map_init_kernel_pages(uintptr_t paddr, uintptr_t vaddr)
         page_desc_set_frame(&new_page, phyz);
         ptable_paddr->entities[i] = new_page;
     }
+
+#ifdef VMM_LARGE_PAGES
+    // The kernel is never remapped, so its tables are replaced with large
+    // pages if the physical placement allows. The tables are kept to serve
+    // walkers of the kernel space.
+    const size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    if (table_coverage == VMM_LARGE_PAGE_SIZE && (paddr % VMM_LARGE_PAGE_SIZE) == 0) {
+        table_desc_set_large_page(_vmm_pdirectory_lookup(_vmm_kernel_pdir, vaddr), paddr, TABLE_DESC_WRITABLE);
+    }
+#endif
 }
 
 /**
@@ -248,7 +473,11 @@ static bool _vmm_map_kernel()
  */
 int vmm_setup()
 {
-    lock_init(&_vmm_lock);
+    lock_init(&_vmm_kernel_lock);
+    for (int i = 0; i < VMM_PDIR_LOCKS; i++) {
+        lock_init(&_vmm_pdir_locks[i]);
+    }
+    lock_init(&_vmm_shared_ptables_lock);
     kmemzone_init();
     vm_alloc_kernel_pdir();
     _vmm_create_kernel_ptables();
@@ -257,6 +486,10 @@ int vmm_setup()
     _vmm_map_kernel();
     kmemzone_init_stage2();
     kmalloc_init();
+    memzone_init();
+#ifdef VMM_ZERO_PAGE
+    _vmm_zero_page_init();
+#endif
     return 0;
 }
 
@@ -333,9 +566,10 @@ skip_allocation:
 
 static int _vmm_allocate_ptable(uintptr_t vaddr, ptable_lv_t lv)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = _vmm_allocate_ptable_lockless(vaddr, lv);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -353,25 +587,28 @@ static ALWAYS_INLINE int vmm_force_allocate_ptable_lockless(uintptr_t vaddr, pta
 
 int vmm_force_allocate_ptable(uintptr_t vaddr, ptable_lv_t lv)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_force_allocate_ptable_lockless(vaddr, lv);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
 /**
  * The function deletes ptable(s) and rebuilds pspace to match the new setup.
  */
-static ALWAYS_INLINE int vmm_free_ptable_lockless(uintptr_t vaddr, dynamic_array_t* zones)
+static ALWAYS_INLINE int vmm_free_ptable_lockless(uintptr_t vaddr, memzones_t* zones)
 {
     if (!THIS_CPU->pdir) {
         return -EACCES;
     }
 
-    if (_vmm_is_copy_on_write(vaddr)) {
-        return -EFAULT;
+    // Shared tables are freed by their last holder.
+    if (_vmm_is_copy_on_write(vaddr) && _vmm_release_shared_ptables_lockless(vaddr)) {
+        return 0;
     }
 
+    _vmm_split_large_page_lockless(vaddr);
     table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, vaddr);
 
     if (!table_desc_has_attrs(*ptable_desc, TABLE_DESC_PRESENT)) {
@@ -419,11 +656,12 @@ static ALWAYS_INLINE int vmm_free_ptable_lockless(uintptr_t vaddr, dynamic_array
     return 0;
 }
 
-static int _vmm_free_ptable(uintptr_t vaddr, dynamic_array_t* zones)
+static int _vmm_free_ptable(uintptr_t vaddr, memzones_t* zones)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_free_ptable_lockless(vaddr, zones);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -465,9 +703,11 @@ int vmm_map_page_lockless(uintptr_t vaddr, uintptr_t paddr, uint32_t settings)
         // TODO: Currently we allocate only LV0 table, since we support only 2-level translation for now.
         _vmm_allocate_ptable_lockless(vaddr, PTABLE_LV0);
     }
+    _vmm_split_large_page_lockless(vaddr);
 
     ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
     page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    bool was_present = page_desc_is_present(*page);
 
     page_desc_init(page);
     page_desc_set_attrs(page, PAGE_DESC_PRESENT);
@@ -490,20 +730,26 @@ int vmm_map_page_lockless(uintptr_t vaddr, uintptr_t paddr, uint32_t settings)
     log("Page mapped %x in pdir: %x", vaddr, vmm_get_active_pdir());
 #endif
 
-    system_flush_local_tlb_entry(vaddr);
+    // Not present entries are never cached, so only a remap needs a shootdown.
+    if (was_present) {
+        _vmm_tlb_flush_page(THIS_CPU->pdir, vaddr);
+    } else {
+        system_flush_local_tlb_entry(vaddr);
+    }
     _vmm_release_active_ptable(vaddr);
     return 0;
 }
 
 int vmm_map_page(uintptr_t vaddr, uintptr_t paddr, uint32_t settings)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_map_page_lockless(vaddr, paddr, settings);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
-int vmm_unmap_page_lockless(uintptr_t vaddr)
+static int _vmm_unmap_page_lockless(uintptr_t vaddr, vmm_tlb_batch_t* batch)
 {
     if (!THIS_CPU->pdir) {
         return -EACCES;
@@ -513,22 +759,33 @@ int vmm_unmap_page_lockless(uintptr_t vaddr)
     if (!table_desc_is_present(*ptable_desc)) {
         return -EACCES;
     }
+    _vmm_split_large_page_lockless(vaddr);
 
     ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
     page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
     page_desc_del_attrs(page, PAGE_DESC_PRESENT);
     page_desc_del_attrs(page, PAGE_DESC_WRITABLE);
     page_desc_del_frame(page);
-    system_flush_local_tlb_entry(vaddr);
+    _vmm_tlb_batch_add(batch, vaddr);
     _vmm_release_active_ptable(vaddr);
     return 0;
 }
 
+int vmm_unmap_page_lockless(uintptr_t vaddr)
+{
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+    int res = _vmm_unmap_page_lockless(vaddr, &batch);
+    _vmm_tlb_batch_flush(&batch);
+    return res;
+}
+
 int vmm_unmap_page(uintptr_t vaddr)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_unmap_page_lockless(vaddr);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -541,20 +798,24 @@ int vmm_map_pages_lockless(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uin
     paddr = ROUND_FLOOR(paddr, VMM_PAGE_SIZE);
 
     int status = 0;
-    for (; n_pages; paddr += VMM_PAGE_SIZE, vaddr += VMM_PAGE_SIZE, n_pages--) {
-        if ((status = vmm_map_page_lockless(vaddr, paddr, settings) != 0)) {
+    for (uintptr_t v = vaddr, p = paddr, n = n_pages; n; p += VMM_PAGE_SIZE, v += VMM_PAGE_SIZE, n--) {
+        if ((status = vmm_map_page_lockless(v, p, settings)) != 0) {
             return status;
         }
     }
 
+#ifdef VMM_LARGE_PAGES
+    _vmm_merge_large_pages_lockless(vaddr, paddr, n_pages, settings);
+#endif
     return 0;
 }
 
 int vmm_map_pages(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uint32_t settings)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_map_pages_lockless(vaddr, paddr, n_pages, settings);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -562,38 +823,226 @@ int vmm_unmap_pages_lockless(uintptr_t vaddr, size_t n_pages)
 {
     vaddr = ROUND_FLOOR(vaddr, VMM_PAGE_SIZE);
 
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
     int status = 0;
     for (; n_pages; vaddr += VMM_PAGE_SIZE, n_pages--) {
-        if ((status = vmm_unmap_page_lockless(vaddr) < 0)) {
-            return status;
+        if ((status = _vmm_unmap_page_lockless(vaddr, &batch)) < 0) {
+            break;
         }
     }
 
-    return 0;
+    _vmm_tlb_batch_flush(&batch);
+    return status;
 }
 
 int vmm_unmap_pages(uintptr_t vaddr, size_t n_pages)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_unmap_pages_lockless(vaddr, n_pages);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
+    return res;
+}
+
+/**
+ * SHARED TABLES FUNCTIONS
+ */
+
+static inline uint32_t _vmm_shared_ptables_hash_index(uintptr_t ptables_paddr)
+{
+    return (ptables_paddr / VMM_PAGE_SIZE) & (VMM_SHARED_PTABLES_HASH_SIZE - 1);
+}
+
+static vmm_shared_ptables_t* _vmm_shared_ptables_find_lockless(uintptr_t ptables_paddr)
+{
+    vmm_shared_ptables_t* it = _vmm_shared_ptables_hash[_vmm_shared_ptables_hash_index(ptables_paddr)];
+    while (it) {
+        if (it->paddr == ptables_paddr) {
+            return it;
+        }
+        it = it->next;
+    }
+    return NULL;
+}
+
+// _vmm_shared_ptables_dup adds a holder to the page of tables.
+static void _vmm_shared_ptables_dup(uintptr_t ptables_paddr)
+{
+    // The entry is allocated in advance, kmalloc could map pages.
+    vmm_shared_ptables_t* new_entry = kmalloc(sizeof(vmm_shared_ptables_t));
+    ASSERT(new_entry && "No space for shared tables");
+
+    lock_acquire(&_vmm_shared_ptables_lock);
+    vmm_shared_ptables_t* entry = _vmm_shared_ptables_find_lockless(ptables_paddr);
+    if (entry) {
+        entry->refs++;
+        lock_release(&_vmm_shared_ptables_lock);
+        kfree(new_entry);
+        return;
+    }
+
+    uint32_t idx = _vmm_shared_ptables_hash_index(ptables_paddr);
+    new_entry->paddr = ptables_paddr;
+    new_entry->refs = 2;
+    new_entry->next = _vmm_shared_ptables_hash[idx];
+    _vmm_shared_ptables_hash[idx] = new_entry;
+    lock_release(&_vmm_shared_ptables_lock);
+}
+
+/**
+ * Drops a holder of the page of tables. Returns the number of holders
+ * which are left, 0 means that the caller was the only one.
+ */
+static int _vmm_shared_ptables_put(uintptr_t ptables_paddr)
+{
+    lock_acquire(&_vmm_shared_ptables_lock);
+    vmm_shared_ptables_t** it = &_vmm_shared_ptables_hash[_vmm_shared_ptables_hash_index(ptables_paddr)];
+    while (*it && (*it)->paddr != ptables_paddr) {
+        it = &(*it)->next;
+    }
+
+    vmm_shared_ptables_t* entry = *it;
+    if (!entry) {
+        lock_release(&_vmm_shared_ptables_lock);
+        return 0;
+    }
+
+    int refs = --entry->refs;
+    if (refs > 1) {
+        lock_release(&_vmm_shared_ptables_lock);
+        return refs;
+    }
+
+    // The last holder owns the page, it is not tracked anymore.
+    *it = entry->next;
+    lock_release(&_vmm_shared_ptables_lock);
+    kfree(entry);
+    return refs;
+}
+
+static bool _vmm_shared_ptables_is_shared(uintptr_t ptables_paddr)
+{
+    lock_acquire(&_vmm_shared_ptables_lock);
+    bool res = _vmm_shared_ptables_find_lockless(ptables_paddr);
+    lock_release(&_vmm_shared_ptables_lock);
     return res;
 }
 
+/**
+ * The active pdir is the last holder of the tables which cover @vaddr, so
+ * they become private without a copy. Write access, which was revoked at
+ * fork, is given back to pages of writable zones. Pages of the page cache
+ * and the zero page stay read-only, writes to them are resolved on faults.
+ */
+static void _vmm_take_shared_ptables_lockless(proc_t* p, uintptr_t vaddr)
+{
+    size_t ptables_per_page = VMM_PAGE_SIZE / PTABLE_SIZE;
+    size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    uintptr_t ptable_serve_vaddr_start = (vaddr / (table_coverage * ptables_per_page)) * (table_coverage * ptables_per_page);
+
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
+    memzone_t* zone = NULL;
+    for (uintptr_t i = 0, pvaddr = ptable_serve_vaddr_start; i < ptables_per_page; i++, pvaddr += table_coverage) {
+        table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, pvaddr);
+        if (!table_desc_is_copy_on_write(*ptable_desc)) {
+            continue;
+        }
+        table_desc_del_attrs(ptable_desc, TABLE_DESC_COPY_ON_WRITE);
+
+        ptable_t* ptable = _vmm_ensure_active_ptable(pvaddr);
+        for (int page_idx = 0; page_idx < VMM_TOTAL_PAGES_PER_TABLE; page_idx++) {
+            page_desc_t* page = &ptable->entities[page_idx];
+            uintptr_t page_vaddr = pvaddr + page_idx * VMM_PAGE_SIZE;
+            if (!page_desc_is_present(*page) || page_desc_is_writable(*page)) {
+                continue;
+            }
+
+            if (!zone || page_vaddr < zone->start || page_vaddr >= zone->start + zone->len) {
+                zone = memzone_find(p, page_vaddr);
+            }
+            if (!zone || !TEST_FLAG(zone->flags, ZONE_WRITABLE)) {
+                continue;
+            }
+
+            uintptr_t paddr = page_desc_get_frame(*page);
+            if (vmm_is_zero_frame(paddr)) {
+                continue;
+            }
+            if (TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_PRIVATLY) || TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+                if (pcache_owns_frame(paddr)) {
+                    continue;
+                }
+            }
+
+            page_desc_set_attrs(page, PAGE_DESC_WRITABLE);
+            // A read-only translation could be cached, a write through it would fault again.
+            _vmm_tlb_batch_add(&batch, page_vaddr);
+        }
+        _vmm_release_active_ptable(pvaddr);
+    }
+
+    _vmm_tlb_batch_flush(&batch);
+}
+
+/**
+ * Drops the hold of the active pdir on the shared tables which cover
+ * @vaddr. Returns true if other pdirs still use the tables, then they are
+ * detached from the active pdir. Otherwise the tables are private again.
+ */
+static bool _vmm_release_shared_ptables_lockless(uintptr_t vaddr)
+{
+    size_t ptables_per_page = VMM_PAGE_SIZE / PTABLE_SIZE;
+    size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    uintptr_t ptable_serve_vaddr_start = (vaddr / (table_coverage * ptables_per_page)) * (table_coverage * ptables_per_page);
+
+    table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, vaddr);
+    uintptr_t ptables_paddr = PAGE_START(table_desc_get_frame(*ptable_desc));
+    bool in_use = _vmm_shared_ptables_put(ptables_paddr) > 0;
+
+    for (uintptr_t i = 0, pvaddr = ptable_serve_vaddr_start; i < ptables_per_page; i++, pvaddr += table_coverage) {
+        table_desc_t* ptable_desc_c = _vmm_pdirectory_lookup(THIS_CPU->pdir, pvaddr);
+        if (in_use) {
+            table_desc_clear(ptable_desc_c);
+        } else {
+            table_desc_del_attrs(ptable_desc_c, TABLE_DESC_COPY_ON_WRITE);
+        }
+    }
+
+    if (in_use) {
+        // Cleaning Pspace
+        uintptr_t ptable_vaddr_start = PAGE_START((uintptr_t)_vmm_ensure_active_ptable(vaddr));
+        _vmm_release_active_ptable(vaddr);
+        vmm_unmap_page_lockless(ptable_vaddr_start);
+    }
+    return in_use;
+}
+
 /**
  * COPY ON WRITE FUNCTIONS
  */
 
 // _vmm_tables_set_cow marks both page tables as COW.
-static void _vmm_tables_set_cow(size_t table_index, table_desc_t* cur, table_desc_t* new)
+static void _vmm_tables_set_cow(size_t table_index, table_desc_t* cur, table_desc_t* new, vmm_tlb_batch_t* batch)
 {
+    size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+
     table_desc_set_attrs(cur, TABLE_DESC_COPY_ON_WRITE);
     table_desc_set_attrs(new, TABLE_DESC_COPY_ON_WRITE);
 
     // Marking all pages as not-writable to handle COW. Later will restore using zones data.
+    // Writable pages of shared file mappings lose their write access as well.
     ptable_t* ptable = vm_pspace_get_nth_active_ptable(table_index);
     for (int i = 0; i < VMM_TOTAL_PAGES_PER_TABLE; i++) {
         page_desc_t* page = &ptable->entities[i];
+        if (page_desc_is_present(*page) && page_desc_is_writable(*page)) {
+            pcache_frame_unmap_writable(page_desc_get_frame(*page));
+            // Only writable translations could be cached with wrong rights.
+            _vmm_tlb_batch_add(batch, table_index * table_coverage + i * VMM_PAGE_SIZE);
+        }
         page_desc_del_attrs(page, PAGE_DESC_WRITABLE);
     }
 }
@@ -604,6 +1053,10 @@ static bool _vmm_is_copy_on_write(uintptr_t vaddr)
     return table_desc_is_copy_on_write(*ptable_desc);
 }
 
+/**
+ * Gives the active pdir private tables which cover @vaddr. The tables are
+ * copied only if other pdirs still hold them, the last holder takes them.
+ */
 static int _vmm_resolve_copy_on_write(proc_t* p, uintptr_t vaddr)
 {
     table_desc_t orig_table_desc[VMM_PAGE_SIZE / PTABLE_SIZE];
@@ -611,6 +1064,13 @@ static int _vmm_resolve_copy_on_write(proc_t* p, uintptr_t vaddr)
     size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
     uintptr_t ptable_serve_vaddr_start = (vaddr / (table_coverage * ptables_per_page)) * (table_coverage * ptables_per_page);
 
+    // Other holders could only go away, nobody could share the tables with the active pdir concurrently.
+    uintptr_t ptables_paddr = PAGE_START(table_desc_get_frame(*_vmm_pdirectory_lookup(THIS_CPU->pdir, vaddr)));
+    if (!_vmm_shared_ptables_is_shared(ptables_paddr)) {
+        _vmm_take_shared_ptables_lockless(p, vaddr);
+        return 0;
+    }
+
     /* Copying old ptables which cover the full page. See a comment above vmm_allocate_ptable. */
     kmemzone_t src_ptable_zone = vm_alloc_mapped_zone(VMM_PAGE_SIZE, VMM_PAGE_SIZE);
     ptable_t* src_ptable = (ptable_t*)src_ptable_zone.ptr;
@@ -644,12 +1104,32 @@ static int _vmm_resolve_copy_on_write(proc_t* p, uintptr_t vaddr)
                     if (err) {
                         return err;
                     }
+                } else if (page_desc_get_frame(*page_desc)) {
+                    err = _vmm_copy_swapped_page_to_resolve_cow(p, page_vaddr, src_ptable, offset_in_table_set);
+                    if (err) {
+                        return err;
+                    }
                 }
             }
         }
     }
 
     _vmm_release_active_ptable(ptable_serve_vaddr_start);
+
+    // Other holders have gone while the tables were copied, the old tables are freed.
+    if (!_vmm_shared_ptables_put(ptables_paddr)) {
+        for (int ptable_idx = 0; ptable_idx < ptables_per_page; ptable_idx++) {
+            if (!table_desc_is_present(orig_table_desc[ptable_idx])) {
+                continue;
+            }
+            for (int page_idx = 0; page_idx < VMM_TOTAL_PAGES_PER_TABLE; page_idx++) {
+                size_t offset_in_table_set = ptable_idx * VMM_TOTAL_PAGES_PER_TABLE + page_idx;
+                uintptr_t page_vaddr = table_start + (offset_in_table_set * VMM_PAGE_SIZE);
+                vmm_free_page_lockless(page_vaddr, &src_ptable->entities[offset_in_table_set], &p->zones);
+            }
+        }
+        vm_free_ptables_to_cover_page(ptables_paddr);
+    }
     return vm_free_mapped_zone(src_ptable_zone);
 }
 
@@ -728,6 +1208,13 @@ static int _vmm_ensure_write_to_page(uintptr_t vaddr)
 {
     _vmm_ensure_cow_for_page(vaddr);
 
+#ifdef VMM_ZERO_PAGE
+    // The kernel is not trapped on writes to read-only pages.
+    if (_vmm_is_zero_page_mapped(vaddr)) {
+        return vm_alloc_page_with_perm(vaddr);
+    }
+#endif
+
     if (!_vmm_is_page_present(vaddr)) {
         int err = vm_alloc_page_with_perm(vaddr);
         if (err) {
@@ -735,6 +1222,10 @@ static int _vmm_ensure_write_to_page(uintptr_t vaddr)
         }
     }
 
+    if (_vmm_is_cached_page_shared(vaddr)) {
+        return _vmm_resolve_write_to_cached_page_lockless(_vmm_memzone_for_active_pdir(vaddr), vaddr);
+    }
+
     return 0;
 }
 
@@ -767,11 +1258,26 @@ static int _vmm_copy_page_to_resolve_cow(proc_t* p, uintptr_t vaddr, ptable_t* s
         return -EFAULT;
     }
 
+    // Pages of the page cache stay shared and read-only, a write to them
+    // is resolved by _vmm_resolve_write_to_cached_page_lockless().
+    if (TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_PRIVATLY) || TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+        uintptr_t old_page_paddr = page_desc_get_frame(*old_page_desc);
+        if (pcache_dup_frame(old_page_paddr)) {
+            return vmm_map_page_lockless(vaddr, old_page_paddr, zone->flags & ~ZONE_WRITABLE);
+        }
+    }
+
     if (TEST_FLAG(zone->type, ZONE_TYPE_DEVICE) || TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
         uintptr_t old_page_paddr = page_desc_get_frame(*old_page_desc);
         return vmm_map_page_lockless(vaddr, old_page_paddr, zone->flags);
     }
 
+#ifdef VMM_ZERO_PAGE
+    if (vmm_is_zero_frame(page_desc_get_frame(*old_page_desc))) {
+        return _vmm_map_zero_page_lockless(zone, vaddr);
+    }
+#endif
+
     vmm_alloc_page_lockless(vaddr, zone->flags);
 
     /* Mapping the old page to do a copy */
@@ -794,6 +1300,28 @@ static int _vmm_copy_page_to_resolve_cow(proc_t* p, uintptr_t vaddr, ptable_t* s
     return 0;
 }
 
+/**
+ * The slot of a swapped page is shared with the other holders of the COW
+ * table, so the page is loaded into the private copy and the slot stays.
+ */
+static int _vmm_copy_swapped_page_to_resolve_cow(proc_t* p, uintptr_t vaddr, ptable_t* src_ptable, int page_index)
+{
+    page_desc_t* old_page_desc = &src_ptable->entities[page_index];
+    uintptr_t id = page_desc_get_frame(*old_page_desc) >> PAGE_DESC_FRAME_OFFSET;
+
+    memzone_t* zone = memzone_find(p, vaddr);
+    if (!zone) {
+        kpanic("Cow: No page in zone");
+        return -EFAULT;
+    }
+
+    int err = vm_alloc_user_page_no_fill_lockless(zone, vaddr);
+    if (err) {
+        return err;
+    }
+    return swapfile_load(vaddr, id);
+}
+
 /**
  * ZEROING ON DEMAND FUNCTIONS
  */
@@ -837,16 +1365,182 @@ static void _vmm_resolve_zeroing_on_demand(uintptr_t vaddr)
 
 void vmm_zero_user_pages(pdirectory_t* pdir)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_of_pdir(pdir);
+    _vmm_lock_acquire(lock);
     for (int i = 0; i < VMM_KERNEL_TABLES_START; i++) {
         table_desc_t* ptable_desc = &pdir->entities[i];
         table_desc_del_attrs(ptable_desc, TABLE_DESC_WRITABLE);
         table_desc_set_attrs(ptable_desc, TABLE_DESC_ZEROING_ON_DEMAND);
     }
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
 }
 #endif // ZEROING_ON_DEMAND
 
+/**
+ * ZERO PAGE FUNCTIONS
+ *
+ * A read of an untouched anonymous page maps the zero page, which is shared
+ * by all processes and is never writable. The first write allocates a
+ * private page. The kernel is not trapped on writes to read-only pages, so
+ * only faults of user mode map the zero page, and kernel writers resolve it
+ * with _vmm_ensure_write_to_page().
+ */
+
+#ifdef VMM_ZERO_PAGE
+static uintptr_t _vmm_zero_page_paddr = 0;
+
+static void _vmm_zero_page_init()
+{
+    kmemzone_t zone = vm_alloc_mapped_zone(VMM_PAGE_SIZE, VMM_PAGE_SIZE);
+    memset(zone.ptr, 0, VMM_PAGE_SIZE);
+    _vmm_zero_page_paddr = (uintptr_t)_vmm_convert_vaddr2paddr(zone.start);
+}
+
+static bool _vmm_is_zero_page_mapped(uintptr_t vaddr)
+{
+    table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, vaddr);
+    if (!table_desc_is_present(*ptable_desc)) {
+        return false;
+    }
+
+    ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
+    page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    bool res = page_desc_is_present(*page) && vmm_is_zero_frame(page_desc_get_frame(*page));
+    _vmm_release_active_ptable(vaddr);
+    return res;
+}
+
+static int _vmm_map_zero_page_lockless(memzone_t* zone, uintptr_t vaddr)
+{
+    return vmm_map_page_lockless(vaddr, _vmm_zero_page_paddr, zone->flags & ~ZONE_WRITABLE);
+}
+#endif // VMM_ZERO_PAGE
+
+/**
+ * Gives private pages instead of the zero page in the range of the active
+ * pdir. Is used before the kernel writes into a user buffer directly.
+ */
+int vmm_unshare_zero_pages(uintptr_t vaddr, size_t length)
+{
+#ifdef VMM_ZERO_PAGE
+    if (!IS_USER_VADDR(vaddr)) {
+        return 0;
+    }
+
+    uintptr_t end = min(vaddr + length, KERNEL_BASE);
+    if (end < vaddr) {
+        end = KERNEL_BASE;
+    }
+
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
+    for (uintptr_t page_addr = PAGE_START(vaddr); page_addr < end; page_addr += VMM_PAGE_SIZE) {
+        table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, page_addr);
+        if (!table_desc_is_present(*ptable_desc)) {
+            page_addr = TABLE_START(page_addr) + VMM_PAGE_SIZE * (VMM_TOTAL_PAGES_PER_TABLE - 1);
+            continue;
+        }
+
+        if (_vmm_is_zero_page_mapped(page_addr)) {
+            int err = vm_alloc_page_with_perm(page_addr);
+            if (err) {
+                _vmm_lock_release(lock);
+                return err;
+            }
+        }
+    }
+    _vmm_lock_release(lock);
+#endif
+    return 0;
+}
+
+bool vmm_is_zero_frame(uintptr_t paddr)
+{
+#ifdef VMM_ZERO_PAGE
+    return _vmm_zero_page_paddr && paddr == _vmm_zero_page_paddr;
+#else
+    return false;
+#endif
+}
+
+/**
+ * LARGE PAGES FUNCTIONS
+ *
+ * A user table which maps an aligned contiguous physical range with the same
+ * rights is replaced with a large page in its pdir. The table is not freed
+ * and is kept up to date in pspace, so every walker of the pdir still sees
+ * its pages. The large page is split back into the table before any page of
+ * it changes. Kernel tables are shared by all pdirs, so they are merged only
+ * while the kernel is mapped at init.
+ */
+
+static inline uint32_t _vmm_large_page_attrs(uint32_t settings)
+{
+    uint32_t attrs = 0;
+    if (settings & MMU_FLAG_PERM_WRITE) {
+        attrs |= TABLE_DESC_WRITABLE;
+    }
+    if (settings & MMU_FLAG_NONPRIV) {
+        attrs |= TABLE_DESC_USER;
+    }
+    if (settings & MMU_FLAG_UNCACHED) {
+        attrs |= TABLE_DESC_PCD;
+    }
+    return attrs;
+}
+
+static void _vmm_split_large_page_lockless(uintptr_t vaddr)
+{
+    table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, vaddr);
+    if (!table_desc_is_large_page(*ptable_desc)) {
+        return;
+    }
+
+    uintptr_t ptable_paddr = (uintptr_t)_vmm_convert_vaddr2paddr((uintptr_t)_vmm_ensure_active_ptable(vaddr));
+    table_desc_init(ptable_desc);
+    table_desc_set_attrs(ptable_desc, TABLE_DESC_PRESENT | TABLE_DESC_WRITABLE);
+    if (IS_USER_VADDR(vaddr)) {
+        table_desc_set_attrs(ptable_desc, TABLE_DESC_USER);
+    }
+    table_desc_set_frame(ptable_desc, ptable_paddr);
+    _vmm_release_active_ptable(vaddr);
+    _vmm_tlb_flush_table(THIS_CPU->pdir, vaddr);
+}
+
+#ifdef VMM_LARGE_PAGES
+/**
+ * Merges tables which are fully covered by the range, just mapped with
+ * the settings.
+ */
+static void _vmm_merge_large_pages_lockless(uintptr_t vaddr, uintptr_t paddr, size_t n_pages, uint32_t settings)
+{
+    const size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    if (table_coverage != VMM_LARGE_PAGE_SIZE || (vaddr % VMM_LARGE_PAGE_SIZE) != (paddr % VMM_LARGE_PAGE_SIZE)) {
+        return;
+    }
+
+    uintptr_t end = vaddr + n_pages * VMM_PAGE_SIZE;
+    uintptr_t start = ROUND_CEIL(vaddr, VMM_LARGE_PAGE_SIZE);
+    paddr += start - vaddr;
+    for (; start >= vaddr && start + VMM_LARGE_PAGE_SIZE <= end; start += VMM_LARGE_PAGE_SIZE, paddr += VMM_LARGE_PAGE_SIZE) {
+        if (!IS_USER_VADDR(start) || _vmm_is_copy_on_write(start)) {
+            continue;
+        }
+
+        table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, start);
+        if (!table_desc_is_present(*ptable_desc) || table_desc_is_large_page(*ptable_desc)) {
+            continue;
+        }
+
+        table_desc_set_large_page(ptable_desc, paddr, _vmm_large_page_attrs(settings));
+        _vmm_tlb_flush_table(THIS_CPU->pdir, start);
+#ifdef VMM_DEBUG
+        log("Large page mapped %x -> %x in pdir: %x", start, paddr, vmm_get_active_pdir());
+#endif
+    }
+}
+#endif // VMM_LARGE_PAGES
+
 /**
  * SWAP FUNCTIONS
  */
@@ -900,23 +1594,19 @@ static int _vmm_restore_swapped_page_lockless(uintptr_t vaddr)
     if (err) {
         return err;
     }
+    swapfile_free(id);
 
-    system_flush_all_cpus_tlb_entry(vaddr);
+    kswapd_note_refault();
+    _vmm_tlb_flush_page(THIS_CPU->pdir, vaddr);
     return 0;
 }
 
-int vmm_swap_page(ptable_t* ptable, memzone_t* zone, uintptr_t vaddr)
+int vmm_swap_page(pdirectory_t* pdir, ptable_t* ptable, memzone_t* zone, uintptr_t vaddr)
 {
-    lock_acquire(&_vmm_lock);
-
     if (!zone) {
         return -EINVAL;
     }
 
-    if (_vmm_is_copy_on_write(vaddr)) {
-        return -EBUSY;
-    }
-
     int swap_mode = SWAP_TO_DEV;
     if (zone->ops && zone->ops->swap_page_mode) {
         swap_mode = zone->ops->swap_page_mode(zone, vaddr);
@@ -926,12 +1616,45 @@ int vmm_swap_page(ptable_t* ptable, memzone_t* zone, uintptr_t vaddr)
         return -EPERM;
     }
 
+    lock_t* lock = _vmm_lock_of_pdir(pdir);
+    _vmm_lock_acquire(lock);
+    // The pdir is not the active one, so its table descriptor is checked directly.
+    // Fork marks tables under this lock, so a table can't become shared after the check.
+    if (table_desc_is_copy_on_write(pdir->entities[VMM_OFFSET_IN_DIRECTORY(vaddr)])) {
+        _vmm_lock_release(lock);
+        return -EBUSY;
+    }
+
     page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    if (!page_desc_is_present(*page)) {
+        _vmm_lock_release(lock);
+        return -ENOENT;
+    }
+
+    // The zero page is never freed, there is nothing to reclaim.
+    if (vmm_is_zero_frame(page_desc_get_frame(*page))) {
+        _vmm_lock_release(lock);
+        return -EBUSY;
+    }
+
+    // Pages of the page cache are just unmapped, they are loaded back on fault.
+    if (TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY) && page_desc_is_writable(*page)) {
+        pcache_frame_unmap_writable(page_desc_get_frame(*page));
+    }
+    if (pcache_put_frame(page_desc_get_frame(*page))) {
+        page_desc_del_attrs(page, PAGE_DESC_PRESENT);
+        page_desc_del_frame(page);
+        _vmm_tlb_flush_page(pdir, vaddr);
+        _vmm_lock_release(lock);
+        return 0;
+    }
     kmemzone_t tmp_zone = kmemzone_new(VMM_PAGE_SIZE);
     uintptr_t old_page_vaddr = (uintptr_t)tmp_zone.start;
     uintptr_t old_page_paddr = page_desc_get_frame(*page);
     int err = vmm_map_page_lockless(old_page_vaddr, old_page_paddr, MMU_FLAG_PERM_READ);
     if (err) {
+        kmemzone_free(tmp_zone);
+        _vmm_lock_release(lock);
         return err;
     }
 
@@ -941,7 +1664,7 @@ int vmm_swap_page(ptable_t* ptable, memzone_t* zone, uintptr_t vaddr)
         if (new_frame < 0) {
             vmm_unmap_page_lockless(old_page_vaddr);
             kmemzone_free(tmp_zone);
-            lock_release(&_vmm_lock);
+            _vmm_lock_release(lock);
             return -1;
         }
     }
@@ -949,11 +1672,145 @@ int vmm_swap_page(ptable_t* ptable, memzone_t* zone, uintptr_t vaddr)
     page_desc_del_attrs(page, PAGE_DESC_PRESENT);
     vm_free_page_paddr(page_desc_get_frame(*page));
     page_desc_set_frame(page, new_frame << PAGE_DESC_FRAME_OFFSET);
-    system_flush_all_cpus_tlb_entry(vaddr);
+    _vmm_tlb_flush_page(pdir, vaddr);
 
     vmm_unmap_page_lockless(old_page_vaddr);
     kmemzone_free(tmp_zone);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
+    return 0;
+}
+
+/**
+ * Clears the accessed bit of the page and returns if it was set. Is used
+ * to age pages of a pdir, which is not necessarily the active one.
+ */
+bool vmm_test_and_clear_accessed(pdirectory_t* pdir, ptable_t* ptable, uintptr_t vaddr)
+{
+    lock_t* lock = _vmm_lock_of_pdir(pdir);
+    _vmm_lock_acquire(lock);
+    page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    bool accessed = page_desc_is_present(*page) && page_desc_is_accessed(*page);
+    if (accessed) {
+        page_desc_del_attrs(page, PAGE_DESC_ACCESSED);
+        _vmm_tlb_flush_page(pdir, vaddr);
+    }
+    _vmm_lock_release(lock);
+    return accessed;
+}
+
+/**
+ * PAGE CACHE FUNCTIONS
+ */
+
+static bool _vmm_is_cached_page_shared(uintptr_t vaddr)
+{
+    if (IS_KERNEL_VADDR(vaddr) || !_vmm_is_page_present(vaddr)) {
+        return false;
+    }
+
+    ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
+    page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    bool res = !page_desc_is_writable(*page) && pcache_owns_frame(page_desc_get_frame(*page));
+    _vmm_release_active_ptable(vaddr);
+    return res;
+}
+
+/**
+ * Replaces a read-only page of the page cache with a private copy.
+ */
+static int _vmm_unshare_cached_page_lockless(uintptr_t vaddr)
+{
+    memzone_t* zone = _vmm_memzone_for_active_pdir(vaddr);
+    if (!zone) {
+        return -EFAULT;
+    }
+
+    ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
+    page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    uintptr_t cached_paddr = page_desc_get_frame(*page);
+    _vmm_release_active_ptable(vaddr);
+
+    uintptr_t paddr = vm_alloc_page_paddr();
+    if (!paddr) {
+        return -ENOMEM;
+    }
+
+    kmemzone_t tmp_zone = kmemzone_new(VMM_PAGE_SIZE);
+    int err = vmm_map_page_lockless(tmp_zone.start, paddr, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
+    if (err) {
+        vm_free_page_paddr(paddr);
+        kmemzone_free(tmp_zone);
+        return err;
+    }
+    memcpy(tmp_zone.ptr, (void*)PAGE_START(vaddr), VMM_PAGE_SIZE);
+    vmm_unmap_page_lockless(tmp_zone.start);
+    kmemzone_free(tmp_zone);
+
+    err = vmm_map_page_lockless(vaddr, paddr, zone->flags);
+    if (err) {
+        vm_free_page_paddr(paddr);
+        return err;
+    }
+    pcache_put_frame(cached_paddr);
+    return 0;
+}
+
+/**
+ * Shared file mappings write straight into the page of the cache, private
+ * ones get their own copy.
+ */
+static int _vmm_resolve_write_to_cached_page_lockless(memzone_t* zone, uintptr_t vaddr)
+{
+    if (!zone) {
+        return -EFAULT;
+    }
+
+    if (!TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+        return _vmm_unshare_cached_page_lockless(vaddr);
+    }
+
+    if (!TEST_FLAG(zone->flags, ZONE_WRITABLE)) {
+        return -EFAULT;
+    }
+
+    ptable_t* ptable = _vmm_ensure_active_ptable(vaddr);
+    page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
+    if (pcache_frame_map_writable(page_desc_get_frame(*page))) {
+        page_desc_set_attrs(page, PAGE_DESC_WRITABLE);
+        system_flush_local_tlb_entry(vaddr);
+    }
+    _vmm_release_active_ptable(vaddr);
+    return 0;
+}
+
+/**
+ * Revokes write access to pages of the page cache in the range, so the next
+ * write to them marks them dirty again. Is used by msync().
+ */
+int vmm_protect_cached_pages(uintptr_t vaddr, size_t length)
+{
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
+    for (uintptr_t page_addr = PAGE_START(vaddr); page_addr < vaddr + length; page_addr += VMM_PAGE_SIZE) {
+        // Pages of COW tables are write-protected already.
+        table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, page_addr);
+        if (!table_desc_is_present(*ptable_desc) || table_desc_is_copy_on_write(*ptable_desc)) {
+            continue;
+        }
+
+        ptable_t* ptable = _vmm_ensure_active_ptable(page_addr);
+        page_desc_t* page = _vmm_ptable_lookup(ptable, page_addr);
+        if (page_desc_is_present(*page) && page_desc_is_writable(*page) && pcache_frame_unmap_writable(page_desc_get_frame(*page))) {
+            page_desc_del_attrs(page, PAGE_DESC_WRITABLE);
+            _vmm_tlb_batch_add(&batch, page_addr);
+        }
+        _vmm_release_active_ptable(page_addr);
+    }
+    _vmm_tlb_batch_flush(&batch);
+    _vmm_lock_release(lock);
     return 0;
 }
 
@@ -984,19 +1841,28 @@ static ALWAYS_INLINE pdirectory_t* vmm_new_user_pdir_lockless()
 
 pdirectory_t* vmm_new_user_pdir()
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = &_vmm_kernel_lock;
+    _vmm_lock_acquire(lock);
     pdirectory_t* res = vmm_new_user_pdir_lockless();
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
 /**
  * The function created a new user's pdir from the active pdir.
- * After copying the task we need to flush tlb.
+ * After copying the task, pages which became read-only are flushed from TLB.
  */
 static ALWAYS_INLINE pdirectory_t* vmm_new_forked_user_pdir_lockless()
 {
     pdirectory_t* new_pdir = vm_alloc_pdir();
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
+    // Large pages have no per-page rights to mark tables as COW.
+    size_t table_coverage = VMM_PAGE_SIZE * VMM_TOTAL_PAGES_PER_TABLE;
+    for (int i = 0; i < VMM_KERNEL_TABLES_START; i++) {
+        _vmm_split_large_page_lockless(table_coverage * i);
+    }
 
     // coping all tables
     for (int i = 0; i < VMM_TOTAL_TABLES_PER_DIRECTORY; i++) {
@@ -1004,27 +1870,37 @@ static ALWAYS_INLINE pdirectory_t* vmm_new_forked_user_pdir_lockless()
     }
     vm_pspace_gen(new_pdir);
 
-    for (int i = 0; i < VMM_KERNEL_TABLES_START; i++) {
-        table_desc_t* act_ptable_desc = &THIS_CPU->pdir->entities[i];
-        if (table_desc_has_attrs(*act_ptable_desc, TABLE_DESC_PRESENT)) {
-            table_desc_t* new_ptable_desc = &new_pdir->entities[i];
-            _vmm_tables_set_cow(i, act_ptable_desc, new_ptable_desc);
+    // Pages of tables are shared with the new pdir, nothing is copied until a write.
+    size_t ptables_per_page = VMM_PAGE_SIZE / PTABLE_SIZE;
+    for (int i = 0; i < VMM_KERNEL_TABLES_START; i += ptables_per_page) {
+        uintptr_t ptables_paddr = 0;
+        for (int j = i; j < i + ptables_per_page; j++) {
+            table_desc_t* act_ptable_desc = &THIS_CPU->pdir->entities[j];
+            if (table_desc_has_attrs(*act_ptable_desc, TABLE_DESC_PRESENT)) {
+                table_desc_t* new_ptable_desc = &new_pdir->entities[j];
+                _vmm_tables_set_cow(j, act_ptable_desc, new_ptable_desc, &batch);
+                ptables_paddr = PAGE_START(table_desc_get_frame(*act_ptable_desc));
+            }
+        }
+        if (ptables_paddr) {
+            _vmm_shared_ptables_dup(ptables_paddr);
         }
     }
 
-    system_flush_whole_tlb();
+    _vmm_tlb_batch_flush(&batch);
     return new_pdir;
 }
 
 pdirectory_t* vmm_new_forked_user_pdir()
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_of_pdir(THIS_CPU->pdir);
+    _vmm_lock_acquire(lock);
     pdirectory_t* res = vmm_new_forked_user_pdir_lockless();
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
-static ALWAYS_INLINE int vmm_free_pdir_lockless(pdirectory_t* pdir, dynamic_array_t* zones)
+static ALWAYS_INLINE int vmm_free_pdir_lockless(pdirectory_t* pdir, memzones_t* zones)
 {
     if (!pdir) {
         return -EINVAL;
@@ -1052,11 +1928,12 @@ static ALWAYS_INLINE int vmm_free_pdir_lockless(pdirectory_t* pdir, dynamic_arra
     return 0;
 }
 
-int vmm_free_pdir(pdirectory_t* pdir, dynamic_array_t* zones)
+int vmm_free_pdir(pdirectory_t* pdir, memzones_t* zones)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_of_pdir(pdir);
+    _vmm_lock_acquire(lock);
     int res = vmm_free_pdir_lockless(pdir, zones);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -1078,9 +1955,10 @@ static ALWAYS_INLINE void vmm_prepare_active_pdir_for_writing_at_lockless(uintpt
 
 void vmm_prepare_active_pdir_for_writing_at(uintptr_t dest_vaddr, size_t length)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(dest_vaddr);
+    _vmm_lock_acquire(lock);
     vmm_prepare_active_pdir_for_writing_at_lockless(dest_vaddr, length);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
 }
 
 static ALWAYS_INLINE void vmm_copy_to_user_lockless(void* dest, void* src, size_t length)
@@ -1091,9 +1969,10 @@ static ALWAYS_INLINE void vmm_copy_to_user_lockless(void* dest, void* src, size_
 
 void vmm_copy_to_user(void* dest, void* src, size_t length)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for((uintptr_t)dest);
+    _vmm_lock_acquire(lock);
     vmm_prepare_active_pdir_for_writing_at_lockless((uintptr_t)dest, length);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     memcpy(dest, src, length);
 }
 
@@ -1132,10 +2011,11 @@ void vmm_copy_to_pdir(pdirectory_t* pdir, void* src, uintptr_t dest_vaddr, size_
         ksrc = src;
     }
 
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_of_pdir(pdir);
+    _vmm_lock_acquire(lock);
     vmm_switch_pdir_lockless(pdir);
     vmm_prepare_active_pdir_for_writing_at_lockless(dest_vaddr, length);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
 
     uint8_t* dest = (uint8_t*)dest_vaddr;
     memcpy(dest, ksrc, length);
@@ -1162,11 +2042,12 @@ pdirectory_t* vmm_get_kernel_pdir()
  * PF HANDLER FUNCTIONS
  */
 
-static ALWAYS_INLINE int vmm_tune_page_lockless(uintptr_t vaddr, uint32_t settings)
+static int _vmm_tune_page_lockless(uintptr_t vaddr, uint32_t settings, vmm_tlb_batch_t* batch)
 {
     if (_vmm_is_copy_on_write(vaddr)) {
         return -EBUSY;
     }
+    _vmm_split_large_page_lockless(vaddr);
 
     bool is_writable = ((settings & MMU_FLAG_PERM_WRITE) > 0);
     bool is_readable = ((settings & MMU_FLAG_PERM_READ) > 0);
@@ -1179,41 +2060,61 @@ static ALWAYS_INLINE int vmm_tune_page_lockless(uintptr_t vaddr, uint32_t settin
     page_desc_t* page = _vmm_ptable_lookup(ptable, vaddr);
 
     if (page_desc_is_present(*page)) {
+        // The zero page stays read-only, a write fault gives a private page.
+        if (vmm_is_zero_frame(page_desc_get_frame(*page))) {
+            is_writable = false;
+        }
         is_user ? page_desc_set_attrs(page, PAGE_DESC_USER) : page_desc_del_attrs(page, PAGE_DESC_USER);
         is_writable ? page_desc_set_attrs(page, PAGE_DESC_WRITABLE) : page_desc_del_attrs(page, PAGE_DESC_WRITABLE);
         is_not_cacheable ? page_desc_set_attrs(page, PAGE_DESC_NOT_CACHEABLE) : page_desc_del_attrs(page, PAGE_DESC_NOT_CACHEABLE);
+        _vmm_tlb_batch_add(batch, vaddr);
     } else {
         vmm_alloc_page_lockless(vaddr, settings);
     }
 
-    system_flush_local_tlb_entry(vaddr);
     _vmm_release_active_ptable(vaddr);
     return 0;
 }
 
+static ALWAYS_INLINE int vmm_tune_page_lockless(uintptr_t vaddr, uint32_t settings)
+{
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+    int res = _vmm_tune_page_lockless(vaddr, settings, &batch);
+    _vmm_tlb_batch_flush(&batch);
+    return res;
+}
+
 int vmm_tune_page(uintptr_t vaddr, uint32_t settings)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_tune_page_lockless(vaddr, settings);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
 static ALWAYS_INLINE int vmm_tune_pages_lockless(uintptr_t vaddr, size_t length, uint32_t settings)
 {
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
     uintptr_t page_addr = PAGE_START(vaddr);
     while (page_addr < vaddr + length) {
-        vmm_tune_page_lockless(page_addr, settings);
+        _vmm_tune_page_lockless(page_addr, settings, &batch);
         page_addr += VMM_PAGE_SIZE;
     }
+
+    _vmm_tlb_batch_flush(&batch);
     return 0;
 }
 
 int vmm_tune_pages(uintptr_t vaddr, size_t length, uint32_t settings)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_tune_pages_lockless(vaddr, length, settings);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
@@ -1241,14 +2142,15 @@ static ALWAYS_INLINE int vmm_alloc_page_lockless(uintptr_t vaddr, uint32_t setti
 
 int vmm_alloc_page(uintptr_t vaddr, uint32_t settings)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     if (_vmm_is_page_present(vaddr)) {
-        lock_release(&_vmm_lock);
+        _vmm_lock_release(lock);
         return -EALREADY;
     }
 
     int err = vmm_alloc_page_no_fill_lockless(vaddr, settings);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     if (err) {
         return err;
     }
@@ -1273,7 +2175,7 @@ int vmm_copy_page_lockless(uintptr_t to_vaddr, uintptr_t src_vaddr, ptable_t* sr
     ptable_t* cur_ptable = _vmm_ensure_active_ptable(to_vaddr);
     page_desc_t* cur_page = _vmm_ptable_lookup(cur_ptable, to_vaddr);
 
-    if (!page_desc_is_present(*cur_page)) {
+    if (!page_desc_is_present(*cur_page) || vmm_is_zero_frame(page_desc_get_frame(*cur_page))) {
         vmm_alloc_page_lockless(to_vaddr, page_desc_get_settings_ignore_cow(*old_page_desc));
     }
 
@@ -1297,19 +2199,27 @@ int vmm_copy_page_lockless(uintptr_t to_vaddr, uintptr_t src_vaddr, ptable_t* sr
 
 int vmm_copy_page(uintptr_t to_vaddr, uintptr_t src_vaddr, ptable_t* src_ptable)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(to_vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_copy_page_lockless(to_vaddr, src_vaddr, src_ptable);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
-static ALWAYS_INLINE int vmm_free_page_lockless(uintptr_t vaddr, page_desc_t* page, dynamic_array_t* zones)
+static ALWAYS_INLINE int vmm_free_page_lockless(uintptr_t vaddr, page_desc_t* page, memzones_t* zones)
 {
     if (_vmm_is_copy_on_write(vaddr)) {
         return -EBUSY;
     }
+    _vmm_split_large_page_lockless(vaddr);
 
     if (!page_desc_has_attrs(*page, PAGE_DESC_PRESENT)) {
+        // A not present page with a frame is swapped, the frame is an id of its slot.
+        uintptr_t id = page_desc_get_frame(*page) >> PAGE_DESC_FRAME_OFFSET;
+        if (id) {
+            swapfile_free(id);
+            page_desc_del_frame(page);
+        }
         return 0;
     }
     page_desc_del_attrs(page, PAGE_DESC_PRESENT);
@@ -1320,24 +2230,87 @@ static ALWAYS_INLINE int vmm_free_page_lockless(uintptr_t vaddr, page_desc_t* pa
             return 0;
         }
     }
-    vm_free_page_paddr(page_desc_get_frame(*page));
+
+    uintptr_t paddr = page_desc_get_frame(*page);
+    if (vmm_is_zero_frame(paddr)) {
+        page_desc_del_frame(page);
+        return 0;
+    }
+    if (zone && TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY) && page_desc_is_writable(*page)) {
+        pcache_frame_unmap_writable(paddr);
+    }
+    if (!pcache_put_frame(paddr)) {
+        vm_free_page_paddr(paddr);
+    }
+    page_desc_del_frame(page);
     return 0;
 }
 
-int vmm_free_page(uintptr_t vaddr, page_desc_t* page, dynamic_array_t* zones)
+int vmm_free_page(uintptr_t vaddr, page_desc_t* page, memzones_t* zones)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int res = vmm_free_page_lockless(vaddr, page, zones);
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return res;
 }
 
-static int _vmm_page_not_present_lockless(uintptr_t vaddr)
+/**
+ * Frees pages of the active address space in the range. Is used to unmap
+ * a zone before it is removed.
+ */
+int vmm_free_pages(uintptr_t vaddr, size_t length, memzones_t* zones)
+{
+    vmm_tlb_batch_t batch;
+    _vmm_tlb_batch_init(&batch, THIS_CPU->pdir);
+
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
+    for (uintptr_t page_addr = PAGE_START(vaddr); page_addr < vaddr + length; page_addr += VMM_PAGE_SIZE) {
+        table_desc_t* ptable_desc = _vmm_pdirectory_lookup(THIS_CPU->pdir, page_addr);
+        if (!table_desc_is_present(*ptable_desc)) {
+            continue;
+        }
+
+        int err = _vmm_ensure_cow_for_page(page_addr);
+        if (err) {
+            _vmm_tlb_batch_flush(&batch);
+            _vmm_lock_release(lock);
+            return err;
+        }
+
+        ptable_t* ptable = _vmm_ensure_active_ptable(page_addr);
+        page_desc_t* page = _vmm_ptable_lookup(ptable, page_addr);
+        bool was_present = page_desc_is_present(*page);
+        vmm_free_page_lockless(page_addr, page, zones);
+        page_desc_del_frame(page);
+        _vmm_release_active_ptable(page_addr);
+        if (was_present) {
+            _vmm_tlb_batch_add(&batch, page_addr);
+        }
+    }
+    _vmm_tlb_batch_flush(&batch);
+    _vmm_lock_release(lock);
+    return 0;
+}
+
+static int _vmm_page_not_present_lockless(uint32_t info, uintptr_t vaddr)
 {
     if (_vmm_is_page_present(vaddr)) {
         return 0;
     }
 
+    // Swapped pages of a COW table are restored into the private copy.
+    if (!IS_KERNEL_VADDR(vaddr)) {
+        int err = _vmm_ensure_cow_for_page(vaddr);
+        if (err) {
+            return err;
+        }
+        if (_vmm_is_page_present(vaddr)) {
+            return 0;
+        }
+    }
+
     if (_vmm_is_page_swapped(vaddr)) {
         return _vmm_restore_swapped_page_lockless(vaddr);
     }
@@ -1358,6 +2331,25 @@ static int _vmm_page_not_present_lockless(uintptr_t vaddr)
         }
     }
 
+    if (zone->ops && zone->ops->get_cached_page) {
+        uintptr_t paddr = zone->ops->get_cached_page(zone, vaddr);
+        if (paddr) {
+            return vmm_map_page_lockless(vaddr, paddr, zone->flags & ~ZONE_WRITABLE);
+        }
+
+        // A private copy of a shared page would lose writes.
+        if (TEST_FLAG(zone->type, ZONE_TYPE_MAPPED_FILE_SHAREDLY)) {
+            return -ENOMEM;
+        }
+    }
+
+#ifdef VMM_ZERO_PAGE
+    bool is_anonymous = !(zone->ops && zone->ops->load_page_content) && !TEST_FLAG(zone->type, ZONE_TYPE_DEVICE);
+    if (is_anonymous && _vmm_is_caused_by_user(info) && _vmm_is_caused_reading(info)) {
+        return _vmm_map_zero_page_lockless(zone, vaddr);
+    }
+#endif
+
     int err = vm_alloc_user_page_no_fill_lockless(zone, vaddr);
     if (err) {
         return err;
@@ -1374,12 +2366,14 @@ static int _vmm_page_not_present_lockless(uintptr_t vaddr)
 
 int _vmm_pf_on_writing(uintptr_t vaddr)
 {
-    lock_acquire(&_vmm_lock);
+    lock_t* lock = _vmm_lock_for(vaddr);
+    _vmm_lock_acquire(lock);
     int visited = 0;
 
     if (_vmm_is_copy_on_write(vaddr)) {
         int err = _vmm_ensure_cow_for_page(vaddr);
         if (err) {
+            _vmm_lock_release(lock);
             return err;
         }
         visited++;
@@ -1390,21 +2384,61 @@ int _vmm_pf_on_writing(uintptr_t vaddr)
         visited++;
     }
 #endif // ZEROING_ON_DEMAND
+#ifdef VMM_ZERO_PAGE
+    if (_vmm_is_zero_page_mapped(vaddr)) {
+        memzone_t* zone = _vmm_memzone_for_active_pdir(vaddr);
+        if (zone && TEST_FLAG(zone->flags, ZONE_WRITABLE)) {
+            int err = vm_alloc_user_page_lockless(zone, vaddr);
+            if (err) {
+                _vmm_lock_release(lock);
+                return err;
+            }
+            visited++;
+        }
+    }
+#endif // VMM_ZERO_PAGE
+    if (_vmm_is_cached_page_shared(vaddr)) {
+        memzone_t* zone = _vmm_memzone_for_active_pdir(vaddr);
+        if (zone && TEST_FLAG(zone->flags, ZONE_WRITABLE)) {
+            int err = _vmm_resolve_write_to_cached_page_lockless(zone, vaddr);
+            if (err) {
+                _vmm_lock_release(lock);
+                return err;
+            }
+            visited++;
+        }
+    }
     if (!visited) {
-        lock_release(&_vmm_lock);
+        _vmm_lock_release(lock);
         return -EFAULT;
     }
 
-    lock_release(&_vmm_lock);
+    _vmm_lock_release(lock);
     return 0;
 }
 
+/**
+ * Returns true if the caller holds an address space lock, e.g. when it is
+ * reached from the page fault handler. Such callers must not sleep.
+ */
+bool vmm_holds_lock()
+{
+    void* owner = _vmm_lock_owner();
+    for (int i = 0; i < VMM_PDIR_LOCKS; i++) {
+        if (_vmm_pdir_lock_owners[i] == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int vmm_page_fault_handler(uint32_t info, uintptr_t vaddr)
 {
     if (_vmm_is_table_not_present(info) || _vmm_is_page_not_present(info)) {
-        lock_acquire(&_vmm_lock);
-        int res = _vmm_page_not_present_lockless(vaddr);
-        lock_release(&_vmm_lock);
+        lock_t* lock = _vmm_lock_for(vaddr);
+        _vmm_lock_acquire(lock);
+        int res = _vmm_page_not_present_lockless(info, vaddr);
+        _vmm_lock_release(lock);
         return res;
     }
 
@@ -1442,10 +2476,8 @@ static ALWAYS_INLINE int vmm_switch_pdir_lockless(pdirectory_t* pdir)
 
 int vmm_switch_pdir(pdirectory_t* pdir)
 {
-    lock_acquire(&_vmm_lock);
-    int res = vmm_switch_pdir_lockless(pdir);
-    lock_release(&_vmm_lock);
-    return res;
+    // Only the CPU's own state is changed, so no address space lock is needed.
+    return vmm_switch_pdir_lockless(pdir);
 }
 
 /**
@@ -64,7 +64,7 @@ void table_desc_del_attrs(table_desc_t* pde, uint32_t attrs)
 bool table_desc_has_attrs(table_desc_t pde, uint32_t attrs)
 {
     if ((attrs & TABLE_DESC_PRESENT) == TABLE_DESC_PRESENT) {
-        if (pde.valid == 0) {
+        if (pde.valid == 0 && !table_desc_is_large_page(pde)) {
             return false;
         }
     }
@@ -87,9 +87,28 @@ void table_desc_del_frame(table_desc_t* pde)
     pde->baddr = 0;
 }
 
+/**
+ * Turns the entry into a 1MB section, which maps paddr directly. Memory
+ * attributes and access permissions match those of pages, see page_desc_init().
+ */
+void table_desc_set_large_page(table_desc_t* pde, uint32_t paddr, uint32_t attrs)
+{
+    uint32_t ap = 0b01;
+    if ((attrs & TABLE_DESC_USER) == TABLE_DESC_USER) {
+        ap = ((attrs & TABLE_DESC_WRITABLE) == TABLE_DESC_WRITABLE) ? 0b11 : 0b10;
+    }
+
+    // Section, B, C, domain, AP, TEX = 0b001, S.
+    uint32_t data = 0b10 | (1 << 2) | (1 << 3) | (0b0011 << 5) | (ap << 10) | (0b001 << 12) | (1 << 16);
+    if ((attrs & TABLE_DESC_PCD) == TABLE_DESC_PCD) {
+        data &= ~(1 << 3);
+    }
+    pde->data = (paddr & 0xfff00000) | data;
+}
+
 bool table_desc_is_present(table_desc_t pde)
 {
-    return pde.valid;
+    return pde.valid || table_desc_is_large_page(pde);
 }
 
 bool table_desc_is_writable(table_desc_t pde)
@@ -102,6 +121,11 @@ bool table_desc_is_4mb(table_desc_t pde)
     return 0;
 }
 
+bool table_desc_is_large_page(table_desc_t pde)
+{
+    return (pde.data & 0b11) == 0b10;
+}
+
 bool table_desc_is_copy_on_write(table_desc_t pde)
 {
     return pde.imp;
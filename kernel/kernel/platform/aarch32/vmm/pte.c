@@ -106,6 +106,12 @@ bool page_desc_is_not_cacheable(page_desc_t pte)
     return (pte.c == 0);
 }
 
+bool page_desc_is_accessed(page_desc_t pte)
+{
+    // The access flag is not managed by hardware in the short-descriptor format.
+    return false;
+}
+
 uint32_t page_desc_get_frame(page_desc_t pte)
 {
     return (pte.baddr << PAGE_DESC_FRAME_OFFSET);
@@ -15,6 +15,7 @@
 #include <drivers/x86/mouse.h>
 #include <drivers/x86/pci.h>
 #include <drivers/x86/pit.h>
+#include <drivers/x86/tsc.h>
 #include <platform/x86/gdt.h>
 #include <platform/x86/idt.h>
 #include <platform/x86/init.h>
@@ -29,6 +30,7 @@ void platform_setup_boot_cpu()
 {
     clean_screen();
     pit_setup();
+    tsc_setup();
     fpu_init();
 }
 
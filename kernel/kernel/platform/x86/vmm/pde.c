@@ -56,6 +56,16 @@ void table_desc_del_frame(table_desc_t* pde)
     *pde &= ((1 << (TABLE_DESC_FRAME_OFFSET)) - 1);
 }
 
+/**
+ * Turns the entry into a 4MB page, which maps paddr directly. Requires
+ * PSE to be enabled, see system_enable_large_pages().
+ */
+void table_desc_set_large_page(table_desc_t* pde, uint32_t paddr, uint32_t attrs)
+{
+    const uint32_t allowed_attrs = TABLE_DESC_WRITABLE | TABLE_DESC_USER | TABLE_DESC_PWT | TABLE_DESC_PCD;
+    *pde = (paddr & 0xffc00000) | TABLE_DESC_PRESENT | TABLE_DESC_4MB | (attrs & allowed_attrs);
+}
+
 bool table_desc_is_present(table_desc_t pde)
 {
     return ((pde & TABLE_DESC_PRESENT) > 0);
@@ -71,6 +81,11 @@ bool table_desc_is_4mb(table_desc_t pde)
     return ((pde & TABLE_DESC_4MB) > 0);
 }
 
+bool table_desc_is_large_page(table_desc_t pde)
+{
+    return table_desc_is_present(pde) && table_desc_is_4mb(pde);
+}
+
 bool table_desc_is_copy_on_write(table_desc_t pde)
 {
     return ((pde & TABLE_DESC_COPY_ON_WRITE) > 0);
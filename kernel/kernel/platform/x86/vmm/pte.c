@@ -66,6 +66,11 @@ bool page_desc_is_not_cacheable(page_desc_t pte)
     return ((pte & PAGE_DESC_NOT_CACHEABLE) > 0);
 }
 
+bool page_desc_is_accessed(page_desc_t pte)
+{
+    return ((pte & PAGE_DESC_ACCESSED) > 0);
+}
+
 bool page_desc_is_cow(page_desc_t pte)
 {
     return ((pte & PAGE_DESC_COPY_ON_WRITE) > 0);
@@ -6,6 +6,8 @@
  * found in the LICENSE file.
  */
 
+#include <fs/bcache.h>
+#include <fs/pcache.h>
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/log.h>
@@ -96,6 +98,8 @@ void sys_read(trapframe_t* tf)
 
     init_read_blocker(RUNNING_THREAD, fd);
 
+    // The kernel writes into the buffer directly.
+    vmm_unshare_zero_pages(SYSCALL_VAR2(tf), SYSCALL_VAR3(tf));
     int res = vfs_read(fd, (uint8_t*)SYSCALL_VAR2(tf), (uint32_t)SYSCALL_VAR3(tf));
     return_with_val(res);
 }
@@ -200,8 +204,10 @@ void sys_fstat(trapframe_t* tf)
 void sys_fsync(trapframe_t* tf)
 {
     file_descriptor_t* fd = proc_get_fd(RUNNING_THREAD->process, (int)SYSCALL_VAR1(tf));
+    pcache_sync_inode(fd->dentry);
     dentry_flush(fd->dentry);
-    return_with_val(0);
+    vfs_sync_device(fd->dentry->dev_indx);
+    return_with_val(bcache_sync_device(fd->dentry->dev->dev));
 }
 
 void sys_mkdir(trapframe_t* tf)
@@ -285,6 +291,7 @@ void sys_getdents(trapframe_t* tf)
 {
     proc_t* p = RUNNING_THREAD->process;
     file_descriptor_t* fd = (file_descriptor_t*)proc_get_fd(p, (uint32_t)SYSCALL_VAR1(tf));
+    vmm_unshare_zero_pages(SYSCALL_VAR2(tf), SYSCALL_VAR3(tf));
     int read = vfs_getdents(fd, (uint8_t*)SYSCALL_VAR2(tf), SYSCALL_VAR3(tf));
     return_with_val(read);
 }
@@ -313,13 +320,17 @@ void sys_select(trapframe_t* tf)
 
     init_select_blocker(RUNNING_THREAD, nfds, readfds, writefds, exceptfds, timeout);
 
+    // Sets are written in place, so shared pages under them are resolved first.
     if (readfds) {
+        vmm_prepare_active_pdir_for_writing_at((uintptr_t)readfds, sizeof(fd_set_t));
         FD_ZERO(readfds);
     }
     if (writefds) {
+        vmm_prepare_active_pdir_for_writing_at((uintptr_t)writefds, sizeof(fd_set_t));
         FD_ZERO(writefds);
     }
     if (exceptfds) {
+        vmm_prepare_active_pdir_for_writing_at((uintptr_t)exceptfds, sizeof(fd_set_t));
         FD_ZERO(exceptfds);
     }
 
@@ -417,6 +428,29 @@ void sys_munmap(trapframe_t* tf)
     return_with_val(0);
 }
 
+void sys_msync(trapframe_t* tf)
+{
+    proc_t* p = RUNNING_THREAD->process;
+    uintptr_t addr = (uintptr_t)SYSCALL_VAR1(tf);
+    size_t length = (size_t)SYSCALL_VAR2(tf);
+    int flags = (int)SYSCALL_VAR3(tf);
+
+    if (addr % VMM_PAGE_SIZE) {
+        return_with_val(-EINVAL);
+    }
+
+    if (TEST_FLAG(flags, MS_SYNC) && TEST_FLAG(flags, MS_ASYNC)) {
+        return_with_val(-EINVAL);
+    }
+
+    memzone_t* zone = memzone_find(p, addr);
+    if (!zone) {
+        return_with_val(-ENOMEM);
+    }
+
+    return_with_val(vfs_msync(zone, addr, length, flags));
+}
+
 void sys_dup(trapframe_t* tf)
 {
     proc_t* p = RUNNING_THREAD->process;
@@ -45,6 +45,7 @@ static const void* syscalls[] = {
     [SYS_RMDIR] = sys_rmdir,
     [SYS_MMAP] = sys_mmap,
     [SYS_MUNMAP] = sys_munmap,
+    [SYS_MSYNC] = sys_msync,
     [SYS_DUP] = sys_dup,
     [SYS_DUP2] = sys_dup2,
     [SYS_SOCKET] = sys_socket,
@@ -55,7 +56,7 @@ static const void* syscalls[] = {
     [SYS_SETPGID] = sys_setpgid,
     [SYS_GETPGID] = sys_getpgid,
     [SYS_PTHREAD_CREATE] = sys_create_thread,
-    [SYS_NANOSLEEP] = sys_sleep,
+    [SYS_NANOSLEEP] = sys_nanosleep,
     [SYS_PTRACE] = sys_ptrace,
     [SYS_SELECT] = sys_select,
     [SYS_FSTAT] = sys_fstat,
@@ -65,10 +66,12 @@ static const void* syscalls[] = {
     [SYS_CLOCK_GETTIME] = sys_clock_gettime,
     [SYS_CLOCK_SETTIME] = sys_none,
     [SYS_CLOCK_GETRES] = sys_none,
+    [SYS_CLOCK_NANOSLEEP] = sys_clock_nanosleep,
     [SYS_NICE] = sys_nice,
     [SYS_SHBUF_CREATE] = sys_shbuf_create,
     [SYS_SHBUF_GET] = sys_shbuf_get,
     [SYS_SHBUF_FREE] = sys_shbuf_free,
+    [SYS_SPAWN] = sys_spawn,
 };
 
 #ifdef __i386__
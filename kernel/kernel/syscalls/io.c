@@ -11,6 +11,7 @@
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/log.h>
+#include <mem/vmm.h>
 #include <platform/generic/syscalls/params.h>
 #include <syscalls/handlers.h>
 #include <tasking/tasking.h>
@@ -94,14 +95,24 @@ void sys_shbuf_create(trapframe_t* tf)
 {
     uint8_t** buffer = (uint8_t**)SYSCALL_VAR1(tf);
     size_t size = SYSCALL_VAR2(tf);
-    return_with_val(shared_buffer_create(buffer, size));
+    uint8_t* kbuffer;
+    int res = shared_buffer_create(&kbuffer, size);
+    if (res >= 0) {
+        vmm_copy_to_user(buffer, &kbuffer, sizeof(uint8_t*));
+    }
+    return_with_val(res);
 }
 
 void sys_shbuf_get(trapframe_t* tf)
 {
     int id = SYSCALL_VAR1(tf);
     uint8_t** buffer = (uint8_t**)SYSCALL_VAR2(tf);
-    return_with_val(shared_buffer_get(id, buffer));
+    uint8_t* kbuffer;
+    int res = shared_buffer_get(id, &kbuffer);
+    if (res >= 0) {
+        vmm_copy_to_user(buffer, &kbuffer, sizeof(uint8_t*));
+    }
+    return_with_val(res);
 }
 
 void sys_shbuf_free(trapframe_t* tf)
@@ -39,6 +39,12 @@ void sys_exec(trapframe_t* tf)
     }
 }
 
+void sys_spawn(trapframe_t* tf)
+{
+    int res = tasking_spawn((char*)SYSCALL_VAR1(tf), (const char**)SYSCALL_VAR2(tf), (const char**)SYSCALL_VAR3(tf), (const spawn_file_action_t*)SYSCALL_VAR4(tf), (int)SYSCALL_VAR5(tf));
+    return_with_val(res);
+}
+
 void sys_sigaction(trapframe_t* tf)
 {
     int res = signal_set_handler(RUNNING_THREAD, (int)SYSCALL_VAR1(tf), (void*)SYSCALL_VAR2(tf));
@@ -103,16 +109,6 @@ void sys_create_thread(trapframe_t* tf)
     return_with_val(thread->tid);
 }
 
-void sys_sleep(trapframe_t* tf)
-{
-    thread_t* p = RUNNING_THREAD;
-    time_t time = SYSCALL_VAR1(tf);
-
-    init_sleep_blocker(p, time);
-
-    return_with_val(0);
-}
-
 void sys_sched_yield(trapframe_t* tf)
 {
     resched();
@@ -9,9 +9,11 @@
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/log.h>
+#include <mem/vmm.h>
 #include <platform/generic/syscalls/params.h>
 #include <platform/generic/tasking/trapframe.h>
 #include <syscalls/handlers.h>
+#include <tasking/tasking.h>
 #include <time/time_manager.h>
 
 void sys_clock_gettime(trapframe_t* tf)
@@ -19,18 +21,18 @@ void sys_clock_gettime(trapframe_t* tf)
     clockid_t clk_id = SYSCALL_VAR1(tf);
     timespec_t* u_ts = (timespec_t*)SYSCALL_VAR2(tf);
 
+    timespec_t ts;
     switch (clk_id) {
     case CLOCK_MONOTONIC:
-        u_ts->tv_sec = timeman_seconds_since_boot();
-        u_ts->tv_nsec = timeman_get_ticks_from_last_second() * (1000000000 / timeman_ticks_per_second());
+        timeman_ns_to_timespec(timeman_ns_since_boot(), &ts);
         break;
     case CLOCK_REALTIME:
-        u_ts->tv_sec = timeman_now();
-        u_ts->tv_nsec = timeman_get_ticks_from_last_second() * (1000000000 / timeman_ticks_per_second());
+        timeman_ns_to_timespec(timeman_ns_since_epoch(), &ts);
         break;
     default:
         return_with_val(-EINVAL);
     }
+    vmm_copy_to_user(u_ts, &ts, sizeof(timespec_t));
     return_with_val(0);
 }
 
@@ -43,11 +45,87 @@ void sys_gettimeofday(trapframe_t* tf)
         return_with_val(-EINVAL);
     }
 
-    tv->tv_sec = timeman_now();
-    tv->tv_usec = timeman_get_ticks_from_last_second() * (1000000 / timeman_ticks_per_second());
+    timespec_t ts;
+    timeman_ns_to_timespec(timeman_ns_since_epoch(), &ts);
+    timeval_t ktv;
+    ktv.tv_sec = ts.tv_sec;
+    ktv.tv_usec = ts.tv_nsec / 1000;
+    vmm_copy_to_user(tv, &ktv, sizeof(timeval_t));
 
-    tz->tz_dsttime = DST_NONE;
-    tz->tz_minuteswest = 0;
+    timezone_t ktz;
+    ktz.tz_dsttime = DST_NONE;
+    ktz.tz_minuteswest = 0;
+    vmm_copy_to_user(tz, &ktz, sizeof(timezone_t));
 
     return_with_val(0);
-}
\ No newline at end of file
+}
+
+/**
+ * Deadlines are kept in nanoseconds since boot. A sleep which is
+ * interrupted by a signal returns -EINTR and the time left in rem.
+ */
+static int _sys_sleep_until(uint64_t until, timespec_t* rem)
+{
+    thread_t* thread = RUNNING_THREAD;
+    init_sleep_blocker(thread, until);
+
+    uint64_t now = timeman_ns_since_boot();
+    if (!thread->wait_timed_out && now < until) {
+        if (rem) {
+            timespec_t left;
+            timeman_ns_to_timespec(until - now, &left);
+            vmm_copy_to_user(rem, &left, sizeof(timespec_t));
+        }
+        return -EINTR;
+    }
+    return 0;
+}
+
+void sys_nanosleep(trapframe_t* tf)
+{
+    timespec_t* req = (timespec_t*)SYSCALL_VAR1(tf);
+    timespec_t* rem = (timespec_t*)SYSCALL_VAR2(tf);
+
+    if (!req || req->tv_nsec >= NS_PER_SEC) {
+        return_with_val(-EINVAL);
+    }
+
+    uint64_t until = timeman_ns_since_boot() + timeman_timespec_to_ns(req);
+    return_with_val(_sys_sleep_until(until, rem));
+}
+
+void sys_clock_nanosleep(trapframe_t* tf)
+{
+    clockid_t clk_id = SYSCALL_VAR1(tf);
+    int flags = SYSCALL_VAR2(tf);
+    timespec_t* req = (timespec_t*)SYSCALL_VAR3(tf);
+    timespec_t* rem = (timespec_t*)SYSCALL_VAR4(tf);
+
+    if (!req || req->tv_nsec >= NS_PER_SEC) {
+        return_with_val(-EINVAL);
+    }
+
+    uint64_t now;
+    switch (clk_id) {
+    case CLOCK_MONOTONIC:
+        now = timeman_ns_since_boot();
+        break;
+    case CLOCK_REALTIME:
+        now = timeman_ns_since_epoch();
+        break;
+    default:
+        return_with_val(-EINVAL);
+    }
+
+    uint64_t until = timeman_ns_since_boot();
+    uint64_t req_ns = timeman_timespec_to_ns(req);
+    if (TEST_FLAG(flags, TIMER_ABSTIME)) {
+        // Absolute sleeps are restarted with the same deadline, so rem is not used.
+        until += req_ns > now ? req_ns - now : 0;
+        rem = NULL;
+    } else {
+        until += req_ns;
+    }
+
+    return_with_val(_sys_sleep_until(until, rem));
+}
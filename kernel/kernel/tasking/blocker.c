@@ -6,7 +6,9 @@
  * found in the LICENSE file.
  */
 
+#include <drivers/generic/blkqueue.h>
 #include <libkern/atomic.h>
+#include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
 #include <libkern/log.h>
 #include <libkern/syscall_structs.h>
@@ -14,6 +16,98 @@
 #include <tasking/thread.h>
 #include <time/time_manager.h>
 
+/**
+ * A blocked thread is attached to wait queues of the objects it waits on,
+ * and producers of these objects wake the queues. A woken thread is put back
+ * to the runqueue only once its should_unblock() is satisfied. Threads leave
+ * queues by themselves when they run again, so a producer never touches
+ * queues of other objects.
+ * Sleeps and select timeouts arm the thread's timer on the timer wheel,
+ * which wakes the thread directly once the deadline has come.
+ */
+
+static int _blocker_wait_on(thread_t* thread, wait_queue_t* wq)
+{
+    for (int i = 0; i < thread->wait_entries_count; i++) {
+        if (thread->wait_entries[i].queue == wq) {
+            return 0;
+        }
+    }
+
+    if (thread->wait_entries_count >= THREAD_WAIT_ENTRIES) {
+        return -ENOSPC;
+    }
+
+    wait_entry_t* entry = &thread->wait_entries[thread->wait_entries_count++];
+    entry->thread = thread;
+    wait_queue_add(wq, entry);
+    return 0;
+}
+
+static void _blocker_timer_callback(ktimer_t* timer)
+{
+    thread_t* thread = (thread_t*)timer->data;
+    thread->wait_timed_out = true;
+    thread_try_unblock(thread);
+}
+
+static void _blocker_wait_until(thread_t* thread, uint64_t until)
+{
+    ktimer_init(&thread->wait_timer, _blocker_timer_callback, thread);
+    ktimer_arm(&thread->wait_timer, until);
+}
+
+static void _blocker_prepare(thread_t* thread, int reason, int (*should_unblock)(thread_t*), bool should_unblock_for_signal)
+{
+    thread->status = THREAD_STATUS_BLOCKED;
+    thread->blocker.reason = reason;
+    thread->blocker.should_unblock = should_unblock;
+    thread->blocker.should_unblock_for_signal = should_unblock_for_signal;
+}
+
+static int _blocker_block(thread_t* thread)
+{
+    // The object could have changed while the thread was being attached to queues.
+    if (thread->blocker.should_unblock(thread)) {
+        thread->status = THREAD_STATUS_RUNNING;
+        thread->blocker.reason = BLOCKER_INVALID;
+    } else {
+        sched_dequeue(thread);
+        resched();
+    }
+
+    thread_leave_wait_queues(thread);
+    return 0;
+}
+
+bool thread_try_unblock(thread_t* thread)
+{
+    if (thread->status != THREAD_STATUS_BLOCKED || thread->blocker.reason == BLOCKER_INVALID) {
+        return false;
+    }
+
+    if (!thread->blocker.should_unblock || !thread->blocker.should_unblock(thread)) {
+        return false;
+    }
+
+    thread->blocker.reason = BLOCKER_INVALID;
+    sched_enqueue(thread);
+    return true;
+}
+
+void thread_leave_wait_queues(thread_t* thread)
+{
+    for (int i = 0; i < thread->wait_entries_count; i++) {
+        wait_queue_remove(&thread->wait_entries[i]);
+    }
+    thread->wait_entries_count = 0;
+    ktimer_cancel(&thread->wait_timer);
+}
+
+/**
+ * BLOCKERS
+ */
+
 int should_unblock_join_block(thread_t* thread)
 {
     if (thread_is_freed(thread->blocker_data.join.joinee) || thread->blocker_data.join.join_pid != thread->blocker_data.join.joinee->tid) {
@@ -39,14 +133,9 @@ int init_join_blocker(thread_t* thread, int wait_for_pid)
         return 0;
     }
 
-    thread->status = THREAD_STATUS_BLOCKED;
-    thread->blocker.reason = BLOCKER_JOIN;
-    thread->blocker.should_unblock = should_unblock_join_block;
-    thread->blocker.should_unblock_for_signal = true;
-    sched_dequeue(thread);
-    resched();
-
-    return 0;
+    _blocker_prepare(thread, BLOCKER_JOIN, should_unblock_join_block, true);
+    _blocker_wait_on(thread, &joinee_thread->exit_wait_queue);
+    return _blocker_block(thread);
 }
 
 int should_unblock_read_block(thread_t* thread)
@@ -65,13 +154,15 @@ int init_read_blocker(thread_t* thread, file_descriptor_t* bfd)
         return 0;
     }
 
-    thread->status = THREAD_STATUS_BLOCKED;
-    thread->blocker.reason = BLOCKER_READ;
-    thread->blocker.should_unblock = should_unblock_read_block;
-    thread->blocker.should_unblock_for_signal = true;
-    sched_dequeue(thread);
-    resched();
-    return 0;
+    // Files without a queue never block.
+    wait_queue_t* wq = vfs_wait_queue(bfd);
+    if (!wq) {
+        return 0;
+    }
+
+    _blocker_prepare(thread, BLOCKER_READ, should_unblock_read_block, true);
+    _blocker_wait_on(thread, wq);
+    return _blocker_block(thread);
 }
 
 int should_unblock_write_block(thread_t* thread)
@@ -90,48 +181,59 @@ int init_write_blocker(thread_t* thread, file_descriptor_t* bfd)
         return 0;
     }
 
-    thread->status = THREAD_STATUS_BLOCKED;
-    thread->blocker.reason = BLOCKER_WRITE;
-    thread->blocker.should_unblock = should_unblock_write_block;
-    thread->blocker.should_unblock_for_signal = true;
-    sched_dequeue(thread);
-    resched();
-    return 0;
+    // Files without a queue never block.
+    wait_queue_t* wq = vfs_wait_queue(bfd);
+    if (!wq) {
+        return 0;
+    }
+
+    _blocker_prepare(thread, BLOCKER_WRITE, should_unblock_write_block, true);
+    _blocker_wait_on(thread, wq);
+    return _blocker_block(thread);
 }
 
 int should_unblock_sleep_block(thread_t* thread)
 {
-    return thread->blocker_data.sleep.until <= timeman_now();
+    // The timer of another cpu could fire a bit before the clock of cpu 0 reaches the deadline.
+    return thread->wait_timed_out || thread->blocker_data.sleep.until <= timeman_ns_since_boot();
 }
 
-int init_sleep_blocker(thread_t* thread, time_t time)
+int init_sleep_blocker(thread_t* thread, uint64_t until)
 {
-    thread->blocker_data.sleep.until = timeman_now() + time;
+    thread->blocker_data.sleep.until = until;
+    thread->wait_timed_out = false;
 
     if (should_unblock_sleep_block(thread)) {
         return 0;
     }
 
-    thread->status = THREAD_STATUS_BLOCKED;
-    thread->blocker.reason = BLOCKER_SLEEP;
-    thread->blocker.should_unblock = should_unblock_sleep_block;
-    thread->blocker.should_unblock_for_signal = true;
-    sched_dequeue(thread);
-    resched();
-    return 0;
+    _blocker_prepare(thread, BLOCKER_SLEEP, should_unblock_sleep_block, true);
+    _blocker_wait_until(thread, thread->blocker_data.sleep.until);
+    return _blocker_block(thread);
+}
+
+/**
+ * Could be called by producers which hold their queue locks, so fds are
+ * looked up without taking the process lock.
+ */
+static inline file_descriptor_t* _blocker_select_fd(thread_t* thread, int i)
+{
+    file_descriptor_t* fd = &thread->process->fds[i];
+    return fd->dentry ? fd : NULL;
 }
 
 int should_unblock_select_block(thread_t* thread)
 {
-    if (thread->blocker_data.sleep.until != 0 && thread->blocker_data.sleep.until <= timeman_now()) {
+    uint64_t until = thread->blocker_data.select.until;
+    if (until && (thread->wait_timed_out || until <= timeman_ns_since_boot())) {
         return true;
     }
 
     file_descriptor_t* fd;
     for (int i = 0; i < thread->blocker_data.select.nfds; i++) {
         if (FD_ISSET(i, &thread->blocker_data.select.readfds)) {
-            fd = proc_get_fd(thread->process, i);
-            if (fd->ops->can_read(fd->dentry, fd->offset)) {
+            fd = _blocker_select_fd(thread, i);
+            if (!fd || !fd->ops->can_read || fd->ops->can_read(fd->dentry, fd->offset)) {
                 return true;
             }
         }
@@ -139,8 +241,8 @@ int should_unblock_select_block(thread_t* thread)
 
     for (int i = 0; i < thread->blocker_data.select.nfds; i++) {
         if (FD_ISSET(i, &thread->blocker_data.select.writefds)) {
-            fd = proc_get_fd(thread->process, i);
-            if (fd->ops->can_write(fd->dentry, fd->offset)) {
+            fd = _blocker_select_fd(thread, i);
+            if (!fd || !fd->ops->can_write || fd->ops->can_write(fd->dentry, fd->offset)) {
                 return true;
             }
         }
@@ -148,12 +250,26 @@ int should_unblock_select_block(thread_t* thread)
     return false;
 }
 
+static void _blocker_select_wait_on_fds(thread_t* thread, fd_set_t* fds)
+{
+    for (int i = 0; i < thread->blocker_data.select.nfds; i++) {
+        if (FD_ISSET(i, fds)) {
+            file_descriptor_t* fd = _blocker_select_fd(thread, i);
+            wait_queue_t* wq = fd ? vfs_wait_queue(fd) : NULL;
+            if (wq) {
+                _blocker_wait_on(thread, wq);
+            }
+        }
+    }
+}
+
 int init_select_blocker(thread_t* thread, int nfds, fd_set_t* readfds, fd_set_t* writefds, fd_set_t* exceptfds, timeval_t* timeout)
 {
     FD_ZERO(&(thread->blocker_data.select.readfds));
     FD_ZERO(&(thread->blocker_data.select.writefds));
     FD_ZERO(&(thread->blocker_data.select.exceptfds));
-    thread->blocker_data.sleep.until = 0;
+    thread->blocker_data.select.until = 0;
+    thread->wait_timed_out = false;
 
     if (readfds) {
         thread->blocker_data.select.readfds = *readfds;
@@ -165,7 +281,8 @@ int init_select_blocker(thread_t* thread, int nfds, fd_set_t* readfds, fd_set_t*
         thread->blocker_data.select.exceptfds = *exceptfds;
     }
     if (timeout) {
-        thread->blocker_data.sleep.until = timeman_now() + timeout->tv_sec;
+        uint64_t delta = (uint64_t)timeout->tv_sec * NS_PER_SEC + (uint64_t)timeout->tv_usec * 1000;
+        thread->blocker_data.select.until = timeman_ns_since_boot() + delta;
     }
     thread->blocker_data.select.nfds = nfds;
 
@@ -173,11 +290,30 @@ int init_select_blocker(thread_t* thread, int nfds, fd_set_t* readfds, fd_set_t*
         return 0;
     }
 
-    thread->status = THREAD_STATUS_BLOCKED;
-    thread->blocker.reason = BLOCKER_SELECT;
-    thread->blocker.should_unblock = should_unblock_select_block;
-    thread->blocker.should_unblock_for_signal = true;
-    sched_dequeue(thread);
-    resched();
-    return 0;
+    _blocker_prepare(thread, BLOCKER_SELECT, should_unblock_select_block, true);
+    _blocker_select_wait_on_fds(thread, &thread->blocker_data.select.readfds);
+    _blocker_select_wait_on_fds(thread, &thread->blocker_data.select.writefds);
+    if (thread->blocker_data.select.until) {
+        _blocker_wait_until(thread, thread->blocker_data.select.until);
+    }
+    return _blocker_block(thread);
+}
+
+int should_unblock_blkio_block(thread_t* thread)
+{
+    return thread->blocker_data.blkio.req->status == BLK_REQUEST_DONE;
+}
+
+int init_blkio_blocker(thread_t* thread, struct blk_request* req)
+{
+    thread->blocker_data.blkio.req = req;
+
+    if (should_unblock_blkio_block(thread)) {
+        return 0;
+    }
+
+    // The request memory is owned by the thread, so it can't be interrupted by signals.
+    _blocker_prepare(thread, BLOCKER_BLKIO, should_unblock_blkio_block, false);
+    _blocker_wait_on(thread, &blkqueue_get(req->dev)->wait_queue);
+    return _blocker_block(thread);
 }
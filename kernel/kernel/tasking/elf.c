@@ -6,6 +6,7 @@
  * found in the LICENSE file.
  */
 
+#include <fs/pcache.h>
 #include <fs/vfs.h>
 #include <libkern/bits/errno.h>
 #include <libkern/libkern.h>
@@ -32,10 +33,10 @@ static int _elf_load_do_copy_to_ram(proc_t* p, file_descriptor_t* fd, elf_progra
     pdirectory_t* prev_pdir = vmm_get_active_pdir();
     vmm_switch_pdir(p->pdir);
 
-    uint32_t zones_count = proc->zones.size;
+    size_t zones_count = proc->zones.size;
 
-    for (uint32_t i = 0; i < zones_count; i++) {
-        memzone_t* zone = (memzone_t*)dynarr_get(&proc->zones, i);
+    for (size_t i = 0; i < zones_count; i++) {
+        memzone_t* zone = proc->zones.list[i];
         if (zone->type == ZONE_TYPE_BSS) {
             memset((void*)zone->start, 0, zone->len);
         }
@@ -51,7 +52,7 @@ static int _elf_load_do_copy_to_ram(proc_t* p, file_descriptor_t* fd, elf_progra
         memset(coping_zone.ptr, 0, COPING_BUFFER_LEN);
         if (file_remaining) {
             uint32_t file_read_len = min(file_remaining, COPING_BUFFER_LEN);
-            fd->ops->read(fd->dentry, coping_zone.ptr, file_offset, file_read_len);
+            pcache_read(fd->dentry, coping_zone.ptr, file_offset, file_read_len);
             file_offset += file_read_len;
             file_remaining -= file_read_len;
         }
@@ -59,7 +60,8 @@ static int _elf_load_do_copy_to_ram(proc_t* p, file_descriptor_t* fd, elf_progra
         void* write_ptr = coping_zone.ptr;
         for (int i = 0; i < PAGES_PER_COPING_BUFFER && mem_remaining; i++) {
             uint32_t mem_write_len = min(mem_remaining, VMM_PAGE_SIZE);
-            if (memzone_find(p, mem_offset)) {
+            memzone_t* zone = memzone_find(p, mem_offset);
+            if (zone && !zone->file) {
                 vmm_copy_to_user((void*)mem_offset, write_ptr, mem_write_len);
             }
             mem_offset += mem_write_len;
@@ -72,6 +74,48 @@ static int _elf_load_do_copy_to_ram(proc_t* p, file_descriptor_t* fd, elf_progra
     return vmm_switch_pdir(prev_pdir);
 }
 
+/**
+ * Read-only segments are mapped from the page cache instead of being copied,
+ * so processes which run the same binary share these pages. The segment
+ * should be covered by read-only zones which are not shared with other
+ * segments.
+ */
+static bool _elf_load_try_map_from_file(proc_t* p, file_descriptor_t* fd, elf_program_header_32_t* ph)
+{
+    if (TEST_FLAG(ph->p_flags, PF_W) || ph->p_filesz != ph->p_memsz) {
+        return false;
+    }
+
+    if ((ph->p_vaddr - ph->p_offset) % VMM_PAGE_SIZE || !pcache_is_cacheable(fd->dentry)) {
+        return false;
+    }
+
+    uintptr_t start = PAGE_START(ph->p_vaddr);
+    uintptr_t end = ROUND_CEIL(ph->p_vaddr + ph->p_memsz, VMM_PAGE_SIZE);
+    for (uintptr_t vaddr = start; vaddr < end;) {
+        memzone_t* zone = memzone_find(p, vaddr);
+        if (!zone) {
+            vaddr += VMM_PAGE_SIZE;
+            continue;
+        }
+        if (zone->file || TEST_FLAG(zone->flags, ZONE_WRITABLE) || zone->start < start || zone->start + zone->len > end) {
+            return false;
+        }
+        vaddr = zone->start + zone->len;
+    }
+
+    for (uintptr_t vaddr = start; vaddr < end;) {
+        memzone_t* zone = memzone_find(p, vaddr);
+        if (!zone) {
+            vaddr += VMM_PAGE_SIZE;
+            continue;
+        }
+        vfs_mmap_private_zone(zone, fd->dentry, ph->p_offset - (ph->p_vaddr - zone->start));
+        vaddr = zone->start + zone->len;
+    }
+    return true;
+}
+
 static int _elf_load_interpret_program_header_entry(proc_t* p, file_descriptor_t* fd)
 {
     elf_program_header_32_t ph;
@@ -85,7 +129,9 @@ static int _elf_load_interpret_program_header_entry(proc_t* p, file_descriptor_t
 #endif
     switch (ph.p_type) {
     case PT_LOAD:
-        _elf_load_do_copy_to_ram(p, fd, &ph);
+        if (!_elf_load_try_map_from_file(p, fd, &ph)) {
+            _elf_load_do_copy_to_ram(p, fd, &ph);
+        }
         break;
     default:
         break;
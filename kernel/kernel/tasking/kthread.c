@@ -49,6 +49,12 @@ int kthread_setup(proc_t* p)
     p->main_thread->tid = p->pid;
     p->main_thread->process = p;
     p->main_thread->last_cpu = LAST_CPU_NOT_SET;
+    p->main_thread->sched_last_ran = 0;
+    p->main_thread->sched_array = NULL;
+    p->main_thread->sched_next = p->main_thread->sched_prev = NULL;
+    p->main_thread->stat_sched_runs = 0;
+    p->main_thread->stat_sched_latency_total_ns = 0;
+    p->main_thread->stat_sched_latency_max_ns = 0;
 
     p->main_thread->kstack = kmemzone_new(KSTACK_ZONE_SIZE);
     if (!p->main_thread->kstack.start) {
@@ -108,6 +108,18 @@ thread_t* thread_by_pid(pid_t pid)
     return NULL;
 }
 
+// Drops references to files which back zones, should be called after pages are freed.
+static void _proc_put_zone_files(memzones_t* zones)
+{
+    for (size_t i = 0; i < zones->size; i++) {
+        memzone_t* zone = zones->list[i];
+        if (zone->file) {
+            dentry_put(zone->file);
+            zone->file = NULL;
+        }
+    }
+}
+
 pid_t proc_alloc_pid()
 {
     return atomic_add(&proc_next_pid, 1);
@@ -159,7 +171,7 @@ static ALWAYS_INLINE int proc_setup_lockless(proc_t* p)
     memset((void*)p->fds, 0, MAX_OPENED_FILES * sizeof(file_descriptor_t));
 
     /* setting up zones */
-    if (dynarr_init_of_size(memzone_t, &p->zones, 8) != 0) {
+    if (memzones_init(&p->zones) != 0) {
         return -ENOMEM;
     }
 
@@ -227,11 +239,8 @@ int proc_setup_tty(proc_t* p, tty_entry_t* tty)
     return res;
 }
 
-int proc_fork_from(proc_t* new_proc, thread_t* from_thread)
+static void _proc_inherit_from(proc_t* new_proc, proc_t* from_proc)
 {
-    proc_t* from_proc = from_thread->process;
-    thread_copy_of(new_proc->main_thread, from_thread);
-
     new_proc->ppid = from_proc->pid;
     new_proc->pgid = from_proc->gid;
     new_proc->uid = from_proc->uid;
@@ -241,7 +250,6 @@ int proc_fork_from(proc_t* new_proc, thread_t* from_thread)
     new_proc->suid = from_proc->suid;
     new_proc->sgid = from_proc->sgid;
     new_proc->cwd = dentry_duplicate(from_proc->cwd);
-    new_proc->proc_file = dentry_duplicate(from_proc->proc_file);
     new_proc->tty = from_proc->tty;
 
     if (from_proc->fds) {
@@ -252,18 +260,118 @@ int proc_fork_from(proc_t* new_proc, thread_t* from_thread)
             }
         }
     }
+}
+
+int proc_fork_from(proc_t* new_proc, thread_t* from_thread)
+{
+    proc_t* from_proc = from_thread->process;
+    thread_copy_of(new_proc->main_thread, from_thread);
+    _proc_inherit_from(new_proc, from_proc);
+    new_proc->proc_file = dentry_duplicate(from_proc->proc_file);
+
+    int err = memzones_copy(&new_proc->zones, &from_proc->zones);
+    if (err) {
+        return err;
+    }
 
-    for (int i = 0; i < from_proc->zones.size; i++) {
-        memzone_t* zone_to_copy = (memzone_t*)dynarr_get(&from_proc->zones, i);
-        if (zone_to_copy->file) {
-            dentry_duplicate(zone_to_copy->file); // For the copied zone.
+    for (size_t i = 0; i < new_proc->zones.size; i++) {
+        memzone_t* zone = new_proc->zones.list[i];
+        if (zone->file) {
+            dentry_duplicate(zone->file); // For the copied zone.
         }
-        dynarr_push(&new_proc->zones, zone_to_copy);
     }
 
     return 0;
 }
 
+static int _proc_spawn_open(proc_t* p, file_descriptor_t* fd, const spawn_file_action_t* action)
+{
+    size_t path_len = strlen(action->path);
+    if (TEST_FLAG(action->flags, O_CREAT)) {
+        char* kpath = kmem_bring_to_kernel(action->path, path_len + 1);
+        char* kname = vfs_helper_split_path_with_name(kpath, path_len);
+        if (!kname) {
+            kfree(kpath);
+            return -EINVAL;
+        }
+
+        dentry_t* dir;
+        int err = vfs_resolve_path_start_from(p->cwd, kpath, &dir);
+        if (!err) {
+            err = vfs_create(dir, kname, strlen(kname), action->mode & 0x777, p->uid, p->gid);
+            dentry_put(dir);
+        }
+        kfree(kname);
+        kfree(kpath);
+        if (err && (err != -EEXIST || TEST_FLAG(action->flags, O_EXCL))) {
+            return err;
+        }
+    }
+
+    dentry_t* file;
+    if (vfs_resolve_path_start_from(p->cwd, action->path, &file) < 0) {
+        return -ENOENT;
+    }
+    lock_init(&fd->lock);
+    int err = vfs_open(file, fd, action->flags);
+    dentry_put(file);
+    return err;
+}
+
+static int _proc_spawn_file_action(proc_t* p, const spawn_file_action_t* action)
+{
+    if (action->fd < 0 || action->fd >= MAX_OPENED_FILES) {
+        return -EBADF;
+    }
+    file_descriptor_t* fd = &p->fds[action->fd];
+
+    switch (action->type) {
+    case SPAWN_FILE_ACTION_CLOSE:
+        if (!proc_is_fd_opened_lockless(fd)) {
+            return -EBADF;
+        }
+        return vfs_close(fd);
+
+    case SPAWN_FILE_ACTION_DUP2:
+        if (action->newfd < 0 || action->newfd >= MAX_OPENED_FILES || !proc_is_fd_opened_lockless(fd)) {
+            return -EBADF;
+        }
+        if (action->newfd == action->fd) {
+            return 0;
+        }
+        if (proc_is_fd_opened_lockless(&p->fds[action->newfd])) {
+            vfs_close(&p->fds[action->newfd]);
+        }
+        return proc_copy_fd(fd, &p->fds[action->newfd]);
+
+    case SPAWN_FILE_ACTION_OPEN:
+        if (proc_is_fd_opened_lockless(fd)) {
+            vfs_close(fd);
+        }
+        return _proc_spawn_open(p, fd, action);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * Prepares a process which runs a new binary right away, so the address
+ * space of @from_thread is not copied. The file actions are applied to the
+ * descriptors the new process inherited, paths are resolved from its cwd.
+ */
+int proc_spawn_from(proc_t* new_proc, thread_t* from_thread, const spawn_file_action_t* actions, int count)
+{
+    _proc_inherit_from(new_proc, from_thread->process);
+    for (int i = 0; i < count; i++) {
+        int err = _proc_spawn_file_action(new_proc, &actions[i]);
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
 /**
  * LOAD FUNCTIONS
  */
@@ -317,14 +425,14 @@ static ALWAYS_INLINE int proc_load_lockless(proc_t* p, thread_t* main_thread, co
 
     // Saving data to restore in case of error.
     pdirectory_t* old_pdir = p->pdir;
-    dynamic_array_t old_zones = p->zones;
+    memzones_t old_zones = p->zones;
 
     // Reallocating proc.
     pdirectory_t* new_pdir = vmm_new_user_pdir();
     vmm_switch_pdir(new_pdir);
     p->pdir = new_pdir;
 
-    if (dynarr_init_of_size(memzone_t, &p->zones, 8) != 0) {
+    if (memzones_init(&p->zones) != 0) {
         dentry_put(dentry);
         vfs_close(&fd);
         return -ENOMEM;
@@ -350,7 +458,8 @@ success:
     if (old_pdir) {
         vmm_free_pdir(old_pdir, &old_zones);
     }
-    dynarr_clear(&old_zones);
+    _proc_put_zone_files(&old_zones);
+    memzones_free(&old_zones);
 
     // Setting up proc
     p->proc_file = dentry; // dentry isn't put, but is transfered to the proc.
@@ -375,7 +484,8 @@ restore:
     p->pdir = old_pdir;
     vmm_switch_pdir(old_pdir);
     vmm_free_pdir(new_pdir, &p->zones);
-    dynarr_clear(&p->zones);
+    _proc_put_zone_files(&p->zones);
+    memzones_free(&p->zones);
     p->zones = old_zones;
     vfs_close(&fd);
     dentry_put(dentry);
@@ -429,7 +539,8 @@ int proc_free_lockless(proc_t* p)
     }
 
     p->is_tracee = false;
-    dynarr_free(&p->zones);
+    _proc_put_zone_files(&p->zones);
+    memzones_free(&p->zones);
     return 0;
 }
 
@@ -624,6 +735,9 @@ int proc_copy_fd(file_descriptor_t* oldfd, file_descriptor_t* newfd)
         newfd->offset = oldfd->offset;
         newfd->flags = oldfd->flags;
         newfd->ops = oldfd->ops;
+        newfd->ra_next = oldfd->ra_next;
+        newfd->ra_start = oldfd->ra_start;
+        newfd->ra_window = oldfd->ra_window;
         lock_init(&newfd->lock);
         lock_release(&oldfd->lock);
         return 0;
@@ -10,6 +10,7 @@
 #include <libkern/atomic.h>
 #include <libkern/libkern.h>
 #include <libkern/log.h>
+#include <libkern/platform.h>
 #include <mem/kmalloc.h>
 #include <platform/generic/registers.h>
 #include <platform/generic/system.h>
@@ -18,13 +19,35 @@
 #include <tasking/cpu.h>
 #include <tasking/sched.h>
 #include <tasking/tasking.h>
+#include <time/clockevent.h>
 #include <time/time_manager.h>
 
 // #define SCHED_DEBUG
 // #define SCHED_SHOW_STAT
+#define SCHED_STARVATION_LIMIT_NS (200000000ULL)
+#define SCHED_BALANCE_INTERVAL_TICKS (4)
+#define SCHED_MIGRATION_COST_NS (2000000ULL) // Threads which were switched out more recently are cache hot.
+#define SCHED_CACHE_NICE_TRIES (2)
+
+/**
+ * Every cpu has two arrays of runqueues, one per priority. Threads run
+ * from the active array and are put to the expired one once they are
+ * preempted. Woken threads go to the active array, so they run soon,
+ * unless the expired array waits for too long. When the active array is
+ * empty, arrays are swapped. A bitmap of non-empty runqueues gives the
+ * next priority to run with one find-first-set.
+ * Runqueues of a cpu are guarded with its lock, since other cpus enqueue
+ * threads which they wake up. The idle thread is never enqueued, it is
+ * picked when both arrays are empty.
+ *
+ * Load is balanced by pulling: a cpu which runs out of threads, and every
+ * busy cpu once in SCHED_BALANCE_INTERVAL_TICKS, steals queued threads from
+ * the busiest cpu. Threads which ran recently keep their cache warm where
+ * they are, so they are stolen only after SCHED_CACHE_NICE_TRIES passes
+ * in a row could not find anything else.
+ */
 
 static time_t _sched_timeslices[];
-static int _enqueued_tasks;
 static uint32_t _active_cpus;
 
 extern void switch_contexts(context_t** old, context_t* new);
@@ -32,18 +55,22 @@ extern void switch_to_context(context_t* new);
 
 /* INIT */
 static void _init_cpu(cpu_t* cpu);
-/* BUFFERS */
-static inline void _sched_swap_buffers();
-static inline thread_t* _master_buf_back();
-static inline void _sched_save_running_proc();
-static inline void _sched_enqueue_impl(sched_data_t* sched, thread_t* thread);
+/* RUNQUEUES */
+static inline void _sched_add_lockless(sched_data_t* sched, prio_array_t* array, thread_t* thread);
+static inline void _sched_del_lockless(sched_data_t* sched, thread_t* thread);
 /* DEBUG */
-static void _debug_print_runqueue(runqueue_t* it);
+static void _debug_print_runqueue(prio_array_t* array);
 
 static void _idle_thread()
 {
     while (1) {
-        system_stop_until_interrupt();
+        // The tick could be stopped only after no interrupt can slip in before the cpu halts.
+        system_disable_interrupts_no_counter();
+        clockevent_enter_idle();
+        system_idle_until_interrupt();
+        system_disable_interrupts_no_counter();
+        clockevent_exit_idle();
+        system_enable_interrupts_no_counter();
     }
 }
 
@@ -57,7 +84,6 @@ static void _create_idle_thread(cpu_t* cpu)
     proc_t* idle_proc = tasking_create_kernel_thread(_idle_thread, NULL);
     cpu->idle_thread = idle_proc->main_thread;
     idle_proc->prio = IDLE_PRIO;
-    _sched_enqueue_impl(&cpu->sched, idle_proc->main_thread);
 }
 
 uint32_t active_cpu_count()
@@ -73,6 +99,7 @@ static inline void _add_cpu_count()
 static void _init_cpu(cpu_t* cpu)
 {
     cpu->current_state = CPU_IN_KERNEL;
+    timer_wheel_init(&cpu->timer_wheel);
 
     cpu->sched_stack_zone = kmemzone_new(VMM_PAGE_SIZE);
     vmm_alloc_page(cpu->sched_stack_zone.start, MMU_FLAG_PERM_READ | MMU_FLAG_PERM_WRITE);
@@ -83,12 +110,16 @@ static void _init_cpu(cpu_t* cpu)
     context_set_instruction_pointer(cpu->sched_context, (uintptr_t)sched);
     cpu->running_thread = NULL;
 
-    cpu->sched.master_buf = kmalloc(sizeof(runqueue_t) * TOTAL_PRIOS_COUNT);
-    cpu->sched.slave_buf = kmalloc(sizeof(runqueue_t) * TOTAL_PRIOS_COUNT);
-    memset(cpu->sched.master_buf, 0, sizeof(runqueue_t) * TOTAL_PRIOS_COUNT);
-    memset(cpu->sched.slave_buf, 0, sizeof(runqueue_t) * TOTAL_PRIOS_COUNT);
-    cpu->sched.next_read_prio = 0;
+    lock_init(&cpu->sched.lock);
+    memset(cpu->sched.arrays, 0, sizeof(cpu->sched.arrays));
+    cpu->sched.active = &cpu->sched.arrays[0];
+    cpu->sched.expired = &cpu->sched.arrays[1];
+    cpu->sched.expired_since = 0;
     cpu->sched.enqueued_tasks = 0;
+    cpu->sched.balance_countdown = SCHED_BALANCE_INTERVAL_TICKS;
+    cpu->sched.balance_failed = 0;
+    cpu->sched.stat_migrations_in = 0;
+    cpu->sched.stat_migrations_out = 0;
 
 #ifdef FPU_ENABLED
     cpu->fpu_for_thread = NULL;
@@ -98,85 +129,282 @@ static void _init_cpu(cpu_t* cpu)
     _add_cpu_count();
 }
 
-static inline void _sched_swap_buffers(sched_data_t* sched)
-{
-    runqueue_t* tmp = sched->master_buf;
-    sched->master_buf = sched->slave_buf;
-    sched->slave_buf = tmp;
-    sched->next_read_prio = 0;
-}
+/**
+ * RUNQUEUES
+ */
 
-static inline void _sched_add_to_start_of_runqueue(sched_data_t* sched, thread_t* thread)
+static inline void _sched_add_lockless(sched_data_t* sched, prio_array_t* array, thread_t* thread)
 {
-    thread->sched_next = sched->slave_buf[thread->process->prio].head;
-    if (thread->sched_next) {
-        thread->sched_next->sched_prev = thread;
+    int prio = thread->process->prio;
+    runqueue_t* queue = &array->queues[prio];
+    uint64_t now = timeman_ns_since_boot();
+
+    if (array == sched->expired && !array->bitmap) {
+        sched->expired_since = now;
+    }
+
+    thread->sched_next = NULL;
+    thread->sched_prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->sched_next = thread;
     } else {
-        sched->slave_buf[thread->process->prio].tail = thread;
+        queue->head = thread;
     }
-    sched->slave_buf[thread->process->prio].head = thread;
+    queue->tail = thread;
+    array->bitmap |= (1U << prio);
+
+    thread->sched_array = array;
+    thread->sched_prio = prio;
+    thread->sched_enqueue_time = now;
+    sched->enqueued_tasks++;
 }
 
-static inline void _sched_add_to_end_of_runqueue(sched_data_t* sched, thread_t* thread)
+static inline void _sched_del_lockless(sched_data_t* sched, thread_t* thread)
 {
-    thread->sched_prev = sched->slave_buf[thread->process->prio].tail;
+    prio_array_t* array = thread->sched_array;
+    runqueue_t* queue = &array->queues[thread->sched_prio];
+
     if (thread->sched_prev) {
-        thread->sched_prev->sched_next = thread;
+        thread->sched_prev->sched_next = thread->sched_next;
+    } else {
+        queue->head = thread->sched_next;
+    }
+
+    if (thread->sched_next) {
+        thread->sched_next->sched_prev = thread->sched_prev;
     } else {
-        sched->slave_buf[thread->process->prio].head = thread;
+        queue->tail = thread->sched_prev;
+    }
+
+    if (!queue->head) {
+        array->bitmap &= ~(1U << thread->sched_prio);
     }
-    sched->slave_buf[thread->process->prio].tail = thread;
+
+    thread->sched_next = thread->sched_prev = NULL;
+    thread->sched_array = NULL;
+    sched->enqueued_tasks--;
 }
 
-static inline void _sched_enqueue_impl(sched_data_t* sched, thread_t* thread)
+static inline bool _sched_expired_is_starving(sched_data_t* sched)
 {
-    _sched_add_to_start_of_runqueue(sched, thread);
-    sched->enqueued_tasks++;
+    return sched->expired->bitmap && timeman_ns_since_boot() - sched->expired_since > SCHED_STARVATION_LIMIT_NS;
 }
 
-void _sched_dequeue_impl(sched_data_t* sched, thread_t* thread)
+/**
+ * Returns NULL if there is nothing to run, swapped is set if the arrays were swapped.
+ */
+static thread_t* _sched_pick_next_lockless(sched_data_t* sched, bool* swapped)
 {
-    if (sched->slave_buf[thread->process->prio].tail == thread) {
-        sched->slave_buf[thread->process->prio].tail = thread->sched_prev;
-    }
+    if (!sched->active->bitmap) {
+        if (!sched->expired->bitmap) {
+            return NULL;
+        }
 
-    if (sched->slave_buf[thread->process->prio].head == thread) {
-        sched->slave_buf[thread->process->prio].head = thread->sched_next;
+        prio_array_t* tmp = sched->active;
+        sched->active = sched->expired;
+        sched->expired = tmp;
+        *swapped = true;
     }
 
-    if (sched->master_buf[thread->process->prio].tail == thread) {
-        sched->master_buf[thread->process->prio].tail = thread->sched_prev;
-    }
+    thread_t* thread = sched->active->queues[ctz32(sched->active->bitmap)].head;
+    _sched_del_lockless(sched, thread);
+    return thread;
+}
 
-    if (sched->master_buf[thread->process->prio].head == thread) {
-        sched->master_buf[thread->process->prio].head = thread->sched_next;
+/**
+ * Locks runqueues of the cpu the thread belongs to. The thread could be
+ * migrated while the lock is being taken, so the cpu is checked again.
+ */
+static sched_data_t* _sched_lock_thread_cpu(thread_t* thread)
+{
+    for (;;) {
+        int cpu = thread->last_cpu;
+        sched_data_t* sched = &cpus[cpu].sched;
+        lock_acquire(&sched->lock);
+        if (thread->last_cpu == cpu) {
+            return sched;
+        }
+        lock_release(&sched->lock);
     }
+}
 
-    if (thread->sched_prev) {
-        thread->sched_prev->sched_next = thread->sched_next;
+/**
+ * The running thread is put back to the expired array of its cpu, if it is
+ * still runnable and was not enqueued by a wakeup in the meantime.
+ */
+static void _sched_put_back_running(thread_t* thread)
+{
+    if (thread == THIS_CPU->idle_thread || thread->status != THREAD_STATUS_RUNNING) {
+        return;
     }
 
-    if (thread->sched_next) {
-        thread->sched_next->sched_prev = thread->sched_prev;
+    sched_data_t* sched = _sched_lock_thread_cpu(thread);
+    if (!thread->sched_array) {
+        _sched_add_lockless(sched, sched->expired, thread);
     }
+    lock_release(&sched->lock);
+}
 
-    thread->sched_next = thread->sched_prev = NULL;
-    sched->enqueued_tasks--;
+static inline int _sched_cpu_load(cpu_t* cpu)
+{
+    int running = cpu->running_thread && cpu->running_thread != cpu->idle_thread;
+    return atomic_load(&cpu->sched.enqueued_tasks) + running;
 }
 
 int _sched_find_cpu_with_less_load()
 {
-    int mx = cpus[0].sched.enqueued_tasks;
+    int mn = _sched_cpu_load(&cpus[0]);
     int id = 0;
     for (int i = 1; i < active_cpu_count(); i++) {
-        if (mx > cpus[i].sched.enqueued_tasks) {
-            mx = cpus[i].sched.enqueued_tasks;
+        int load = _sched_cpu_load(&cpus[i]);
+        if (mn > load) {
+            mn = load;
             id = i;
         }
     }
     return id;
 }
 
+/**
+ * BALANCING
+ */
+
+static bool _sched_can_migrate(cpu_t* src, thread_t* thread, uint64_t now, bool ignore_hot)
+{
+    // A woken thread could be enqueued while it is still switching out of its cpu.
+    if (thread == atomic_load(&src->running_thread)) {
+        return false;
+    }
+
+#ifdef FPU_ENABLED
+    // Fpu state is saved lazily, so it could be only in registers of the cpu.
+    if (src->fpu_for_thread == thread && src->fpu_for_pid == thread->tid) {
+        return false;
+    }
+#endif // FPU_ENABLED
+
+    // A thread woken after a long sleep has a recent enqueue time, but its cache is cold.
+    return ignore_hot || now - thread->sched_last_ran >= SCHED_MIGRATION_COST_NS;
+}
+
+static void _sched_migrate_lockless(cpu_t* src, cpu_t* dst, thread_t* thread)
+{
+    bool expired = thread->sched_array == src->sched.expired;
+    uint64_t enqueue_time = thread->sched_enqueue_time;
+
+    _sched_del_lockless(&src->sched, thread);
+    thread->last_cpu = dst->id;
+    _sched_add_lockless(&dst->sched, expired ? dst->sched.expired : dst->sched.active, thread);
+    // Keeping the time, so the latency stat covers the whole wait.
+    thread->sched_enqueue_time = enqueue_time;
+
+    src->sched.stat_migrations_out++;
+    dst->sched.stat_migrations_in++;
+#ifdef SCHED_DEBUG
+    log("migrate task %d from cpu %d to cpu %d", thread->tid, src->id, dst->id);
+#endif
+}
+
+/**
+ * Steals up to count threads, the expired array goes first, since its
+ * threads would wait for the whole active array on the src cpu.
+ */
+static int _sched_steal_lockless(cpu_t* src, cpu_t* dst, int count, bool ignore_hot)
+{
+    int moved = 0;
+    uint64_t now = timeman_ns_since_boot();
+    prio_array_t* arrays[] = { src->sched.expired, src->sched.active };
+
+    for (int i = 0; i < 2 && moved < count; i++) {
+        uint32_t bitmap = arrays[i]->bitmap;
+        while (bitmap && moved < count) {
+            int prio = ctz32(bitmap);
+            bitmap &= bitmap - 1;
+
+            thread_t* thread = arrays[i]->queues[prio].head;
+            while (thread && moved < count) {
+                thread_t* next = thread->sched_next;
+                if (_sched_can_migrate(src, thread, now, ignore_hot)) {
+                    _sched_migrate_lockless(src, dst, thread);
+                    moved++;
+                }
+                thread = next;
+            }
+        }
+    }
+
+    return moved;
+}
+
+static cpu_t* _sched_find_busiest_cpu(cpu_t* this_cpu, int* busiest_load)
+{
+    cpu_t* busiest = NULL;
+    *busiest_load = 0;
+    for (int i = 0; i < active_cpu_count(); i++) {
+        int load = _sched_cpu_load(&cpus[i]);
+        if (&cpus[i] != this_cpu && atomic_load(&cpus[i].sched.enqueued_tasks) && load > *busiest_load) {
+            *busiest_load = load;
+            busiest = &cpus[i];
+        }
+    }
+    return busiest;
+}
+
+/**
+ * Pulls threads from the busiest cpu to this_cpu. Returns the number of
+ * moved threads.
+ */
+static int _sched_balance(cpu_t* this_cpu, bool idle)
+{
+    int busiest_load;
+    cpu_t* busiest = _sched_find_busiest_cpu(this_cpu, &busiest_load);
+    if (!busiest) {
+        return 0;
+    }
+
+    // When the cpu is idle, running_thread still points to the thread which has just left it.
+    int this_load = idle ? this_cpu->sched.enqueued_tasks : _sched_cpu_load(this_cpu);
+    int imbalance = busiest_load - this_load;
+    if (imbalance < 2) {
+        return 0;
+    }
+
+    // Runqueues are always locked in order of cpu ids, so two cpus pulling from each other can't deadlock.
+    sched_data_t* first = this_cpu->id < busiest->id ? &this_cpu->sched : &busiest->sched;
+    sched_data_t* second = this_cpu->id < busiest->id ? &busiest->sched : &this_cpu->sched;
+    lock_acquire(&first->lock);
+    lock_acquire(&second->lock);
+
+    bool ignore_hot = this_cpu->sched.balance_failed >= SCHED_CACHE_NICE_TRIES;
+    int moved = _sched_steal_lockless(busiest, this_cpu, imbalance / 2, ignore_hot);
+    if (moved) {
+        this_cpu->sched.balance_failed = 0;
+    } else {
+        this_cpu->sched.balance_failed++;
+    }
+
+    lock_release(&second->lock);
+    lock_release(&first->lock);
+    return moved;
+}
+
+/**
+ * Is called from the timer interrupt.
+ */
+void sched_balance_tick()
+{
+    sched_data_t* sched = &THIS_CPU->sched;
+    if (--sched->balance_countdown > 0) {
+        return;
+    }
+    sched->balance_countdown = SCHED_BALANCE_INTERVAL_TICKS;
+
+    // An idle cpu balances each time it looks for a thread to run.
+    if (RUNNING_THREAD != THIS_CPU->idle_thread) {
+        _sched_balance(THIS_CPU, false);
+    }
+}
+
 void scheduler_init()
 {
 }
@@ -189,33 +417,17 @@ void schedule_activate_cpu()
     cpus[id].id = id;
 }
 
-extern thread_list_t thread_list;
-void sched_unblock_threads()
+static inline void _sched_switch_out(thread_t* thread)
 {
-    thread_t* thread;
-
-    thread_list_node_t* __thread_list_node = thread_list.head;
-    while (__thread_list_node) {
-        for (int i = 0; i < THREADS_PER_NODE; i++) {
-            thread = &__thread_list_node->thread_storage[i];
-            if (thread->status == THREAD_STATUS_BLOCKED && thread->blocker.reason != BLOCKER_INVALID) {
-                if (thread->blocker.should_unblock && thread->blocker.should_unblock(thread)) {
-                    thread->status = THREAD_STATUS_RUNNING;
-                    thread->blocker.reason = BLOCKER_INVALID;
-                    sched_enqueue(thread);
-                }
-            }
-        }
-        __thread_list_node = __thread_list_node->next;
-    }
+    thread->stat_total_running_ticks += timeman_ticks_since_boot() - thread->start_time_in_ticks;
+    thread->sched_last_ran = timeman_ns_since_boot();
+    _sched_put_back_running(thread);
 }
 
 void resched_dont_save_context()
 {
-    // Add the thread back to runqueue only if thread is still running.
-    if (RUNNING_THREAD && RUNNING_THREAD->status == THREAD_STATUS_RUNNING) {
-        RUNNING_THREAD->stat_total_running_ticks += timeman_ticks_since_boot() - RUNNING_THREAD->start_time_in_ticks;
-        _sched_add_to_end_of_runqueue(&cpus[RUNNING_THREAD->last_cpu].sched, RUNNING_THREAD);
+    if (RUNNING_THREAD) {
+        _sched_switch_out(RUNNING_THREAD);
     }
     switch_to_context(THIS_CPU->sched_context);
 }
@@ -223,11 +435,7 @@ void resched_dont_save_context()
 void resched()
 {
     if (RUNNING_THREAD) {
-        RUNNING_THREAD->stat_total_running_ticks += timeman_ticks_since_boot() - RUNNING_THREAD->start_time_in_ticks;
-        // Add the thread back to runqueue only if thread is still running.
-        if (RUNNING_THREAD->status == THREAD_STATUS_RUNNING) {
-            _sched_add_to_end_of_runqueue(&cpus[RUNNING_THREAD->last_cpu].sched, RUNNING_THREAD);
-        }
+        _sched_switch_out(RUNNING_THREAD);
         switch_contexts(&RUNNING_THREAD->context, THIS_CPU->sched_context);
     } else {
         switch_to_context(THIS_CPU->sched_context);
@@ -241,18 +449,19 @@ void sched_enqueue(thread_t* thread)
         thread->process->prio = MIN_PRIO;
     }
 
-    if (thread->last_cpu != LAST_CPU_NOT_SET) {
-        _sched_enqueue_impl(&cpus[thread->last_cpu].sched, thread);
-    } else {
-        int cpu = _sched_find_cpu_with_less_load();
-        _sched_enqueue_impl(&cpus[cpu].sched, thread);
-        thread->last_cpu = cpu;
+    if (thread->last_cpu == LAST_CPU_NOT_SET) {
+        thread->last_cpu = _sched_find_cpu_with_less_load();
     }
 
+    sched_data_t* sched = _sched_lock_thread_cpu(thread);
+    if (!thread->sched_array) {
+        _sched_add_lockless(sched, _sched_expired_is_starving(sched) ? sched->expired : sched->active, thread);
+    }
+    lock_release(&sched->lock);
+
 #ifdef SCHED_DEBUG
     log("enqueue task %d to cpu %d", thread->tid, thread->last_cpu);
 #endif
-    _enqueued_tasks++;
 }
 
 void sched_dequeue(thread_t* thread)
@@ -260,11 +469,24 @@ void sched_dequeue(thread_t* thread)
 #ifdef SCHED_DEBUG
     log("dequeue task %d", thread->tid);
 #endif
-    if (likely(thread->last_cpu != LAST_CPU_NOT_SET)) {
-        _sched_dequeue_impl(&cpus[thread->last_cpu].sched, thread);
-    } else {
+    if (unlikely(thread->last_cpu == LAST_CPU_NOT_SET)) {
         log("dequeue error task %d", thread->tid);
+        return;
     }
+
+    sched_data_t* sched = _sched_lock_thread_cpu(thread);
+    if (thread->sched_array) {
+        _sched_del_lockless(sched, thread);
+    }
+    lock_release(&sched->lock);
+}
+
+static inline void _sched_account_latency(thread_t* thread)
+{
+    uint64_t latency = timeman_ns_since_boot() - thread->sched_enqueue_time;
+    thread->stat_sched_runs++;
+    thread->stat_sched_latency_total_ns += latency;
+    thread->stat_sched_latency_max_ns = max(thread->stat_sched_latency_max_ns, latency);
 }
 
 void switch_to_thread(thread_t* thread)
@@ -277,6 +499,10 @@ void switch_to_thread(thread_t* thread)
         }
     }
 
+    if (thread != THIS_CPU->idle_thread) {
+        _sched_account_latency(thread);
+    }
+
     thread->last_cpu = THIS_CPU->id;
     thread->start_time_in_ticks = timeman_ticks_since_boot();
     thread->ticks_until_preemption = _sched_get_timeslice(thread);
@@ -288,42 +514,39 @@ void sched()
 {
     for (;;) {
         sched_data_t* sched = &THIS_CPU->sched;
-        while (!sched->master_buf[sched->next_read_prio].head) {
-            sched->next_read_prio++;
-            if (sched->next_read_prio >= TOTAL_PRIOS_COUNT) {
-                if (THIS_CPU->id == 0) {
-                    tasking_kill_dying();
-                    sched_unblock_threads();
-                }
-                _sched_swap_buffers(sched);
-            }
+        bool swapped = false;
+        lock_acquire(&sched->lock);
+        thread_t* thread = _sched_pick_next_lockless(sched, &swapped);
+#ifdef SCHED_SHOW_STAT
+        _debug_print_runqueue(sched->active);
+#endif
+        lock_release(&sched->lock);
+
+        if (!thread && _sched_balance(THIS_CPU, true)) {
+            continue;
         }
 
-        thread_t* thread = sched->master_buf[sched->next_read_prio].head;
-        sched->master_buf[sched->next_read_prio].head = thread->sched_next;
-        if (sched->master_buf[sched->next_read_prio].tail == thread) {
-            sched->master_buf[sched->next_read_prio].tail = NULL;
+        if ((!thread || swapped) && THIS_CPU->id == 0) {
+            tasking_kill_dying();
         }
-        if (thread->sched_next) {
-            thread->sched_next->sched_prev = NULL;
+
+        if (!thread) {
+            thread = THIS_CPU->idle_thread;
         }
-        thread->sched_next = thread->sched_prev = NULL;
 #ifdef SCHED_DEBUG
         log("next to run %d %x %x [cpu %d]", thread->tid, thread->process->prio, thread->tf, THIS_CPU->id);
-#endif
-#ifdef SCHED_SHOW_STAT
-        _debug_print_runqueue(sched->master_buf);
 #endif
         ASSERT(thread->status == THREAD_STATUS_RUNNING);
         switch_to_thread(thread);
     }
 }
 
-static void _debug_print_runqueue(runqueue_t* it)
+static void _debug_print_runqueue(prio_array_t* array)
 {
+    log(" Bitmap %x", array->bitmap);
     for (int i = 0; i < TOTAL_PRIOS_COUNT; i++) {
         log(" Prio %d", i);
-        thread_t* tmp = it[i].head;
+        thread_t* tmp = array->queues[i].head;
         while (tmp) {
             log("   %d ->", tmp->tid);
             tmp = tmp->sched_next;
@@ -182,6 +182,11 @@ int signal_restore_thread_after_handling_signal(thread_t* thread)
 
     // If our thread is blocked, that means that it already has a context on stack, no need to overwrite it.
     if (thread->blocker.reason != BLOCKER_INVALID) {
+        // Wakeups are missed while the handler runs, so the thread checks its blocker again.
+        if (thread->blocker.should_unblock && thread->blocker.should_unblock(thread)) {
+            thread->blocker.reason = BLOCKER_INVALID;
+            resched_dont_save_context();
+        }
         thread->status = THREAD_STATUS_BLOCKED;
         sched_dequeue(thread);
         resched_dont_save_context();
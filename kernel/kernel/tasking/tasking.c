@@ -313,6 +313,25 @@ static int _tasking_do_exec(proc_t* p, thread_t* main_thread, const char* path,
     return thread_fill_up_stack(p->main_thread, argc, argv, envc, envp);
 }
 
+static void _tasking_free_exec_params(char* kpath, int kargc, char** kargv, int kenvc, char** kenv)
+{
+    if (kpath) {
+        kfree(kpath);
+    }
+    if (kargv) {
+        for (int argi = 0; argi < kargc; argi++) {
+            kfree(kargv[argi]);
+        }
+        kfree(kargv);
+    }
+    if (kenv) {
+        for (int argi = 0; argi < kenvc; argi++) {
+            kfree(kenv[argi]);
+        }
+        kfree(kenv);
+    }
+}
+
 int tasking_exec(const char* path, const char** argv, const char** envp)
 {
     thread_t* thread = RUNNING_THREAD;
@@ -353,22 +372,110 @@ int tasking_exec(const char* path, const char** argv, const char** envp)
     }
 
 exit:
-    if (kpath) {
-        kfree(kpath);
+    _tasking_free_exec_params(kpath, kargc, kargv, kenvc, kenv);
+    return err;
+}
+
+static void _tasking_free_spawn_file_actions(spawn_file_action_t* kactions, int count)
+{
+    if (!kactions) {
+        return;
     }
-    if (kargv) {
-        for (int argi = 0; argi < kargc; argi++) {
-            kfree(kargv[argi]);
+    for (int i = 0; i < count; i++) {
+        if (kactions[i].path) {
+            kfree((char*)kactions[i].path);
         }
-        kfree(kargv);
     }
-    if (kenv) {
-        for (int argi = 0; argi < kenvc; argi++) {
-            kfree(kenv[argi]);
+    kfree(kactions);
+}
+
+static int _tasking_validate_spawn_file_actions(const spawn_file_action_t* actions, int count, spawn_file_action_t** kactions)
+{
+    if (!count) {
+        return 0;
+    }
+    if (!actions || count < 0 || count > SPAWN_MAX_FILE_ACTIONS) {
+        return -EINVAL;
+    }
+
+    spawn_file_action_t* res = (spawn_file_action_t*)kmem_bring_to_kernel((const char*)actions, count * sizeof(spawn_file_action_t));
+    for (int i = 0; i < count; i++) {
+        const char* path = res[i].path;
+        res[i].path = NULL;
+        if (res[i].type != SPAWN_FILE_ACTION_OPEN) {
+            continue;
         }
-        kfree(kenv);
+        if (!str_validate_len(path, 128)) {
+            _tasking_free_spawn_file_actions(res, count);
+            return -EINVAL;
+        }
+        res[i].path = kmem_bring_to_kernel(path, strlen(path) + 1);
+    }
+
+    *kactions = res;
+    return 0;
+}
+
+/**
+ * Starts a new process which runs @path. Unlike fork() followed by exec(),
+ * the address space of the caller is not copied. File actions are applied
+ * to the descriptors of the new process before the binary is loaded.
+ * Returns the pid of the new process.
+ */
+int tasking_spawn(const char* path, const char** argv, const char** envp, const spawn_file_action_t* actions, int actions_count)
+{
+    char* kpath = NULL;
+    int kargc = 0;
+    char** kargv = NULL;
+    int kenvc = 0;
+    char** kenv = NULL;
+    spawn_file_action_t* kactions = NULL;
+
+    if (!str_validate_len(path, 128)) {
+        return -EINVAL;
+    }
+    kpath = kmem_bring_to_kernel(path, strlen(path) + 1);
+
+    int err = _tasking_validate_exec_params(argv, &kargc, &kargv);
+    if (err) {
+        goto exit;
     }
 
+    err = _tasking_validate_exec_params(envp, &kenvc, &kenv);
+    if (err) {
+        goto exit;
+    }
+
+    err = _tasking_validate_spawn_file_actions(actions, actions_count, &kactions);
+    if (err) {
+        goto exit;
+    }
+
+    proc_t* new_proc = _tasking_setup_proc();
+    err = proc_spawn_from(new_proc, RUNNING_THREAD, kactions, actions_count);
+    if (!err) {
+        // The binary is loaded while the new pdir is active, the caller's one is restored after.
+        pdirectory_t* prev_pdir = vmm_get_active_pdir();
+        err = _tasking_do_exec(new_proc, new_proc->main_thread, kpath, kargc, kargv, kenvc, kenv);
+        vmm_switch_pdir(prev_pdir);
+    }
+    if (err) {
+        new_proc->status = PROC_DYING;
+        proc_free(new_proc);
+        tasking_evict_proc_entry(new_proc);
+        goto exit;
+    }
+
+#ifdef TASKING_DEBUG
+    log("Spawn %s : pid %d", kpath, new_proc->pid);
+#endif
+
+    err = new_proc->pid;
+    sched_enqueue(new_proc->main_thread);
+
+exit:
+    _tasking_free_spawn_file_actions(kactions, actions_count);
+    _tasking_free_exec_params(kpath, kargc, kargv, kenvc, kenv);
     return err;
 }
 
@@ -53,6 +53,15 @@ int thread_setup_main(proc_t* p, thread_t* thread)
     thread->process = p;
     thread->tid = p->pid;
     thread->last_cpu = LAST_CPU_NOT_SET;
+    thread->sched_array = NULL;
+    thread->sched_last_ran = 0;
+    thread->sched_next = thread->sched_prev = NULL;
+    thread->stat_sched_runs = 0;
+    thread->stat_sched_latency_total_ns = 0;
+    thread->stat_sched_latency_max_ns = 0;
+    thread->wait_entries_count = 0;
+    ktimer_init(&thread->wait_timer, NULL, thread);
+    wait_queue_init(&thread->exit_wait_queue);
 
     /* setting signal handlers to 0 */
     thread->signals_mask = 0xffffffff; /* for now all signals are legal */
@@ -80,6 +89,15 @@ int thread_setup(proc_t* p, thread_t* thread)
     thread->process = p;
     thread->tid = proc_alloc_pid();
     thread->last_cpu = LAST_CPU_NOT_SET;
+    thread->sched_array = NULL;
+    thread->sched_last_ran = 0;
+    thread->sched_next = thread->sched_prev = NULL;
+    thread->stat_sched_runs = 0;
+    thread->stat_sched_latency_total_ns = 0;
+    thread->stat_sched_latency_max_ns = 0;
+    thread->wait_entries_count = 0;
+    ktimer_init(&thread->wait_timer, NULL, thread);
+    wait_queue_init(&thread->exit_wait_queue);
 
     /* setting signal handlers to 0 */
     thread->signals_mask = 0xffffffff; /* for now all signals are legal */
@@ -247,6 +265,8 @@ int thread_die(thread_t* thread)
 
     thread->status = THREAD_STATUS_DYING;
     sched_dequeue(thread);
+    thread_leave_wait_queues(thread);
+    wait_queue_wake_all(&thread->exit_wait_queue);
     return 0;
 }
 
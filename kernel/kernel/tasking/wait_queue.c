@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <tasking/thread.h>
+#include <tasking/wait_queue.h>
+
+void wait_queue_init(wait_queue_t* wq)
+{
+    lock_init(&wq->lock);
+    wq->head = NULL;
+}
+
+void wait_queue_add(wait_queue_t* wq, wait_entry_t* entry)
+{
+    lock_acquire(&wq->lock);
+    entry->queue = wq;
+    entry->next = wq->head;
+    wq->head = entry;
+    lock_release(&wq->lock);
+}
+
+void wait_queue_remove(wait_entry_t* entry)
+{
+    wait_queue_t* wq = entry->queue;
+    if (!wq) {
+        return;
+    }
+
+    lock_acquire(&wq->lock);
+    wait_entry_t** it = &wq->head;
+    while (*it) {
+        if (*it == entry) {
+            *it = entry->next;
+            break;
+        }
+        it = &(*it)->next;
+    }
+    entry->queue = NULL;
+    entry->next = NULL;
+    lock_release(&wq->lock);
+}
+
+void wait_queue_wake_all(wait_queue_t* wq)
+{
+    // Woken threads leave the queue by themselves, once they run.
+    lock_acquire(&wq->lock);
+    for (wait_entry_t* it = wq->head; it; it = it->next) {
+        thread_try_unblock(it->thread);
+    }
+    lock_release(&wq->lock);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <libkern/atomic.h>
+#include <libkern/libkern.h>
+#include <libkern/lock.h>
+#include <libkern/log.h>
+#include <tasking/cpu.h>
+#include <tasking/sched.h>
+#include <time/clockevent.h>
+#include <time/time_manager.h>
+#include <time/timer_wheel.h>
+
+// #define CLOCKEVENT_DEBUG
+#define CLOCKEVENT_TICKLESS_IDLE
+#define CLOCKEVENT_MAX_IDLE_NS (1000000000ULL)
+
+/**
+ * The timer interrupt comes from one device, which is shared by all cpus.
+ * Once the last cpu goes idle, the device is programmed to fire once at the
+ * nearest timer of all wheels instead of ticking. The first cpu which leaves
+ * idle, or takes the interrupt, brings the periodic tick back.
+ * Stopping the tick needs a clocksource which counts on its own, since the
+ * time is not advanced by ticks then.
+ */
+
+static lock_t _clockevent_lock;
+static clockevent_t* _clockevent = NULL;
+static uint32_t _idle_cpus_mask = 0;
+static bool _oneshot = false;
+
+void clockevent_register(clockevent_t* ce)
+{
+    lock_acquire(&_clockevent_lock);
+    _clockevent = ce;
+    _oneshot = false;
+    lock_release(&_clockevent_lock);
+}
+
+static inline uint32_t _clockevent_active_cpus_mask()
+{
+    return (1U << active_cpu_count()) - 1;
+}
+
+static void _clockevent_set_periodic_lockless()
+{
+    if (_oneshot) {
+        _clockevent->set_periodic();
+        _oneshot = false;
+    }
+}
+
+static bool _clockevent_cpus_have_work()
+{
+    for (int i = 0; i < active_cpu_count(); i++) {
+        if (cpus[i].sched.enqueued_tasks) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t _clockevent_next_tick()
+{
+    uint32_t next = timer_wheel_next_tick(&cpus[0].timer_wheel);
+    for (int i = 1; i < active_cpu_count(); i++) {
+        uint32_t tick = timer_wheel_next_tick(&cpus[i].timer_wheel);
+        if ((int32_t)(tick - next) < 0) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+static void _clockevent_stop_tick_lockless()
+{
+    if (!timeman_has_highres_clock() || _clockevent_cpus_have_work()) {
+        return;
+    }
+
+    uint32_t rem;
+    uint64_t now = timeman_ns_since_boot();
+    uint32_t now_tick = udiv64(now, timeman_ns_per_tick(), &rem);
+    int32_t ticks = _clockevent_next_tick() - now_tick;
+    if (ticks <= 1) {
+        return;
+    }
+
+    // Tick N is served once the clock passes N * ns_per_tick.
+    uint64_t delta = (uint64_t)ticks * timeman_ns_per_tick() - rem;
+    delta = min(delta, min(_clockevent->max_delta_ns, CLOCKEVENT_MAX_IDLE_NS));
+    if (delta <= timeman_ns_per_tick() || delta < _clockevent->min_delta_ns) {
+        return;
+    }
+
+#ifdef CLOCKEVENT_DEBUG
+    log("[clockevent] Stop tick for %d us", (uint32_t)udiv64(delta, 1000, NULL));
+#endif
+    _clockevent->set_oneshot(delta);
+    _oneshot = true;
+}
+
+/**
+ * Is called from the timer interrupt.
+ */
+void clockevent_tick()
+{
+    uint32_t cpu_mask = 1U << system_cpu_id();
+    if (!(atomic_load(&_idle_cpus_mask) & cpu_mask)) {
+        // Only the cpu itself marks it idle, and the tick is stopped only when all cpus are idle.
+        return;
+    }
+
+    lock_acquire(&_clockevent_lock);
+    _idle_cpus_mask &= ~cpu_mask;
+    _clockevent_set_periodic_lockless();
+    lock_release(&_clockevent_lock);
+}
+
+/**
+ * Are called from the idle thread with interrupts disabled.
+ */
+void clockevent_enter_idle()
+{
+#ifdef CLOCKEVENT_TICKLESS_IDLE
+    if (!_clockevent || !_clockevent->set_oneshot) {
+        return;
+    }
+
+    lock_acquire(&_clockevent_lock);
+    _idle_cpus_mask |= 1U << system_cpu_id();
+    uint32_t active_mask = _clockevent_active_cpus_mask();
+    if (!_oneshot && (_idle_cpus_mask & active_mask) == active_mask) {
+        _clockevent_stop_tick_lockless();
+    }
+    lock_release(&_clockevent_lock);
+#endif // CLOCKEVENT_TICKLESS_IDLE
+}
+
+void clockevent_exit_idle()
+{
+    clockevent_tick();
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <libkern/libkern.h>
+#include <libkern/log.h>
+#include <time/clocksource.h>
+#include <time/time_manager.h>
+
+// #define CLOCKSOURCE_DEBUG
+
+/**
+ * Picks the largest shift, which keeps cycles * mult of a delta up to
+ * CLOCKSOURCE_MAX_DELTA_SECS within 64 bits.
+ */
+void clocksource_calc_mult_shift(clocksource_t* cs)
+{
+    uint64_t tmp = ((uint64_t)CLOCKSOURCE_MAX_DELTA_SECS * cs->freq) >> 32;
+    uint32_t shift_acc = 32;
+    while (tmp) {
+        tmp >>= 1;
+        shift_acc--;
+    }
+
+    uint32_t shift;
+    for (shift = 32; shift > 0; shift--) {
+        tmp = ((uint64_t)NS_PER_SEC << shift) + cs->freq / 2;
+        tmp = udiv64(tmp, cs->freq, NULL);
+        if (!(tmp >> shift_acc)) {
+            break;
+        }
+    }
+
+    cs->mult = (uint32_t)tmp;
+    cs->shift = shift;
+}
+
+void clocksource_register(clocksource_t* cs)
+{
+    clocksource_calc_mult_shift(cs);
+#ifdef CLOCKSOURCE_DEBUG
+    log("[clocksource] %s: %u Hz, mult %u, shift %u", cs->name, cs->freq, cs->mult, cs->shift);
+#endif
+
+    clocksource_t* cur = timeman_clocksource();
+    if (!cur || cur->rating < cs->rating) {
+        timeman_set_clocksource(cs);
+    }
+}
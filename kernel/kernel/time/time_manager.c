@@ -8,15 +8,45 @@
 
 #include <drivers/generic/rtc.h>
 #include <drivers/generic/timer.h>
+#include <libkern/libkern.h>
 #include <libkern/log.h>
+#include <time/clockevent.h>
+#include <time/clocksource.h>
 #include <time/time_manager.h>
+#include <time/timer_wheel.h>
 
 // #define TIME_MANAGER_DEBUG
 
+/**
+ * The time is read from the best clocksource. The clock is moved forward on
+ * timer interrupts, so a read converts only the cycles passed since then.
+ * Readers don't take the lock, they retry if the clock was updated meanwhile.
+ * Till a hardware clocksource is registered, the time is counted in ticks.
+ */
+
 time_t ticks_since_boot = 0;
-time_t ticks_since_second = 0;
-static time_t time_since_boot = 0;
-static time_t time_since_epoch = 0;
+static lock_t _timeman_lock;
+static uint32_t _timeman_seq = 0;
+static uint64_t _clock_base_cycles = 0;
+static uint64_t _clock_base_ns = 0;
+static uint64_t _clock_base_frac = 0; // Left from the shift, keeps updates from drifting.
+static uint64_t _boot_time_ns = 0; // Since epoch.
+
+static uint64_t _timeman_ticks_read()
+{
+    return (uint32_t)atomic_load(&ticks_since_boot);
+}
+
+static clocksource_t _ticks_clocksource = {
+    .name = "ticks",
+    .rating = 0,
+    .read = _timeman_ticks_read,
+    .mask = 0xffffffff,
+    .freq = TIMER_TICKS_PER_SECOND,
+    .mult = NS_PER_SEC / TIMER_TICKS_PER_SECOND,
+    .shift = 0,
+};
+static clocksource_t* _clocksource = &_ticks_clocksource;
 
 static uint32_t pref_sum_of_days_in_mounts[] = {
     0,
@@ -69,12 +99,91 @@ time_t timeman_to_seconds_since_epoch(uint8_t secs, uint8_t mins, uint8_t hrs, u
     return res;
 }
 
+/**
+ * CLOCK
+ */
+
+static inline uint64_t _timeman_scaled_delta_lockless(uint64_t cycles)
+{
+    uint64_t delta = (cycles - _clock_base_cycles) & _clocksource->mask;
+    return delta * _clocksource->mult + _clock_base_frac;
+}
+
+static inline uint64_t _timeman_ns_since_boot_lockless()
+{
+    return _clock_base_ns + (_timeman_scaled_delta_lockless(_clocksource->read()) >> _clocksource->shift);
+}
+
+static void _timeman_update_clock_lockless()
+{
+    uint64_t cycles = _clocksource->read();
+    uint64_t scaled = _timeman_scaled_delta_lockless(cycles);
+    _clock_base_ns += scaled >> _clocksource->shift;
+    _clock_base_frac = scaled & ((1ULL << _clocksource->shift) - 1);
+    _clock_base_cycles = cycles;
+}
+
+static void _timeman_update_clock()
+{
+    lock_acquire(&_timeman_lock);
+    atomic_add(&_timeman_seq, 1);
+    _timeman_update_clock_lockless();
+    atomic_add(&_timeman_seq, 1);
+    lock_release(&_timeman_lock);
+}
+
+clocksource_t* timeman_clocksource()
+{
+    return _clocksource;
+}
+
+void timeman_set_clocksource(clocksource_t* cs)
+{
+    lock_acquire(&_timeman_lock);
+    atomic_add(&_timeman_seq, 1);
+    _timeman_update_clock_lockless();
+    _clocksource = cs;
+    _clock_base_cycles = cs->read();
+    _clock_base_frac = 0;
+    atomic_add(&_timeman_seq, 1);
+    lock_release(&_timeman_lock);
+    log("Time: using %s clocksource", cs->name);
+}
+
+bool timeman_has_highres_clock()
+{
+    return _clocksource != &_ticks_clocksource;
+}
+
+uint64_t timeman_ns_since_boot()
+{
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = atomic_load(&_timeman_seq);
+        ns = _timeman_ns_since_boot_lockless();
+    } while ((seq & 1) || seq != atomic_load(&_timeman_seq));
+    return ns;
+}
+
+uint64_t timeman_ns_since_epoch()
+{
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = atomic_load(&_timeman_seq);
+        ns = _boot_time_ns + _timeman_ns_since_boot_lockless();
+    } while ((seq & 1) || seq != atomic_load(&_timeman_seq));
+    return ns;
+}
+
 int timeman_setup()
 {
     uint8_t secs = 0, mins = 0, hrs = 0, day = 0, month = 0;
     uint32_t year = 1970;
 
     // FIXME: Rewrite as a proper driver
+    time_t time_since_epoch = 0;
 #ifdef __i386__
     rtc_load_time(&secs, &mins, &hrs, &day, &month, &year);
     time_since_epoch = timeman_to_seconds_since_epoch(secs, mins, hrs, day, month, year);
@@ -85,36 +194,60 @@ int timeman_setup()
 #ifdef TIME_MANAGER_DEBUG
     log("Loaded date: %d", time_since_epoch);
 #endif
+    lock_acquire(&_timeman_lock);
+    atomic_add(&_timeman_seq, 1);
+    _boot_time_ns = (uint64_t)time_since_epoch * NS_PER_SEC - _timeman_ns_since_boot_lockless();
+    atomic_add(&_timeman_seq, 1);
+    lock_release(&_timeman_lock);
     return 0;
 }
 
 void timeman_timer_tick()
 {
-    THIS_CPU->stat_ticks_since_boot++;
-    if (system_cpu_id() != 0) {
-        return;
+    clockevent_tick();
+    if (system_cpu_id() == 0) {
+        atomic_add(&ticks_since_boot, 1);
     }
+    _timeman_update_clock();
 
-    atomic_add(&ticks_since_second, 1);
-
-    if (ticks_since_second >= TIMER_TICKS_PER_SECOND) {
-        atomic_add(&time_since_boot, 1);
-        atomic_add(&time_since_epoch, 1);
-        atomic_store(&ticks_since_second, 0);
+    // Ticks are counted by the clock, so ones missed while the tick was stopped are served at once.
+    uint32_t ticks = timer_wheel_run(&THIS_CPU->timer_wheel, timeman_ns_to_ticks(timeman_ns_since_boot()));
+    THIS_CPU->stat_ticks_since_boot += ticks;
+    if (ticks > 1) {
+        THIS_CPU->stat_system_and_idle_ticks += ticks - 1;
     }
 }
 
 time_t timeman_now()
 {
-    return atomic_load(&time_since_epoch);
+    return udiv64(timeman_ns_since_epoch(), NS_PER_SEC, NULL);
 }
 
 time_t timeman_seconds_since_boot()
 {
-    return atomic_load(&time_since_boot);
+    return udiv64(timeman_ns_since_boot(), NS_PER_SEC, NULL);
 }
 
 time_t timeman_get_ticks_from_last_second()
 {
-    return atomic_load(&ticks_since_second);
-}
\ No newline at end of file
+    uint32_t nsec;
+    udiv64(timeman_ns_since_epoch(), NS_PER_SEC, &nsec);
+    return nsec / timeman_ns_per_tick();
+}
+
+uint32_t timeman_ns_to_ticks(uint64_t ns)
+{
+    return udiv64(ns, timeman_ns_per_tick(), NULL);
+}
+
+uint64_t timeman_timespec_to_ns(const timespec_t* ts)
+{
+    return (uint64_t)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+void timeman_ns_to_timespec(uint64_t ns, timespec_t* ts)
+{
+    uint32_t nsec;
+    ts->tv_sec = udiv64(ns, NS_PER_SEC, &nsec);
+    ts->tv_nsec = nsec;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2020-2022 The opuntiaOS Project Authors.
+ *  + Contributed by Nikita Melekhin <nimelehin@gmail.com>
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <libkern/libkern.h>
+#include <libkern/log.h>
+#include <tasking/cpu.h>
+#include <time/time_manager.h>
+#include <time/timer_wheel.h>
+
+/**
+ * Every cpu has its own wheel, which is served from its timer interrupt.
+ * A level covers 64 times more ticks than the previous one. Timers of the
+ * first level fire from their slots, timers of upper levels are moved a
+ * level down (cascaded) once the lower level wraps. Arming, cancelling and
+ * firing a timer are O(1), a cascade moves one slot.
+ * Ticks are numbered by the clock: tick N is served once the time passes
+ * N * ns_per_tick, so ticks missed while the timer interrupt was stopped
+ * are caught up on the next one.
+ */
+
+static inline ktimer_t** _timer_wheel_slot(timer_wheel_t* wheel, uint32_t expires)
+{
+    uint32_t idx = expires - wheel->tick;
+    if ((int32_t)idx < 0) {
+        // Already expired, served on the next tick.
+        return &wheel->slots[0][wheel->tick & TIMER_WHEEL_SLOT_MASK];
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && idx >= (1U << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+        level++;
+    }
+
+    // Timers beyond the last level get back to it on cascades, till they are close enough.
+    return &wheel->slots[level][(expires >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK];
+}
+
+static void _timer_wheel_add_lockless(timer_wheel_t* wheel, ktimer_t* timer)
+{
+    ktimer_t** slot = _timer_wheel_slot(wheel, timer->expires_tick);
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void _timer_wheel_del_lockless(ktimer_t* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static uint32_t _timer_wheel_cascade_lockless(timer_wheel_t* wheel, int level)
+{
+    uint32_t idx = (wheel->tick >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK;
+    ktimer_t* timer = wheel->slots[level][idx];
+    wheel->slots[level][idx] = NULL;
+
+    while (timer) {
+        ktimer_t* next = timer->next;
+        _timer_wheel_add_lockless(wheel, timer);
+        timer = next;
+    }
+    return idx;
+}
+
+void timer_wheel_init(timer_wheel_t* wheel)
+{
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    lock_init(&wheel->lock);
+    wheel->tick = timeman_ns_to_ticks(timeman_ns_since_boot()) + 1;
+}
+
+static void _timer_wheel_tick_lockless(timer_wheel_t* wheel)
+{
+    uint32_t idx = wheel->tick & TIMER_WHEEL_SLOT_MASK;
+    if (!idx) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (_timer_wheel_cascade_lockless(wheel, level)) {
+                break;
+            }
+        }
+    }
+    wheel->tick++;
+
+    ktimer_t* timer = wheel->slots[0][idx];
+    wheel->slots[0][idx] = NULL;
+    while (timer) {
+        ktimer_t* next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer->callback(timer);
+        timer = next;
+    }
+}
+
+/**
+ * Serves all ticks up to now_tick, returns the number of served ticks.
+ */
+uint32_t timer_wheel_run(timer_wheel_t* wheel, uint32_t now_tick)
+{
+    uint32_t ticks = 0;
+    lock_acquire(&wheel->lock);
+    while ((int32_t)(now_tick - wheel->tick) >= 0) {
+        _timer_wheel_tick_lockless(wheel);
+        ticks++;
+    }
+    lock_release(&wheel->lock);
+    return ticks;
+}
+
+/**
+ * Returns the first tick which could have timers to fire. Timers of upper
+ * levels are counted from the next cascade, which is early but cheap to find.
+ */
+uint32_t timer_wheel_next_tick(timer_wheel_t* wheel)
+{
+    lock_acquire(&wheel->lock);
+    uint32_t next = wheel->tick + TIMER_WHEEL_MAX_TICKS;
+    for (uint32_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        uint32_t tick = wheel->tick + i;
+        if (wheel->slots[0][tick & TIMER_WHEEL_SLOT_MASK]) {
+            next = tick;
+            break;
+        }
+    }
+
+    uint32_t cascade_tick = (wheel->tick + TIMER_WHEEL_SLOT_MASK) & ~TIMER_WHEEL_SLOT_MASK;
+    if ((int32_t)(cascade_tick - next) < 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+                if (wheel->slots[level][i]) {
+                    next = cascade_tick;
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    lock_release(&wheel->lock);
+    return next;
+}
+
+void ktimer_init(ktimer_t* timer, void (*callback)(ktimer_t*), void* data)
+{
+    memset(timer, 0, sizeof(ktimer_t));
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/**
+ * Arms the timer on the wheel of the current cpu. The timer fires on the
+ * first tick which is not earlier than expires.
+ */
+void ktimer_arm(ktimer_t* timer, uint64_t expires)
+{
+    ktimer_cancel(timer);
+
+    uint64_t max_expires = timeman_ns_since_boot() + (uint64_t)TIMER_WHEEL_MAX_TICKS * timeman_ns_per_tick();
+    uint32_t expires_tick = timeman_ns_to_ticks(min(expires, max_expires) + timeman_ns_per_tick() - 1);
+
+    timer_wheel_t* wheel = &THIS_CPU->timer_wheel;
+    lock_acquire(&wheel->lock);
+    timer->wheel = wheel;
+    timer->expires = expires;
+    timer->expires_tick = expires_tick;
+    _timer_wheel_add_lockless(wheel, timer);
+    lock_release(&wheel->lock);
+}
+
+void ktimer_cancel(ktimer_t* timer)
+{
+    timer_wheel_t* wheel = timer->wheel;
+    if (!wheel) {
+        return;
+    }
+
+    lock_acquire(&wheel->lock);
+    if (timer->pprev) {
+        _timer_wheel_del_lockless(timer);
+    }
+    lock_release(&wheel->lock);
+}
@@ -391,6 +391,7 @@ enum __sysid {
     SYS_SHBUF_GET,
     SYS_SHBUF_FREE,
     SYS_PTHREAD_CREATE,
+    SYS_SPAWN,
 };
 #elif __arm__
 enum __sysid {
@@ -755,6 +756,7 @@ enum __sysid {
     SYS_PTHREAD_CREATE,
     SYS_MMAP,
     SYS_WAITPID,
+    SYS_SPAWN,
 };
 #endif
 
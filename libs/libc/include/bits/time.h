@@ -51,6 +51,8 @@ typedef enum {
     CLOCK_THREAD_CPUTIME_ID,
 } clockid_t;
 
+#define TIMER_ABSTIME 0x1
+
 __END_DECLS
 
 #endif // _LIBC_BITS_TIME_H
\ No newline at end of file
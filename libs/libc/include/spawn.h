@@ -0,0 +1,31 @@
+#ifndef _LIBC_SPAWN_H
+#define _LIBC_SPAWN_H
+
+#include <bits/spawn.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+struct __posix_spawn_file_actions {
+    int count;
+    int capacity;
+    spawn_file_action_t* actions;
+};
+typedef struct __posix_spawn_file_actions posix_spawn_file_actions_t;
+
+// Attributes are not supported yet, only NULL is accepted.
+typedef struct __posix_spawnattr posix_spawnattr_t;
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t* file_actions);
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t* file_actions);
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t* file_actions, int fd);
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t* file_actions, int fd, int newfd);
+int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t* file_actions, int fd, const char* path, int oflag, mode_t mode);
+
+int posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]);
+int posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]);
+
+__END_DECLS
+
+#endif // _LIBC_SPAWN_H
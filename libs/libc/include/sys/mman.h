@@ -10,6 +10,7 @@ __BEGIN_DECLS
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(void* addr, size_t length);
+int msync(void* addr, size_t length, int flags);
 
 __END_DECLS
 
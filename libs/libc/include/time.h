@@ -28,6 +28,8 @@ time_t mktime(tm_t* tm);
 int clock_getres(clockid_t clk_id, timespec_t* res);
 int clock_gettime(clockid_t clk_id, timespec_t* tp);
 int clock_settime(clockid_t clk_id, const timespec_t* tp);
+int clock_nanosleep(clockid_t clk_id, int flags, const timespec_t* req, timespec_t* rem);
+int nanosleep(const timespec_t* req, timespec_t* rem);
 
 __END_DECLS
 
@@ -108,4 +108,10 @@ int munmap(void* addr, size_t length)
 {
     int res = DO_SYSCALL_2(SYS_MUNMAP, addr, length);
     RETURN_WITH_ERRNO(res, 0, -1);
+}
+
+int msync(void* addr, size_t length, int flags)
+{
+    int res = DO_SYSCALL_3(SYS_MSYNC, addr, length, flags);
+    RETURN_WITH_ERRNO(res, 0, -1);
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysdep.h>
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t* file_actions)
+{
+    file_actions->count = 0;
+    file_actions->capacity = 0;
+    file_actions->actions = NULL;
+    return 0;
+}
+
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t* file_actions)
+{
+    for (int i = 0; i < file_actions->count; i++) {
+        free((char*)file_actions->actions[i].path);
+    }
+    free(file_actions->actions);
+    return posix_spawn_file_actions_init(file_actions);
+}
+
+static spawn_file_action_t* _posix_spawn_file_actions_add(posix_spawn_file_actions_t* file_actions, int type, int fd)
+{
+    if (file_actions->count == SPAWN_MAX_FILE_ACTIONS) {
+        return NULL;
+    }
+
+    if (file_actions->count == file_actions->capacity) {
+        int capacity = file_actions->capacity ? file_actions->capacity * 2 : 4;
+        spawn_file_action_t* actions = realloc(file_actions->actions, capacity * sizeof(spawn_file_action_t));
+        if (!actions) {
+            return NULL;
+        }
+        file_actions->actions = actions;
+        file_actions->capacity = capacity;
+    }
+
+    spawn_file_action_t* action = &file_actions->actions[file_actions->count++];
+    memset(action, 0, sizeof(spawn_file_action_t));
+    action->type = type;
+    action->fd = fd;
+    return action;
+}
+
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t* file_actions, int fd)
+{
+    if (fd < 0) {
+        return EBADF;
+    }
+    if (!_posix_spawn_file_actions_add(file_actions, SPAWN_FILE_ACTION_CLOSE, fd)) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t* file_actions, int fd, int newfd)
+{
+    if (fd < 0 || newfd < 0) {
+        return EBADF;
+    }
+    spawn_file_action_t* action = _posix_spawn_file_actions_add(file_actions, SPAWN_FILE_ACTION_DUP2, fd);
+    if (!action) {
+        return ENOMEM;
+    }
+    action->newfd = newfd;
+    return 0;
+}
+
+int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t* file_actions, int fd, const char* path, int oflag, mode_t mode)
+{
+    if (fd < 0) {
+        return EBADF;
+    }
+    size_t path_len = strlen(path) + 1;
+    char* path_copy = malloc(path_len);
+    if (!path_copy) {
+        return ENOMEM;
+    }
+    memcpy(path_copy, path, path_len);
+
+    spawn_file_action_t* action = _posix_spawn_file_actions_add(file_actions, SPAWN_FILE_ACTION_OPEN, fd);
+    if (!action) {
+        free(path_copy);
+        return ENOMEM;
+    }
+    action->flags = oflag;
+    action->mode = mode;
+    action->path = path_copy;
+    return 0;
+}
+
+/**
+ * The process is created by the kernel right from the binary, the address
+ * space of the caller is not copied as fork() followed by exec() does.
+ * Errors are returned, errno is not set.
+ */
+int posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[])
+{
+    if (attrp) {
+        return ENOSYS;
+    }
+
+    spawn_file_action_t* actions = file_actions ? file_actions->actions : NULL;
+    int actions_count = file_actions ? file_actions->count : 0;
+    int res = DO_SYSCALL_5(SYS_SPAWN, (int)path, (int)argv, (int)envp, (int)actions, actions_count);
+    if (res < 0) {
+        return -res;
+    }
+
+    if (pid) {
+        *pid = res;
+    }
+    return 0;
+}
+
+int posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[])
+{
+    if (strchr(file, '/')) {
+        return posix_spawn(pid, file, file_actions, attrp, argv, envp);
+    }
+
+    char* full_path = malloc(256);
+    size_t namelen = strlen(file);
+    char* env_path = getenv("PATH");
+    if (!env_path) {
+        // Get it from confstr
+        env_path = "/bin:/usr/bin";
+    }
+
+    int err = ENOENT;
+    int len = 0;
+    for (int i = 0; env_path[i]; i += len) {
+        len = 0;
+        while (env_path[i + len] && env_path[i + len] != ':') {
+            len++;
+        }
+
+        memcpy(full_path, &env_path[i], len);
+        full_path[len] = '/';
+        memcpy(&full_path[len + 1], file, namelen + 1);
+
+        err = posix_spawn(pid, full_path, file_actions, attrp, argv, envp);
+        if (err != ENOENT) {
+            break;
+        }
+        if (env_path[i + len] == ':') {
+            len++;
+        }
+    }
+
+    free(full_path);
+    return err;
+}
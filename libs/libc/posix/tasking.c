@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sysdep.h>
+#include <time.h>
 #include <unistd.h>
 
 int fork()
@@ -108,8 +109,24 @@ pid_t getpgid(pid_t pid)
     RETURN_WITH_ERRNO(res, (pid_t)res, -1);
 }
 
+int nanosleep(const timespec_t* req, timespec_t* rem)
+{
+    int res = DO_SYSCALL_2(SYS_NANOSLEEP, req, rem);
+    RETURN_WITH_ERRNO(res, 0, -1);
+}
+
 uint32_t sleep(uint32_t seconds)
 {
-    uint32_t res = DO_SYSCALL_1(SYS_NANOSLEEP, seconds);
-    RETURN_WITH_ERRNO(res, seconds, 0);
+    timespec_t req = { seconds, 0 };
+    timespec_t rem = { 0, 0 };
+    if (nanosleep(&req, &rem) < 0) {
+        return rem.tv_sec;
+    }
+    return 0;
+}
+
+int usleep(uint32_t usec)
+{
+    timespec_t req = { usec / 1000000, (usec % 1000000) * 1000 };
+    return nanosleep(&req, NULL);
 }
\ No newline at end of file
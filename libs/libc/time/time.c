@@ -120,6 +120,13 @@ int clock_gettime(clockid_t clk_id, timespec_t* tp)
     RETURN_WITH_ERRNO(res, res, -1);
 }
 
+int clock_nanosleep(clockid_t clk_id, int flags, const timespec_t* req, timespec_t* rem)
+{
+    // Returns the error number instead of setting errno.
+    int res = DO_SYSCALL_4(SYS_CLOCK_NANOSLEEP, clk_id, flags, req, rem);
+    return res < 0 ? -res : 0;
+}
+
 // TODO: Implement
 int clock_getres(clockid_t clk_id, timespec_t* res) { return -1; }
 int clock_settime(clockid_t clk_id, const timespec_t* tp) { return -1; }
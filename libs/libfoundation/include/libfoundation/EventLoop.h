@@ -81,6 +81,9 @@ public:
     int run();
 
 private:
+    bool nearest_timer(std::timespec& expire_time) const;
+    void wait_for_timer(const std::timespec& expire_time);
+
     bool m_stop_flag { false };
     int m_exit_code { 0 };
     std::vector<FDWaiter> m_waiting_fds;
@@ -144,6 +144,7 @@ public:
     }
 
     inline bool repeated() const { return m_repeat; }
+    inline const std::timespec& expire_time() const { return m_expire_time; }
     inline bool expired(const std::timespec& now) const
     {
         return now.tv_sec > m_expire_time.tv_sec || (now.tv_sec == m_expire_time.tv_sec && now.tv_nsec >= m_expire_time.tv_nsec);
@@ -26,9 +26,36 @@ EventLoop::EventLoop()
     s_LFoundation_EventLoop_the = this;
 }
 
+bool EventLoop::nearest_timer(std::timespec& expire_time) const
+{
+    if (m_timers.empty()) {
+        return false;
+    }
+
+    expire_time = m_timers[0].expire_time();
+    for (auto& timer : m_timers) {
+        const std::timespec& tp = timer.expire_time();
+        if (tp.tv_sec < expire_time.tv_sec || (tp.tv_sec == expire_time.tv_sec && tp.tv_nsec < expire_time.tv_nsec)) {
+            expire_time = tp;
+        }
+    }
+    return true;
+}
+
+void EventLoop::wait_for_timer(const std::timespec& expire_time)
+{
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &expire_time, nullptr);
+}
+
 void EventLoop::check_fds()
 {
+    std::timespec expire_time;
+    bool has_timer = nearest_timer(expire_time);
     if (m_waiting_fds.empty()) {
+        // Nothing could wake us up except timers.
+        if (m_event_queue.empty() && has_timer) {
+            wait_for_timer(expire_time);
+        }
         return;
     }
     fd_set_t readfds;
@@ -48,12 +75,33 @@ void EventLoop::check_fds()
         }
     }
 
-    // For now, that means, that we don't wait for fds.
+    // Sleeping until one of fds is ready or the nearest timer expires.
+    // Queued events are dispatched right away, so fds are only polled then.
     timeval_t timeout;
+    timeval_t* timeout_ptr = &timeout;
     timeout.tv_sec = 0;
     timeout.tv_usec = 0;
+    if (m_event_queue.empty()) {
+        if (has_timer) {
+            std::timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            std::time_t secs = expire_time.tv_sec - now.tv_sec;
+            long nsecs = expire_time.tv_nsec - now.tv_nsec;
+            if (nsecs < 0) {
+                secs--;
+                nsecs += 1000000000;
+            }
+            if (secs >= 0) {
+                // Rounding up, so we don't wake up right before the timer.
+                timeout.tv_sec = secs;
+                timeout.tv_usec = (nsecs + 999) / 1000;
+            }
+        } else {
+            timeout_ptr = nullptr;
+        }
+    }
 
-    int res = select(nfds + 1, &readfds, &writefds, nullptr, &timeout);
+    int res = select(nfds + 1, &readfds, &writefds, nullptr, timeout_ptr);
 
     for (int i = 0; i < m_waiting_fds.size(); i++) {
         if (m_waiting_fds[i].m_on_read) {
@@ -101,7 +149,8 @@ void EventLoop::check_timers()
         event.receiver.receive_event(std::move(event.event));
     }
 
-    if (!events_to_dispatch.size()) {
+    // Without fds and timers check_fds() can't wait for anything.
+    if (!events_to_dispatch.size() && m_waiting_fds.empty() && m_timers.empty()) {
         sched_yield();
     }
 }
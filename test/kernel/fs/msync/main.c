@@ -0,0 +1,71 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FILE_SIZE 8192
+
+char buf[FILE_SIZE];
+char expected[FILE_SIZE];
+
+int check_file(char* fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        TestErr("open for read failed");
+    }
+    int n = read(fd, buf, FILE_SIZE);
+    close(fd);
+    return n == FILE_SIZE && !memcmp(buf, expected, FILE_SIZE);
+}
+
+int main(int argc, char** argv)
+{
+    int fd, i;
+    char* ptr;
+    char* fname = "msync.e";
+
+    unlink(fname);
+    fd = open(fname, O_CREAT | O_RDWR);
+    if (fd < 0) {
+        TestErr("create failed");
+    }
+
+    memset(expected, 'a', FILE_SIZE);
+    if (write(fd, expected, FILE_SIZE) != FILE_SIZE) {
+        TestErr("write failed");
+    }
+
+    ptr = (char*)mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ((int)ptr < 0) {
+        TestErr("mmap failed");
+    }
+
+    for (i = 0; i < FILE_SIZE; i++) {
+        expected[i] = 'a' + i % 26;
+        ptr[i] = expected[i];
+    }
+
+    if (msync(ptr, FILE_SIZE, MS_SYNC) < 0) {
+        TestErr("msync failed");
+    }
+    if (!check_file(fname)) {
+        TestErr("wrong data after msync");
+    }
+
+    // Pages are write-protected by msync, later writes must be tracked again.
+    expected[100] = ptr[100] = '#';
+    if (munmap(ptr, FILE_SIZE) < 0) {
+        TestErr("munmap failed");
+    }
+    close(fd);
+
+    if (!check_file(fname)) {
+        TestErr("wrong data after munmap");
+    }
+
+    unlink(fname);
+    return 0;
+}
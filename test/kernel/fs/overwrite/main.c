@@ -0,0 +1,65 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE 8192
+#define PASSES 16
+
+char buf[FILE_SIZE];
+char expected[FILE_SIZE];
+
+// Rewrites of the same blocks could be in the block request queue together,
+// a newer write must never be overtaken by an older one.
+int main(int argc, char** argv)
+{
+    int fd, n, pass, off, len;
+    char* fname = "overwrite.e";
+
+    unlink(fname);
+    fd = open(fname, O_CREAT | O_RDWR);
+    if (fd < 0) {
+        TestErr("create failed");
+    }
+
+    memset(expected, 'a', FILE_SIZE);
+    if (write(fd, expected, FILE_SIZE) != FILE_SIZE) {
+        TestErr("write failed");
+    }
+
+    for (pass = 0; pass < PASSES; pass++) {
+        // Ranges cross block boundaries and overlap the ones of the previous pass.
+        off = 512 + (pass % 4) * 1536;
+        len = 2048 + (pass % 3) * 512;
+        memset(expected + off, 'b' + pass, len);
+        if (lseek(fd, off, SEEK_SET) != off) {
+            TestErr("lseek failed");
+        }
+        if (write(fd, expected + off, len) != len) {
+            TestErr("rewrite failed");
+        }
+        if (pass % 4 == 3) {
+            // Giving the flusher a chance to write out the blocks in between.
+            usleep(100000);
+        }
+    }
+    close(fd);
+    usleep(100000);
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        TestErr("open failed");
+    }
+    n = read(fd, buf, FILE_SIZE);
+    close(fd);
+    if (n != FILE_SIZE) {
+        TestErr("wrong length");
+    }
+    if (memcmp(buf, expected, FILE_SIZE)) {
+        TestErr("wrong data");
+    }
+
+    unlink(fname);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000ULL
+#define TICK_NS (NS_PER_SEC / 125) // The kernel timer runs at 125 Hz.
+
+uint64_t monotonic_ns()
+{
+    timespec_t ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        TestErr("clock_gettime failed");
+    }
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void check_sleep_lasts(timespec_t* req, int use_clock_nanosleep, int check_upper_bound)
+{
+    uint64_t req_ns = (uint64_t)req->tv_sec * NS_PER_SEC + req->tv_nsec;
+    uint64_t start = monotonic_ns();
+    if (use_clock_nanosleep) {
+        if (clock_nanosleep(CLOCK_MONOTONIC, 0, req, NULL)) {
+            TestErr("clock_nanosleep failed");
+        }
+    } else {
+        if (nanosleep(req, NULL) < 0) {
+            TestErr("nanosleep failed");
+        }
+    }
+    uint64_t slept = monotonic_ns() - start;
+    if (slept < req_ns) {
+        TestErr("Woke up before the requested interval");
+    }
+    // Wakeups happen on a tick, so a short sleep shouldn't be rounded up to a second.
+    if (check_upper_bound && slept >= req_ns + 2 * TICK_NS) {
+        TestErr("Slept much longer than the requested interval");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    timespec_t short_sleep = { 0, 30 * 1000 * 1000 };
+    check_sleep_lasts(&short_sleep, 0, 1);
+    check_sleep_lasts(&short_sleep, 1, 1);
+
+    timespec_t long_sleep = { 1, 5 * 1000 * 1000 };
+    check_sleep_lasts(&long_sleep, 0, 0);
+
+    // tv_nsec is unsigned here, so -1 turns into a value above NS_PER_SEC.
+    timespec_t bad = { 0, -1 };
+    if (nanosleep(&bad, NULL) != -1) {
+        TestErr("nanosleep accepted a negative tv_nsec");
+    }
+    if (clock_nanosleep(CLOCK_MONOTONIC, 0, &bad, NULL) != EINVAL) {
+        TestErr("clock_nanosleep accepted a negative tv_nsec");
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHILD_EXIT_CODE 42
+#define CHILD_FD 5
+
+char msg[] = "spawned";
+char buf[32];
+
+int child()
+{
+    // The descriptor used for the redirection is closed by the file actions.
+    if (write(CHILD_FD, msg, sizeof(msg)) >= 0) {
+        return 1;
+    }
+    if (write(1, msg, sizeof(msg)) != sizeof(msg)) {
+        return 1;
+    }
+    return CHILD_EXIT_CODE;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "child")) {
+            TestErr("Loop while executing test.");
+        }
+        return child();
+    }
+
+    char* fname = "spawn.e";
+    unlink(fname);
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    if (posix_spawn_file_actions_addopen(&file_actions, CHILD_FD, fname, O_CREAT | O_WRONLY | O_TRUNC, 0644)) {
+        TestErr("addopen failed");
+    }
+    if (posix_spawn_file_actions_adddup2(&file_actions, CHILD_FD, 1)) {
+        TestErr("adddup2 failed");
+    }
+    if (posix_spawn_file_actions_addclose(&file_actions, CHILD_FD)) {
+        TestErr("addclose failed");
+    }
+
+    pid_t pid;
+    char* child_argv[] = { argv[0], "child", NULL };
+    if (posix_spawnp(&pid, argv[0], &file_actions, NULL, child_argv, NULL)) {
+        TestErr("posix_spawnp failed");
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        TestErr("waitpid failed");
+    }
+    if (status != CHILD_EXIT_CODE) {
+        TestErr("Wrong exit status of the child");
+    }
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        TestErr("Redirected file was not created");
+    }
+    int n = read(fd, buf, sizeof(buf));
+    close(fd);
+    unlink(fname);
+    if (n != sizeof(msg) || memcmp(buf, msg, sizeof(msg))) {
+        TestErr("Child output was not redirected");
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define PAGE_SIZE 4096
+
+// Untouched BSS pages are backed by the shared zero page once they are read.
+volatile char ts_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+volatile char tv_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+volatile char clean_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+void check_zeroed(volatile char* page, const char* msg)
+{
+    for (int i = 0; i < PAGE_SIZE; i++) {
+        if (page[i]) {
+            TestErr(msg);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    check_zeroed(ts_page, "BSS is not zeroed");
+    check_zeroed(tv_page, "BSS is not zeroed");
+    check_zeroed(clean_page, "BSS is not zeroed");
+
+    timespec_t* ts = (timespec_t*)ts_page;
+    if (clock_gettime(CLOCK_REALTIME, ts) < 0) {
+        TestErr("clock_gettime failed");
+    }
+    if (!ts->tv_sec) {
+        TestErr("clock_gettime didn't fill the result");
+    }
+    check_zeroed(clean_page, "clock_gettime wrote into the shared zero page");
+
+    timeval_t* tv = (timeval_t*)tv_page;
+    timezone_t* tz = (timezone_t*)(tv_page + sizeof(timeval_t));
+    if (gettimeofday(tv, tz) < 0) {
+        TestErr("gettimeofday failed");
+    }
+    if (!tv->tv_sec) {
+        TestErr("gettimeofday didn't fill the result");
+    }
+    check_zeroed(clean_page, "gettimeofday wrote into the shared zero page");
+    return 0;
+}
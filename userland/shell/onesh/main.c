@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -139,14 +140,11 @@ void _cmd_processor()
         uint32_t namelen = strlen(_cmd_parsed_buffer[0]);
         memcpy(_cmd_app + 5, _cmd_buffer, namelen + 1);
 
-        int res = fork();
-        if (!res) {
-            // We don't pass an app name to args.
-            execve(_cmd_app, &_cmd_parsed_buffer[0], environ);
-            exit(-1);
-        } else {
-            running_job = res;
-            wait(res);
+        pid_t pid;
+        // We don't pass an app name to args.
+        if (!posix_spawn(&pid, _cmd_app, NULL, NULL, &_cmd_parsed_buffer[0], environ)) {
+            running_job = pid;
+            wait(pid);
         }
     } else {
         _cmd_do_internal(cmd);
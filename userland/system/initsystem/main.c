@@ -1,4 +1,5 @@
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,10 +53,11 @@ int runentry_add(const launchentry_t* launchentry, pid_t pid)
 
 int launch(const launchentry_t* launchentry)
 {
-    int pid = fork();
-    if (pid == 0) {
-        execlp(launchentry->path, launchentry->path, NULL);
-        exit(1);
+    pid_t pid;
+    char* const argv[] = { (char*)launchentry->path, NULL };
+    int err = posix_spawnp(&pid, launchentry->path, NULL, NULL, argv, environ);
+    if (err) {
+        return -err;
     }
 
     runentry_add(launchentry, pid);